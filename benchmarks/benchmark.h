@@ -0,0 +1,115 @@
+/*
+ *  Copyright (C) 2014-2016 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+// Common utilities for the benchmarks
+
+#pragma once
+
+#include <opendht.h>
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstring>
+
+namespace bench {
+
+using dht::clock;
+using dht::duration;
+
+/* Minimum measured time of a benchmark */
+static constexpr std::chrono::milliseconds MIN_TIME {500};
+
+/* Benchmarks run are the ones whose name contains this string */
+static std::string filter {};
+
+static bool
+enabled(const std::string& name)
+{
+    return filter.empty() or name.find(filter) != std::string::npos;
+}
+
+/* Keeps the compiler from optimizing away results */
+static volatile uint64_t sink {0};
+
+template <typename T>
+static inline void
+use(const T& v)
+{
+    sink = sink + (uint64_t)v;
+}
+
+static void
+report(const std::string& name, size_t n, duration d)
+{
+    using namespace std::chrono;
+    double ns = duration_cast<nanoseconds>(d).count() / (double)n;
+    std::cout << std::left << std::setw(40) << name << std::right
+              << std::setw(10) << n << " ops "
+              << std::setw(14) << std::fixed << std::setprecision(1) << ns << " ns/op "
+              << std::setw(14) << std::setprecision(0) << (ns > 0 ? 1e9 / ns : 0.) << " ops/s"
+              << std::endl;
+}
+
+/**
+ * Run op(n) for n operations, doubling n until it runs for MIN_TIME,
+ * and print the time per operation. op returns the time spent in the
+ * n operations, so it can leave its setup out.
+ */
+static void
+run(const std::string& name, const std::function<duration(size_t n)>& op)
+{
+    if (not enabled(name))
+        return;
+    size_t n = 1;
+    duration d {};
+    while ((d = op(n)) < MIN_TIME)
+        n *= 2;
+    report(name, n, d);
+}
+
+/**
+ * Same as run(), with n fixed, for slow or rate limited operations.
+ */
+static void
+runFixed(const std::string& name, size_t n, const std::function<duration(size_t n)>& op)
+{
+    if (not enabled(name))
+        return;
+    report(name, n, op(n));
+}
+
+/**
+ * Time n calls of f(i).
+ */
+template <typename F>
+static std::function<duration(size_t)>
+loop(F&& f)
+{
+    return [f](size_t n) {
+        auto start = clock::now();
+        for (size_t i = 0; i < n; i++)
+            f(i);
+        return clock::now() - start;
+    };
+}
+
+}
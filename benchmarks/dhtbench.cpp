@@ -0,0 +1,418 @@
+/*
+ *  Copyright (C) 2014-2016 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+// Micro-benchmarks of the hot paths of the library.
+// Usage: dhtbench [filter], to only run benchmarks whose name contains filter.
+
+#include "benchmark.h"
+
+#include <msgpack.hpp>
+#include <gnutls/gnutls.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <random>
+#include <limits>
+#include <thread>
+#include <vector>
+
+using namespace dht;
+using namespace bench;
+
+/* Requests processed per second, below Dht::MAX_REQUESTS_PER_SEC */
+static constexpr size_t REQUEST_ROUND {1200};
+/* Distinct sources of requests, to stay below the per-source limit */
+static constexpr unsigned REQUEST_SOURCES {32};
+
+static std::mt19937 rd {42};
+
+static std::vector<InfoHash>
+randomIds(size_t n)
+{
+    std::vector<InfoHash> ids;
+    ids.reserve(n);
+    for (size_t i = 0; i < n; i++)
+        ids.emplace_back(InfoHash::getRandom());
+    return ids;
+}
+
+static Blob
+randomBlob(size_t size)
+{
+    std::uniform_int_distribution<uint16_t> byte_dis(0, 255);
+    Blob b(size);
+    for (auto& c : b)
+        c = byte_dis(rd);
+    return b;
+}
+
+/* An address of the TEST-NET-1 range (RFC 5737) */
+static sockaddr_in
+testAddr(uint32_t i)
+{
+    sockaddr_in sin;
+    std::fill_n((uint8_t*)&sin, sizeof(sin), 0);
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(0xC0000200 | (i % 254 + 1));
+    sin.sin_port = htons(1024 + i / 254 % 60000);
+    return sin;
+}
+
+/**
+ * A node bound to the loopback interface. Replies to the test addresses
+ * of the requests can't leave the host.
+ */
+class LocalDht {
+public:
+    LocalDht() {
+        sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sock < 0)
+            throw std::runtime_error("Can't create socket");
+        sockaddr_in sin;
+        std::fill_n((uint8_t*)&sin, sizeof(sin), 0);
+        sin.sin_family = AF_INET;
+        sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (bind(sock, (sockaddr*)&sin, sizeof(sin)) < 0) {
+            close(sock);
+            throw std::runtime_error("Can't bind socket");
+        }
+        node.reset(new Dht(sock, -1, {InfoHash::getRandom(), false, 0}));
+    }
+    ~LocalDht() {
+        node.reset();
+        close(sock);
+    }
+
+    /* Fill the routing table with n random nodes */
+    void populate(size_t n) {
+        auto ids = randomIds(n);
+        for (size_t i = 0; i < n; i++) {
+            auto sin = testAddr(i);
+            node->insertNode(ids[i], (sockaddr*)&sin, sizeof(sin));
+        }
+    }
+
+    /* Process buf as received from sa */
+    void receive(const msgpack::sbuffer& buf, const sockaddr_in& sa) {
+        node->periodic((const uint8_t*)buf.data(), buf.size(), (const sockaddr*)&sa, sizeof(sa));
+    }
+
+    std::unique_ptr<Dht> node;
+private:
+    int sock {-1};
+};
+
+static void
+packTid(msgpack::packer<msgpack::sbuffer>& pk, const char* prefix, uint16_t seq)
+{
+    char tid[4] = {prefix[0], prefix[1], (char)(seq >> 8), (char)(seq & 0xFF)};
+    pk.pack(std::string("t")); pk.pack_bin(4); pk.pack_bin_body(tid, 4);
+}
+
+/* A request from id, of type q, with args packed after "id" */
+static msgpack::sbuffer
+makeRequest(const InfoHash& id, const char* q, const std::function<void(msgpack::packer<msgpack::sbuffer>&)>& args, unsigned nargs)
+{
+    msgpack::sbuffer buf;
+    msgpack::packer<msgpack::sbuffer> pk(&buf);
+    pk.pack_map(4);
+    pk.pack(std::string("a")); pk.pack_map(1 + nargs);
+      pk.pack(std::string("id")); pk.pack(id);
+      args(pk);
+    pk.pack(std::string("q")); pk.pack(std::string(q));
+    packTid(pk, "xx", 0);
+    pk.pack(std::string("y")); pk.pack(std::string("q"));
+    return buf;
+}
+
+/**
+ * Time n requests, in rounds of REQUEST_ROUND requests per second
+ * (waiting time is not counted), since the node rate limits requests.
+ */
+static duration
+timeRequests(LocalDht& local, size_t n, const std::function<msgpack::sbuffer(size_t i)>& make)
+{
+    duration total {};
+    for (size_t done = 0; done < n;) {
+        size_t count = std::min(REQUEST_ROUND, n - done);
+        std::vector<msgpack::sbuffer> msgs;
+        std::vector<sockaddr_in> from;
+        msgs.reserve(count);
+        for (size_t i = 0; i < count; i++) {
+            msgs.emplace_back(make(done + i));
+            from.emplace_back(testAddr(i % REQUEST_SOURCES + 100000));
+        }
+        auto start = clock::now();
+        for (size_t i = 0; i < count; i++)
+            local.receive(msgs[i], from[i]);
+        total += clock::now() - start;
+        done += count;
+        if (done < n)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    }
+    return total;
+}
+
+static void
+benchInfoHash()
+{
+    constexpr size_t N {4096};
+    auto a = randomIds(N);
+    auto b = randomIds(N);
+    auto target = InfoHash::getRandom();
+    run("InfoHash::xorCmp", loop([&](size_t i) {
+        use(target.xorCmp(a[i % N], b[i % N]));
+    }));
+    run("InfoHash::commonBits", loop([&](size_t i) {
+        use(InfoHash::commonBits(a[i % N], b[i % N]));
+    }));
+    run("InfoHash::lowbit", loop([&](size_t i) {
+        use(a[i % N].lowbit());
+    }));
+    // closest 8 of 64 ids, as in findClosestNodes
+    run("InfoHash::sortClosest 8/64", [&](size_t n) {
+        duration d {};
+        for (size_t i = 0; i < n; i++) {
+            std::vector<InfoHash> ids(a.begin() + (i % (N - 64)), a.begin() + (i % (N - 64)) + 64);
+            auto start = clock::now();
+            target.sortClosest(ids, 8, [](const InfoHash& h) -> const InfoHash& { return h; });
+            d += clock::now() - start;
+            use(ids.front()[0]);
+        }
+        return d;
+    });
+}
+
+static void
+benchValue()
+{
+    for (size_t size : {64, 1024, 16 * 1024}) {
+        Value v {ValueType::USER_DATA.id, randomBlob(size), 42};
+        auto packed = packMsg(v);
+        auto s = std::to_string(size);
+        run("Value pack (" + s + " B)", loop([&](size_t) {
+            use(packMsg(v).size());
+        }));
+        run("Value unpack (" + s + " B)", loop([&](size_t) {
+            auto msg = msgpack::unpack((const char*)packed.data(), packed.size());
+            Value u {msg.get()};
+            use(u.id);
+        }));
+    }
+}
+
+/* Store n values of size bytes, over n / per_key keys */
+static std::vector<Dht::ValuesExport>
+makeValues(size_t n, size_t per_key, size_t size)
+{
+    std::uniform_int_distribution<Value::Id> id_dis;
+    auto data = randomBlob(size);
+    auto t = clock::now().time_since_epoch().count();
+    std::vector<Dht::ValuesExport> values;
+    for (size_t i = 0; i < n; i += per_key) {
+        size_t count = std::min(per_key, n - i);
+        msgpack::sbuffer buf;
+        msgpack::packer<msgpack::sbuffer> pk(&buf);
+        pk.pack_array(count);
+        for (size_t j = 0; j < count; j++) {
+            pk.pack_array(2);
+            pk.pack(t);
+            pk.pack(Value {ValueType::USER_DATA.id, data, id_dis(rd)});
+        }
+        values.emplace_back(InfoHash::getRandom(), Blob {buf.data(), buf.data() + buf.size()});
+    }
+    return values;
+}
+
+static void
+benchStorage()
+{
+    // the number of keys is limited to Dht::MAX_HASHES
+    constexpr size_t N {128 * 1024};
+    for (size_t per_key : {8, 64, 512}) {
+        runFixed("Storage store (" + std::to_string(per_key) + " values/key)", N, [=](size_t n) {
+            LocalDht local;
+            local.node->setStorageLimit(std::numeric_limits<size_t>::max());
+            auto values = makeValues(n, per_key, 64);
+            auto start = clock::now();
+            local.node->importValues(values);
+            auto d = clock::now() - start;
+            use(local.node->getStoreSize().second);
+            return d;
+        });
+    }
+}
+
+static void
+benchMessages()
+{
+    // replies are not rate limited
+    run("Parse and process pong", [](size_t n) {
+        LocalDht local;
+        std::vector<msgpack::sbuffer> msgs;
+        std::vector<sockaddr_in> from;
+        msgs.reserve(n);
+        for (size_t i = 0; i < n; i++) {
+            msgpack::sbuffer buf;
+            msgpack::packer<msgpack::sbuffer> pk(&buf);
+            pk.pack_map(3);
+            pk.pack(std::string("r")); pk.pack_map(1);
+              pk.pack(std::string("id")); pk.pack(InfoHash::getRandom());
+            packTid(pk, "pn", 0);
+            pk.pack(std::string("y")); pk.pack(std::string("r"));
+            msgs.emplace_back(std::move(buf));
+            from.emplace_back(testAddr(i));
+        }
+        auto start = clock::now();
+        for (size_t i = 0; i < n; i++)
+            local.receive(msgs[i], from[i]);
+        return clock::now() - start;
+    });
+
+    // closest nodes lookup
+    runFixed("Process find request", 3 * REQUEST_ROUND, [](size_t n) {
+        LocalDht local;
+        local.populate(4096);
+        auto targets = randomIds(REQUEST_ROUND);
+        return timeRequests(local, n, [&](size_t i) {
+            return makeRequest(InfoHash::getRandom(), "find", [&](msgpack::packer<msgpack::sbuffer>& pk) {
+                pk.pack(std::string("target")); pk.pack(targets[i % REQUEST_ROUND]);
+            }, 1);
+        });
+    });
+
+    // token, closest nodes and values of a storage
+    runFixed("Process get request (32 values)", 3 * REQUEST_ROUND, [](size_t n) {
+        LocalDht local;
+        local.populate(4096);
+        auto values = makeValues(32 * 64, 32, 256);
+        local.node->importValues(values);
+        return timeRequests(local, n, [&](size_t i) {
+            return makeRequest(InfoHash::getRandom(), "get", [&](msgpack::packer<msgpack::sbuffer>& pk) {
+                pk.pack(std::string("h")); pk.pack(values[i % values.size()].first);
+            }, 1);
+        });
+    });
+}
+
+static void
+benchCrypto()
+{
+    // generated on first use: this takes a while
+    std::unique_ptr<crypto::PrivateKey> key, ec_key;
+    auto getKey = [&]() -> const crypto::PrivateKey& {
+        if (not key)
+            key.reset(new crypto::PrivateKey(crypto::PrivateKey::generate()));
+        return *key;
+    };
+    auto getEcKey = [&]() -> const crypto::PrivateKey& {
+        if (not ec_key)
+            ec_key.reset(new crypto::PrivateKey(crypto::PrivateKey::generateEC()));
+        return *ec_key;
+    };
+
+    const std::vector<std::pair<std::string, std::function<const crypto::PrivateKey&()>>> key_types {
+        {"RSA-4096", getKey},
+        {"ECDSA P-256", getEcKey}
+    };
+    for (const auto& kt : key_types) {
+        const auto& getKeyOfType = kt.second;
+        for (size_t size : {64, 1024}) {
+            auto data = randomBlob(size);
+            auto s = " " + kt.first + " (" + std::to_string(size) + " B)";
+            run("crypto: sign" + s, [&](size_t n) {
+                const auto& k = getKeyOfType();
+                auto start = clock::now();
+                for (size_t i = 0; i < n; i++)
+                    use(k.sign(data).size());
+                return clock::now() - start;
+            });
+            run("crypto: verify" + s, [&](size_t n) {
+                auto pk = getKeyOfType().getPublicKey();
+                auto sig = getKeyOfType().sign(data);
+                auto start = clock::now();
+                for (size_t i = 0; i < n; i++)
+                    use(pk.checkSignature(data, sig));
+                return clock::now() - start;
+            });
+        }
+    }
+
+    // RSA only up to a block, hybrid RSA/AES-GCM above
+    for (size_t size : {64, 256, 1024, 4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024}) {
+        auto data = randomBlob(size);
+        auto s = " (" + std::to_string(size) + " B)";
+        run("crypto: encrypt RSA-4096" + s, [&](size_t n) {
+            auto pk = getKey().getPublicKey();
+            auto start = clock::now();
+            for (size_t i = 0; i < n; i++)
+                use(pk.encrypt(data).size());
+            return clock::now() - start;
+        });
+        run("crypto: decrypt RSA-4096" + s, [&](size_t n) {
+            const auto& k = getKey();
+            auto cypher = k.getPublicKey().encrypt(data);
+            auto start = clock::now();
+            for (size_t i = 0; i < n; i++)
+                use(k.decrypt(cypher).size());
+            return clock::now() - start;
+        });
+    }
+
+    auto aes_key = randomBlob(32);
+    auto data = randomBlob(16 * 1024);
+    auto aes_cypher = crypto::aesEncrypt(data, aes_key);
+    run("crypto: aesEncrypt (16 KiB)", loop([&](size_t) {
+        use(crypto::aesEncrypt(data, aes_key).size());
+    }));
+    run("crypto: aesDecrypt (16 KiB)", loop([&](size_t) {
+        use(crypto::aesDecrypt(aes_cypher, aes_key).size());
+    }));
+    runFixed("crypto: stretchKey", 8, loop([&](size_t) {
+        Blob salt;
+        use(crypto::stretchKey("benchmark password", salt).size());
+    }));
+    for (unsigned lanes : {2, 4}) {
+        runFixed("crypto: stretchKey (" + std::to_string(lanes) + " lanes)", 8, loop([&](size_t) {
+            Blob salt;
+            use(crypto::stretchKey("benchmark password", salt, lanes).size());
+        }));
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc > 1)
+        filter = argv[1];
+    if (int rc = gnutls_global_init())
+        throw std::runtime_error(std::string("Error initializing GnuTLS: ")+gnutls_strerror(rc));
+
+    benchInfoHash();
+    benchValue();
+    benchStorage();
+    benchMessages();
+    benchCrypto();
+
+    gnutls_global_deinit();
+    return 0;
+}
@@ -0,0 +1,575 @@
+/*
+ *  Copyright (C) 2014-2016 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+// Simulation of a network of Dht nodes in a single process, over a
+// virtual transport with configurable latency and packet loss, and a
+// virtual clock: minutes of network time run in seconds.
+// The seed sets the node ids, delays, losses and keys of a run; the nodes
+// still draw their own random numbers, so runs are not reproducible.
+// Each node adds a random access delay to its packets, so round trip
+// times vary between pairs of nodes.
+// Reports, for puts and gets from random nodes on random keys, the
+// success rate, the lookup latency distribution, the number of messages
+// per operation and the hops to the closest node found.
+// With --check, runs regression checks on the joined network instead,
+// and exits with a non-zero status if any fails.
+
+#include "benchmark.h"
+
+#include <getopt.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <queue>
+#include <random>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+using namespace dht;
+using namespace bench;
+
+static const constexpr in_port_t SIM_PORT {4222};
+
+class Network {
+public:
+    struct Params {
+        duration latency;
+        duration jitter;
+        /* maximum access delay of a node */
+        duration spread;
+        double loss;
+    };
+
+    Network(size_t n, const Params& p, unsigned seed) : params(p), rd(seed), now_(clock::now()) {
+        for (size_t i = 0; i < n; i++) {
+            // 10.0.0.1, 10.0.0.2...
+            uint32_t ip = (10u << 24) + i + 1;
+            sockaddr_in sin;
+            std::fill_n((uint8_t*)&sin, sizeof(sin), 0);
+            sin.sin_family = AF_INET;
+            sin.sin_addr.s_addr = htonl(ip);
+            sin.sin_port = htons(SIM_PORT);
+
+            // node ids from the seeded generator
+            InfoHash id;
+            std::generate(id.begin(), id.end(), [&]() { return (uint8_t)rd(); });
+
+            Dht::Transport transport {};
+            transport.send = [this,i](const uint8_t* buf, size_t len, const sockaddr* to, socklen_t tolen) {
+                return send(i, buf, len, to, tolen);
+            };
+            transport.clock = [this]() { return now_; };
+            transport.ipv4 = true;
+            Dht::Config config {};
+            config.node_id = id;
+            nodes.emplace_back(Node {
+                std::unique_ptr<Dht>(new Dht(transport, config)),
+                sin,
+                time_point::max(),
+                randomDuration(params.spread)
+            });
+            addresses.emplace(ip, i);
+        }
+    }
+
+    size_t size() const { return nodes.size(); }
+    time_point now() const { return now_; }
+    Dht& operator[](size_t i) { return *nodes[i].dht; }
+    std::mt19937_64& random() { return rd; }
+
+    size_t randomNode() {
+        return std::uniform_int_distribution<size_t>(0, nodes.size() - 1)(rd);
+    }
+
+    /**
+     * Add node i to the network, bootstrapping from node b.
+     */
+    void join(size_t i, size_t b) {
+        nodes[i].dht->pingNode((const sockaddr*)&nodes[b].addr, sizeof(sockaddr_in));
+        wake(i);
+    }
+
+    /**
+     * Run node i at the current time, after an operation was started on it.
+     */
+    void wake(size_t i) {
+        schedule(i, now_);
+    }
+
+    /**
+     * Deliver packets and run the nodes until t, or until stop() returns true.
+     */
+    void runUntil(time_point t, const std::function<bool()>& stop = {}) {
+        while (not stop or not stop()) {
+            auto next_packet = packets.empty() ? time_point::max() : packets.top().time;
+            auto next_wakeup = wakeups.empty() ? time_point::max() : wakeups.begin()->first;
+            auto next = std::min(next_packet, next_wakeup);
+            if (next > t)
+                break;
+            if (next > now_)
+                now_ = next;
+            if (next_packet <= next_wakeup) {
+                auto p = std::move(const_cast<Packet&>(packets.top()));
+                packets.pop();
+                auto& n = nodes[p.to];
+                schedule(p.to, n.dht->periodic(p.data.data(), p.data.size(), (const sockaddr*)&p.from, sizeof(sockaddr_in)));
+            } else {
+                auto i = wakeups.begin()->second;
+                wakeups.erase(wakeups.begin());
+                nodes[i].wakeup = time_point::max();
+                schedule(i, nodes[i].dht->periodic(nullptr, 0, nullptr, 0));
+            }
+        }
+        if (now_ < t and (not stop or not stop()))
+            now_ = t;
+    }
+
+    /**
+     * Deliver a packet to node i from an address outside of the network,
+     * as a remote peer would send it.
+     */
+    void inject(size_t i, const sockaddr_in& from, Blob data) {
+        packets.emplace(Packet {now_ + params.latency, seq++, i, from, std::move(data)});
+    }
+
+    const sockaddr_in& address(size_t i) const { return nodes[i].addr; }
+
+    uint64_t sent() const { return packets_sent; }
+    uint64_t lost() const { return packets_lost; }
+
+private:
+    struct Node {
+        std::unique_ptr<Dht> dht;
+        sockaddr_in addr;
+        time_point wakeup;
+        duration delay;
+    };
+
+    struct Packet {
+        time_point time;
+        uint64_t seq;
+        size_t to;
+        sockaddr_in from;
+        Blob data;
+        /* std::priority_queue is a max heap */
+        bool operator<(const Packet& o) const {
+            return time > o.time or (time == o.time and seq > o.seq);
+        }
+    };
+
+    int send(size_t from, const uint8_t* buf, size_t len, const sockaddr* to, socklen_t tolen) {
+        packets_sent++;
+        if (to->sa_family != AF_INET or tolen < sizeof(sockaddr_in))
+            return -1;
+        auto dst = addresses.find(ntohl(((const sockaddr_in*)to)->sin_addr.s_addr));
+        if (dst == addresses.end() or ((const sockaddr_in*)to)->sin_port != htons(SIM_PORT)
+            or std::bernoulli_distribution(params.loss)(rd)) {
+            packets_lost++;
+            return len;
+        }
+        auto delay = params.latency + nodes[from].delay + nodes[dst->second].delay + randomDuration(params.jitter);
+        packets.emplace(Packet {now_ + delay, seq++, dst->second, nodes[from].addr, Blob(buf, buf + len)});
+        return len;
+    }
+
+    duration randomDuration(duration max) {
+        if (max <= duration::zero())
+            return duration::zero();
+        return duration(std::uniform_int_distribution<duration::rep>(0, max.count())(rd));
+    }
+
+    void schedule(size_t i, time_point t) {
+        auto& n = nodes[i];
+        if (t < now_)
+            t = now_;
+        if (t >= n.wakeup)
+            return;
+        if (n.wakeup != time_point::max())
+            wakeups.erase({n.wakeup, i});
+        n.wakeup = t;
+        if (t != time_point::max())
+            wakeups.emplace(t, i);
+    }
+
+    Params params;
+    std::mt19937_64 rd;
+    time_point now_;
+
+    std::vector<Node> nodes;
+    std::unordered_map<uint32_t, size_t> addresses;
+
+    std::priority_queue<Packet> packets;
+    std::set<std::pair<time_point, size_t>> wakeups;
+    uint64_t seq {0};
+    uint64_t packets_sent {0};
+    uint64_t packets_lost {0};
+};
+
+struct PhaseResult {
+    size_t ok {0};
+    Histogram latency {};
+    uint64_t messages {0};
+    duration elapsed {};
+};
+
+/**
+ * Start ops operations, one every interval, and run the network until
+ * they complete or timeout expires. op(i, done) starts operation i and
+ * returns the node it runs on; done(ok) must be called once complete.
+ */
+static PhaseResult
+runPhase(Network& net, size_t ops, duration interval, duration timeout,
+         const std::function<size_t(size_t, std::function<void(bool)>)>& op)
+{
+    // operations still running after the timeout may complete later
+    auto res = std::make_shared<PhaseResult>();
+    auto done = std::make_shared<size_t>(0);
+    auto sent = net.sent();
+    auto start = net.now();
+    for (size_t i = 0; i < ops; i++) {
+        auto op_start = net.now();
+        auto node = op(i, [&net,res,done,op_start](bool ok) {
+            (*done)++;
+            if (ok) {
+                res->ok++;
+                res->latency.add(net.now() - op_start);
+            }
+        });
+        net.wake(node);
+        net.runUntil(net.now() + interval);
+    }
+    net.runUntil(net.now() + timeout, [&]() { return *done == ops; });
+    res->elapsed = net.now() - start;
+    res->messages = net.sent() - sent;
+    return *res;
+}
+
+static void
+report(const std::string& name, size_t ops, const PhaseResult& r, double background)
+{
+    double s = std::chrono::duration<double>(r.elapsed).count();
+    double msgs = std::max(0., r.messages - background * s);
+    std::cout << name << ": " << r.ok << "/" << ops << " ok, "
+              << std::fixed << std::setprecision(1) << (ops ? msgs / ops : 0.) << " messages/op" << std::endl
+              << "  latency (us): " << r.latency.toString() << std::endl;
+}
+
+/* SipHash-2-4 with 128 bit output, as used by Dht to make tokens */
+static inline uint64_t rotl64(uint64_t x, unsigned b) { return (x << b) | (x >> (64 - b)); }
+
+static void
+sipRound(std::array<uint64_t, 4>& v)
+{
+    v[0] += v[1]; v[1] = rotl64(v[1], 13); v[1] ^= v[0]; v[0] = rotl64(v[0], 32);
+    v[2] += v[3]; v[3] = rotl64(v[3], 16); v[3] ^= v[2];
+    v[0] += v[3]; v[3] = rotl64(v[3], 21); v[3] ^= v[0];
+    v[2] += v[1]; v[1] = rotl64(v[1], 17); v[1] ^= v[2]; v[2] = rotl64(v[2], 32);
+}
+
+static Blob
+sipHash128(std::array<uint64_t, 4> v, const uint8_t* data, size_t len)
+{
+    auto block = [&](uint64_t m) {
+        v[3] ^= m;
+        sipRound(v);
+        sipRound(v);
+        v[0] ^= m;
+    };
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t m = 0;
+        for (unsigned j = 0; j < 8; j++)
+            m |= (uint64_t)data[i + j] << (8 * j);
+        block(m);
+    }
+    uint64_t b = (uint64_t)len << 56;
+    for (unsigned j = 0; i + j < len; j++)
+        b |= (uint64_t)data[i + j] << (8 * j);
+    block(b);
+
+    Blob out(16);
+    v[2] ^= 0xee;
+    for (unsigned r = 0; r < 2; r++) {
+        for (unsigned j = 0; j < 4; j++)
+            sipRound(v);
+        uint64_t h = v[0] ^ v[1] ^ v[2] ^ v[3];
+        for (unsigned j = 0; j < 8; j++)
+            out[8 * r + j] = (uint8_t)(h >> (8 * j));
+        v[1] ^= 0xdd;
+    }
+    return out;
+}
+
+/**
+ * A put token made from an all-zero SipHash state, the state of a secret
+ * that was never set, must be rejected right after the node starts.
+ */
+static bool
+checkZeroToken(Network& net)
+{
+    const size_t target = net.randomNode();
+    // the node's own id, so that it is among the closest nodes to the key
+    const InfoHash key = net[target].getNodeId();
+
+    sockaddr_in from;
+    std::fill_n((uint8_t*)&from, sizeof(from), 0);
+    from.sin_family = AF_INET;
+    from.sin_addr.s_addr = htonl((10u << 24) + (250u << 16) + 1);
+    from.sin_port = htons(SIM_PORT);
+
+    // address followed by port, as Dht::makeToken hashes them
+    std::array<uint8_t, 4 + 2> addr;
+    in_port_t port = htons(from.sin_port);
+    std::copy_n((const uint8_t*)&from.sin_addr, 4, addr.begin());
+    std::copy_n((const uint8_t*)&port, 2, addr.begin() + 4);
+    auto token = sipHash128({{}}, addr.data(), addr.size());
+
+    InfoHash id;
+    std::generate(id.begin(), id.end(), [&]() { return (uint8_t)net.random()(); });
+    Value v {Blob(16, 'x')};
+    v.id = 1;
+
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    pk.pack_map(4);
+    pk.pack(std::string("a")); pk.pack_map(4);
+      pk.pack(std::string("id"));     pk.pack(id);
+      pk.pack(std::string("h"));      pk.pack(key);
+      pk.pack(std::string("values")); pk.pack_array(1); pk.pack(v);
+      pk.pack(std::string("token"));  pk.pack_bin(token.size());
+                                      pk.pack_bin_body((const char*)token.data(), token.size());
+    pk.pack(std::string("q")); pk.pack(std::string("put"));
+    pk.pack(std::string("t")); pk.pack_bin(4); pk.pack_bin_body("pt\0\0", 4);
+    pk.pack(std::string("y")); pk.pack(std::string("q"));
+
+    net.inject(target, from, Blob(buffer.data(), buffer.data() + buffer.size()));
+    net.runUntil(net.now() + std::chrono::seconds(1));
+
+    bool ok = net[target].getLocal(key).empty();
+    std::cout << "zero token rejected: " << (ok ? "ok" : "FAILED") << std::endl;
+    return ok;
+}
+
+/**
+ * A getMany repeated on the same keys within the get cache window
+ * completes synchronously from the cache, and must return the values
+ * found by the first one. Best run with -fsanitize=address, since
+ * the batch used to be released while still running.
+ */
+static bool
+checkGetManyTwice(Network& net)
+{
+    const size_t n_keys = 8;
+    std::vector<std::pair<InfoHash, std::shared_ptr<Value>>> values;
+    std::vector<InfoHash> keys;
+    for (size_t i = 0; i < n_keys; i++) {
+        InfoHash h;
+        std::generate(h.begin(), h.end(), [&]() { return (uint8_t)net.random()(); });
+        keys.emplace_back(h);
+        values.emplace_back(h, std::make_shared<Value>(Blob(16, 'x')));
+    }
+
+    bool put_done = false;
+    auto p = net.randomNode();
+    net[p].putMany(std::move(values), [&](std::vector<bool>&&) { put_done = true; });
+    net.wake(p);
+    net.runUntil(net.now() + std::chrono::minutes(2), [&]() { return put_done; });
+
+    auto found = [&](const Dht::GetManyResult& res) {
+        size_t n = 0;
+        for (const auto& r : res)
+            if (not r.second.empty())
+                n++;
+        return n;
+    };
+
+    auto g = net.randomNode();
+    bool get_done = false;
+    size_t first = 0;
+    net[g].getMany(keys, [&](Dht::GetManyResult&& res) {
+        first = found(res);
+        get_done = true;
+    });
+    net.wake(g);
+    net.runUntil(net.now() + std::chrono::minutes(2), [&]() { return get_done; });
+
+    // right away, from the get cache
+    get_done = false;
+    size_t second = 0;
+    net[g].getMany(keys, [&](Dht::GetManyResult&& res) {
+        second = found(res);
+        get_done = true;
+    });
+    net.wake(g);
+    net.runUntil(net.now() + std::chrono::minutes(2), [&]() { return get_done; });
+
+    bool ok = put_done and first == n_keys and second == n_keys;
+    std::cout << "getMany twice: " << first << "/" << n_keys << " then " << second << "/" << n_keys
+              << " found: " << (ok ? "ok" : "FAILED") << std::endl;
+    return ok;
+}
+
+static const constexpr struct option long_options[] = {
+   {"help",    no_argument,       nullptr, 'h'},
+   {"nodes",   required_argument, nullptr, 'n'},
+   {"ops",     required_argument, nullptr, 'o'},
+   {"latency", required_argument, nullptr, 'l'},
+   {"jitter",  required_argument, nullptr, 'j'},
+   {"spread",  required_argument, nullptr, 'd'},
+   {"alpha",   required_argument, nullptr, 'a'},
+   {"latency-aware", no_argument, nullptr, 'r'},
+   {"loss",    required_argument, nullptr, 'p'},
+   {"seed",    required_argument, nullptr, 's'},
+   {"warmup",  required_argument, nullptr, 'w'},
+   {"check",   no_argument,       nullptr, 'c'},
+   {nullptr,   0,                 nullptr,  0}
+};
+
+static void
+print_usage()
+{
+    std::cout << "Usage: dhtsim [options]" << std::endl
+              << "  -n, --nodes N     number of nodes (default 500)" << std::endl
+              << "  -o, --ops N       number of puts and gets (default 200)" << std::endl
+              << "  -l, --latency MS  one way latency (default 50)" << std::endl
+              << "  -j, --jitter MS   maximum added random latency (default 20)" << std::endl
+              << "  -d, --spread MS   maximum access delay of a node (default 100)" << std::endl
+              << "  -a, --alpha N     parallel get requests per search step (default 3)" << std::endl
+              << "  -r, --latency-aware  query the fastest of the closest nodes first" << std::endl
+              << "  -p, --loss P      packet loss probability (default 0)" << std::endl
+              << "  -s, --seed N      random seed (default 0)" << std::endl
+              << "  -w, --warmup S    virtual time to let the network settle (default 300)" << std::endl
+              << "  -c, --check       run regression checks instead of the benchmark" << std::endl;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t n_nodes = 500;
+    size_t ops = 200;
+    unsigned latency = 50, jitter = 20, spread = 100, warmup = 300, seed = 0;
+    unsigned alpha = Dht::SEARCH_ALPHA;
+    bool latency_aware = false;
+    bool check = false;
+    double loss = 0.;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hn:o:l:j:d:a:rp:s:w:c", long_options, nullptr)) != -1) {
+        switch (opt) {
+        case 'n': n_nodes = std::stoul(optarg); break;
+        case 'o': ops = std::stoul(optarg); break;
+        case 'l': latency = std::stoul(optarg); break;
+        case 'j': jitter = std::stoul(optarg); break;
+        case 'd': spread = std::stoul(optarg); break;
+        case 'a': alpha = std::stoul(optarg); break;
+        case 'r': latency_aware = true; break;
+        case 'p': loss = std::stod(optarg); break;
+        case 's': seed = std::stoul(optarg); break;
+        case 'w': warmup = std::stoul(optarg); break;
+        case 'c': check = true; break;
+        default:
+            print_usage();
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (n_nodes < 2 or loss < 0. or loss >= 1.) {
+        print_usage();
+        return 1;
+    }
+
+    Network net(n_nodes, {
+        std::chrono::milliseconds(latency),
+        std::chrono::milliseconds(jitter),
+        std::chrono::milliseconds(spread),
+        loss
+    }, seed);
+    for (size_t i = 0; i < net.size(); i++) {
+        net[i].setSearchAlpha(alpha);
+        net[i].setLatencyAware(latency_aware);
+    }
+    std::cout << "Simulating " << n_nodes << " nodes, latency " << latency << "+" << jitter
+              << " ms, access delay up to " << spread << " ms, loss " << loss << ", seed " << seed
+              << ", alpha " << alpha << (latency_aware ? ", latency aware" : "") << std::endl;
+
+    // nodes join one after the other, from a random node already in the network
+    auto real_start = clock::now();
+    auto sim_start = net.now();
+    for (size_t i = 1; i < net.size(); i++) {
+        net.join(i, std::uniform_int_distribution<size_t>(0, i - 1)(net.random()));
+        net.runUntil(net.now() + std::chrono::milliseconds(100));
+    }
+
+    if (check) {
+        net.runUntil(net.now() + std::chrono::seconds(30));
+        bool ok = true;
+        ok &= checkZeroToken(net);
+        ok &= checkGetManyTwice(net);
+        return ok ? 0 : 1;
+    }
+
+    net.runUntil(net.now() + std::chrono::seconds(warmup));
+
+    // background traffic rate, to leave out of the messages per operation
+    auto idle_sent = net.sent();
+    auto idle_time = std::chrono::seconds(30);
+    net.runUntil(net.now() + idle_time);
+    double background = (net.sent() - idle_sent) / std::chrono::duration<double>(idle_time).count();
+    std::cout << "Background traffic: " << std::fixed << std::setprecision(1)
+              << background / net.size() << " messages/s per node" << std::endl;
+
+    for (size_t i = 0; i < net.size(); i++)
+        net[i].getMetrics(true);
+
+    std::vector<InfoHash> keys;
+    for (size_t i = 0; i < ops; i++) {
+        InfoHash h;
+        std::generate(h.begin(), h.end(), [&]() { return (uint8_t)net.random()(); });
+        keys.emplace_back(h);
+    }
+    Blob data(256, 'x');
+    const auto interval = std::chrono::milliseconds(50);
+    const auto timeout = std::chrono::minutes(2);
+
+    auto puts = runPhase(net, ops, interval, timeout, [&](size_t i, std::function<void(bool)> done) {
+        auto node = net.randomNode();
+        net[node].put(keys[i], Value {data}, [=](bool ok) { done(ok); });
+        return node;
+    });
+    report("put", ops, puts, background);
+
+    auto gets = runPhase(net, ops, interval, timeout, [&](size_t i, std::function<void(bool)> done) {
+        auto node = net.randomNode();
+        auto found = std::make_shared<bool>(false);
+        net[node].get(keys[i], [=](const std::vector<std::shared_ptr<Value>>& values) {
+            *found |= not values.empty();
+            return true;
+        }, [=](bool) { done(*found); });
+        return node;
+    });
+    report("get", ops, gets, background);
+
+    Histogram hops;
+    for (size_t i = 0; i < net.size(); i++)
+        hops.merge(net[i].getMetrics().search_hops);
+    std::cout << "Search hops: " << hops.toString() << std::endl;
+    std::cout << "Packets: " << net.sent() << " sent, " << net.lost() << " lost" << std::endl;
+    std::cout << "Simulated " << std::chrono::duration_cast<std::chrono::seconds>(net.now() - sim_start).count()
+              << " s in " << std::chrono::duration<double>(clock::now() - real_start).count() << " s" << std::endl;
+    return 0;
+}
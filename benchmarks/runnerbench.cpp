@@ -0,0 +1,217 @@
+/*
+ *  Copyright (C) 2014-2016 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+// End-to-end throughput of puts and gets between local DhtRunner nodes.
+// Usage: dhtrunnerbench [address] [nodes] [operations] [concurrency]
+// address must be a local, non-loopback IPv4 address (the DHT ignores
+// loopback addresses). By default, the first one found is used.
+// Then checks that the query of a get filter is sent to the remote
+// nodes: a get for a single value id must receive less data than a get
+// for all the values at the key.
+
+#include "benchmark.h"
+
+#include <gnutls/gnutls.h>
+
+#include <ifaddrs.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace dht;
+using namespace bench;
+
+static std::string
+localAddress()
+{
+    ifaddrs* addrs;
+    if (getifaddrs(&addrs) < 0)
+        return {};
+    std::string ret;
+    for (auto a = addrs; a; a = a->ifa_next) {
+        if (not a->ifa_addr or a->ifa_addr->sa_family != AF_INET)
+            continue;
+        auto sin = (const sockaddr_in*)a->ifa_addr;
+        if ((ntohl(sin->sin_addr.s_addr) >> 24) == 127)
+            continue;
+        char buf[INET_ADDRSTRLEN];
+        if (inet_ntop(AF_INET, &sin->sin_addr, buf, sizeof(buf))) {
+            ret = buf;
+            break;
+        }
+    }
+    freeifaddrs(addrs);
+    return ret;
+}
+
+/**
+ * Run n operations with at most concurrency of them in progress.
+ * op(i, done) must call done(ok) once complete.
+ * @returns the elapsed time and number of successful operations.
+ */
+static std::pair<duration, size_t>
+runConcurrent(size_t n, unsigned concurrency, const std::function<void(size_t, std::function<void(bool)>)>& op)
+{
+    std::mutex mtx;
+    std::condition_variable cv;
+    size_t started = 0, done = 0, ok = 0;
+
+    auto start = clock::now();
+    std::unique_lock<std::mutex> lck(mtx);
+    while (done < n) {
+        while (started < n and started - done < concurrency) {
+            auto i = started++;
+            lck.unlock();
+            op(i, [&](bool success) {
+                std::lock_guard<std::mutex> l(mtx);
+                done++;
+                if (success)
+                    ok++;
+                cv.notify_all();
+            });
+            lck.lock();
+        }
+        cv.wait(lck, [&]() { return done == n or started - done < concurrency; });
+    }
+    return {clock::now() - start, ok};
+}
+
+static void
+report(const std::string& name, size_t n, const std::pair<duration, size_t>& r)
+{
+    double s = std::chrono::duration<double>(r.first).count();
+    std::cout << std::left << std::setw(20) << name << std::right
+              << std::setw(8) << n << " ops " << std::setw(8) << r.second << " ok "
+              << std::setw(10) << std::fixed << std::setprecision(1) << (s > 0 ? n / s : 0.) << " ops/s" << std::endl;
+}
+
+int
+main(int argc, char **argv)
+{
+    std::string addr = argc > 1 ? argv[1] : localAddress();
+    unsigned nodes = argc > 2 ? std::stoul(argv[2]) : 8;
+    size_t ops = argc > 3 ? std::stoul(argv[3]) : 2048;
+    unsigned concurrency = argc > 4 ? std::stoul(argv[4]) : 64;
+    if (addr.empty()) {
+        std::cerr << "No local IPv4 address found" << std::endl;
+        return 1;
+    }
+    if (nodes < 2) {
+        std::cerr << "At least 2 nodes are needed" << std::endl;
+        return 1;
+    }
+
+    if (int rc = gnutls_global_init())
+        throw std::runtime_error(std::string("Error initializing GnuTLS: ")+gnutls_strerror(rc));
+
+    sockaddr_in local;
+    std::fill_n((uint8_t*)&local, sizeof(local), 0);
+    local.sin_family = AF_INET;
+    if (inet_pton(AF_INET, addr.c_str(), &local.sin_addr) != 1) {
+        std::cerr << "Invalid IPv4 address: " << addr << std::endl;
+        return 1;
+    }
+
+    std::cout << "Running " << nodes << " nodes on " << addr << std::endl;
+    std::vector<std::unique_ptr<DhtRunner>> runners;
+    for (unsigned i = 0; i < nodes; i++) {
+        runners.emplace_back(new DhtRunner);
+        // no identity: random node ids, values are not signed
+        DhtRunner::Config config {};
+        config.threaded = true;
+        runners.back()->run(&local, nullptr, config);
+        if (i > 0)
+            runners.back()->bootstrap(addr.c_str(), std::to_string(runners.front()->getBoundPort()).c_str());
+    }
+
+    // let the nodes find each other
+    auto deadline = clock::now() + std::chrono::seconds(30);
+    for (auto& r : runners) {
+        unsigned good = 0, dubious, cached, incoming;
+        while (good == 0 and clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            r->getNodesStats(AF_INET, &good, &dubious, &cached, &incoming);
+        }
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+
+    std::vector<InfoHash> keys;
+    for (size_t i = 0; i < ops; i++)
+        keys.emplace_back(InfoHash::getRandom());
+    Blob data(256, 'x');
+
+    auto& client = *runners.back();
+    report("put", ops, runConcurrent(ops, concurrency, [&](size_t i, std::function<void(bool)> done) {
+        client.put(keys[i], Value {data}, [=](bool ok) { done(ok); });
+    }));
+
+    // bypass the result cache of the client
+    client.setGetCacheWindow(duration::zero());
+    report("get", ops, runConcurrent(ops, concurrency, [&](size_t i, std::function<void(bool)> done) {
+        auto found = std::make_shared<bool>(false);
+        client.get(keys[i], [=](const std::vector<std::shared_ptr<Value>>& values) {
+            *found |= not values.empty();
+            return true;
+        }, [=](bool) { done(*found); });
+    }));
+
+    auto m = client.getMetrics();
+    std::cout << "Client metrics:" << std::endl << m.toString() << std::endl;
+
+    // many values at one key: one of them is wanted
+    const auto key = InfoHash::getRandom();
+    const size_t n_values = 16;
+    report("put (query)", n_values, runConcurrent(n_values, concurrency, [&](size_t, std::function<void(bool)> done) {
+        auto v = std::make_shared<Value>(Blob(1024, 'x'));
+        runners.front()->put(key, v, [=](bool ok) { done(ok); });
+    }));
+    auto values = client.get(key).get();
+    if (values.empty()) {
+        std::cerr << "No value found for the query check" << std::endl;
+        return 1;
+    }
+    const auto wanted = values.front()->id;
+
+    auto getBytes = [&](Value::Filter f) {
+        client.getMetrics(true);
+        size_t found = 0;
+        runConcurrent(1, 1, [&](size_t, std::function<void(bool)> done) {
+            client.get(key, [&](const std::vector<std::shared_ptr<Value>>& vals) {
+                found += vals.size();
+                return true;
+            }, [=](bool ok) { done(ok); }, std::move(f));
+        });
+        return std::make_pair(client.getMetrics().bytes_in, found);
+    };
+    // the filtered get runs first, with a colder search
+    auto filtered = getBytes(Value::IdFilter(wanted));
+    auto all = getBytes({});
+    bool ok = filtered.second > 0 and filtered.first * 2 < all.first;
+    std::cout << "Query check: " << filtered.first << " bytes received for one value, "
+              << all.first << " for " << all.second << ": " << (ok ? "ok" : "FAILED") << std::endl;
+
+    for (auto& r : runners)
+        r->join();
+    gnutls_global_deinit();
+    return ok ? 0 : 1;
+}
@@ -24,5 +24,8 @@
 #include "opendht/infohash.h"
 #include "opendht/securedht.h"
 #include "opendht/dhtrunner.h"
+#include "opendht/sharded_runner.h"
+#include "opendht/value_log.h"
+#include "opendht/metrics.h"
 #include "opendht/log.h"
 #include "opendht/default_types.h"
@@ -73,6 +73,14 @@ struct PublicKey
 
     InfoHash getId() const;
     bool checkSignature(const Blob& data, const Blob& signature) const;
+
+    /**
+     * Encrypt data for the owner of the corresponding private key.
+     * Data that fits in a single RSA block is encrypted with RSA.
+     * Larger data is encrypted with AES-GCM using a random key, and only
+     * the key is encrypted with RSA (a single RSA operation in any case).
+     * Only supported for RSA keys.
+     */
     Blob encrypt(const Blob&) const;
 
     void pack(Blob& b) const;
@@ -139,6 +147,13 @@ struct PrivateKey
      */
     static PrivateKey generate(unsigned key_length = 4096);
 
+    /**
+     * Generate a new elliptic curve (ECDSA P-256) key pair.
+     * Signing and verification are much faster than with RSA keys,
+     * but data can't be encrypted for EC keys.
+     */
+    static PrivateKey generateEC();
+
     gnutls_privkey_t key {};
     gnutls_x509_privkey_t x509_key {};
 private:
@@ -317,6 +332,15 @@ private:
 Identity generateIdentity(const std::string& name, Identity ca, unsigned key_length, bool is_ca);
 Identity generateIdentity(const std::string& name = "dhtnode", Identity ca = {}, unsigned key_length = 4096);
 
+/**
+ * Generate an elliptic curve (ECDSA P-256) key pair and a certificate.
+ * @param name the name used in the generated certificate
+ * @param ca if set, the certificate authority that will sign the generated certificate.
+ *           If not set, the generated certificate will be a self-signed CA.
+ */
+Identity generateEcIdentity(const std::string& name, Identity ca, bool is_ca);
+Identity generateEcIdentity(const std::string& name = "dhtnode", Identity ca = {});
+
 
 /**
  * SHA512
@@ -329,8 +353,12 @@ Blob hash(const Blob& data);
  * The generated key also depends on a unique salt value of any size,
  * that can be transmitted in clear, and will be generated if
  * not provided (32 bytes).
+ * Argon2 runs over lanes memory lanes, filled by up to threads threads
+ * (0 for one per lane). The number of lanes changes the key: the same
+ * value must be used to generate it again. The default, 1, is used for
+ * password protected data and keys.
  */
-Blob stretchKey(const std::string& password, Blob& salt);
+Blob stretchKey(const std::string& password, Blob& salt, unsigned lanes = 1, unsigned threads = 0);
 
 /**
  * AES-GCM encryption. Key must be 128, 192 or 256 bits long (16, 24 or 32 bytes).
@@ -29,16 +29,22 @@ THE SOFTWARE.
 
 #include "infohash.h"
 #include "value.h"
+#include "scheduler.h"
+#include "value_log.h"
+#include "metrics.h"
 
 #include <string>
 #include <array>
 #include <vector>
 #include <map>
+#include <set>
+#include <unordered_map>
 #include <list>
 #include <queue>
 #include <functional>
 #include <algorithm>
 #include <memory>
+#include <iosfwd>
 
 namespace dht {
 
@@ -62,6 +68,8 @@ struct Node {
     time_point reply_time {time_point::min()};      /* time of last correct reply received */
     time_point pinged_time {time_point::min()};     /* time of last message sent */
     unsigned pinged {0};           /* how many requests we sent since last reply */
+    duration rtt {};               /* smoothed round trip time, zero if unknown */
+    duration rtt_var {};           /* round trip time variation */
 
     Node() : ss() {
         std::fill_n((uint8_t*)&ss, sizeof(ss), 0);
@@ -97,6 +105,19 @@ struct Node {
      Answer should be true if the message was an aswer to a request we made*/
     void received(time_point now, bool answer);
 
+    /** To be called with the time between a request and its reply */
+    void updateRtt(duration sample);
+
+    /** To be called when the node can't be reached at all (send error) */
+    void setExpired(time_point now);
+
+    /**
+     * Time to wait for a reply before sending the request to other nodes:
+     * from MIN_RESPONSE_TIME to MAX_RESPONSE_TIME depending on the round
+     * trip time, or MAX_RESPONSE_TIME if unknown.
+     */
+    duration getResponseTime() const;
+
     friend std::ostream& operator<< (std::ostream& s, const Node& h);
 
     static constexpr const std::chrono::minutes NODE_GOOD_TIME {120};
@@ -106,6 +127,7 @@ struct Node {
 
     /* Time for a request to timeout */
     static constexpr const std::chrono::seconds MAX_RESPONSE_TIME {3};
+    static constexpr const std::chrono::milliseconds MIN_RESPONSE_TIME {250};
 };
 
 /**
@@ -127,6 +149,8 @@ public:
     struct Config {
         InfoHash node_id;
         bool is_bootstrap;
+        /* maximum number of searches, 0 for MAX_SEARCHES */
+        unsigned max_searches;
     };
 
     // [[deprecated]]
@@ -140,6 +164,12 @@ public:
 
     static constexpr size_t DEFAULT_STORAGE_LIMIT {1024 * 1024 * 64};
 
+    /* Default time the result of a get is reused */
+    static constexpr std::chrono::seconds GET_CACHE_WINDOW {1};
+
+    /* Default number of parallel get requests of a search step */
+    static constexpr unsigned SEARCH_ALPHA {3};
+
     static GetCallbackSimple
     bindGetCb(GetCallbackRaw raw_cb, void* user_data) {
         if (not raw_cb) return {};
@@ -164,6 +194,11 @@ public:
 
     typedef std::function<void(bool success)> DoneCallbackSimple;
 
+    /* Result of every put of a batch, in the order of the batch */
+    typedef std::function<void(std::vector<bool>&& success)> PutManyCallback;
+    typedef std::map<InfoHash, std::vector<std::shared_ptr<Value>>> GetManyResult;
+    typedef std::function<void(GetManyResult&& values)> GetManyCallback;
+
     static ShutdownCallback
     bindShutdownCb(ShutdownCallbackRaw shutdown_cb_raw, void* user_data) {
         return [=]() { shutdown_cb_raw(user_data); };
@@ -191,6 +226,25 @@ public:
      * and an ID for the node.
      */
     Dht(int s, int s6, Config config);
+
+    /**
+     * Replacement for the sockets and the clock of a node, to run many
+     * nodes in a single process over a simulated network.
+     */
+    struct Transport {
+        /* Send a packet. Returns the number of bytes sent, or -1. */
+        std::function<int(const uint8_t* buf, size_t len, const sockaddr* to, socklen_t tolen)> send;
+        /* Current time. If not set, clock::now() is used. */
+        std::function<time_point()> clock;
+        bool ipv4;
+        bool ipv6;
+    };
+
+    /**
+     * Initialise the Dht over transport: received packets must be
+     * provided to periodic().
+     */
+    Dht(const Transport& transport, Config config);
     virtual ~Dht();
 
     /**
@@ -247,6 +301,22 @@ public:
 
     time_point periodic(const uint8_t *buf, size_t buflen, const sockaddr *from, socklen_t fromlen);
 
+    /**
+     * If enabled, outgoing messages are queued and sent in batches
+     * (using sendmmsg where available) at the end of every periodic() call,
+     * instead of one system call per message.
+     */
+    void setBatchedSend(bool batch) {
+        if (not batch)
+            flushSendQueue();
+        batch_send = batch;
+    }
+
+    /**
+     * Send all queued outgoing messages now.
+     */
+    void flushSendQueue();
+
     /**
      * Get a value by searching on all available protocols (IPv4, IPv6),
      * and call the provided get callback when values are found at key.
@@ -300,6 +370,22 @@ public:
         put(key, std::forward<Value>(v), bindDoneCb(cb), created);
     }
 
+    /**
+     * Put many values, like put(), as a single operation.
+     * Keys are processed in keyspace order, so that the search of a key
+     * can start from the nodes found for the previous one, and at most
+     * concurrency keys are searched at the same time.
+     * @param cb called once all values were announced, or failed.
+     */
+    void putMany(std::vector<std::pair<InfoHash, std::shared_ptr<Value>>> values, PutManyCallback cb = {}, unsigned concurrency = BATCH_CONCURRENCY);
+
+    /**
+     * Get values at many keys, like get(), as a single operation.
+     * Keys are processed like for putMany().
+     * @param cb called once with the values found at every key.
+     */
+    void getMany(std::vector<InfoHash> keys, GetManyCallback cb, Value::Filter f = Value::AllFilter(), unsigned concurrency = BATCH_CONCURRENCY);
+
     /**
      * Get data currently being put at the given hash.
      */
@@ -343,10 +429,53 @@ public:
      */
     std::vector<NodeExport> exportNodes();
 
+    /**
+     * Reconnect quickly using nodes saved with exportNodes().
+     * All nodes are pinged at once (paced to WARM_START_PINGS_PER_SEC),
+     * and replying nodes are added to the routing table as good nodes,
+     * without waiting for bucket maintenance.
+     */
+    void warmStart(const std::vector<NodeExport>& nodes);
+
+    /**
+     * Time it took to get connected, since the node was created or since
+     * the last warm start. duration::max() if not connected yet.
+     */
+    duration getTimeToConnected() const {
+        return time_to_connected;
+    }
+
     typedef std::pair<InfoHash, Blob> ValuesExport;
     std::vector<ValuesExport> exportValues() const;
     void importValues(const std::vector<ValuesExport>&);
 
+    /**
+     * Streaming export and import of the node state (good nodes and
+     * stored values), in a versioned format: a header, chunks of at most
+     * STATE_CHUNK_SIZE nodes or keys, and an end marker.
+     *
+     * The export is incremental: one chunk is written per scheduler run,
+     * so it can be used for periodic snapshots without stalling the node.
+     * The import also processes one chunk per scheduler run.
+     * done is called with false if the writer or reader failed,
+     * or the stream is invalid or truncated.
+     */
+    typedef std::function<bool(const char* data, size_t size)> StateWriter;
+    /* fill data with at most size bytes, returns 0 at the end of the stream */
+    typedef std::function<size_t(char* data, size_t size)> StateReader;
+
+    void exportState(StateWriter&& writer, DoneCallbackSimple&& done = {});
+    void importState(StateReader&& reader, DoneCallbackSimple&& done = {});
+
+    /**
+     * The stream must stay valid until done is called.
+     */
+    void exportState(std::ostream& os, DoneCallbackSimple&& done = {});
+    void importState(std::istream& is, DoneCallbackSimple&& done = {});
+
+    static constexpr unsigned STATE_FORMAT_VERSION {1};
+    static constexpr size_t STATE_CHUNK_SIZE {256};
+
     int getNodesStats(sa_family_t af, unsigned *good_return, unsigned *dubious_return, unsigned *cached_return, unsigned *incoming_return) const;
     std::string getStorageLog() const;
     std::string getRoutingTablesLog(sa_family_t) const;
@@ -362,6 +491,15 @@ public:
         return stats;
     }
 
+    /**
+     * Persist stored values in an append-only log file at path.
+     * Values already in the log are served right away: they are unpacked
+     * from the mapped file when their key is first accessed, or
+     * in the background, by batches.
+     * Throws DhtException if the log can't be opened.
+     */
+    void setStorageLog(const std::string& path);
+
     /**
      * Set the in-memory storage limit in bytes
      */
@@ -369,24 +507,179 @@ public:
         max_store_size = limit;
     }
 
+    /**
+     * How room is made for new values when the storage limit is reached.
+     * NONE: new values are refused.
+     * LRU: values of the keys accessed least recently are evicted first.
+     * TYPE_PRIORITY: values of the types with the lowest
+     *                ValueType::priority are evicted first, then by LRU.
+     */
+    enum class EvictionPolicy {
+        NONE,
+        LRU,
+        TYPE_PRIORITY
+    };
+    void setEvictionPolicy(EvictionPolicy policy) {
+        eviction_policy = policy;
+    }
+
     /**
      * Returns the total memory usage of stored values and the number
      * of stored values.
+     * Memory usage includes an estimate of the memory used by the
+     * storage structures, value buffers and serialized values.
      */
     std::pair<size_t, size_t> getStoreSize() const {
         return {total_store_size, total_values};
     }
 
+    /**
+     * Memory usage of the values stored at key, and their number.
+     */
+    std::pair<size_t, size_t> getStoreSize(const InfoHash& key) const;
+
+    /**
+     * Number of values evicted to make room for new ones, and of values
+     * refused because the storage was full.
+     */
+    struct EvictionStats {
+        unsigned evicted {0};
+        unsigned refused {0};
+    };
+    EvictionStats getEvictionStats(bool reset = false) {
+        auto stats = eviction_stats;
+        if (reset)
+            eviction_stats = {};
+        return stats;
+    }
+
+    /**
+     * Number of received packets dropped, by reason.
+     */
+    struct DropStats {
+        unsigned malformed {0};
+        unsigned blacklisted {0};
+        unsigned rate_limit_source {0};
+        unsigned rate_limit_global {0};
+    };
+    DropStats getDropStats(bool reset = false) {
+        auto stats = drop_stats;
+        if (reset)
+            drop_stats = {};
+        return stats;
+    }
+
+    /**
+     * Gets on a key started while another get on that key is in progress
+     * share its network operation. Once complete, its result answers
+     * the gets on that key for the duration of the window, along with
+     * the local storage. A zero window disables both.
+     */
+    void setGetCacheWindow(duration window = GET_CACHE_WINDOW) {
+        get_cache_window = window;
+    }
+
+    /**
+     * Number of get requests a search sends in parallel at each step.
+     */
+    void setSearchAlpha(unsigned alpha = SEARCH_ALPHA) {
+        search_alpha = std::max(alpha, 1u);
+    }
+
+    /**
+     * If enabled, searches send their get requests to the nodes with
+     * the lowest round trip time among the closest ones that can be
+     * queried, instead of the closest ones first.
+     */
+    void setLatencyAware(bool enabled) {
+        latency_aware = enabled;
+    }
+
+    /**
+     * Number of gets answered from a completed get (hits), that joined
+     * a get in progress (coalesced), or that started a network
+     * operation (misses).
+     */
+    struct GetCacheStats {
+        unsigned hits {0};
+        unsigned coalesced {0};
+        unsigned misses {0};
+    };
+    GetCacheStats getGetCacheStats(bool reset = false) {
+        auto stats = get_cache_stats;
+        if (reset)
+            get_cache_stats = {};
+        return stats;
+    }
+
+    /**
+     * Counters and distributions about the node activity.
+     * Durations are in microseconds.
+     */
+    struct Metrics {
+        /* round-trip time of requests answered by remote nodes */
+        Histogram rtt_ping {}, rtt_find {}, rtt_get {}, rtt_listen {}, rtt_put {};
+        /* completion time of gets that searched the network, and of puts */
+        Histogram get_time {}, put_time {};
+        /* duration of periodic() */
+        Histogram periodic_time {};
+        /* hops to the closest node found, for completed gets */
+        Histogram search_hops {};
+        /* set by SecureDht: signature checks, signing, encryption and decryption */
+        Histogram verify_time {}, sign_time {}, encrypt_time {}, decrypt_time {};
+        /* set by DhtRunner: received packets and queued operations, per loop */
+        Histogram rcv_depth {}, ops_depth {};
+        uint64_t packets_in {0}, bytes_in {0};
+        uint64_t packets_out {0}, bytes_out {0};
+        /* messages the system failed to send */
+        uint64_t send_errors {0};
+        /* same as getDropStats(), not reset with the metrics */
+        DropStats drops {};
+
+        /** One metric per line */
+        std::string toString() const;
+    };
+    Metrics getMetrics(bool reset = false) {
+        auto m = metrics;
+        m.drops = drop_stats;
+        if (reset)
+            metrics = {};
+        return m;
+    }
+
     /* This must be provided by the user. */
     static bool isBlacklisted(const sockaddr*, socklen_t) { return false; }
 
+    /**
+     * Ignore messages from, and don't send messages to an address or a
+     * subnet.
+     * @param prefix_len number of significant bits of the address, or 0
+     *        for the full address. If the port of sa is 0, any port matches.
+     * @param expiration time after which the entry is removed.
+     */
+    void blacklistAddress(const sockaddr* sa, socklen_t salen, unsigned prefix_len = 0, time_point expiration = time_point::max());
+    void clearBlacklist() {
+        blacklist.clear();
+    }
+
     std::vector<Address> getPublicAddress(sa_family_t family = 0);
 
+    /* Default number of keys searched at the same time by batch operations.
+       A key uses one search per address family. */
+    static constexpr unsigned BATCH_CONCURRENCY {32};
+
 protected:
     LogMethod DHT_DEBUG = NOLOG;
     LogMethod DHT_WARN = NOLOG;
     LogMethod DHT_ERROR = NOLOG;
 
+    typedef std::function<void(const InfoHash&, GetCallback, DoneCallback, Value::Filter)> GetFunction;
+
+    /**
+     * getMany() implementation, using get_fn to get each key.
+     */
+    void getBatch(std::vector<InfoHash>&& keys, GetManyCallback&& cb, Value::Filter&& f, unsigned concurrency, GetFunction&& get_fn);
+
 private:
 
     static constexpr unsigned TARGET_NODES {8};
@@ -403,9 +696,16 @@ private:
     /* The maximum number of hashes we're willing to track. */
     static constexpr unsigned MAX_HASHES {16384};
 
-    /* The maximum number of searches we keep data about. */
+    /* The default maximum number of searches we keep data about. */
     static constexpr unsigned MAX_SEARCHES {128};
 
+    /* Upper bound for Config::max_searches: searches are identified
+       by a 16 bits transaction id. */
+    static constexpr unsigned MAX_SEARCHES_LIMIT {32 * 1024};
+
+    /* Number of spare Search objects kept for reuse */
+    static constexpr size_t SEARCH_POOL_SIZE {64};
+
     /* The time after which we can send get requests for
        a search in case of no answers. */
     static constexpr std::chrono::seconds SEARCH_GET_STEP {3};
@@ -422,20 +722,75 @@ private:
 
     static constexpr std::chrono::seconds UDP_REPLY_TIME {15};
 
-    /* The maximum number of nodes that we snub.  There is probably little
-        reason to increase this value. */
-    static constexpr unsigned BLACKLISTED_MAX {10};
+    /* The maximum number of blacklisted addresses or subnets, permanent
+       ones included. When full, the entry expiring first is dropped
+       (permanent entries last, oldest first). */
+    static constexpr unsigned BLACKLISTED_MAX {16 * 1024};
 
+    /* Time a node that sent an incorrect message stays blacklisted */
+    static constexpr std::chrono::hours BLACKLIST_EXPIRE_TIME {1};
+
+    /* Global limit on the rate of requests we process, and burst size. */
     static constexpr long unsigned MAX_REQUESTS_PER_SEC {1600};
 
-    static constexpr size_t TOKEN_SIZE {64};
+    /* Limit on the rate of requests from one source (an IPv4 /24 or an
+       IPv6 /64 subnet), and burst size. */
+    static constexpr long unsigned MAX_REQUESTS_PER_SEC_PER_SOURCE {MAX_REQUESTS_PER_SEC / 8};
+
+    /* Maximum number of sources tracked by the rate limiter. */
+    static constexpr size_t RATE_LIMIT_SOURCES_MAX {8 * 1024};
+
+    /* Pings sent per second during a warm start, leaving room for replies
+       and other traffic in the request budget of remote nodes. */
+    static constexpr unsigned WARM_START_PINGS_PER_SEC {MAX_REQUESTS_PER_SEC / 4};
+    static constexpr std::chrono::milliseconds WARM_START_INTERVAL {100};
+
+    static constexpr size_t TOKEN_SIZE {16};
+    /* Keyed hash (SipHash-2-4-128) of the address and port of a peer */
+    using Token = std::array<uint8_t, TOKEN_SIZE>;
+
+    /* Maximum number of queued outgoing messages when batching sends. */
+    static constexpr size_t SEND_BATCH_MAX {64};
+
+    /* Value updates are sent to remote listeners by batches of
+       LISTENER_PUSH_BATCH, every LISTENER_PUSH_INTERVAL. */
+    static constexpr size_t LISTENER_PUSH_BATCH {SEND_BATCH_MAX};
+    static constexpr std::chrono::milliseconds LISTENER_PUSH_INTERVAL {10};
+
+    /* Maximum number of values passed to a GetCallback at once */
+    static constexpr size_t GET_CHUNK_SIZE {64};
+
+    /* Maximum number of keys in the get cache. Gets started when
+       it is full are not shared. */
+    static constexpr size_t GET_CACHE_MAX {1024};
+
+    /* Storage maintenance budget per run, see storageMaintenance() */
+    static constexpr size_t STORAGE_MAINTENANCE_OPS {256};
+    static constexpr std::chrono::milliseconds STORAGE_MAINTENANCE_BUDGET {5};
+    static constexpr std::chrono::milliseconds STORAGE_MAINTENANCE_INTERVAL {10};
+    static constexpr std::chrono::minutes STORAGE_MAINTENANCE_SLACK {1};
+    /* Maximum number of neighbour storages visited with a due one */
+    static constexpr size_t STORAGE_MAINTENANCE_GROUP {32};
+
+    /* Number of keys loaded from the value log per scheduler run */
+    static constexpr size_t LOG_LOAD_BATCH {256};
+
+    /* The value log is compacted when larger than this size, and twice
+       the size of the live values. */
+    static constexpr size_t LOG_COMPACT_MIN {4 * 1024 * 1024};
 
     static const std::string my_v;
 
+    /**
+     * Every known node, by id, so the same Node is shared by the routing
+     * table and searches.
+     */
     struct NodeCache {
+        NodeCache();
+
         std::shared_ptr<Node> getNode(const InfoHash& id, sa_family_t family);
         std::shared_ptr<Node> getNode(const InfoHash& id, const sockaddr* sa, socklen_t sa_len, time_point now, int confirmed);
-        void putNode(std::shared_ptr<Node> n);
+        void putNode(const std::shared_ptr<Node>& n);
 
         /**
          * Reset the connectivity state of every node,
@@ -444,8 +799,24 @@ private:
          */
         void clearBadNodes(sa_family_t family = 0);
     private:
-        std::list<std::weak_ptr<Node>> cache_4;
-        std::list<std::weak_ptr<Node>> cache_6;
+        /* Peers choose their ids: keyed hash, so they can't make them collide */
+        struct IdHash {
+            IdHash() : state() {}
+            std::array<uint64_t, 4> state;
+            size_t operator()(const InfoHash& id) const;
+        };
+        typedef std::unordered_map<InfoHash, std::weak_ptr<Node>, IdHash> NodeMap;
+
+        NodeMap& getMap(sa_family_t family) {
+            return family == AF_INET ? cache_4 : cache_6;
+        }
+        /* Remove expired entries, once the map doubled since the last cleanup */
+        void cleanup(NodeMap& map, size_t& clean_size);
+
+        NodeMap cache_4 {};
+        NodeMap cache_6 {};
+        size_t clean_size_4 {0};
+        size_t clean_size_6 {0};
     };
 
     struct Bucket {
@@ -463,9 +834,24 @@ private:
         std::shared_ptr<Node> randomNode();
     };
 
+    /**
+     * Ordered list of buckets covering the whole keyspace.
+     *
+     * A flat array of bucket lower bounds is maintained alongside the list,
+     * so that finding the bucket of an id is a binary search over contiguous
+     * memory (O(depth)) instead of a walk through the list.
+     * Buckets must only be added through split().
+     */
     class RoutingTable : public std::list<Bucket> {
     public:
-        using std::list<Bucket>::list;
+        RoutingTable() {}
+        RoutingTable(std::initializer_list<Bucket> l) : std::list<Bucket>(l) { reindex(); }
+        RoutingTable(RoutingTable&& o) : std::list<Bucket>(std::move(o)) { reindex(); }
+        RoutingTable& operator=(RoutingTable&& o) {
+            std::list<Bucket>::operator=(std::move(o));
+            reindex();
+            return *this;
+        }
 
         InfoHash middle(const RoutingTable::const_iterator&) const;
 
@@ -500,14 +886,30 @@ private:
          * Split a bucket in two equal parts.
          */
         bool split(const RoutingTable::iterator& b);
+
+    private:
+        RoutingTable(const RoutingTable&) = delete;
+        RoutingTable& operator=(const RoutingTable&) = delete;
+
+        /**
+         * Position of the bucket containing id in the flat index.
+         * The table must not be empty.
+         */
+        size_t findBucketPos(const InfoHash& id) const;
+        void reindex();
+
+        /* bucket lower bounds, in the same order as the list */
+        std::vector<InfoHash> index_first {};
+        std::vector<iterator> index {};
     };
 
     struct SearchNode {
-        SearchNode(std::shared_ptr<Node> node) : node(node) {}
+        SearchNode(std::shared_ptr<Node> node) : node(std::move(node)) {}
 
         struct RequestStatus {
             time_point request_time {time_point::min()};    /* the time of the last unanswered request */
             time_point reply_time {time_point::min()};      /* the time of the last confirmation */
+            unsigned sent {0};                              /* requests sent since the last reply */
             RequestStatus() {};
             RequestStatus(time_point q, time_point a = time_point::min()) : request_time(q), reply_time(a) {};
             bool expired(time_point now) const {
@@ -517,7 +919,29 @@ private:
                 return reply_time < request_time && now - request_time <= Node::MAX_RESPONSE_TIME;
             }
         };
-        typedef std::map<Value::Id, RequestStatus> AnnounceStatusMap;
+
+        /**
+         * Announcement status by value id. A search announces only a few
+         * values, so a flat vector beats a tree of heap nodes.
+         */
+        struct AnnounceStatusMap : public std::vector<std::pair<Value::Id, RequestStatus>> {
+            iterator find(Value::Id vid) {
+                return std::find_if(begin(), end(), [vid](const value_type& v) { return v.first == vid; });
+            }
+            const_iterator find(Value::Id vid) const {
+                return std::find_if(begin(), end(), [vid](const value_type& v) { return v.first == vid; });
+            }
+            std::pair<iterator, bool> emplace(Value::Id vid, const RequestStatus& status) {
+                auto it = find(vid);
+                if (it != end())
+                    return {it, false};
+                emplace_back(vid, status);
+                return {std::prev(end()), true};
+            }
+            RequestStatus& operator[](Value::Id vid) {
+                return emplace(vid, {}).first->second;
+            }
+        };
 
         /**
          * Can we use this node to listen/announce now ?
@@ -529,7 +953,7 @@ private:
         bool canGet(time_point now, time_point update) const {
             return not node->isExpired(now) and
                    (now > getStatus.reply_time + Node::NODE_EXPIRE_TIME or update > getStatus.reply_time) and
-                   now > getStatus.request_time + Node::MAX_RESPONSE_TIME;
+                   now > getStatus.request_time + node->getResponseTime();
         }
 
         bool isAnnounced(Value::Id vid, const ValueType& type, time_point now) const {
@@ -568,6 +992,8 @@ private:
 
         RequestStatus getStatus {};    /* get/sync status */
         RequestStatus listenStatus {};
+        /* replies between the routing table and this node */
+        unsigned hops {0};
         AnnounceStatusMap acked {};    /* announcement status for a given value id */
 
         Blob token {};
@@ -622,6 +1048,8 @@ private:
         time_point refill_time {time_point::min()};
         time_point step_time {time_point::min()};           /* the time of the last search step */
         time_point get_step_time {time_point::min()};       /* the time of the last get step */
+        /* time to wait for the requests of the last get step, at most SEARCH_GET_STEP */
+        duration get_step_timeout {SEARCH_GET_STEP};
 
         bool expired {false};              /* no node, or all nodes expired */
         bool done {false};                 /* search is over, cached for later */
@@ -637,10 +1065,13 @@ private:
         std::map<size_t, LocalListener> listeners {};
         size_t listener_token = 1;
 
+        /* the next scheduled search step */
+        std::shared_ptr<Scheduler::Job> nextSearchStep {};
+
         /**
          * @returns true if the node was not present and added to the search
          */
-        bool insertNode(std::shared_ptr<Node> n, time_point now, const Blob& token={});
+        bool insertNode(const std::shared_ptr<Node>& n, time_point now, const Blob& token={}, unsigned hops=0);
         unsigned insertBucket(const Bucket&, time_point now);
 
         /**
@@ -650,6 +1081,14 @@ private:
 
         time_point getLastGetTime() const;
 
+        /**
+         * Query sent with get (or listen) requests: the query of the
+         * pending gets (or listeners) if they all have the same,
+         * an empty query otherwise.
+         */
+        Query getQuery() const;
+        Query getListenQuery() const;
+
         /**
          * Is this get operation done ?
          */
@@ -677,6 +1116,10 @@ private:
          */
         time_point getListenTime(time_point now) const;
 
+        /**
+         * Time of the next step: the earliest of the update, announce
+         * and listen times. Computed in a single pass over the nodes.
+         */
         time_point getNextStepTime(const std::map<ValueType::Id, ValueType>& types, time_point now) const;
 
         bool removeExpiredNode(time_point now);
@@ -692,6 +1135,37 @@ private:
 
         ValueStorage() {}
         ValueStorage(const std::shared_ptr<Value>& v, time_point t) : data(v), time(t) {}
+
+        /**
+         * Serialized (wire) form of data, computed on first use. Stored
+         * values are served many times, this avoids packing them again
+         * for every reply.
+         */
+        const Blob& getPacked() const {
+            if (packed.empty())
+                packed = packMsg(*data);
+            return packed;
+        }
+
+        /**
+         * Estimated memory used by this entry: the Value and its
+         * control block, its buffers, the packed copy and the index
+         * entry.
+         */
+        size_t memoryUsage() const;
+
+        /* memoryUsage() when last accounted for by the storage */
+        size_t memory {0};
+
+        /**
+         * Must be called when data, or the value it points to, changed.
+         */
+        void invalidatePacked() {
+            packed.clear();
+        }
+
+    private:
+        mutable Blob packed {};
     };
 
     /**
@@ -703,22 +1177,27 @@ private:
         socklen_t sslen {};
         uint16_t tid {};
         time_point time {};
+        Query query {};
 
         /*constexpr*/ Listener() : ss() {}
-        Listener(const InfoHash& id, const sockaddr *from, socklen_t fromlen, uint16_t ttid, time_point t) : id(id), ss(), sslen(fromlen), tid(ttid), time(t) {
+        Listener(const InfoHash& id, const sockaddr *from, socklen_t fromlen, uint16_t ttid, time_point t, const Query& q)
+            : id(id), ss(), sslen(fromlen), tid(ttid), time(t), query(q) {
             memcpy(&ss, from, fromlen);
         }
-        void refresh(const sockaddr *from, socklen_t fromlen, uint16_t ttid, time_point t) {
+        void refresh(const sockaddr *from, socklen_t fromlen, uint16_t ttid, time_point t, const Query& q) {
             memcpy(&ss, from, fromlen);
             sslen = fromlen;
             tid = ttid;
             time = t;
+            query = q;
         }
     };
 
     struct Storage {
         InfoHash id;
         time_point maintenance_time {};
+        /* last time values were read, locally or by a remote node */
+        mutable time_point access_time {};
         std::vector<Listener> listeners {};
         std::map<size_t, LocalListener> local_listeners {};
         size_t listener_token {1};
@@ -731,10 +1210,12 @@ private:
         Storage(Storage&& o) noexcept
 			: id(std::move(o.id))
             , maintenance_time(std::move(o.maintenance_time))
+            , access_time(std::move(o.access_time))
             , listeners(std::move(o.listeners))
             , local_listeners(std::move(o.local_listeners))
             , listener_token(std::move(o.listener_token))
             , values(std::move(o.values))
+            , values_index(std::move(o.values_index))
             , total_size(std::move(o.total_size)) {}
 #else
         Storage(Storage&& o) noexcept = default;
@@ -759,9 +1240,8 @@ private:
         const std::vector<ValueStorage>& getValues() const { return values; }
 
         std::shared_ptr<Value> getById(Value::Id vid) const {
-            for (auto& v : values)
-                if (v.data->id == vid) return v.data;
-            return {};
+            auto it = values_index.find(vid);
+            return it != values_index.end() ? values[it->second].data : nullptr;
         }
 
         std::vector<std::shared_ptr<Value>> get(Value::Filter f = {}) const {
@@ -787,11 +1267,21 @@ private:
 
         std::pair<ssize_t, ssize_t> expire(const std::map<ValueType::Id, ValueType>& types, time_point now);
 
+        /**
+         * Remove the values matching pred.
+         * @return <change_size, change_value_num>
+         */
+        std::pair<ssize_t, ssize_t> remove(std::function<bool(const ValueStorage&)>&& pred);
+
     private:
         Storage(const Storage&) = delete;
         Storage& operator=(const Storage&) = delete;
 
+        void reindex();
+
         std::vector<ValueStorage> values {};
+        /* Value::Id -> position in values, kept in sync by store() and expire() */
+        std::unordered_map<Value::Id, size_t> values_index {};
         size_t total_size {};
     };
 
@@ -854,11 +1344,25 @@ private:
     // socket descriptors
     int dht_socket {-1};
     int dht_socket6 {-1};
+    // used instead of the sockets and clock::now(), if set
+    Transport transport {};
+
+    void init();
+    time_point getTime() const {
+        return transport.clock ? transport.clock() : clock::now();
+    }
 
     InfoHash myid {};
 
-    std::array<uint8_t, 8> secret {{}};
-    std::array<uint8_t, 8> oldsecret {{}};
+    std::array<uint8_t, 16> secret {{}};
+    std::array<uint8_t, 16> oldsecret {{}};
+
+    // token hash state computed from secret and oldsecret
+    std::array<uint64_t, 4> token_state {{}};
+    std::array<uint64_t, 4> old_token_state {{}};
+
+    // keyed hash state for value digests, see valueDigest()
+    std::array<uint64_t, 4> digest_state {{}};
 
     // registred types
     std::map<ValueType::Id, ValueType> types;
@@ -876,54 +1380,244 @@ private:
     RoutingTable buckets {};
     RoutingTable buckets6 {};
 
-    std::vector<Storage> store {};
+    std::map<InfoHash, Storage> store {};
     size_t total_values {0};
     size_t total_store_size {0};
     size_t max_store_size {DEFAULT_STORAGE_LIMIT};
+    EvictionPolicy eviction_policy {EvictionPolicy::NONE};
+    EvictionStats eviction_stats {};
+
+    /* Estimated memory used by a storage besides its values */
+    static const size_t STORAGE_MEMORY_OVERHEAD;
+
+    /* When evicting, at least 1/EVICTION_RATIO of the storage limit is
+       freed, so the values aren't sorted again for every new value. */
+    static constexpr size_t EVICTION_RATIO {32};
+
+    /**
+     * Evict values according to eviction_policy, to free at least
+     * needed bytes.
+     */
+    void evictValues(size_t needed);
+
+    /* storages by maintenance time */
+    std::set<std::pair<time_point, InfoHash>> maintenance_queue {};
+    std::shared_ptr<Scheduler::Job> nextStorageMaintenance {};
+
+    std::unique_ptr<ValueLog> value_log {};
+    /* values in the mapped log, not loaded yet */
+    std::map<InfoHash, std::vector<ValueLog::Record>> logged_values {};
 
     std::list<Search> searches {};
     uint16_t search_id {0};
+    const unsigned max_searches {MAX_SEARCHES};
+
+    /* expired searches, kept to be reused */
+    std::list<Search> search_pool {};
+
+    /* indexes of searches, by transaction id (unique across
+       both families) and by target */
+    std::unordered_map<uint16_t, Search*> searches_by_tid {};
+    std::map<InfoHash, Search*> searches4_by_id {};
+    std::map<InfoHash, Search*> searches6_by_id {};
+
+    /**
+     * A get and the callbacks it answers.
+     */
+    struct GetSubscriber {
+        GetSubscriber(GetCallback&& get_cb, DoneCallback&& done_cb, Value::Filter&& filter)
+            : get_cb(std::move(get_cb)), done_cb(std::move(done_cb)), filter(std::move(filter)) {}
+
+        GetCallback get_cb;
+        DoneCallback done_cb;
+        Value::Filter filter;
+        bool done {false};
+
+        void notify(const std::vector<std::shared_ptr<Value>>& values, const std::vector<std::shared_ptr<Node>>& nodes);
+        void finish(bool ok, const std::vector<std::shared_ptr<Node>>& nodes);
+    };
+
+    /**
+     * Network operation of a get, in progress or recently completed,
+     * shared by the gets on the same key.
+     */
+    struct GetCacheEntry {
+        std::vector<std::shared_ptr<Value>> values {};
+        /* value digest -> position in values */
+        std::unordered_multimap<uint64_t, size_t> values_index {};
+        std::vector<std::shared_ptr<Node>> nodes {};
+        std::vector<std::shared_ptr<GetSubscriber>> subscribers {};
+        /* query sent with the get, if any */
+        std::shared_ptr<const Query> query {};
+        bool done {false};
+        bool ok {false};
+        time_point done_time {time_point::max()};
+    };
+    std::map<InfoHash, std::shared_ptr<GetCacheEntry>> get_cache {};
+    duration get_cache_window {GET_CACHE_WINDOW};
+    GetCacheStats get_cache_stats {};
+
+    unsigned search_alpha {SEARCH_ALPHA};
+    bool latency_aware {false};
+
+    Metrics metrics {};
+
+    void joinGet(const InfoHash& id, const std::shared_ptr<GetCacheEntry>& entry, std::shared_ptr<GetSubscriber> sub);
+    /**
+     * Add values found by the get of entry, and notify its subscribers of
+     * the new ones.
+     * @return false once every subscriber is done.
+     */
+    bool addGetValues(GetCacheEntry& entry, const std::vector<std::shared_ptr<Value>>& values);
+
+    /**
+     * Keyed hash of the id and content of a value: equal values have
+     * the same digest.
+     */
+    uint64_t valueDigest(const Value& v) const;
+    void getDone(const InfoHash& id, const std::shared_ptr<GetCacheEntry>& entry, bool ok);
 
     // map a global listen token to IPv4, IPv6 specific listen tokens.
     // 0 is the invalid token.
     std::map<size_t, std::tuple<size_t, size_t, size_t>> listeners {};
     size_t listener_token {1};
 
-    sockaddr_storage blacklist[BLACKLISTED_MAX] {};
-    unsigned next_blacklisted = 0;
+    /**
+     * Hashed set of blacklisted addresses and subnets, with expiration.
+     * IPv4 addresses are stored as IPv4-mapped IPv6 addresses.
+     * A lookup costs one hash lookup per prefix length in use.
+     */
+    class Blacklist {
+    public:
+        void add(const sockaddr* sa, socklen_t salen, unsigned prefix_len, time_point expiration);
+        bool contains(const sockaddr* sa, socklen_t salen, time_point now) const;
+        void expire(time_point now);
+        void clear();
+        size_t size() const { return entries.size(); }
+
+    private:
+        struct Key {
+            std::array<uint8_t, 16> addr;
+            in_port_t port;      /* 0 for any port */
+            uint8_t prefix_len;  /* 0 to 128 */
+
+            bool operator==(const Key& o) const {
+                return port == o.port and prefix_len == o.prefix_len and addr == o.addr;
+            }
+        };
+        struct KeyHash {
+            size_t operator()(const Key& k) const;
+        };
+        static bool makeKey(const sockaddr* sa, socklen_t salen, Key& key);
+        static void maskKey(Key& key, unsigned prefix_len);
+        void erase(std::unordered_map<Key, time_point, KeyHash>::iterator it);
+
+        std::unordered_map<Key, time_point, KeyHash> entries {};
+        /* by expiration time (time_point::max() for permanent entries),
+           may contain outdated entries */
+        std::multimap<time_point, Key> expirations {};
+        /* number of entries per prefix length, and prefix lengths in use */
+        std::array<unsigned, 129> prefix_count {{}};
+        std::vector<uint8_t> prefixes {};
+    };
+    Blacklist blacklist {};
 
     // timing
     time_point now;
     time_point mybucket_grow_time {time_point::min()}, mybucket6_grow_time {time_point::min()};
-    time_point expire_stuff_time {time_point::min()};
-    time_point search_time {time_point::max()};
-    time_point confirm_nodes_time {time_point::min()};
-    time_point rotate_secrets_time {time_point::min()};
-    std::queue<time_point> rate_limit_time {};
+
+    // Warm start
+    std::vector<NodeExport> warm_start_nodes {};
+    time_point start_time {time_point::min()};
+    duration time_to_connected {duration::max()};
+
+    /**
+     * Token bucket rate limiter, with one bucket per source subnet
+     * in a bounded table and a global bucket.
+     */
+    class RateLimiter {
+    public:
+        enum class Result { OK, SOURCE, GLOBAL };
+        Result limit(const sockaddr* from, time_point now);
+
+    private:
+        struct Bucket {
+            Bucket(double t, time_point l) : tokens(t), last(l) {}
+            double tokens;
+            time_point last;
+            void refill(time_point now, double rate);
+        };
+        Bucket& getSourceBucket(const sockaddr* from, time_point now);
+
+        Bucket global {(double)MAX_REQUESTS_PER_SEC, time_point::min()};
+        /* by subnet prefix; AF_INET and AF_INET6 in separate tables */
+        std::unordered_map<uint64_t, Bucket> sources4 {}, sources6 {};
+        /* shared by untracked sources when the tables are full */
+        Bucket overflow {(double)MAX_REQUESTS_PER_SEC_PER_SOURCE, time_point::min()};
+        time_point last_cleanup {};
+    };
+    RateLimiter rate_limiter {};
+    DropStats drop_stats {};
+
+    // maintenance jobs
+    Scheduler scheduler {};
+    std::shared_ptr<Scheduler::Job> nextNodesConfirmation {};
 
     using ReportedAddr = std::pair<unsigned, Address>;
     std::vector<ReportedAddr> reported_addr;
 
     // Networking & packet handling
     int send(const char* buf, size_t len, int flags, const sockaddr*, socklen_t);
+
+    /* Outgoing message queued by send() when batched sending is enabled */
+    struct PendingSend {
+        Blob data;
+        int socket;
+        int flags;
+        sockaddr_storage ss;
+        socklen_t sslen;
+    };
+    std::vector<PendingSend> send_queue {};
+    bool batch_send {false};
+
+    /* Scratch buffers reused by the send* message builders */
+    msgpack::sbuffer send_buffer {};
+    msgpack::sbuffer values_buffer {};
     int sendPing(const sockaddr*, socklen_t, TransId tid);
     int sendPong(const sockaddr*, socklen_t, TransId tid);
 
     int sendFindNode (const sockaddr*, socklen_t, TransId tid, const InfoHash& target, want_t want, int confirm);
-    int sendGetValues(const sockaddr*, socklen_t, TransId tid, const InfoHash& target, want_t want, int confirm);
+    int sendGetValues(const sockaddr*, socklen_t, TransId tid, const InfoHash& target, want_t want, int confirm, const Query& query);
 
+    /**
+     * Only the values of st matching query are sent.
+     */
     int sendNodesValues(const sockaddr*, socklen_t, TransId tid,
                               const uint8_t *nodes, unsigned nodes_len,
                               const uint8_t *nodes6, unsigned nodes6_len,
-                              const std::vector<ValueStorage>& st, const Blob& token);
+                              const std::vector<ValueStorage>& st, const Token& token,
+                              const Query& query);
 
     int sendClosestNodes(const sockaddr*, socklen_t, TransId tid,
-                               const InfoHash& id, want_t want, const Blob& token={},
-                               const std::vector<ValueStorage>& st = {});
+                               const InfoHash& id, want_t want, const Token& token,
+                               const std::vector<ValueStorage>& st = {}, const Query& query = {});
+
+    /**
+     * A value update for the remote listeners of a storage.
+     * The message is built once: only the address, token and
+     * transaction id of each listener are packed per listener.
+     */
+    struct ListenerPush {
+        Blob head;
+        Blob tail;
+        std::vector<Listener> listeners;
+        size_t next {0};
+    };
+    void pushToListeners(std::shared_ptr<ListenerPush> push);
 
 
     int sendListen(const sockaddr*, socklen_t, TransId,
-                            const InfoHash&, const Blob& token, int confirm);
+                            const InfoHash&, const Blob& token, int confirm, const Query& query);
 
     int sendListenConfirmation(const sockaddr*, socklen_t, TransId);
 
@@ -937,6 +1631,30 @@ private:
 
     void processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, socklen_t fromlen);
 
+    /**
+     * Non-owning view of a binary field of a received message.
+     */
+    struct BlobView {
+        BlobView() {}
+        BlobView(const msgpack::object& o) {
+            if (o.type != msgpack::type::BIN)
+                throw msgpack::type_error();
+            ptr = (const uint8_t*)o.via.bin.ptr;
+            len = o.via.bin.size;
+        }
+        const uint8_t* data() const { return ptr; }
+        size_t size() const { return len; }
+        bool empty() const { return len == 0; }
+    private:
+        const uint8_t* ptr {nullptr};
+        size_t len {0};
+    };
+
+    /**
+     * A parsed message. Binary fields and values reference the msgpack
+     * object the message was unpacked from (and the receive buffer),
+     * which must outlive it.
+     */
     struct ParsedMessage {
         MessageType type;
         InfoHash id;
@@ -946,36 +1664,61 @@ private:
         Blob token;
         Value::Id value_id;
         time_point created { time_point::max() };
-        Blob nodes4;
-        Blob nodes6;
-        std::vector<std::shared_ptr<Value>> values;
+        BlobView nodes4;
+        BlobView nodes6;
         want_t want;
         uint16_t error_code;
         std::string ua;
         Address addr;
+        Query query;
         void msgpack_unpack(msgpack::object o);
+
+        /**
+         * Values carried by the message, unpacked on first access.
+         */
+        const std::vector<std::shared_ptr<Value>>& getValues();
+    private:
+        msgpack::object values_obj {};
+        std::vector<std::shared_ptr<Value>> values {};
     };
 
     void rotateSecrets();
 
-    Blob makeToken(const sockaddr *sa, bool old) const;
+    Token makeToken(const sockaddr *sa, bool old) const;
     bool tokenMatch(const Blob& token, const sockaddr *sa) const;
 
     void reportedAddr(const sockaddr *sa, socklen_t sa_len);
 
     // Storage
     decltype(Dht::store)::iterator findStorage(const InfoHash& id) {
-        return std::find_if(store.begin(), store.end(), [&](const Storage& st) {
-            return st.id == id;
-        });
+        if (not logged_values.empty())
+            loadLogged(id);
+        return store.find(id);
     }
     decltype(Dht::store)::const_iterator findStorage(const InfoHash& id) const {
-        return std::find_if(store.cbegin(), store.cend(), [&](const Storage& st) {
-            return st.id == id;
-        });
+        return store.find(id);
     }
 
-    void storageAddListener(const InfoHash& id, const InfoHash& node, const sockaddr *from, socklen_t fromlen, uint16_t tid);
+    /**
+     * Create the storage for id and schedule its maintenance.
+     */
+    decltype(Dht::store)::iterator newStorage(const InfoHash& id);
+
+    // State export and import
+    struct StateExport;
+    struct StateImport;
+    void exportStateChunk(std::shared_ptr<StateExport> e);
+    void importStateChunk(std::shared_ptr<StateImport> i);
+    bool importStateObject(StateImport& i, const msgpack::object& o);
+
+    // Value log
+    void loadLogged(const InfoHash& id);
+    void loadLoggedBatch();
+    void logValue(const InfoHash& id, const ValueStorage& v);
+    void logDrop(const InfoHash& id, Value::Id vid);
+    void compactStorageLog();
+
+    void storageAddListener(const InfoHash& id, const InfoHash& node, const sockaddr *from, socklen_t fromlen, uint16_t tid, const Query& query);
     bool storageStore(const InfoHash& id, const std::shared_ptr<Value>& value, time_point created);
     void expireStorage();
     void storageChanged(Storage& st, ValueStorage&);
@@ -987,6 +1730,23 @@ private:
      */
     size_t maintainStorage(InfoHash id, bool force=false, DoneCallback donecb=nullptr);
 
+    /**
+     * Scheduled storage maintenance: calls maintainStorage for due
+     * storages, by due time, within a budget of STORAGE_MAINTENANCE_OPS
+     * announces and STORAGE_MAINTENANCE_BUDGET of processing time per run.
+     * Storages in the same bucket as a due one (so with the same close
+     * nodes) and due within STORAGE_MAINTENANCE_SLACK are maintained
+     * in the same run.
+     */
+    void storageMaintenance();
+    void scheduleStorageMaintenance(const InfoHash& id, Storage& st, time_point t);
+
+    /* Periodic jobs */
+    void expire();
+    void confirmNodes();
+    void warmStartStep();
+    void checkConnected();
+
     // Buckets
     Bucket* findBucket(const InfoHash& id, sa_family_t af) {
         RoutingTable::iterator b;
@@ -1024,6 +1784,13 @@ private:
     bool isNodeBlacklisted(const sockaddr*, socklen_t) const;
     static bool isMartian(const sockaddr*, socklen_t);
 
+    /**
+     * Called when sending to sa failed with errno err, right away or when
+     * the send queue was flushed. Nodes at this address are expired when
+     * the error means they can't be reached.
+     */
+    void onSendError(const sockaddr* sa, socklen_t salen, int err);
+
     // Searches
 
     /**
@@ -1038,6 +1805,11 @@ private:
     std::list<Search>::iterator newSearch();
     void bootstrapSearch(Search& sr);
     Search *findSearch(unsigned short tid, sa_family_t af);
+    Search *findSearch(const InfoHash& id, sa_family_t af);
+    std::map<InfoHash, Search*>& getSearchIndex(sa_family_t af) {
+        return af == AF_INET ? searches4_by_id : searches6_by_id;
+    }
+    void unindexSearch(const Search& sr);
     void expireSearches();
 
     /**
@@ -1046,9 +1818,26 @@ private:
     SearchNode* searchSendGetValues(Search& sr, SearchNode *n = nullptr, bool update = true);
 
     void searchStep(Search& sr);
+
+    /**
+     * (Re)schedule the next step of a search, after its state changed.
+     */
+    void scheduleSearchStep(Search& sr);
     void dumpSearch(const Search& sr, std::ostream& out) const;
 
-    bool rateLimit();
+    bool rateLimit(const sockaddr* from);
+
+    /**
+     * Run op(i, next) for i from 0 to n-1, with at most concurrency
+     * operations running at the same time. Each operation must call
+     * next() once when complete. done is called after the last one.
+     */
+    void runBatch(size_t n, unsigned concurrency, std::function<void(size_t, std::function<void()>)>&& op, std::function<void()>&& done);
+
+    /**
+     * Add good nodes of the searches for key from to the searches for key id.
+     */
+    void seedSearches(const InfoHash& id, const InfoHash& from);
     bool neighbourhoodMaintenance(RoutingTable&);
 
     struct MessageStats {
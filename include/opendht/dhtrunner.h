@@ -21,6 +21,7 @@
 #pragma once
 
 #include "securedht.h"
+#include "mpsc_queue.h"
 
 #include <thread>
 #include <mutex>
@@ -28,7 +29,6 @@
 #include <condition_variable>
 #include <future>
 #include <exception>
-#include <queue>
 #include <chrono>
 
 namespace dht {
@@ -162,6 +162,12 @@ public:
 
     void cancelPut(const InfoHash& h, const Value::Id& id);
 
+    /**
+     * Put or get many keys as a single operation (see Dht::putMany).
+     */
+    std::future<std::vector<bool>> putMany(std::vector<std::pair<InfoHash, std::shared_ptr<Value>>> values, unsigned concurrency = Dht::BATCH_CONCURRENCY);
+    std::future<Dht::GetManyResult> getMany(std::vector<InfoHash> keys, Value::Filter f = Value::AllFilter(), unsigned concurrency = Dht::BATCH_CONCURRENCY);
+
     void putSigned(InfoHash hash, std::shared_ptr<Value> value, Dht::DoneCallback cb={});
     void putSigned(InfoHash hash, std::shared_ptr<Value> value, Dht::DoneCallbackSimple cb) {
         putSigned(hash, value, Dht::bindDoneCb(cb));
@@ -188,6 +194,21 @@ public:
     void bootstrap(const std::vector<std::pair<sockaddr_storage, socklen_t>>& nodes);
     void bootstrap(const std::vector<NodeExport>& nodes);
 
+    /**
+     * Reconnect using nodes saved with exportNodes(), see Dht::warmStart.
+     */
+    void warmStart(const std::vector<NodeExport>& nodes);
+
+    /**
+     * Time it took to get connected, see Dht::getTimeToConnected.
+     */
+    duration getTimeToConnected() const {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        if (!dht_)
+            return duration::max();
+        return dht_->getTimeToConnected();
+    }
+
     /**
      * Inform the DHT of lower-layer connectivity changes.
      * This will cause the DHT to assume an IP address change.
@@ -195,6 +216,11 @@ public:
      */
     void connectivityChanged();
 
+    /**
+     * Ignore an address or a subnet (see Dht::blacklistAddress).
+     */
+    void blacklistAddress(const sockaddr* sa, socklen_t salen, unsigned prefix_len = 0, time_point expiration = time_point::max());
+
     void dumpTables() const
     {
         std::lock_guard<std::mutex> lck(dht_mtx);
@@ -243,6 +269,19 @@ public:
             return {};
         return dht_->getStoreSize();
     }
+    std::pair<size_t, size_t> getStoreSize(const InfoHash& key) const {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        if (!dht_)
+            return {};
+        return dht_->getStoreSize(key);
+    }
+
+    void setStorageLog(const std::string& path) {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        if (!dht_)
+            throw std::runtime_error("dht is not running");
+        dht_->setStorageLog(path);
+    }
 
     void setStorageLimit(size_t limit = Dht::DEFAULT_STORAGE_LIMIT) {
         std::lock_guard<std::mutex> lck(dht_mtx);
@@ -251,6 +290,34 @@ public:
         return dht_->setStorageLimit(limit);
     }
 
+    void setGetCacheWindow(duration window = Dht::GET_CACHE_WINDOW) {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        if (!dht_)
+            throw std::runtime_error("dht is not running");
+        dht_->setGetCacheWindow(window);
+    }
+
+    void setSearchAlpha(unsigned alpha = Dht::SEARCH_ALPHA) {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        if (!dht_)
+            throw std::runtime_error("dht is not running");
+        dht_->setSearchAlpha(alpha);
+    }
+
+    void setLatencyAware(bool enabled) {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        if (!dht_)
+            throw std::runtime_error("dht is not running");
+        dht_->setLatencyAware(enabled);
+    }
+
+    void setEvictionPolicy(Dht::EvictionPolicy policy) {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        if (!dht_)
+            throw std::runtime_error("dht is not running");
+        dht_->setEvictionPolicy(policy);
+    }
+
     std::vector<NodeExport> exportNodes() const {
         std::lock_guard<std::mutex> lck(dht_mtx);
         if (!dht_)
@@ -258,6 +325,12 @@ public:
         return dht_->exportNodes();
     }
 
+    /**
+     * Export the good nodes from the DHT thread, without blocking
+     * the caller. Can be used from a status callback.
+     */
+    void exportNodes(std::function<void(std::vector<NodeExport>&&)>&& cb);
+
     std::vector<Dht::ValuesExport> exportValues() const {
         std::lock_guard<std::mutex> lck(dht_mtx);
         if (!dht_)
@@ -265,6 +338,19 @@ public:
         return dht_->exportValues();
     }
 
+    /**
+     * Streaming state export and import, see Dht::exportState.
+     * The writer, reader and done callbacks are called from the DHT thread.
+     */
+    void exportState(Dht::StateWriter&& writer, Dht::DoneCallbackSimple&& done = {});
+    void importState(Dht::StateReader&& reader, Dht::DoneCallbackSimple&& done = {});
+
+    /**
+     * The stream must stay valid until the future is ready.
+     */
+    std::future<bool> exportState(std::ostream& os);
+    std::future<bool> importState(std::istream& is);
+
     void setLoggers(LogMethod&& error = NOLOG, LogMethod&& warn = NOLOG, LogMethod&& debug = NOLOG) {
         std::lock_guard<std::mutex> lck(dht_mtx);
         dht_->setLoggers(std::forward<LogMethod>(error), std::forward<LogMethod>(warn), std::forward<LogMethod>(debug));
@@ -296,6 +382,33 @@ public:
         return dht_->getNodeMessageStats(in);
     }
 
+    Dht::DropStats getDropStats(bool reset = false)
+    {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        return dht_->getDropStats(reset);
+    }
+    Dht::EvictionStats getEvictionStats(bool reset = false)
+    {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        return dht_->getEvictionStats(reset);
+    }
+    Dht::GetCacheStats getGetCacheStats(bool reset = false)
+    {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        return dht_->getGetCacheStats(reset);
+    }
+    Dht::Metrics getMetrics(bool reset = false)
+    {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        if (!dht_)
+            return {};
+        auto m = dht_->getMetrics(reset);
+        m.rcv_depth = rcv_depth;
+        m.ops_depth = ops_depth;
+        if (reset)
+            rcv_depth = ops_depth = {};
+        return m;
+    }
     std::string getStorageLog() const
     {
         std::lock_guard<std::mutex> lck(dht_mtx);
@@ -327,6 +440,12 @@ public:
     // securedht methods
 
     void findCertificate(InfoHash hash, std::function<void(const std::shared_ptr<crypto::Certificate>)>);
+    SecureDht::SignatureCacheStats getSignatureCacheStats() const {
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        if (!dht_)
+            return {0, 0, 0};
+        return dht_->getSignatureCacheStats();
+    }
     void registerCertificate(std::shared_ptr<crypto::Certificate> cert) {
         std::lock_guard<std::mutex> lck(dht_mtx);
         dht_->registerCertificate(cert);
@@ -339,6 +458,19 @@ public:
     struct Config {
         SecureDht::Config dht_config;
         bool threaded;
+        /**
+         * Receive and send packets in batches (recvmmsg/sendmmsg),
+         * reducing the number of system calls under load.
+         * Only effective on Linux.
+         */
+        bool batched_io;
+        /**
+         * In threaded mode, run networking and DHT processing on a single
+         * epoll-driven thread: packets are processed as soon as a socket
+         * is readable, without handoff to another thread.
+         * Only effective on Linux.
+         */
+        bool event_loop;
     };
 
     /**
@@ -352,11 +484,16 @@ public:
             .dht_config = {
                 .node_config = {
                     .node_id = {},
-                    .is_bootstrap = is_bootstrap
+                    .is_bootstrap = is_bootstrap,
+                    .max_searches = 0
                 },
-                .id = identity
+                .id = identity,
+                .crypto_threads = 0,
+                .ordered_delivery = false
             },
-            .threaded = threaded
+            .threaded = threaded,
+            .batched_io = false,
+            .event_loop = false
         });
     }
     void run(in_port_t port, Config config);
@@ -402,12 +539,39 @@ public:
      */
     void join();
 
+    /**
+     * Resolve host and service, for binding or bootstrapping.
+     */
+    static std::vector<std::pair<sockaddr_storage, socklen_t>> getAddrInfo(const char* host, const char* service);
+
 private:
 
-    void doRun(const sockaddr_in* sin4, const sockaddr_in6* sin6, SecureDht::Config config);
+    /* Maximum number of datagrams read by a single recvmmsg call */
+    static constexpr size_t RCV_BATCH_MAX {32};
+
+    void doRun(const sockaddr_in* sin4, const sockaddr_in6* sin6, SecureDht::Config config, bool batched_io = false, bool event_loop = false);
     time_point loop_();
 
-    static std::vector<std::pair<sockaddr_storage, socklen_t>> getAddrInfo(const char* host, const char* service);
+    /**
+     * Queue an operation to run on the DHT thread.
+     * Priority operations run first, and even when disconnected.
+     */
+    void post(std::function<void(SecureDht&)>&& op);
+    void postPriority(std::function<void(SecureDht&)>&& op);
+
+    /**
+     * Wake up the DHT thread, to process new pending operations.
+     */
+    void notify();
+
+    /**
+     * Wait for a notification, or until wakeup.
+     */
+    void waitUntil(time_point wakeup);
+
+#ifdef __linux__
+    void eventLoop(int s4, int s6);
+#endif
 
     Dht::Status getStatus() const {
         return std::max(status4, status6);
@@ -416,18 +580,47 @@ private:
     std::unique_ptr<SecureDht> dht_ {};
     mutable std::mutex dht_mtx {};
     std::thread dht_thread {};
+    /* Used to wait for notifications if event_fd is not available */
     std::condition_variable cv {};
+    std::mutex wake_mtx {};
+    bool wake {false};
 
     std::thread rcv_thread {};
     std::mutex sock_mtx {};
-    std::vector<std::pair<Blob, std::pair<sockaddr_storage, socklen_t>>> rcv {};
+    /* Datagram received by the networking thread */
+    struct ReceivedPacket {
+        std::array<uint8_t, 1024 * 64> data;
+        size_t size {0};
+        sockaddr_storage from;
+        socklen_t fromlen {0};
+    };
+    /* Received packets, waiting to be processed */
+    std::vector<std::unique_ptr<ReceivedPacket>> rcv {};
+    /* Processed packet buffers, reused for reception */
+    std::vector<std::unique_ptr<ReceivedPacket>> rcv_pool {};
+    /* Maximum number of idle buffers kept in rcv_pool */
+    static constexpr size_t RCV_POOL_MAX {64};
 
-    std::queue<std::function<void(SecureDht&)>> pending_ops_prio {};
-    std::queue<std::function<void(SecureDht&)>> pending_ops {};
-    std::mutex storage_mtx {};
+    /**
+     * Get a buffer from the pool, or allocate a new one.
+     */
+    std::unique_ptr<ReceivedPacket> getPacketBuffer();
+
+    /* Operations from the API, consumed by the DHT thread.
+       Producers only notify when a queue was empty. */
+    MpscQueue<std::function<void(SecureDht&)>> pending_ops_prio {};
+    MpscQueue<std::function<void(SecureDht&)>> pending_ops {};
+
+    /* Number of received packets and operations processed per loop,
+       protected by dht_mtx */
+    Histogram rcv_depth {};
+    Histogram ops_depth {};
 
     std::atomic<bool> running {false};
 
+    /* eventfd used to wake up the DHT thread, or -1 if not used */
+    int event_fd {-1};
+
     Dht::Status status4 {Dht::Status::Disconnected},
                 status6 {Dht::Status::Disconnected};
     StatusCallback statusCb {nullptr};
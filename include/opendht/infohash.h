@@ -66,16 +66,12 @@ public:
      * Result will allways be lower than 8*HASH_LEN
      */
     inline unsigned lowbit() const {
-        int i, j;
-        for(i = HASH_LEN-1; i >= 0; i--)
-            if((*this)[i] != 0)
-                break;
-        if(i < 0)
-            return -1;
-        for(j = 7; j >= 0; j--)
-            if(((*this)[i] & (0x80 >> j)) != 0)
-                break;
-        return 8 * i + j;
+        if (auto w = tail())
+            return 8*HASH_LEN - 1 - __builtin_ctz(w);
+        for (int i = WORDS-1; i >= 0; i--)
+            if (auto w = word(i))
+                return 64 * i + 63 - __builtin_ctzll(w);
+        return -1;
     }
 
     /**
@@ -90,45 +86,71 @@ public:
     static inline unsigned
     commonBits(const InfoHash& id1, const InfoHash& id2)
     {
-        unsigned i, j;
-        uint8_t x;
-        for(i = 0; i < HASH_LEN; i++) {
-            if(id1[i] != id2[i])
-                break;
-        }
-
-        if(i == HASH_LEN)
-            return 8*HASH_LEN;
-
-        x = id1[i] ^ id2[i];
-
-        j = 0;
-        while((x & 0x80) == 0) {
-            x <<= 1;
-            j++;
-        }
-
-        return 8 * i + j;
+        for (unsigned i = 0; i < WORDS; i++)
+            if (auto x = id1.word(i) ^ id2.word(i))
+                return 64 * i + __builtin_clzll(x);
+        if (auto x = id1.tail() ^ id2.tail())
+            return 64 * WORDS + __builtin_clz(x);
+        return 8*HASH_LEN;
     }
 
     /** Determine whether id1 or id2 is closer to this */
     int
     xorCmp(const InfoHash& id1, const InfoHash& id2) const
     {
-        for(unsigned i = 0; i < HASH_LEN; i++) {
-            uint8_t xor1, xor2;
-            if(id1[i] == id2[i])
-                continue;
-            xor1 = id1[i] ^ (*this)[i];
-            xor2 = id2[i] ^ (*this)[i];
-            if(xor1 < xor2)
-                return -1;
-            else
-                return 1;
+        for (unsigned i = 0; i < WORDS; i++) {
+            auto w1 = id1.word(i), w2 = id2.word(i);
+            if (w1 != w2)
+                return (w1 ^ word(i)) < (w2 ^ word(i)) ? -1 : 1;
         }
+        auto t1 = id1.tail(), t2 = id2.tail();
+        if (t1 != t2)
+            return (t1 ^ tail()) < (t2 ^ tail()) ? -1 : 1;
         return 0;
     }
 
+    /**
+     * XOR distance between two ids, ordered like xorCmp().
+     */
+    struct Distance {
+        uint64_t w[2];
+        uint32_t t;
+        bool operator<(const Distance& o) const {
+            if (w[0] != o.w[0]) return w[0] < o.w[0];
+            if (w[1] != o.w[1]) return w[1] < o.w[1];
+            return t < o.t;
+        }
+    };
+
+    Distance distance(const InfoHash& id) const {
+        return {{word(0) ^ id.word(0), word(1) ^ id.word(1)}, tail() ^ id.tail()};
+    }
+
+    /**
+     * Sort v by increasing distance of id_of(element) to this, keeping
+     * only the count closest elements. The distances are computed once
+     * per element, instead of twice per comparison with xorCmp().
+     */
+    template <typename T, typename IdOf>
+    void
+    sortClosest(std::vector<T>& v, size_t count, IdOf id_of) const
+    {
+        std::vector<std::pair<Distance, size_t>> d;
+        d.reserve(v.size());
+        for (size_t i = 0; i < v.size(); i++)
+            d.emplace_back(distance(id_of(v[i])), i);
+        auto cmp = [](const std::pair<Distance, size_t>& a, const std::pair<Distance, size_t>& b) {
+            return a.first < b.first;
+        };
+        count = std::min(count, v.size());
+        std::partial_sort(d.begin(), d.begin() + count, d.end(), cmp);
+        std::vector<T> sorted;
+        sorted.reserve(count);
+        for (size_t i = 0; i < count; i++)
+            sorted.emplace_back(std::move(v[d[i].second]));
+        v = std::move(sorted);
+    }
+
     bool
     getBit(unsigned nbit) const
     {
@@ -195,6 +217,27 @@ public:
         std::copy_n(o.via.bin.ptr, HASH_LEN, data());
     }
 
+private:
+    /* the hash as WORDS big endian 64 bits words and a 32 bits tail */
+    static constexpr unsigned WORDS {HASH_LEN / 8};
+    static_assert(HASH_LEN == 8 * WORDS + 4, "InfoHash words don't match HASH_LEN");
+
+    uint64_t word(unsigned i) const {
+        uint64_t w;
+        std::memcpy(&w, data() + 8 * i, 8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        w = __builtin_bswap64(w);
+#endif
+        return w;
+    }
+    uint32_t tail() const {
+        uint32_t w;
+        std::memcpy(&w, data() + 8 * WORDS, 4);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+        w = __builtin_bswap32(w);
+#endif
+        return w;
+    }
 };
 
 }
@@ -209,10 +252,11 @@ namespace std
 
         result_type operator()(dht::InfoHash const& s) const
         {
-            result_type r {};
-            std::hash<uint8_t> hash_fn;
-            for (size_t i = 0; i < HASH_LEN; i++)
-                r = r ^ (hash_fn(s[i]) << i*4);
+            // content hashes are uniformly distributed: any of their bits
+            // will do. Ids chosen by remote peers are not, and containers
+            // indexed by them need a keyed hash instead (see NodeCache).
+            result_type r;
+            std::memcpy(&r, s.data(), sizeof(r));
             return r;
         }
     };
@@ -23,7 +23,12 @@
 #include "dhtrunner.h"
 
 #include <iostream>
-#include <fstream>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cstdio>
 
 namespace dht {
 namespace log {
@@ -62,46 +67,73 @@ constexpr const Color::Modifier yellow(Color::FG_YELLOW);
  * Print va_list to std::ostream (used for logging).
  */
 void
-printLog(std::ostream& s, char const* m, va_list args) {
-	static constexpr int BUF_SZ = 8192;
-	char buffer[BUF_SZ];
-	int ret = vsnprintf(buffer, sizeof(buffer), m, args);
-	if (ret < 0)
-		return;
-	s.write(buffer, std::min(ret, BUF_SZ));
-	if (ret >= BUF_SZ)
-		s << "[[TRUNCATED]]";
-	s.put('\n');
-}
+printLog(std::ostream& s, char const* m, va_list args);
 
-void
-enableLogging(dht::DhtRunner& dht)
-{
-	dht.setLoggers(
-		[](char const* m, va_list args){ std::cerr << red; printLog(std::cerr, m, args); std::cerr << def; },
-		[](char const* m, va_list args){ std::cout << yellow; printLog(std::cout, m, args); std::cout << def; },
-		[](char const* m, va_list args){ printLog(std::cout, m, args); }
-	);
-}
+/**
+ * Most verbose level to log. Disabled levels cost nothing: the
+ * arguments of their messages are not even evaluated.
+ */
+enum class Level {
+	Error,
+	Warning,
+	Debug
+};
 
-void
-enableFileLogging(dht::DhtRunner& dht, const std::string& path)
-{
-	auto logfile = std::make_shared<std::fstream>();
-	logfile->open(path, std::ios::out);
-
-	dht.setLoggers(
-		[=](char const* m, va_list args){ printLog(*logfile, m, args); },
-		[=](char const* m, va_list args){ printLog(*logfile, m, args); },
-		[=](char const* m, va_list args){ printLog(*logfile, m, args); }
-	);
-}
+/**
+ * Log sink writing to a file from a background thread.
+ *
+ * Messages are formatted by the logging thread into a ring buffer, and
+ * written by the background thread, so logging never waits for the disk.
+ * When the buffer is full, messages are dropped and counted.
+ */
+class AsyncFileLog {
+public:
+	static constexpr size_t DEFAULT_BUFFER_SIZE {1024 * 1024};
+	/* Longer messages are truncated */
+	static constexpr size_t MAX_MESSAGE_SIZE {8192};
 
-void
-disableLogging(dht::DhtRunner& dht)
-{
-	dht.setLoggers(dht::NOLOG, dht::NOLOG, dht::NOLOG);
-}
+	AsyncFileLog(const std::string& path, size_t buffer_size = DEFAULT_BUFFER_SIZE);
+	/** Write the remaining messages and close the file */
+	~AsyncFileLog();
+
+	/** Can be called from any thread */
+	void log(char const* m, va_list args);
+
+	/** Wait until the messages logged so far are written */
+	void flush();
+
+	/** Number of messages dropped because the buffer was full */
+	uint64_t getDropped() const {
+		return dropped_.load(std::memory_order_relaxed);
+	}
+
+private:
+	AsyncFileLog(const AsyncFileLog&) = delete;
+	AsyncFileLog& operator=(const AsyncFileLog&) = delete;
+
+	void run();
+
+	std::FILE* file_ {nullptr};
+	std::vector<char> buffer_;
+	/* total bytes written to and read from buffer_ */
+	uint64_t head_ {0};
+	uint64_t tail_ {0};
+	bool running_ {true};
+	std::atomic<uint64_t> dropped_ {0};
+	std::mutex mtx_;
+	std::condition_variable cv_;
+	std::condition_variable flushed_;
+	std::thread thread_;
+};
+
+void enableLogging(dht::DhtRunner& dht, Level level = Level::Debug);
+
+/**
+ * Log to path, from a background thread (see AsyncFileLog).
+ */
+void enableFileLogging(dht::DhtRunner& dht, const std::string& path, Level level = Level::Debug);
+
+void disableLogging(dht::DhtRunner& dht);
 
 } /* log */
 } /* dht  */
@@ -0,0 +1,99 @@
+/*
+ *  Copyright (C) 2014-2016 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#pragma once
+
+#include "utils.h"
+
+#include <array>
+#include <string>
+#include <cstdint>
+
+namespace dht {
+
+/**
+ * Distribution of non-negative values (durations in microseconds, queue
+ * depths...), with power of two buckets: bucket 0 counts zeros and
+ * bucket i counts values from 2^(i-1) to 2^i - 1.
+ *
+ * Adding a value is a few integer operations, so histograms can be
+ * always on. Not thread-safe.
+ */
+class Histogram {
+public:
+    static constexpr unsigned BUCKETS {40};
+
+    void add(uint64_t v) {
+        buckets_[bucket(v)]++;
+        count_++;
+        sum_ += v;
+        if (v > max_)
+            max_ = v;
+    }
+
+    /** Record a duration, in microseconds */
+    void add(duration d) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        add(us > 0 ? (uint64_t)us : 0);
+    }
+
+    void merge(const Histogram& o) {
+        for (unsigned i = 0; i < BUCKETS; i++)
+            buckets_[i] += o.buckets_[i];
+        count_ += o.count_;
+        sum_ += o.sum_;
+        if (o.max_ > max_)
+            max_ = o.max_;
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t sum() const { return sum_; }
+    uint64_t max() const { return max_; }
+    uint64_t mean() const { return count_ ? sum_ / count_ : 0; }
+
+    /**
+     * Upper bound of the p quantile (0 <= p <= 1): the upper bound of
+     * the bucket holding it, or the maximum if lower.
+     */
+    uint64_t quantile(double p) const;
+
+    const std::array<uint64_t, BUCKETS>& getBuckets() const {
+        return buckets_;
+    }
+
+    /**
+     * One line summary: count, mean, median, 99th percentile and maximum.
+     */
+    std::string toString() const;
+
+private:
+    static unsigned bucket(uint64_t v) {
+        if (v == 0)
+            return 0;
+        unsigned b = 64 - __builtin_clzll(v);
+        return b < BUCKETS ? b : BUCKETS - 1;
+    }
+
+    std::array<uint64_t, BUCKETS> buckets_ {{}};
+    uint64_t count_ {0};
+    uint64_t sum_ {0};
+    uint64_t max_ {0};
+};
+
+}
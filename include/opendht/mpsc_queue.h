@@ -0,0 +1,148 @@
+/*
+ *  Copyright (C) 2014-2016 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+namespace dht {
+
+/**
+ * Lock-free multiple producers, single consumer FIFO queue.
+ *
+ * Producers push to an atomic list head, and the consumer takes the whole
+ * list at once, so neither side ever blocks the other.
+ * Nodes come from a fixed pool (a lock-free stack, with an ABA tag),
+ * and are allocated only when the pool is exhausted.
+ */
+template <typename T, uint32_t POOL_SIZE = 1024>
+class MpscQueue {
+public:
+    MpscQueue() : pool_(new Node[POOL_SIZE]) {
+        for (uint32_t i = 0; i < POOL_SIZE; i++) {
+            pool_[i].pooled = true;
+            pool_[i].next_free.store(i + 1 < POOL_SIZE ? i + 2 : 0, std::memory_order_relaxed);
+        }
+        free_.store(POOL_SIZE ? 1 : 0, std::memory_order_relaxed);
+    }
+    ~MpscQueue() {
+        clear();
+    }
+
+    /**
+     * Add an element. Can be called from any thread.
+     * @returns true if the queue was empty.
+     */
+    bool push(T&& v) {
+        Node* n = allocate();
+        n->value = std::move(v);
+        n->next = head_.load(std::memory_order_relaxed);
+        while (not head_.compare_exchange_weak(n->next, n, std::memory_order_release, std::memory_order_relaxed))
+            ;
+        return n->next == nullptr;
+    }
+
+    bool empty() const {
+        return head_.load(std::memory_order_acquire) == nullptr;
+    }
+
+    /**
+     * Take all queued elements and call f on each, in push order.
+     * Must only be called from the consumer thread.
+     * @returns the number of elements consumed.
+     */
+    template <typename F>
+    size_t consume(F&& f) {
+        Node* list = head_.exchange(nullptr, std::memory_order_acquire);
+        // reverse to FIFO order
+        Node* fifo = nullptr;
+        while (list) {
+            Node* next = list->next;
+            list->next = fifo;
+            fifo = list;
+            list = next;
+        }
+        size_t n = 0;
+        while (fifo) {
+            Node* next = fifo->next;
+            f(fifo->value);
+            fifo->value = T {};
+            release(fifo);
+            fifo = next;
+            n++;
+        }
+        return n;
+    }
+
+    /**
+     * Drop all queued elements. Same restrictions as consume().
+     */
+    void clear() {
+        consume([](T&) {});
+    }
+
+private:
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    struct Node {
+        T value {};
+        Node* next {nullptr};
+        bool pooled {false};
+        /* index + 1 of the next free node in the pool, 0 for none */
+        std::atomic<uint32_t> next_free {0};
+    };
+
+    /* free_ holds an ABA tag in the high 32 bits and index + 1 of the
+       first free node in the low 32 bits */
+    static constexpr uint64_t INDEX_MASK {0xFFFFFFFF};
+
+    Node* allocate() {
+        uint64_t head = free_.load(std::memory_order_acquire);
+        while (uint32_t idx = head & INDEX_MASK) {
+            Node& n = pool_[idx - 1];
+            uint64_t next = (((head >> 32) + 1) << 32) | n.next_free.load(std::memory_order_relaxed);
+            if (free_.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire))
+                return &n;
+        }
+        return new Node;
+    }
+
+    void release(Node* n) {
+        if (not n->pooled) {
+            delete n;
+            return;
+        }
+        uint64_t idx = n - pool_.get() + 1;
+        uint64_t head = free_.load(std::memory_order_relaxed);
+        uint64_t next;
+        do {
+            n->next_free.store(head & INDEX_MASK, std::memory_order_relaxed);
+            next = (((head >> 32) + 1) << 32) | idx;
+        } while (not free_.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    std::atomic<Node*> head_ {nullptr};
+    std::unique_ptr<Node[]> pool_;
+    std::atomic<uint64_t> free_ {0};
+};
+
+}
@@ -0,0 +1,124 @@
+/*
+ *  Copyright (C) 2014-2016 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#pragma once
+
+#include "utils.h"
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace dht {
+
+/**
+ * Job scheduler, ordered by execution time.
+ *
+ * Jobs are kept in a time-ordered multimap: adding a job is O(log n),
+ * the next deadline is read in O(1) and run() only visits due jobs.
+ * Cancelled or rescheduled jobs leave an empty entry behind that is
+ * dropped when its time comes.
+ */
+class Scheduler {
+public:
+    struct Job {
+        Job(time_point t, std::function<void()>&& f) : time(t), do_(std::move(f)) {}
+
+        /** Time the job is scheduled at, time_point::max() if not scheduled. */
+        time_point time;
+        std::function<void()> do_;
+
+        void cancel() {
+            do_ = {};
+        }
+    };
+
+    /**
+     * Schedule a job at time t.
+     * A job scheduled at time_point::max() will not run until it is
+     * rescheduled using edit().
+     */
+    std::shared_ptr<Job> add(time_point t, std::function<void()>&& job_func) {
+        auto job = std::make_shared<Job>(t, std::move(job_func));
+        if (t != time_point::max())
+            timers.emplace(t, job);
+        return job;
+    }
+
+    /**
+     * Reschedule a job at time t (or unschedule it if t is
+     * time_point::max()). job is replaced by a new handle.
+     */
+    void edit(std::shared_ptr<Job>& job, time_point t) {
+        if (not job or job->time == t)
+            return;
+        // std::function move doesn't guarantee to leave the source empty.
+        auto task = std::move(job->do_);
+        job->do_ = {};
+        job = add(t, std::move(task));
+    }
+
+    /**
+     * Run the jobs due at time now. Jobs scheduled (again) for a time
+     * less or equal to now by a running job will run on the next call.
+     *
+     * @returns the time of the next job, time_point::max() if none.
+     */
+    time_point run(time_point now) {
+        std::vector<std::shared_ptr<Job>> due;
+        while (not timers.empty()) {
+            auto timer = timers.begin();
+            if (timer->first > now)
+                break;
+            auto job = std::move(timer->second);
+            timers.erase(timer);
+            if (not job->do_)
+                continue;
+            job->time = time_point::max();
+            due.emplace_back(std::move(job));
+        }
+        for (auto& job : due) {
+            if (not job->do_)
+                continue;
+            // a running job may reschedule itself through edit(),
+            // which takes its function object.
+            auto task = job->do_;
+            task();
+        }
+
+        // drop cancelled jobs so they don't cause useless wake-ups
+        while (not timers.empty() and not timers.begin()->second->do_)
+            timers.erase(timers.begin());
+        return getNextJobTime();
+    }
+
+    time_point getNextJobTime() const {
+        return timers.empty() ? time_point::max() : timers.begin()->first;
+    }
+
+    void clear() {
+        timers.clear();
+    }
+
+private:
+    std::multimap<time_point, std::shared_ptr<Job>> timers {};
+};
+
+}
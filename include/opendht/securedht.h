@@ -34,9 +34,14 @@
 #include "crypto.h"
 
 #include <map>
+#include <list>
 #include <vector>
 #include <memory>
 #include <random>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 namespace dht {
 
@@ -45,10 +50,35 @@ public:
 
     typedef std::function<void(bool)> SignatureCheckCallback;
 
+    /* Maximum number of verified signatures kept in cache */
+    static constexpr size_t SIGNATURE_CACHE_MAX {4096};
+
+    struct SignatureCacheStats {
+        size_t hits;
+        size_t misses;
+        size_t size;
+    };
+
     struct Config
     {
         Dht::Config node_config;
         crypto::Identity id;
+
+        /**
+         * Number of threads used to check signatures and decrypt values
+         * received by get() and listen(). With 0 (default), values are
+         * checked on the calling thread before callbacks are called.
+         * Otherwise, values are checked by the worker threads and
+         * callbacks are called later, from periodic().
+         */
+        unsigned crypto_threads;
+
+        /**
+         * With crypto worker threads, deliver the values of a given get
+         * or listen operation in the order they were received.
+         * Otherwise, values are delivered as soon as they are checked.
+         */
+        bool ordered_delivery;
     };
 
     SecureDht() {}
@@ -84,6 +114,21 @@ public:
         Dht::registerType(type);
     }
 
+    /**
+     * Same as Dht::periodic, also delivers values checked by the crypto
+     * worker threads, if any.
+     */
+    time_point periodic(const uint8_t *buf, size_t buflen, const sockaddr* from, socklen_t fromlen);
+
+    /**
+     * Set a callback called from a crypto worker thread when checked
+     * values are ready to be delivered by periodic(), typically used to
+     * wake up the thread running the DHT.
+     */
+    void setOnCryptoDone(std::function<void()>&& cb) {
+        onCryptoDone_ = std::move(cb);
+    }
+
     /**
      * "Secure" get(), that will check the signature of signed data, and decrypt encrypted data.
      * If the signature can't be checked, or if the data can't be decrypted, it is not returned.
@@ -96,6 +141,15 @@ public:
 
     size_t listen(const InfoHash& id, GetCallback cb, Value::Filter&& = {});
 
+    /**
+     * Dht::getMany() using the "secure" get().
+     */
+    void getMany(std::vector<InfoHash> keys, GetManyCallback cb, Value::Filter f = Value::AllFilter(), unsigned concurrency = BATCH_CONCURRENCY) {
+        getBatch(std::move(keys), std::move(cb), std::move(f), concurrency, [this](const InfoHash& key, GetCallback gcb, DoneCallback dcb, Value::Filter f) {
+            get(key, gcb, dcb, std::move(f));
+        });
+    }
+
     /**
      * Will take ownership of the value, sign it using our private key and put it in the DHT.
      */
@@ -130,6 +184,23 @@ public:
 
     const std::shared_ptr<crypto::Certificate> getCertificate(const InfoHash& node) const;
 
+    /**
+     * Check the signature of a signed value, using the cache of
+     * already verified signatures.
+     */
+    bool checkSignature(const Value& v);
+
+    SignatureCacheStats getSignatureCacheStats() const {
+        std::lock_guard<std::mutex> lck(sigCacheMtx_);
+        return {sigCacheHits_, sigCacheMisses_, sigCache_.size()};
+    }
+
+    /**
+     * Same as Dht::getMetrics, with the time spent in cryptographic
+     * operations.
+     */
+    Metrics getMetrics(bool reset = false);
+
 
     using CertificateStoreQuery = std::function<std::vector<std::shared_ptr<crypto::Certificate>>(const InfoHash& pk_id)>;
 
@@ -149,6 +220,20 @@ private:
 
     GetCallback getCallbackFilter(GetCallback, Value::Filter&&);
 
+    /**
+     * Check the signature of a signed value or decrypt an encrypted value.
+     * @returns the value to deliver (decrypted if needed), or nullptr
+     *          if the value must be dropped.
+     */
+    std::shared_ptr<Value> checkValue(const std::shared_ptr<Value>& v);
+
+    // Crypto worker threads
+    struct AsyncGet;
+    GetCallback getCallbackAsync(const std::shared_ptr<AsyncGet>& op);
+    DoneCallback getDoneCallbackAsync(const std::shared_ptr<AsyncGet>& op);
+    void deliverAsync(const std::shared_ptr<AsyncGet>& op, uint64_t seq, std::vector<std::shared_ptr<Value>>&& values);
+    void cryptoWorker();
+
     std::shared_ptr<crypto::PrivateKey> key_ {};
     std::shared_ptr<crypto::Certificate> certificate_ {};
 
@@ -159,6 +244,36 @@ private:
     std::map<InfoHash, std::shared_ptr<crypto::Certificate>> nodesCertificates_ {};
 
     std::uniform_int_distribution<Value::Id> rand_id {};
+
+    // verified signatures, indexed by digest of the signed body
+    // (including the owner public key) and signature.
+    // sigCacheOrder_ is sorted from most to least recently used.
+    mutable std::mutex sigCacheMtx_ {};
+    std::list<Blob> sigCacheOrder_ {};
+    std::map<Blob, std::list<Blob>::iterator> sigCache_ {};
+    size_t sigCacheHits_ {0};
+    size_t sigCacheMisses_ {0};
+
+    // time spent in crypto operations, possibly from the worker threads
+    void addCryptoTime(Histogram& h, time_point start) const {
+        auto t = clock::now() - start;
+        std::lock_guard<std::mutex> lck(cryptoTimeMtx_);
+        h.add(t);
+    }
+    mutable std::mutex cryptoTimeMtx_ {};
+    mutable Histogram verifyTime_ {}, signTime_ {}, encryptTime_ {}, decryptTime_ {};
+
+    std::vector<std::thread> cryptoWorkers_ {};
+    bool orderedDelivery_ {false};
+    std::mutex cryptoMtx_ {};
+    std::condition_variable cryptoCv_ {};
+    std::queue<std::function<void()>> cryptoJobs_ {};
+    bool cryptoStop_ {false};
+
+    // checked values, waiting to be delivered from periodic()
+    std::mutex cryptoDoneMtx_ {};
+    std::queue<std::function<void()>> cryptoDone_ {};
+    std::function<void()> onCryptoDone_ {};
 };
 
 const ValueType CERTIFICATE_TYPE = {
@@ -0,0 +1,169 @@
+/*
+ *  Copyright (C) 2014-2016 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#pragma once
+
+#include "dhtrunner.h"
+
+#include <vector>
+#include <memory>
+#include <mutex>
+
+namespace dht {
+
+/**
+ * Runs several DHT engines (shards) in the same process, each with its
+ * own node id, socket and thread, to use more than one core.
+ *
+ * Node ids of the shards are spread evenly over the keyspace, and
+ * operations on a key are routed to the shard whose node id is the
+ * closest to the key.
+ *
+ * Shards bind consecutive ports starting from the provided port
+ * (or random ports if the port is 0): UDP port sharing (SO_REUSEPORT)
+ * dispatches packets by source address, so replies would not reach
+ * the engine that sent a request.
+ */
+class ShardedDhtRunner {
+public:
+    typedef DhtRunner::StatusCallback StatusCallback;
+
+    struct Config {
+        /* Configuration of every shard. If dht_config.node_config.node_id
+           is set, shard ids are derived from it. */
+        DhtRunner::Config runner_config;
+        /* Number of shards, from 1 to 256 */
+        unsigned shards;
+    };
+
+    ShardedDhtRunner() {}
+    ~ShardedDhtRunner() {
+        join();
+    }
+
+    /**
+     * @param port: Local port of the first shard. Shard i binds port + i.
+     */
+    void run(in_port_t port, Config config);
+
+    /**
+     * In non-threaded mode, the user should call this method
+     * regularly and everytime a new packet is received.
+     * @return the next op
+     */
+    time_point loop();
+
+    /**
+     * Gracefuly disconnect all shards from network.
+     * cb is called once all shards are disconnected.
+     */
+    void shutdown(Dht::ShutdownCallback cb);
+    void join();
+
+    bool isRunning() const {
+        return not shards_.empty() and shards_.front()->isRunning();
+    }
+
+    size_t size() const {
+        return shards_.size();
+    }
+    DhtRunner& getShard(size_t i) {
+        return *shards_.at(i);
+    }
+
+    /**
+     * The shard responsible for key.
+     */
+    DhtRunner& getShard(const InfoHash& key);
+
+    /**
+     * Called with the best IPv4 and IPv6 status of all shards,
+     * when they change.
+     */
+    void setOnStatusChanged(StatusCallback&& cb) {
+        std::lock_guard<std::mutex> lck(mtx_);
+        statusCb_ = std::move(cb);
+    }
+
+    template <typename... Args>
+    void get(const InfoHash& key, Args&&... args) {
+        getShard(key).get(key, std::forward<Args>(args)...);
+    }
+    std::future<std::vector<std::shared_ptr<Value>>> get(const InfoHash& key, Value::Filter f = Value::AllFilter()) {
+        return getShard(key).get(key, f);
+    }
+
+    template <typename... Args>
+    std::future<size_t> listen(const InfoHash& key, Args&&... args) {
+        return getShard(key).listen(key, std::forward<Args>(args)...);
+    }
+    template <typename Token>
+    void cancelListen(const InfoHash& key, Token&& token) {
+        getShard(key).cancelListen(key, std::forward<Token>(token));
+    }
+
+    template <typename... Args>
+    void put(const InfoHash& key, Args&&... args) {
+        getShard(key).put(key, std::forward<Args>(args)...);
+    }
+    template <typename... Args>
+    void putSigned(const InfoHash& key, Args&&... args) {
+        getShard(key).putSigned(key, std::forward<Args>(args)...);
+    }
+    template <typename... Args>
+    void putEncrypted(const InfoHash& key, const InfoHash& to, Args&&... args) {
+        getShard(key).putEncrypted(key, to, std::forward<Args>(args)...);
+    }
+    void cancelPut(const InfoHash& key, const Value::Id& id) {
+        getShard(key).cancelPut(key, id);
+    }
+
+    /**
+     * Bootstrap all shards. host is resolved only once.
+     */
+    void bootstrap(const char* host, const char* service);
+    void bootstrap(const std::vector<std::pair<sockaddr_storage, socklen_t>>& nodes);
+    void bootstrap(const std::vector<NodeExport>& nodes);
+
+    void connectivityChanged();
+
+    /**
+     * Good nodes of all shards.
+     */
+    std::vector<NodeExport> exportNodes() const;
+
+    std::pair<size_t, size_t> getStoreSize() const;
+
+private:
+    ShardedDhtRunner(const ShardedDhtRunner&) = delete;
+    ShardedDhtRunner& operator=(const ShardedDhtRunner&) = delete;
+
+    void onStatusChanged(size_t shard, Dht::Status status4, Dht::Status status6);
+
+    std::vector<std::unique_ptr<DhtRunner>> shards_ {};
+    std::vector<InfoHash> ids_ {};
+
+    std::mutex mtx_ {};
+    std::vector<std::pair<Dht::Status, Dht::Status>> status_ {};
+    /* true once the routing table of a connected shard was shared */
+    bool seeded_ {false};
+    StatusCallback statusCb_ {};
+};
+
+}
@@ -72,15 +72,20 @@ public:
 inline void NOLOG(char const*, va_list) {}
 
 /**
- * Wrapper for logging methods
+ * Wrapper for logging methods.
+ * A LogMethod made from NOLOG or an empty function is disabled.
  */
 struct LogMethod {
     LogMethod() = default;
 
     template<typename T>
-    LogMethod(T&& t) : func(std::forward<T>(t)) {}
+    LogMethod(T&& t) : enabled(isEnabled(t)), func(std::forward<T>(t)) {}
+
+    explicit operator bool() const { return enabled; }
 
     void operator()(char const* format, ...) const {
+        if (not enabled)
+            return;
         va_list args;
         va_start(args, format);
         func(format, args);
@@ -88,15 +93,30 @@ struct LogMethod {
     }
 
     void logPrintable(const uint8_t *buf, size_t buflen) const {
+        if (not enabled)
+            return;
         std::string buf_clean(buflen, '\0');
         for (size_t i=0; i<buflen; i++)
             buf_clean[i] = std::isprint(buf[i]) ? buf[i] : '.';
         (*this)("%s", buf_clean.c_str());
     }
 private:
+    template<typename T>
+    static bool isEnabled(const T&) { return true; }
+    static bool isEnabled(void (*f)(char const*, va_list)) { return f and f != NOLOG; }
+    static bool isEnabled(const std::function<void(char const*, va_list)>& f) { return (bool)f; }
+    static bool isEnabled(const LogMethod& l) { return l.enabled; }
+
+    bool enabled {false};
     std::function<void(char const*, va_list)> func;
 };
 
+/**
+ * Call the LogMethod method only if it is enabled: the arguments, often
+ * built with toString() or print_addr(), are not evaluated otherwise.
+ */
+#define DHT_LOG(method, ...) do { if (method) (method)(__VA_ARGS__); } while (0)
+
 // Serialization related definitions and utility functions
 
 typedef std::vector<uint8_t> Blob;
@@ -51,6 +51,7 @@ typedef uint16_t in_port_t;
 namespace dht {
 
 struct Value;
+struct Query;
 
 /**
  * A storage policy is applied once to every incoming value storage requests.
@@ -111,6 +112,10 @@ struct ValueType {
     duration expiration {60 * 10};
     StorePolicy storePolicy {DEFAULT_STORE_POLICY};
     EditPolicy editPolicy {DEFAULT_EDIT_POLICY};
+
+    /* With Dht::EvictionPolicy::TYPE_PRIORITY, values of types with
+       a lower priority are evicted first when the storage is full. */
+    int priority {0};
 };
 
 /**
@@ -127,47 +132,40 @@ struct Value
     typedef uint64_t Id;
     static const Id INVALID_ID {0};
 
+    /**
+     * A filter can carry a Query: a serializable subset of its
+     * conditions, sent to remote nodes so that they only send the
+     * matching values. The filter itself still applies to the values
+     * received.
+     */
     class Filter : public std::function<bool(const Value&)> {
         using std::function<bool(const Value&)>::function;
     public:
-        static Filter chain(Filter&& f1, Filter&& f2) {
-            return [f1,f2](const Value& v){
-                return f1(v) && f2(v);
-            };
-        }
-        static Filter chain(std::initializer_list<Filter> l) {
-            const std::vector<Filter> list(l.begin(), l.end());
-            return [list](const Value& v){
-                for (const auto& f : list)
-                    if (f and not f(v))
-                        return false;
-                return true;
-            };
-        }
-        Filter chain(Filter&& f2) {
-            Filter f1 = std::move(*this);
-            return [f1,f2](const Value& v){
-                return f1(v) && f2(v);
-            };
+        Filter() {}
+
+        /**
+         * Filter matching the values matched by q.
+         */
+        Filter(const Query& q);
+
+        static Filter chain(Filter&& f1, Filter&& f2);
+        static Filter chain(std::initializer_list<Filter> l);
+        Filter chain(Filter&& f2);
+
+        const std::shared_ptr<const Query>& getQuery() const {
+            return query;
         }
+
+    private:
+        std::shared_ptr<const Query> query {};
     };
 
     static const Filter AllFilter() {
         return [](const Value&){return true;};
     }
 
-    static Filter TypeFilter(const ValueType& t) {
-        const auto tid = t.id;
-        return [tid](const Value& v) {
-            return v.type == tid;
-        };
-    }
-
-    static Filter IdFilter(const Id id) {
-        return [id](const Value& v) {
-            return v.id == id;
-        };
-    }
+    static Filter TypeFilter(const ValueType& t);
+    static Filter IdFilter(const Id id);
 
     static Filter recipientFilter(const InfoHash& r) {
         return [r](const Value& v) {
@@ -421,6 +419,76 @@ struct Value
     Blob cypher {};
 };
 
+/**
+ * Serializable value filter, sent with get and listen requests.
+ * Empty fields match any value. Only ids are checked for encrypted
+ * values, and they are always sent in full.
+ */
+struct Query
+{
+    std::vector<ValueType::Id> types {};
+    /* id of the owner public key */
+    InfoHash owner {};
+    std::vector<Value::Id> ids {};
+    /* only values with a sequence number greater than seq_after */
+    int32_t seq_after {-1};
+    /* remote nodes only send the id and type of matching values */
+    bool ids_only {false};
+
+    bool empty() const {
+        return types.empty() and owner == InfoHash() and ids.empty() and seq_after < 0 and not ids_only;
+    }
+
+    /**
+     * Whether v matches all the conditions of the query, as checked by
+     * the nodes serving it. Only the id matters for encrypted values.
+     */
+    bool match(const Value& v) const;
+
+    /**
+     * Whether v matches the ids and types of the query: the only
+     * conditions that can be checked on the values without content sent
+     * by remote nodes for an ids_only query.
+     */
+    bool matchIdAndType(const Value& v) const;
+
+    /**
+     * A query matching the values matched by both a and b, or a superset.
+     */
+    static Query combine(const Query& a, const Query& b);
+
+    bool operator==(const Query& o) const {
+        return types == o.types and owner == o.owner and ids == o.ids
+           and seq_after == o.seq_after and ids_only == o.ids_only;
+    }
+    bool operator!=(const Query& o) const {
+        return not (*this == o);
+    }
+
+    template <typename Packer>
+    void msgpack_pack(Packer& pk) const
+    {
+        pk.pack_map((types.empty()?0:1) + (owner == InfoHash()?0:1) + (ids.empty()?0:1) + (seq_after<0?0:1) + (ids_only?1:0));
+        if (not types.empty()) {
+            pk.pack(std::string("t")); pk.pack(types);
+        }
+        if (owner != InfoHash()) {
+            pk.pack(std::string("o")); pk.pack(owner);
+        }
+        if (not ids.empty()) {
+            pk.pack(std::string("i")); pk.pack(ids);
+        }
+        if (seq_after >= 0) {
+            pk.pack(std::string("s")); pk.pack(seq_after);
+        }
+        if (ids_only) {
+            pk.pack(std::string("p")); pk.pack(ids_only);
+        }
+    }
+
+    void msgpack_unpack(msgpack::object o);
+};
+
 template <typename T,
           typename std::enable_if<std::is_base_of<Value::SerializableBase, T>::value, T>::type* = nullptr>
 Value::Filter
@@ -0,0 +1,124 @@
+/*
+ *  Copyright (C) 2014-2016 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#pragma once
+
+#include "infohash.h"
+#include "value.h"
+#include "utils.h"
+
+#include <map>
+#include <vector>
+#include <string>
+#include <ctime>
+
+namespace dht {
+
+/**
+ * Append-only log of stored values, used to persist the storage of a node.
+ *
+ * Each record holds a key, a value id, creation and expiration times
+ * (as time_t) and the packed value. The last record for a (key, value id)
+ * wins; a record without data drops the value.
+ *
+ * When opened, the file is memory-mapped and only record headers are
+ * read: values are unpacked later, directly from the mapping.
+ * Records are in host byte order: the log is not meant to be moved
+ * between machines.
+ *
+ * Not available on Windows.
+ */
+class ValueLog {
+public:
+    struct Record {
+        Value::Id id;
+        std::time_t created;
+        std::time_t expiration;
+        /* position and size of the packed value in the mapping */
+        size_t offset;
+        uint32_t size;
+    };
+
+    /**
+     * Open or create the log at path.
+     * Throws DhtException on error.
+     */
+    ValueLog(const std::string& path);
+    ~ValueLog();
+
+    /**
+     * Live records found in the log when it was opened, by key.
+     * Can only be called once.
+     */
+    std::map<InfoHash, std::vector<Record>> takeRecords();
+
+    /**
+     * Packed value of a record, until release() is called.
+     */
+    const uint8_t* getData(const Record& r) const {
+        return map_ + r.offset;
+    }
+
+    /**
+     * Unmap the file opened at startup. Records can't be read anymore.
+     */
+    void release();
+
+    void append(const InfoHash& key, Value::Id id, std::time_t created, std::time_t expiration, const Blob& packed);
+    void drop(const InfoHash& key, Value::Id id);
+
+    /**
+     * Compaction: after startRewrite(), records are appended to a new
+     * file, that replaces the log when finishRewrite() is called.
+     * The new file and its directory entry are synced before
+     * finishRewrite() returns. The mapping must have been released.
+     */
+    void startRewrite();
+    void finishRewrite();
+
+    /** Size of the log file, in bytes */
+    size_t size() const {
+        return size_;
+    }
+
+    /** Size of a record header, in bytes */
+    static const size_t RECORD_HEADER_SIZE;
+
+private:
+    ValueLog(const ValueLog&) = delete;
+    ValueLog& operator=(const ValueLog&) = delete;
+
+    void write(const uint8_t* data, size_t size);
+    void writeRecord(const InfoHash& key, Value::Id id, std::time_t created, std::time_t expiration, const uint8_t* data, uint32_t size);
+    void scan();
+
+    std::string path_;
+    int fd_ {-1};
+    size_t size_ {0};
+
+    const uint8_t* map_ {nullptr};
+    size_t map_size_ {0};
+    std::map<InfoHash, std::vector<Record>> records_ {};
+
+    /* new file during a rewrite, or -1 */
+    int rewrite_fd_ {-1};
+    size_t rewrite_size_ {0};
+};
+
+}
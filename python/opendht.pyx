@@ -35,10 +35,10 @@ from libcpp.string cimport string
 from cython.parallel import parallel, prange
 from cython.operator cimport dereference as deref, preincrement as inc, predecrement as dec
 from cpython cimport ref
+from cpython.buffer cimport PyBuffer_FillInfo
 
 cimport opendht_cpp as cpp
 
-import threading
 
 cdef inline void shutdown_callback(void* user_data) with gil:
     cbs = <object>user_data
@@ -48,9 +48,7 @@ cdef inline void shutdown_callback(void* user_data) with gil:
 
 cdef inline bool get_callback(cpp.shared_ptr[cpp.Value] value, void *user_data) with gil:
     cb = (<object>user_data)['get']
-    pv = Value()
-    pv._value = value
-    return cb(pv)
+    return cb(wrap_value(value))
 
 cdef inline void done_callback(bool done, cpp.vector[cpp.shared_ptr[cpp.Node]]* nodes, void *user_data) with gil:
     node_ids = []
@@ -134,7 +132,14 @@ cdef class NodeEntry(_WithID):
         return n
 
 cdef class Value(object):
+    """A DHT value.
+
+    Values support the buffer protocol: memoryview(value) gives read-only
+    access to the data without copying it. The data can't be set while
+    such a view exists.
+    """
     cdef cpp.shared_ptr[cpp.Value] _value
+    cdef int _exports
     def __init__(self, bytes val=b''):
         self._value.reset(new cpp.Value(val, len(val)))
     def __str__(self):
@@ -155,12 +160,67 @@ cdef class Value(object):
         def __get__(self):
             return string(<char*>self._value.get().data.data(), self._value.get().data.size())
         def __set__(self, bytes value):
+            if self._exports:
+                raise BufferError("value data is exported")
             self._value.get().data = value
     property id:
         def __get__(self):
             return self._value.get().id
         def __set__(self, cpp.uint64_t value):
             self._value.get().id = value
+    def __getbuffer__(self, Py_buffer *buffer, int flags):
+        PyBuffer_FillInfo(buffer, self, <void*>self._value.get().data.data(), self._value.get().data.size(), 1, flags)
+        self._exports += 1
+    def __releasebuffer__(self, Py_buffer *buffer):
+        self._exports -= 1
+
+cdef Value wrap_value(cpp.shared_ptr[cpp.Value] value):
+    # skip __init__, which would allocate a value only to drop it
+    cdef Value pv = Value.__new__(Value)
+    pv._value = value
+    return pv
+
+cdef list wrap_values(cpp.vector[cpp.shared_ptr[cpp.Value]] values):
+    return [wrap_value(v) for v in values]
+
+def _resolve(fut, result):
+    if not fut.done():
+        fut.set_result(result)
+
+def _event_loop(loop):
+    if loop is None:
+        import asyncio
+        loop = asyncio.get_event_loop()
+    return loop
+
+cdef class _ValuesFuture(object):
+    cdef cpp.shared_future[cpp.vector[cpp.shared_ptr[cpp.Value]]] _f
+    def result(self):
+        with nogil:
+            self._f.wait()
+        return wrap_values(self._f.get())
+
+cdef class _GetManyFuture(object):
+    cdef cpp.shared_future[cpp.GetManyResult] _f
+    def result(self):
+        with nogil:
+            self._f.wait()
+        cdef cpp.GetManyResult res = self._f.get()
+        ret = {}
+        cdef InfoHash h
+        for r in res:
+            h = InfoHash()
+            h._infohash = r.first
+            ret[h] = wrap_values(r.second)
+        return ret
+
+cdef class _PutManyFuture(object):
+    cdef cpp.shared_future[cpp.vector[bool]] _f
+    def result(self):
+        with nogil:
+            self._f.wait()
+        cdef cpp.vector[bool] res = self._f.get()
+        return [ok for ok in res]
 
 cdef class NodeSetIter(object):
     cdef map[cpp.InfoHash, cpp.shared_ptr[cpp.Node]]* _nodes
@@ -252,6 +312,8 @@ cdef class DhtConfig(object):
         self._config.dht_config.node_config.is_bootstrap = bootstrap
     def setNodeId(self, InfoHash id):
         self._config.dht_config.node_config.node_id = id._infohash
+    def setMaxSearches(self, unsigned max_searches):
+        self._config.dht_config.node_config.max_searches = max_searches
 
 cdef class DhtRunner(_WithID):
     cdef cpp.DhtRunner* thisptr
@@ -264,39 +326,64 @@ cdef class DhtRunner(_WithID):
     def getNodeId(self):
         return self.thisptr.getNodeId().toString()
     def bootstrap(self, str host, str port):
-        self.thisptr.bootstrap(host.encode(), port.encode())
+        cdef string h = host.encode()
+        cdef string p = port.encode()
+        with nogil:
+            self.thisptr.bootstrap(h.c_str(), p.c_str())
     def run(self, Identity id=None, is_bootstrap=False, cpp.in_port_t port=0, str ipv4="", str ipv6="", DhtConfig config=DhtConfig()):
         if id:
             config.setIdentity(id)
+        cdef cpp.Config c = config._config
+        cdef string bind4 = ipv4.encode()
+        cdef string bind6 = ipv6.encode()
+        cdef string service = str(port).encode()
         if ipv4 or ipv6:
-            bind4 = ipv4.encode() if ipv4 else b''
-            bind6 = ipv6.encode() if ipv6 else b''
-            self.thisptr.run(bind4, bind6, str(port).encode(), config._config)
+            with nogil:
+                self.thisptr.run(bind4.c_str(), bind6.c_str(), service.c_str(), c)
         else:
-            self.thisptr.run(port, config._config)
+            with nogil:
+                self.thisptr.run(port, c)
     def join(self):
-        self.thisptr.join()
+        with nogil:
+            self.thisptr.join()
     def shutdown(self, shutdown_cb=None):
         cb_obj = {'shutdown':shutdown_cb}
         ref.Py_INCREF(cb_obj)
-        self.thisptr.shutdown(cpp.Dht.bindShutdownCb(shutdown_callback, <void*>cb_obj))
+        cdef cpp.Dht.ShutdownCallback cb = cpp.Dht.bindShutdownCb(shutdown_callback, <void*>cb_obj)
+        with nogil:
+            self.thisptr.shutdown(cb)
     def enableLogging(self):
-        cpp.enableLogging(self.thisptr[0])
+        with nogil:
+            cpp.enableLogging(self.thisptr[0])
     def disableLogging(self):
-        cpp.disableLogging(self.thisptr[0])
+        with nogil:
+            cpp.disableLogging(self.thisptr[0])
     def enableFileLogging(self, str path):
-        cpp.enableFileLogging(self.thisptr[0], path)
+        cdef string p = path.encode()
+        with nogil:
+            cpp.enableFileLogging(self.thisptr[0], p)
     def isRunning(self):
         return self.thisptr.isRunning()
     def getStorageLog(self):
-        return self.thisptr.getStorageLog().decode()
+        cdef string log
+        with nogil:
+            log = self.thisptr.getStorageLog()
+        return log.decode()
     def getRoutingTablesLog(self, cpp.sa_family_t af):
-        return self.thisptr.getRoutingTablesLog(af).decode()
+        cdef string log
+        with nogil:
+            log = self.thisptr.getRoutingTablesLog(af)
+        return log.decode()
     def getSearchesLog(self, cpp.sa_family_t af):
-        return self.thisptr.getSearchesLog(af).decode()
+        cdef string log
+        with nogil:
+            log = self.thisptr.getSearchesLog(af)
+        return log.decode()
     def getNodeMessageStats(self):
         stats = []
-        cdef cpp.vector[unsigned] res = self.thisptr.getNodeMessageStats(False)
+        cdef cpp.vector[unsigned] res
+        with nogil:
+            res = self.thisptr.getNodeMessageStats(False)
         for n in res:
             stats.append(n)
         return stats
@@ -308,29 +395,60 @@ cdef class DhtRunner(_WithID):
         get_cb -- is set, makes the operation non-blocking. Called when a value is found on the DHT.
         done_cb -- optional callback used when get_cb is set. Called when the operation is completed.
         """
+        cdef cpp.InfoHash h = key._infohash
+        cdef cpp.Dht.GetCallback gcb
+        cdef cpp.Dht.DoneCallback dcb
+        cdef _ValuesFuture f
         if get_cb:
             cb_obj = {'get':get_cb, 'done':done_cb}
             ref.Py_INCREF(cb_obj)
-            self.thisptr.get(key._infohash, cpp.Dht.bindGetCb(get_callback, <void*>cb_obj), cpp.Dht.bindDoneCb(done_callback, <void*>cb_obj))
+            gcb = cpp.Dht.bindGetCb(get_callback, <void*>cb_obj)
+            dcb = cpp.Dht.bindDoneCb(done_callback, <void*>cb_obj)
+            with nogil:
+                self.thisptr.get(h, gcb, dcb)
         else:
-            lock = threading.Condition()
-            pending = 0
-            res = []
-            def tmp_get(v):
-                nonlocal res
-                res.append(v)
-                return True
-            def tmp_done(ok, nodes):
-                nonlocal pending, lock
-                with lock:
-                    pending -= 1
-                    lock.notify()
-            with lock:
-                pending += 1
-                self.get(key, get_cb=tmp_get, done_cb=tmp_done)
-                while pending > 0:
-                    lock.wait()
-            return res
+            # wait on the future without the GIL, and convert the values
+            # at once rather than taking the GIL for each of them
+            f = _ValuesFuture()
+            f._f = self.thisptr.get(h).share()
+            return f.result()
+    def getAsync(self, InfoHash key, loop=None):
+        """Same as get, returning an asyncio future of the list of values found.
+
+        The future is resolved on loop, or the current event loop.
+        """
+        loop = _event_loop(loop)
+        fut = loop.create_future()
+        res = []
+        def tmp_get(v):
+            res.append(v)
+            return True
+        def tmp_done(ok, nodes):
+            loop.call_soon_threadsafe(_resolve, fut, res)
+        self.get(key, get_cb=tmp_get, done_cb=tmp_done)
+        return fut
+    def getMany(self, keys):
+        """Retreive the values associated with several keys on the DHT,
+        running at most Dht.BATCH_CONCURRENCY searches at once.
+
+        keys -- an iterable of keys
+        Returns a dict mapping each key to the list of values found.
+        """
+        return self._getMany(keys).result()
+    def getManyAsync(self, keys, loop=None):
+        """Same as getMany, returning an asyncio future of the result.
+
+        The batch is awaited in the default executor of loop.
+        """
+        loop = _event_loop(loop)
+        return loop.run_in_executor(None, self._getMany(keys).result)
+    def _getMany(self, keys):
+        cdef cpp.vector[cpp.InfoHash] k
+        for key in keys:
+            k.push_back((<InfoHash?>key)._infohash)
+        cdef _GetManyFuture f = _GetManyFuture()
+        f._f = self.thisptr.getMany(k).share()
+        return f
     def put(self, InfoHash key, Value val, done_cb=None):
         """Publish a new value on the DHT at key.
 
@@ -340,7 +458,44 @@ cdef class DhtRunner(_WithID):
         """
         cb_obj = {'done':done_cb}
         ref.Py_INCREF(cb_obj)
-        self.thisptr.put(key._infohash, val._value, cpp.Dht.bindDoneCb(done_callback, <void*>cb_obj))
+        cdef cpp.Dht.DoneCallback dcb = cpp.Dht.bindDoneCb(done_callback, <void*>cb_obj)
+        cdef cpp.InfoHash h = key._infohash
+        cdef cpp.shared_ptr[cpp.Value] v = val._value
+        with nogil:
+            self.thisptr.put(h, v, dcb)
+    def putAsync(self, InfoHash key, Value val, loop=None):
+        """Same as put, returning an asyncio future of the success of the operation."""
+        loop = _event_loop(loop)
+        fut = loop.create_future()
+        def tmp_done(ok, nodes):
+            loop.call_soon_threadsafe(_resolve, fut, ok)
+        self.put(key, val, done_cb=tmp_done)
+        return fut
+    def putMany(self, values):
+        """Publish several values on the DHT, running at most
+        Dht.BATCH_CONCURRENCY puts at once.
+
+        values -- an iterable of (key, value) pairs
+        Returns the list of the success of each put.
+        """
+        return self._putMany(values).result()
+    def putManyAsync(self, values, loop=None):
+        """Same as putMany, returning an asyncio future of the result.
+
+        The batch is awaited in the default executor of loop.
+        """
+        loop = _event_loop(loop)
+        return loop.run_in_executor(None, self._putMany(values).result)
+    def _putMany(self, values):
+        cdef cpp.vector[cpp.pair[cpp.InfoHash, cpp.shared_ptr[cpp.Value]]] v
+        cdef cpp.pair[cpp.InfoHash, cpp.shared_ptr[cpp.Value]] p
+        for key, val in values:
+            p.first = (<InfoHash?>key)._infohash
+            p.second = (<Value?>val)._value
+            v.push_back(p)
+        cdef _PutManyFuture f = _PutManyFuture()
+        f._f = self.thisptr.putMany(v).share()
+        return f
     def listen(self, InfoHash key, get_cb):
         t = ListenToken()
         t._h = key._infohash
@@ -351,6 +506,9 @@ cdef class DhtRunner(_WithID):
         t._t = self.thisptr.listen(t._h, cpp.Dht.bindGetCb(get_callback, <void*>cb_obj)).share()
         return t
     def cancelListen(self, ListenToken token):
-        self.thisptr.cancelListen(token._h, token._t)
+        cdef cpp.InfoHash h = token._h
+        cdef cpp.SharedListenToken t = token._t
+        with nogil:
+            self.thisptr.cancelListen(h, t)
         ref.Py_DECREF(<object>token._cb['cb'])
         # fixme: not thread safe
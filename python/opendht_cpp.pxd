@@ -20,6 +20,7 @@ from libcpp cimport bool
 from libcpp.string cimport string
 from libcpp.vector cimport vector
 from libcpp.utility cimport pair
+from libcpp.map cimport map
 
 ctypedef uint16_t in_port_t
 ctypedef unsigned short int sa_family_t;
@@ -40,6 +41,8 @@ cdef extern from "<future>" namespace "std" nogil:
     cdef cppclass shared_future[T]:
         shared_future() except +
         bool valid() const
+        T get() except +
+        void wait() const
 
     cdef cppclass future[T]:
         future() except +
@@ -104,6 +107,7 @@ cdef extern from "opendht/dht.h" namespace "dht":
         cppclass Config:
             InfoHash node_id
             bool is_bootstrap
+            unsigned max_searches
         cppclass ShutdownCallback:
             ShutdownCallback() except +
         cppclass GetCallback:
@@ -127,9 +131,10 @@ cdef extern from "opendht/dht.h" namespace "dht":
             Dht.Config node_config
             Identity id
 
-cdef extern from "opendht/dhtrunner.h" namespace "dht":
+cdef extern from "opendht/dhtrunner.h" namespace "dht" nogil:
     ctypedef future[size_t] ListenToken
     ctypedef shared_future[size_t] SharedListenToken
+    ctypedef map[InfoHash, vector[shared_ptr[Value]]] GetManyResult
     cdef cppclass DhtRunner:
         DhtRunner() except +
         cppclass Config:
@@ -147,14 +152,17 @@ cdef extern from "opendht/dhtrunner.h" namespace "dht":
         string getRoutingTablesLog(sa_family_t af) const
         string getSearchesLog(sa_family_t af) const
         void get(InfoHash key, Dht.GetCallback get_cb, Dht.DoneCallback done_cb)
+        future[vector[shared_ptr[Value]]] get(InfoHash key)
         void put(InfoHash key, shared_ptr[Value] val, Dht.DoneCallback done_cb)
+        future[vector[bool]] putMany(vector[pair[InfoHash, shared_ptr[Value]]] values)
+        future[GetManyResult] getMany(vector[InfoHash] keys)
         ListenToken listen(InfoHash key, Dht.GetCallback get_cb)
         void cancelListen(InfoHash key, SharedListenToken token)
         vector[unsigned] getNodeMessageStats(bool i)
 
 ctypedef DhtRunner.Config Config
 
-cdef extern from "opendht/log.h" namespace "dht::log":
+cdef extern from "opendht/log.h" namespace "dht::log" nogil:
     void enableLogging(DhtRunner& dht)
     void disableLogging(DhtRunner& dht)
     void enableFileLogging(DhtRunner& dht, const string& path)
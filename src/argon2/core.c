@@ -236,6 +236,19 @@ uint32_t index_alpha(const argon2_instance_t *instance,
     return absolute_position;
 }
 
+void fill_segment(const argon2_instance_t *instance,
+                  argon2_position_t position) {
+#ifdef ARGON2_OPT
+    /* opt.c is built with SSSE3 enabled */
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        fill_segment_opt(instance, position);
+        return;
+    }
+#endif
+    fill_segment_ref(instance, position);
+}
+
 #ifdef _WIN32
 static unsigned __stdcall fill_segment_thr(void *thread_data)
 #else
@@ -274,6 +287,19 @@ int fill_memory_blocks(argon2_instance_t *instance) {
             int rc;
             uint32_t l;
 
+            /* Single thread: fill the lanes in this thread */
+            if (instance->threads == 1) {
+                for (l = 0; l < instance->lanes; ++l) {
+                    argon2_position_t position;
+                    position.pass = r;
+                    position.lane = l;
+                    position.slice = (uint8_t)s;
+                    position.index = 0;
+                    fill_segment(instance, position);
+                }
+                continue;
+            }
+
             /* 2. Calling threads */
             for (l = 0; l < instance->lanes; ++l) {
                 argon2_position_t position;
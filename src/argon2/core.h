@@ -208,6 +208,16 @@ void finalize(const argon2_context *context, argon2_instance_t *instance);
 void fill_segment(const argon2_instance_t *instance,
                   argon2_position_t position);
 
+/*
+ * Implementations of fill_segment: portable (ref.c) and SSE (opt.c, built
+ * when ARGON2_OPT is defined). fill_segment calls the fastest one
+ * supported by the CPU.
+ */
+void fill_segment_ref(const argon2_instance_t *instance,
+                      argon2_position_t position);
+void fill_segment_opt(const argon2_instance_t *instance,
+                      argon2_position_t position);
+
 /*
  * Function that fills the entire memory t_cost times based on the first two
  * blocks in each lane
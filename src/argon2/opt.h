@@ -15,6 +15,11 @@
 #define ARGON2_OPT_H
 
 #include "core.h"
+
+/* ref.c and opt.c are linked together */
+#define fill_block fill_block_opt
+#define fill_block_with_xor fill_block_with_xor_opt
+#define generate_addresses generate_addresses_opt
 #include <emmintrin.h>
 
 /*
@@ -130,7 +130,7 @@ void generate_addresses(const argon2_instance_t *instance,
     }
 }
 
-void fill_segment(const argon2_instance_t *instance,
+void fill_segment_ref(const argon2_instance_t *instance,
                   argon2_position_t position) {
     block *ref_block = NULL, *curr_block = NULL;
     uint64_t pseudo_rand, ref_index, ref_lane;
@@ -16,6 +16,11 @@
 
 #include "core.h"
 
+/* ref.c and opt.c are linked together */
+#define fill_block fill_block_ref
+#define fill_block_with_xor fill_block_with_xor_ref
+#define generate_addresses generate_addresses_ref
+
 /*
  * Function fills a new memory block by XORing over @next_block. @next_block must be initialized
  * @param prev_block Pointer to the previous block
@@ -101,71 +101,88 @@ bool aesKeySizeGood(size_t key_size)
 #define GCM_DIGEST_SIZE GCM_BLOCK_SIZE
 #endif
 
-Blob aesEncrypt(const Blob& data, const Blob& key)
+/**
+ * AES-GCM encryption of data_sz bytes from data to out, that must
+ * have room for data_sz + GCM_IV_SIZE + GCM_DIGEST_SIZE bytes.
+ */
+static void
+aesEncrypt(const uint8_t* data, size_t data_sz, const Blob& key, uint8_t* out)
 {
     if (not aesKeySizeGood(key.size()))
         throw DecryptError("Wrong key size");
 
-    Blob ret(data.size() + GCM_IV_SIZE + GCM_DIGEST_SIZE);
     {
         crypto::random_device rdev;
-        std::generate_n(ret.begin(), GCM_IV_SIZE, std::bind(rand_byte, std::ref(rdev)));
+        std::generate_n(out, GCM_IV_SIZE, std::bind(rand_byte, std::ref(rdev)));
     }
     struct gcm_aes_ctx aes;
     gcm_aes_set_key(&aes, key.size(), key.data());
-    gcm_aes_set_iv(&aes, GCM_IV_SIZE, ret.data());
-    gcm_aes_update(&aes, data.size(), data.data());
+    gcm_aes_set_iv(&aes, GCM_IV_SIZE, out);
+    gcm_aes_update(&aes, data_sz, data);
 
-    gcm_aes_encrypt(&aes, data.size(), ret.data() + GCM_IV_SIZE, data.data());
-    gcm_aes_digest(&aes, GCM_DIGEST_SIZE, ret.data() + GCM_IV_SIZE + data.size());
-    return ret;
+    gcm_aes_encrypt(&aes, data_sz, out + GCM_IV_SIZE, data);
+    gcm_aes_digest(&aes, GCM_DIGEST_SIZE, out + GCM_IV_SIZE + data_sz);
 }
 
-Blob aesEncrypt(const Blob& data, const std::string& password)
-{
-    Blob salt;
-    Blob key = stretchKey(password, salt);
-    key.resize(256 / 8);
-    Blob encrypted = aesEncrypt(data, key);
-    encrypted.insert(encrypted.begin(), salt.begin(), salt.end());
-    return encrypted;
-}
-
-Blob aesDecrypt(const Blob& data, const Blob& key)
+static Blob
+aesDecrypt(const uint8_t* data, size_t size, const Blob& key)
 {
     if (not aesKeySizeGood(key.size()))
         throw DecryptError("Wrong key size");
 
-    if (data.size() <= GCM_IV_SIZE + GCM_DIGEST_SIZE)
+    if (size <= GCM_IV_SIZE + GCM_DIGEST_SIZE)
         throw DecryptError("Wrong data size");
 
     std::array<uint8_t, GCM_DIGEST_SIZE> digest;
 
     struct gcm_aes_ctx aes;
     gcm_aes_set_key(&aes, key.size(), key.data());
-    gcm_aes_set_iv(&aes, GCM_IV_SIZE, data.data());
+    gcm_aes_set_iv(&aes, GCM_IV_SIZE, data);
 
-    size_t data_sz = data.size() - GCM_IV_SIZE - GCM_DIGEST_SIZE;
+    size_t data_sz = size - GCM_IV_SIZE - GCM_DIGEST_SIZE;
     Blob ret(data_sz);
-    //gcm_aes_update(&aes, data_sz, data.data() + GCM_IV_SIZE);
-    gcm_aes_decrypt(&aes, data_sz, ret.data(), data.data() + GCM_IV_SIZE);
+    //gcm_aes_update(&aes, data_sz, data + GCM_IV_SIZE);
+    gcm_aes_decrypt(&aes, data_sz, ret.data(), data + GCM_IV_SIZE);
     //gcm_aes_digest(aes, GCM_DIGEST_SIZE, digest.data());
 
     // TODO compute the proper digest directly from the decryption pass
     Blob ret_tmp(data_sz);
     struct gcm_aes_ctx aes_d;
     gcm_aes_set_key(&aes_d, key.size(), key.data());
-    gcm_aes_set_iv(&aes_d, GCM_IV_SIZE, data.data());
+    gcm_aes_set_iv(&aes_d, GCM_IV_SIZE, data);
     gcm_aes_update(&aes_d, ret.size(), ret.data());
     gcm_aes_encrypt(&aes_d, ret.size(), ret_tmp.data(), ret.data());
     gcm_aes_digest(&aes_d, GCM_DIGEST_SIZE, digest.data());
 
-    if (not std::equal(digest.begin(), digest.end(), data.end() - GCM_DIGEST_SIZE))
+    if (not std::equal(digest.begin(), digest.end(), data + size - GCM_DIGEST_SIZE))
         throw DecryptError("Can't decrypt data");
 
     return ret;
 }
 
+Blob aesEncrypt(const Blob& data, const Blob& key)
+{
+    Blob ret(data.size() + GCM_IV_SIZE + GCM_DIGEST_SIZE);
+    aesEncrypt(data.data(), data.size(), key, ret.data());
+    return ret;
+}
+
+Blob aesEncrypt(const Blob& data, const std::string& password)
+{
+    Blob salt;
+    Blob key = stretchKey(password, salt);
+    key.resize(256 / 8);
+    Blob encrypted(salt.size() + data.size() + GCM_IV_SIZE + GCM_DIGEST_SIZE);
+    std::copy(salt.begin(), salt.end(), encrypted.begin());
+    aesEncrypt(data.data(), data.size(), key, encrypted.data() + salt.size());
+    return encrypted;
+}
+
+Blob aesDecrypt(const Blob& data, const Blob& key)
+{
+    return aesDecrypt(data.data(), data.size(), key);
+}
+
 Blob aesDecrypt(const Blob& data, const std::string& password)
 {
     if (data.size() <= PASSWORD_SALT_LENGTH)
@@ -173,20 +190,36 @@ Blob aesDecrypt(const Blob& data, const std::string& password)
     Blob salt {data.begin(), data.begin()+PASSWORD_SALT_LENGTH};
     Blob key = stretchKey(password, salt);
     key.resize(256 / 8);
-    Blob encrypted {data.begin()+PASSWORD_SALT_LENGTH, data.end()};
-    return aesDecrypt(encrypted, key);
+    return aesDecrypt(data.data()+PASSWORD_SALT_LENGTH, data.size()-PASSWORD_SALT_LENGTH, key);
 }
 
-Blob stretchKey(const std::string& password, Blob& salt)
+Blob stretchKey(const std::string& password, Blob& salt, unsigned lanes, unsigned threads)
 {
     if (salt.empty()) {
         salt.resize(PASSWORD_SALT_LENGTH);
         crypto::random_device rdev;
         std::generate_n(salt.begin(), salt.size(), std::bind(rand_byte, std::ref(rdev)));
     }
+    if (lanes == 0)
+        lanes = 1;
+    if (threads == 0 or threads > lanes)
+        threads = lanes;
     Blob res;
     res.resize(32);
-    auto ret = argon2i_hash_raw(16, 64*1024, 1, password.data(), password.size(), salt.data(), salt.size(), res.data(), res.size());
+    argon2_context ctx {};
+    ctx.out = res.data();
+    ctx.outlen = (uint32_t)res.size();
+    ctx.pwd = (uint8_t*)password.data();
+    ctx.pwdlen = (uint32_t)password.size();
+    ctx.salt = salt.data();
+    ctx.saltlen = (uint32_t)salt.size();
+    ctx.t_cost = 16;
+    ctx.m_cost = 64*1024;
+    ctx.lanes = lanes;
+    ctx.threads = threads;
+    ctx.version = ARGON2_VERSION_NUMBER;
+    ctx.flags = ARGON2_DEFAULT_FLAGS;
+    auto ret = argon2i_ctx(&ctx);
     if (ret != ARGON2_OK)
         throw CryptoException("Can't compute argon2i !");
     return hash(res);
@@ -348,7 +381,7 @@ PrivateKey::decrypt(const Blob& cipher) const
     else if (cipher.size() == cypher_block_sz)
         return decryptBloc(cipher.data(), cypher_block_sz);
 
-    return aesDecrypt(Blob {cipher.begin() + cypher_block_sz, cipher.end()}, decryptBloc(cipher.data(), cypher_block_sz));
+    return aesDecrypt(cipher.data() + cypher_block_sz, cipher.size() - cypher_block_sz, decryptBloc(cipher.data(), cypher_block_sz));
 }
 
 Blob
@@ -448,7 +481,10 @@ PublicKey::checkSignature(const Blob& data, const Blob& signature) const
         return false;
     const gnutls_datum_t sig {(uint8_t*)signature.data(), (unsigned)signature.size()};
     const gnutls_datum_t dat {(uint8_t*)data.data(), (unsigned)data.size()};
-    int rc = gnutls_pubkey_verify_data2(pk, GNUTLS_SIGN_RSA_SHA512, 0, &dat, &sig);
+    // PrivateKey::sign always uses SHA512
+    auto sign_algo = gnutls_pubkey_get_pk_algorithm(pk, nullptr) == GNUTLS_PK_EC ?
+                        GNUTLS_SIGN_ECDSA_SHA512 : GNUTLS_SIGN_RSA_SHA512;
+    int rc = gnutls_pubkey_verify_data2(pk, sign_algo, 0, &dat, &sig);
     return rc >= 0;
 }
 
@@ -500,14 +536,11 @@ PublicKey::encrypt(const Blob& data) const
         crypto::random_device rdev;
         std::generate_n(key.begin(), key.size(), std::bind(rand_byte, std::ref(rdev)));
     }
-    auto data_encrypted = aesEncrypt(data, key);
 
-    Blob ret;
-    ret.reserve(cypher_block_sz + data_encrypted.size());
-
-    ret.resize(cypher_block_sz);
+    // RSA encrypted key, followed by the AES-GCM encrypted data
+    Blob ret(cypher_block_sz + GCM_IV_SIZE + data.size() + GCM_DIGEST_SIZE);
     encryptBloc(key.data(), key.size(), ret.data(), cypher_block_sz);
-    ret.insert(ret.end(), data_encrypted.begin(), data_encrypted.end());
+    aesEncrypt(data.data(), data.size(), key, ret.data() + cypher_block_sz);
     return ret;
 }
 
@@ -747,6 +780,25 @@ PrivateKey::generate(unsigned key_length)
     return PrivateKey{key};
 }
 
+PrivateKey
+PrivateKey::generateEC()
+{
+#if GNUTLS_VERSION_NUMBER < 0x030300
+    if (gnutls_global_init() != GNUTLS_E_SUCCESS)
+        throw CryptoException("Can't initialize GnuTLS.");
+#endif
+    gnutls_x509_privkey_t key;
+    if (gnutls_x509_privkey_init(&key) != GNUTLS_E_SUCCESS)
+        throw CryptoException("Can't initialize private key.");
+    // 256 bits selects the SECP256R1 (P-256) curve
+    int err = gnutls_x509_privkey_generate(key, GNUTLS_PK_EC, 256, 0);
+    if (err != GNUTLS_E_SUCCESS) {
+        gnutls_x509_privkey_deinit(key);
+        throw CryptoException(std::string("Can't generate EC key pair: ") + gnutls_strerror(err));
+    }
+    return PrivateKey{key};
+}
+
 Identity
 generateIdentity(const std::string& name, crypto::Identity ca, unsigned key_length, bool is_ca)
 {
@@ -770,6 +822,28 @@ generateIdentity(const std::string& name, Identity ca, unsigned key_length) {
     return generateIdentity(name, ca, key_length, !ca.first || !ca.second);
 }
 
+Identity
+generateEcIdentity(const std::string& name, crypto::Identity ca, bool is_ca)
+{
+#if GNUTLS_VERSION_NUMBER < 0x030300
+    if (gnutls_global_init() != GNUTLS_E_SUCCESS)
+        return {};
+#endif
+    auto key = std::make_shared<PrivateKey>(PrivateKey::generateEC());
+
+    auto cert = std::make_shared<Certificate>(Certificate::generate(*key, name, ca, is_ca));
+
+#if GNUTLS_VERSION_NUMBER < 0x030300
+    gnutls_global_deinit();
+#endif
+    return {std::move(key), std::move(cert)};
+}
+
+Identity
+generateEcIdentity(const std::string& name, Identity ca) {
+    return generateEcIdentity(name, ca, !ca.first || !ca.second);
+}
+
 Certificate
 Certificate::generate(const PrivateKey& key, const std::string& name, Identity ca, bool is_ca)
 {
@@ -804,7 +878,9 @@ Certificate::generate(const PrivateKey& key, const std::string& name, Identity c
         gnutls_x509_crt_set_serial(cert, &cert_serial, sizeof(cert_serial));
     }
 
-    unsigned key_usage = GNUTLS_KEY_DIGITAL_SIGNATURE | GNUTLS_KEY_DATA_ENCIPHERMENT;
+    unsigned key_usage = GNUTLS_KEY_DIGITAL_SIGNATURE;
+    if (gnutls_x509_privkey_get_pk_algorithm(key.x509_key) == GNUTLS_PK_RSA)
+        key_usage |= GNUTLS_KEY_DATA_ENCIPHERMENT;
     if (is_ca) {
         gnutls_x509_crt_set_ca_status(cert, 1);
         key_usage |= GNUTLS_KEY_KEY_CERT_SIGN | GNUTLS_KEY_CRL_SIGN;
@@ -35,13 +35,16 @@ extern "C" {
 
 #ifndef _WIN32
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #else
 #include <ws2tcpip.h>
 #endif
 
 #include <algorithm>
+#include <numeric>
 #include <random>
 #include <sstream>
+#include <iostream>
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -51,6 +54,11 @@ extern "C" {
 #define MSG_CONFIRM 0
 #endif
 
+// Log arguments are only evaluated if the level is enabled
+#define DHT_DEBUG(...) DHT_LOG(DHT_DEBUG, __VA_ARGS__)
+#define DHT_WARN(...) DHT_LOG(DHT_WARN, __VA_ARGS__)
+#define DHT_ERROR(...) DHT_LOG(DHT_ERROR, __VA_ARGS__)
+
 #ifdef _WIN32
 
 static bool
@@ -133,6 +141,119 @@ print_dt(DT d) {
     return std::chrono::duration_cast<std::chrono::duration<double>>(d).count();
 }
 
+/**
+ * Allocation-free comparison of a msgpack string object with a literal.
+ */
+template <size_t N>
+static inline bool
+keyEquals(const msgpack::object& o, const char (&key)[N])
+{
+    return o.type == msgpack::type::STR
+        && o.via.str.size == N-1
+        && std::memcmp(o.via.str.ptr, key, N-1) == 0;
+}
+
+/**
+ * Pack a string literal without building a temporary std::string.
+ */
+template <size_t N>
+static inline void
+packStr(msgpack::packer<msgpack::sbuffer>& pk, const char (&str)[N])
+{
+    pk.pack_str(N-1);
+    pk.pack_str_body(str, N-1);
+}
+
+msgpack::object* findMapValue(const msgpack::object& map, const std::string& key);
+
+/**
+ * Keep strings and binary fields of received messages in the receive buffer
+ * instead of copying them to the msgpack zone.
+ */
+static bool
+referenceAll(msgpack::type::object_type, size_t, void*)
+{
+    return true;
+}
+
+/* SipHash-2-4, with 128 bits output */
+
+static inline uint64_t
+rotl64(uint64_t x, unsigned b)
+{
+    return (x << b) | (x >> (64 - b));
+}
+
+static inline uint64_t
+readLe64(const uint8_t* p)
+{
+    uint64_t r = 0;
+    for (unsigned i = 0; i < 8; i++)
+        r |= (uint64_t)p[i] << (8 * i);
+    return r;
+}
+
+static inline void
+writeLe64(uint64_t v, uint8_t* p)
+{
+    for (unsigned i = 0; i < 8; i++)
+        p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static inline void
+sipRound(std::array<uint64_t, 4>& v)
+{
+    v[0] += v[1]; v[1] = rotl64(v[1], 13); v[1] ^= v[0]; v[0] = rotl64(v[0], 32);
+    v[2] += v[3]; v[3] = rotl64(v[3], 16); v[3] ^= v[2];
+    v[0] += v[3]; v[3] = rotl64(v[3], 21); v[3] ^= v[0];
+    v[2] += v[1]; v[1] = rotl64(v[1], 17); v[1] ^= v[2]; v[2] = rotl64(v[2], 32);
+}
+
+/**
+ * Initial state for a given key, computed once per key.
+ */
+static std::array<uint64_t, 4>
+sipInit(const std::array<uint8_t, 16>& key)
+{
+    const uint64_t k0 = readLe64(key.data());
+    const uint64_t k1 = readLe64(key.data() + 8);
+    return {{
+        k0 ^ 0x736f6d6570736575ULL,
+        k1 ^ 0x646f72616e646f6dULL ^ 0xee,
+        k0 ^ 0x6c7967656e657261ULL,
+        k1 ^ 0x7465646279746573ULL
+    }};
+}
+
+static void
+sipHash128(std::array<uint64_t, 4> v, const uint8_t* data, size_t len, uint8_t* out)
+{
+    const uint8_t* end = data + (len - len % 8);
+    for (; data != end; data += 8) {
+        uint64_t m = readLe64(data);
+        v[3] ^= m;
+        sipRound(v);
+        sipRound(v);
+        v[0] ^= m;
+    }
+    uint64_t b = (uint64_t)len << 56;
+    for (unsigned i = 0; i < len % 8; i++)
+        b |= (uint64_t)data[i] << (8 * i);
+    v[3] ^= b;
+    sipRound(v);
+    sipRound(v);
+    v[0] ^= b;
+
+    v[2] ^= 0xee;
+    for (unsigned i = 0; i < 4; i++)
+        sipRound(v);
+    writeLe64(v[0] ^ v[1] ^ v[2] ^ v[3], out);
+    v[1] ^= 0xdd;
+    for (unsigned i = 0; i < 4; i++)
+        sipRound(v);
+    writeLe64(v[0] ^ v[1] ^ v[2] ^ v[3], out + 8);
+}
+
 namespace dht {
 
 const Dht::TransPrefix Dht::TransPrefix::PING = {"pn"};
@@ -143,6 +264,11 @@ const Dht::TransPrefix Dht::TransPrefix::LISTEN  = {"lt"};
 
 const std::string Dht::my_v = "RNG1";
 
+/* nodes of the storage in the store map and in the maintenance queue */
+const size_t Dht::STORAGE_MEMORY_OVERHEAD {
+    sizeof(std::pair<const InfoHash, Storage>) + sizeof(std::pair<time_point, InfoHash>) + 8 * sizeof(void*)
+};
+
 static constexpr InfoHash zeroes {};
 static constexpr InfoHash ones = {std::array<uint8_t, HASH_LEN>{{
     0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
@@ -153,6 +279,7 @@ static constexpr InfoHash ones = {std::array<uint8_t, HASH_LEN>{{
 constexpr std::chrono::minutes Node::NODE_EXPIRE_TIME;
 constexpr std::chrono::minutes Node::NODE_GOOD_TIME;
 constexpr std::chrono::seconds Node::MAX_RESPONSE_TIME;
+constexpr std::chrono::milliseconds Node::MIN_RESPONSE_TIME;
 
 constexpr std::chrono::seconds Dht::SEARCH_GET_STEP;
 constexpr std::chrono::minutes Dht::MAX_STORAGE_MAINTENANCE_EXPIRE_TIME;
@@ -161,6 +288,33 @@ constexpr std::chrono::seconds Dht::LISTEN_EXPIRE_TIME;
 constexpr std::chrono::seconds Dht::REANNOUNCE_MARGIN;
 constexpr std::chrono::seconds Dht::UDP_REPLY_TIME;
 constexpr long unsigned Dht::MAX_REQUESTS_PER_SEC;
+constexpr long unsigned Dht::MAX_REQUESTS_PER_SEC_PER_SOURCE;
+constexpr size_t Dht::RATE_LIMIT_SOURCES_MAX;
+constexpr unsigned Dht::WARM_START_PINGS_PER_SEC;
+constexpr std::chrono::milliseconds Dht::WARM_START_INTERVAL;
+constexpr size_t Dht::SEND_BATCH_MAX;
+constexpr size_t Dht::LISTENER_PUSH_BATCH;
+constexpr std::chrono::milliseconds Dht::LISTENER_PUSH_INTERVAL;
+constexpr size_t Dht::STORAGE_MAINTENANCE_OPS;
+constexpr std::chrono::milliseconds Dht::STORAGE_MAINTENANCE_BUDGET;
+constexpr std::chrono::milliseconds Dht::STORAGE_MAINTENANCE_INTERVAL;
+constexpr std::chrono::minutes Dht::STORAGE_MAINTENANCE_SLACK;
+constexpr size_t Dht::STORAGE_MAINTENANCE_GROUP;
+constexpr size_t Dht::EVICTION_RATIO;
+constexpr size_t Dht::LOG_LOAD_BATCH;
+constexpr unsigned Dht::STATE_FORMAT_VERSION;
+constexpr size_t Dht::STATE_CHUNK_SIZE;
+constexpr size_t Dht::LOG_COMPACT_MIN;
+constexpr unsigned Dht::BATCH_CONCURRENCY;
+constexpr unsigned Dht::MAX_SEARCHES;
+constexpr unsigned Dht::MAX_SEARCHES_LIMIT;
+constexpr size_t Dht::SEARCH_POOL_SIZE;
+constexpr std::chrono::seconds Dht::GET_CACHE_WINDOW;
+constexpr unsigned Dht::SEARCH_ALPHA;
+constexpr size_t Dht::GET_CACHE_MAX;
+constexpr size_t Dht::GET_CHUNK_SIZE;
+constexpr unsigned Dht::BLACKLISTED_MAX;
+constexpr std::chrono::hours Dht::BLACKLIST_EXPIRE_TIME;
 
 void
 Dht::setLoggers(LogMethod&& error, LogMethod&& warn, LogMethod&& debug)
@@ -196,7 +350,7 @@ Dht::shutdown(ShutdownCallback cb) {
     };
 
     for (const auto& str : store) {
-        *remaining += maintainStorage(str.id, true, str_donecb);
+        *remaining += maintainStorage(str.first, true, str_donecb);
     }
     DHT_WARN("Shuting down node: %u ops remaining.", *remaining);
     if (!*remaining && cb) { cb(); }
@@ -207,11 +361,11 @@ Dht::isRunning(sa_family_t af) const
 {
     switch (af) {
     case 0:
-        return dht_socket  >= 0 ||  dht_socket6 >= 0;
+        return isRunning(AF_INET) || isRunning(AF_INET6);
     case AF_INET:
-        return dht_socket  >= 0;
+        return dht_socket  >= 0 || (transport.send && transport.ipv4);
     case AF_INET6:
-        return dht_socket6 >= 0;
+        return dht_socket6 >= 0 || (transport.send && transport.ipv6);
     default:
         return false;
     }
@@ -306,43 +460,53 @@ Dht::RoutingTable::depth(const RoutingTable::const_iterator& it) const
 std::vector<std::shared_ptr<Node>>
 Dht::RoutingTable::findClosestNodes(const InfoHash id, size_t count) const {
     std::vector<std::shared_ptr<Node>> nodes {};
-    auto bucket = findBucket(id);
-
-    if (bucket == end()) { return nodes; }
+    if (empty())
+        return nodes;
 
-    auto sortedBucketInsert = [&](const Bucket &b) {
-        for (auto n : b.nodes) {
-            auto here = std::find_if(nodes.begin(), nodes.end(),
-                [&id,&n](std::shared_ptr<Node> &node) {
-                    return id.xorCmp(n->id, node->id) < 0;
-                }
-            );
-            nodes.insert(here, n);
-        }
+    auto bucketAppend = [&](const Bucket& b) {
+        nodes.insert(nodes.end(), b.nodes.begin(), b.nodes.end());
     };
 
-    auto itn = bucket;
-    auto itp = std::prev(bucket);
-    while (nodes.size() < count && (itn != end() || itp != end())) {
-        if (itn != end()) {
-            sortedBucketInsert(*itn);
-            itn = std::next(itn);
-        }
-        if (itp != end()) {
-            sortedBucketInsert(*itp);
-            if (itp == begin()) {
-                itp = end();
-                continue;
-            }
-            itp = std::prev(itp);
-        }
-    }
+    // walk buckets outward from the one containing id
+    // until enough candidates are gathered
+    const auto pos = findBucketPos(id);
+    size_t itn = pos;
+    size_t itp = pos;
+    while (nodes.size() < count && (itn < index.size() || itp > 0)) {
+        if (itn < index.size())
+            bucketAppend(*index[itn++]);
+        if (itp > 0)
+            bucketAppend(*index[--itp]);
+    }
+
+    // only keep the count closest nodes, in order.
+    id.sortClosest(nodes, count, [](const std::shared_ptr<Node>& n) -> const InfoHash& {
+        return n->id;
+    });
+    return nodes;
+}
+
+size_t
+Dht::RoutingTable::findBucketPos(const InfoHash& id) const
+{
+    // first bucket whose lower bound is strictly greater than id
+    auto it = std::upper_bound(index_first.begin(), index_first.end(), id, [](const InfoHash& a, const InfoHash& b) {
+        return InfoHash::cmp(a, b) < 0;
+    });
+    return it == index_first.begin() ? 0 : std::distance(index_first.begin(), it) - 1;
+}
 
-    // shrink to the count closest nodes.
-    if (nodes.size() > count) {
-        nodes.resize(count);
+void
+Dht::RoutingTable::reindex()
+{
+    index_first.clear();
+    index.clear();
+    index_first.reserve(size());
+    index.reserve(size());
+    for (auto b = begin(); b != end(); ++b) {
+        index_first.emplace_back(b->first);
+        index.emplace_back(b);
     }
-    return nodes;
 }
 
 Dht::RoutingTable::iterator
@@ -350,15 +514,7 @@ Dht::RoutingTable::findBucket(const InfoHash& id)
 {
     if (empty())
         return end();
-    auto b = begin();
-    while (true) {
-        auto next = std::next(b);
-        if (next == end())
-            return b;
-        if (InfoHash::cmp(id, next->first) < 0)
-            return b;
-        b = next;
-    }
+    return index[findBucketPos(id)];
 }
 
 Dht::RoutingTable::const_iterator
@@ -442,6 +598,38 @@ Node::received(time_point now, bool answer)
     }
 }
 
+void
+Node::setExpired(time_point now)
+{
+    pinged = std::max(pinged, 3u);
+    reply_time = time_point::min();
+    pinged_time = now - MAX_RESPONSE_TIME - duration(1);
+}
+
+void
+Node::updateRtt(duration sample)
+{
+    // as TCP (RFC 6298)
+    if (rtt == duration::zero()) {
+        rtt = sample;
+        rtt_var = sample / 2;
+    } else {
+        auto delta = sample > rtt ? sample - rtt : rtt - sample;
+        rtt_var = (3 * rtt_var + delta) / 4;
+        rtt = (7 * rtt + sample) / 8;
+    }
+    if (rtt == duration::zero())
+        rtt = duration(1);
+}
+
+duration
+Node::getResponseTime() const
+{
+    if (rtt == duration::zero())
+        return MAX_RESPONSE_TIME;
+    return std::min<duration>(std::max<duration>(rtt + 4 * rtt_var, MIN_RESPONSE_TIME), MAX_RESPONSE_TIME);
+}
+
 std::ostream& operator<< (std::ostream& s, const Node& h)
 {
     s << h.id << " " << print_addr(h.ss, h.sslen);
@@ -449,18 +637,36 @@ std::ostream& operator<< (std::ostream& s, const Node& h)
 }
 
 
+size_t
+Dht::NodeCache::IdHash::operator()(const InfoHash& id) const
+{
+    std::array<uint8_t, 16> h;
+    sipHash128(state, id.data(), id.size(), h.data());
+    size_t ret;
+    std::memcpy(&ret, h.data(), sizeof(ret));
+    return ret;
+}
+
+Dht::NodeCache::NodeCache()
+{
+    crypto::random_device rdev;
+    std::array<uint8_t, 16> key;
+    std::generate_n(key.begin(), key.size(), std::bind(rand_byte, std::ref(rdev)));
+    IdHash hash;
+    hash.state = sipInit(key);
+    cache_4 = NodeMap(0, hash);
+    cache_6 = NodeMap(0, hash);
+}
+
 std::shared_ptr<Node>
 Dht::NodeCache::getNode(const InfoHash& id, sa_family_t family) {
-    auto& list = family == AF_INET ? cache_4 : cache_6;
-    for (auto n = list.begin(); n != list.end();) {
-        if (auto ln = n->lock()) {
-            if (ln->id == id)
-                return ln;
-            ++n;
-        } else {
-            n = list.erase(n);
-        }
-    }
+    auto& map = getMap(family);
+    auto n = map.find(id);
+    if (n == map.end())
+        return nullptr;
+    if (auto ln = n->second.lock())
+        return ln;
+    map.erase(n);
     return nullptr;
 }
 
@@ -479,10 +685,27 @@ Dht::NodeCache::getNode(const InfoHash& id, const sockaddr* sa, socklen_t sa_len
 }
 
 void
-Dht::NodeCache::putNode(std::shared_ptr<Node> n) {
+Dht::NodeCache::putNode(const std::shared_ptr<Node>& n) {
     if (not n) return;
-    auto& list = n->ss.ss_family == AF_INET ? cache_4 : cache_6;
-    list.push_back(n);
+    bool v4 = n->ss.ss_family == AF_INET;
+    auto& map = v4 ? cache_4 : cache_6;
+    map[n->id] = n;
+    cleanup(map, v4 ? clean_size_4 : clean_size_6);
+}
+
+void
+Dht::NodeCache::cleanup(NodeMap& map, size_t& clean_size)
+{
+    static constexpr size_t MIN_CLEAN_SIZE {64};
+    if (map.size() < 2 * std::max(clean_size, MIN_CLEAN_SIZE))
+        return;
+    for (auto n = map.begin(); n != map.end();) {
+        if (n->second.expired())
+            n = map.erase(n);
+        else
+            ++n;
+    }
+    clean_size = map.size();
 }
 
 void
@@ -492,13 +715,13 @@ Dht::NodeCache::clearBadNodes(sa_family_t family)
         clearBadNodes(AF_INET);
         clearBadNodes(AF_INET6);
     } else {
-        auto& list = family == AF_INET ? cache_4 : cache_6;
-        for (auto n = list.begin(); n != list.end();) {
-            if (auto ln = n->lock()) {
+        auto& map = getMap(family);
+        for (auto n = map.begin(); n != map.end();) {
+            if (auto ln = n->second.lock()) {
                 ln->pinged = 0;
                 ++n;
             } else {
-                n = list.erase(n);
+                n = map.erase(n);
             }
         }
     }
@@ -535,8 +758,157 @@ Dht::pinged(Node& n, Bucket* b)
     }
 }
 
-/* The internal blacklist is an LRU cache of nodes that have sent
-   incorrect messages. */
+bool
+Dht::Blacklist::makeKey(const sockaddr* sa, socklen_t salen, Key& key)
+{
+    if (sa->sa_family == AF_INET) {
+        if (salen < sizeof(sockaddr_in))
+            return false;
+        const sockaddr_in* sin = (const sockaddr_in*)sa;
+        std::copy_n(v4prefix, 12, key.addr.begin());
+        std::copy_n((const uint8_t*)&sin->sin_addr, 4, key.addr.begin() + 12);
+        key.port = sin->sin_port;
+    } else if (sa->sa_family == AF_INET6) {
+        if (salen < sizeof(sockaddr_in6))
+            return false;
+        const sockaddr_in6* sin6 = (const sockaddr_in6*)sa;
+        std::copy_n((const uint8_t*)&sin6->sin6_addr, 16, key.addr.begin());
+        key.port = sin6->sin6_port;
+    } else
+        return false;
+    key.prefix_len = 128;
+    return true;
+}
+
+void
+Dht::Blacklist::maskKey(Key& key, unsigned prefix_len)
+{
+    key.prefix_len = prefix_len;
+    for (unsigned i = prefix_len / 8; i < key.addr.size(); i++) {
+        unsigned bits = (i == prefix_len / 8) ? prefix_len % 8 : 0;
+        key.addr[i] &= (uint8_t)(0xFF00 >> bits);
+    }
+}
+
+size_t
+Dht::Blacklist::KeyHash::operator()(const Key& k) const
+{
+    uint64_t a, b;
+    std::memcpy(&a, k.addr.data(), sizeof(a));
+    std::memcpy(&b, k.addr.data() + sizeof(a), sizeof(b));
+    uint64_t h = a * 0x9E3779B97F4A7C15ULL;
+    h ^= (b + (((uint64_t)k.port << 8) | k.prefix_len)) * 0xC2B2AE3D27D4EB4FULL;
+    return h ^ (h >> 29);
+}
+
+void
+Dht::Blacklist::add(const sockaddr* sa, socklen_t salen, unsigned prefix_len, time_point expiration)
+{
+    Key key;
+    if (not makeKey(sa, salen, key))
+        return;
+    if (sa->sa_family == AF_INET and prefix_len)
+        prefix_len = std::min(prefix_len, 32u) + 96;
+    if (prefix_len and prefix_len < 128)
+        maskKey(key, std::min(prefix_len, 128u));
+
+    auto it = entries.find(key);
+    if (it != entries.end()) {
+        if (it->second >= expiration)
+            return;
+        it->second = expiration;
+    } else {
+        if (entries.size() >= BLACKLISTED_MAX) {
+            // drop the entry expiring first, or the oldest permanent one
+            while (not expirations.empty()) {
+                auto e = expirations.begin();
+                auto eit = entries.find(e->second);
+                bool current = eit != entries.end() and eit->second == e->first;
+                expirations.erase(e);
+                if (current) {
+                    erase(eit);
+                    break;
+                }
+            }
+        }
+        entries.emplace(key, expiration);
+        if (prefix_count[key.prefix_len]++ == 0) {
+            prefixes.emplace_back(key.prefix_len);
+            // check most specific prefixes first
+            std::sort(prefixes.begin(), prefixes.end(), std::greater<uint8_t>());
+        }
+    }
+    // permanent entries are indexed too, last, so they count toward
+    // BLACKLISTED_MAX and can be evicted once no other entry is left
+    expirations.emplace(expiration, key);
+}
+
+void
+Dht::Blacklist::erase(std::unordered_map<Key, time_point, KeyHash>::iterator it)
+{
+    auto plen = it->first.prefix_len;
+    entries.erase(it);
+    if (--prefix_count[plen] == 0)
+        prefixes.erase(std::find(prefixes.begin(), prefixes.end(), plen));
+}
+
+bool
+Dht::Blacklist::contains(const sockaddr* sa, socklen_t salen, time_point now) const
+{
+    if (entries.empty())
+        return false;
+    Key addr;
+    if (not makeKey(sa, salen, addr))
+        return false;
+    for (auto plen : prefixes) {
+        Key key = addr;
+        if (plen < 128)
+            maskKey(key, plen);
+        auto it = entries.find(key);
+        if (it != entries.end() and it->second > now)
+            return true;
+        if (key.port) {
+            // entry for any port
+            key.port = 0;
+            it = entries.find(key);
+            if (it != entries.end() and it->second > now)
+                return true;
+        }
+    }
+    return false;
+}
+
+void
+Dht::Blacklist::expire(time_point now)
+{
+    while (not expirations.empty() and expirations.begin()->first <= now) {
+        auto e = expirations.begin();
+        auto it = entries.find(e->second);
+        if (it != entries.end() and it->second == e->first)
+            erase(it);
+        expirations.erase(e);
+    }
+}
+
+void
+Dht::Blacklist::clear()
+{
+    entries.clear();
+    expirations.clear();
+    prefix_count.fill(0);
+    prefixes.clear();
+}
+
+void
+Dht::blacklistAddress(const sockaddr* sa, socklen_t salen, unsigned prefix_len, time_point expiration)
+{
+    if (not sa)
+        return;
+    blacklist.add(sa, salen, prefix_len, expiration);
+}
+
+/* The internal blacklist holds nodes that have sent incorrect messages,
+   for BLACKLIST_EXPIRE_TIME. */
 void
 Dht::blacklistNode(const InfoHash* id, const sockaddr *sa, socklen_t salen)
 {
@@ -561,8 +933,7 @@ Dht::blacklistNode(const InfoHash* id, const sockaddr *sa, socklen_t salen)
         }
     }
     /* And make sure we don't hear from it again. */
-    memcpy(&blacklist[next_blacklisted], sa, salen);
-    next_blacklisted = (next_blacklisted + 1) % BLACKLISTED_MAX;
+    blacklist.add(sa, salen, 0, now + BLACKLIST_EXPIRE_TIME);
 }
 
 bool
@@ -574,12 +945,7 @@ Dht::isNodeBlacklisted(const sockaddr *sa, socklen_t salen) const
     if (isBlacklisted(sa, salen))
         return true;
 
-    for (unsigned i = 0; i < BLACKLISTED_MAX; i++) {
-        if (memcmp(&blacklist[i], sa, salen) == 0)
-            return true;
-    }
-
-    return false;
+    return blacklist.contains(sa, salen, now);
 }
 
 std::vector<Address>
@@ -607,7 +973,10 @@ Dht::RoutingTable::split(const RoutingTable::iterator& b)
     }
 
     // Insert new bucket
-    insert(std::next(b), Bucket {b->af, new_id, b->time});
+    auto nb = insert(std::next(b), Bucket {b->af, new_id, b->time});
+    auto pos = findBucketPos(b->first) + 1;
+    index_first.insert(index_first.begin() + pos, new_id);
+    index.insert(index.begin() + pos, nb);
 
     // Re-assign nodes
     std::list<std::shared_ptr<Node>> nodes {};
@@ -633,7 +1002,7 @@ Dht::trySearchInsert(const std::shared_ptr<Node>& node)
         if (s.af != family) continue;
         if (s.insertNode(node, now)) {
             inserted = true;
-            search_time = std::min(search_time, s.getNextStepTime(types, now));
+            scheduleSearchStep(s);
         }
     }
     return inserted;
@@ -771,8 +1140,6 @@ Dht::expireBuckets(RoutingTable& list)
         if (changed)
             sendCachedPing(b);
     }
-    uniform_duration_distribution<> time_dis(std::chrono::minutes(2), std::chrono::minutes(6));
-    expire_stuff_time = now + duration(time_dis(rd));
 }
 
 /* While a search is in progress, we don't necessarily keep the nodes being
@@ -783,10 +1150,30 @@ Dht::expireBuckets(RoutingTable& list)
 Dht::Search *
 Dht::findSearch(unsigned short tid, sa_family_t af)
 {
-    auto sr = std::find_if (searches.begin(), searches.end(), [tid,af](const Search& s){
-        return s.tid == tid && s.af == af;
-    });
-    return sr == searches.end() ? nullptr : &(*sr);
+    auto sr = searches_by_tid.find(tid);
+    if (sr == searches_by_tid.end() or sr->second->af != af)
+        return nullptr;
+    return sr->second;
+}
+
+Dht::Search *
+Dht::findSearch(const InfoHash& id, sa_family_t af)
+{
+    const auto& index = getSearchIndex(af);
+    auto sr = index.find(id);
+    return sr == index.end() ? nullptr : sr->second;
+}
+
+void
+Dht::unindexSearch(const Search& sr)
+{
+    auto t = searches_by_tid.find(sr.tid);
+    if (t != searches_by_tid.end() and t->second == &sr)
+        searches_by_tid.erase(t);
+    auto& index = getSearchIndex(sr.af);
+    auto i = index.find(sr.id);
+    if (i != index.end() and i->second == &sr)
+        index.erase(i);
 }
 
 bool
@@ -809,7 +1196,7 @@ Dht::Search::removeExpiredNode(time_point now)
    target.  We just got a new candidate, insert it at the right spot or
    discard it. */
 bool
-Dht::Search::insertNode(std::shared_ptr<Node> node, time_point now, const Blob& token)
+Dht::Search::insertNode(const std::shared_ptr<Node>& node, time_point now, const Blob& token, unsigned hops)
 {
     if (node->ss.ss_family != af) {
         //DHT_DEBUG("Attempted to insert node in the wrong family.");
@@ -849,6 +1236,7 @@ Dht::Search::insertNode(std::shared_ptr<Node> node, time_point now, const Blob&
 
         //bool synced = isSynced(now);
         n = nodes.insert(n, SearchNode(node));
+        n->hops = hops;
         node->time = now;
         new_search_node = true;
         /*if (synced) {
@@ -869,10 +1257,12 @@ Dht::Search::insertNode(std::shared_ptr<Node> node, time_point now, const Blob&
             } // else, all nodes are expired.
         }
         expired = false;
-    }
+    } else if (hops < n->hops)
+        n->hops = hops;
     if (not token.empty()) {
         n->getStatus.reply_time = now;
         n->getStatus.request_time = TIME_INVALID;
+        n->getStatus.sent = 0;
         n->candidate = false;
         if (token.size() <= 64)
             n->token = token;
@@ -895,9 +1285,22 @@ void
 Dht::expireSearches()
 {
     auto t = now - SEARCH_EXPIRE_TIME;
-    searches.remove_if([t](const Search& sr) {
-        return sr.callbacks.empty() && sr.announce.empty() && sr.listeners.empty() && sr.step_time < t;
-    });
+    for (auto sr = searches.begin(); sr != searches.end();) {
+        bool expired = sr->callbacks.empty() && sr->announce.empty() && sr->listeners.empty() && sr->step_time < t;
+        if (not expired) {
+            ++sr;
+            continue;
+        }
+        if (sr->nextSearchStep)
+            sr->nextSearchStep->cancel();
+        unindexSearch(*sr);
+        auto next = std::next(sr);
+        if (search_pool.size() < SEARCH_POOL_SIZE)
+            search_pool.splice(search_pool.begin(), searches, sr);
+        else
+            searches.erase(sr);
+        sr = next;
+    }
 }
 
 Dht::SearchNode*
@@ -909,6 +1312,19 @@ Dht::searchSendGetValues(Search& sr, SearchNode* pn, bool update)
         if (not pn->canGet(now, up))
             return nullptr;
         n = pn;
+    } else if (latency_aware) {
+        // the fastest of the closest nodes we can query
+        unsigned k = 0;
+        for (auto& sn : sr.nodes) {
+            if (not sn.canGet(now, up))
+                continue;
+            if (not n or sn.node->getResponseTime() < n->node->getResponseTime())
+                n = &sn;
+            if (++k == 2 * search_alpha)
+                break;
+        }
+        if (not n)
+            return nullptr;
     } else {
         for (auto& sn : sr.nodes) {
             if (sn.canGet(now, up)) {
@@ -929,8 +1345,9 @@ Dht::searchSendGetValues(Search& sr, SearchNode* pn, bool update)
     if (sr.callbacks.empty() and sr.listeners.empty())
         sendFindNode((sockaddr*)&n->node->ss, n->node->sslen, TransId {TransPrefix::FIND_NODE, sr.tid}, sr.id, -1, n->node->reply_time >= now - UDP_REPLY_TIME);
     else
-        sendGetValues((sockaddr*)&n->node->ss, n->node->sslen, TransId {TransPrefix::GET_VALUES, sr.tid}, sr.id, -1, n->node->reply_time >= now - UDP_REPLY_TIME);
+        sendGetValues((sockaddr*)&n->node->ss, n->node->sslen, TransId {TransPrefix::GET_VALUES, sr.tid}, sr.id, -1, n->node->reply_time >= now - UDP_REPLY_TIME, sr.getQuery());
     n->getStatus.request_time = now;
+    n->getStatus.sent++;
     pinged(*n->node);
     if (n->node->pinged > 1 and not n->candidate) {
         n->candidate = true;
@@ -966,6 +1383,11 @@ Dht::searchStep(Search& sr)
             // Call callbacks when done
             for (auto b = sr.callbacks.begin(); b != sr.callbacks.end();) {
                 if (sr.isDone(*b, now)) {
+                    auto closest = std::find_if(sr.nodes.begin(), sr.nodes.end(), [&](const SearchNode& sn) {
+                        return not sn.isBad(now);
+                    });
+                    if (closest != sr.nodes.end())
+                        metrics.search_hops.add((uint64_t)closest->hops);
                     if (b->done_cb)
                         b->done_cb(true, sr.getNodes());
                     b = sr.callbacks.erase(b);
@@ -983,6 +1405,7 @@ Dht::searchStep(Search& sr)
         DHT_DEBUG("[search %s IPv%c] synced%s", sr.id.toString().c_str(), sr.af == AF_INET ? '4' : '6', in ? ", in" : "");
 
         if (not sr.listeners.empty()) {
+            const auto query = sr.getListenQuery();
             unsigned i = 0, t = 0;
             for (auto& n : sr.nodes) {
                 if (not n.isSynced(now) or (n.candidate and t >= LISTEN_NODES))
@@ -994,7 +1417,7 @@ Dht::searchStep(Search& sr)
                         print_addr(n.node->ss, n.node->sslen).c_str());
                     //std::cout << "Sending listen to " << n.node->id << " " << print_addr(n.node->ss, n.node->sslen) << std::endl;
 
-                    sendListen((sockaddr*)&n.node->ss, n.node->sslen, TransId {TransPrefix::LISTEN, sr.tid}, sr.id, n.token, n.node->reply_time >= now - UDP_REPLY_TIME);
+                    sendListen((sockaddr*)&n.node->ss, n.node->sslen, TransId {TransPrefix::LISTEN, sr.tid}, sr.id, n.token, n.node->reply_time >= now - UDP_REPLY_TIME, query);
                     n.pending = true;
                     n.listenStatus.request_time = now;
                 }
@@ -1049,18 +1472,22 @@ Dht::searchStep(Search& sr)
             sr.done = true;
     }
 
-    if (sr.get_step_time + SEARCH_GET_STEP <= now) {
+    if (sr.get_step_time + sr.get_step_timeout <= now) {
         unsigned i = 0;
         SearchNode* sent;
+        duration timeout {};
         do {
             sent = searchSendGetValues(sr);
             if (sent) {
                 sent->pending = false;
+                timeout = std::max(timeout, sent->node->getResponseTime());
                 if (not sent->candidate)
                     i++;
             }
         }
-        while (sent and i < 3);
+        while (sent and i < search_alpha);
+        if (timeout > duration::zero())
+            sr.get_step_timeout = std::min<duration>(timeout, SEARCH_GET_STEP);
         DHT_DEBUG("[search %s IPv%c] step: sent %u requests.",
             sr.id.toString().c_str(), sr.af == AF_INET ? '4' : '6', i);
 
@@ -1103,34 +1530,45 @@ Dht::searchStep(Search& sr)
         }
     }
 
+    scheduleSearchStep(sr);
+
 }
 
 
 std::list<Dht::Search>::iterator
 Dht::newSearch()
 {
-    auto oldest = searches.begin();
-    for (auto i = searches.begin(); i != searches.end(); ++i) {
-        if (i->done && (oldest->step_time > i->step_time))
-            oldest = i;
+    /* Allocate a new slot, from the pool if possible. */
+    if (searches.size() < max_searches) {
+        if (search_pool.empty())
+            searches.push_front(Search {});
+        else
+            searches.splice(searches.begin(), search_pool, search_pool.begin());
+        return searches.begin();
     }
 
-    /* The oldest slot is expired. */
-    if (oldest != searches.end() && oldest->announce.empty() && oldest->listeners.empty() && oldest->step_time < now - SEARCH_EXPIRE_TIME) {
-        DHT_WARN("Reusing expired search %s", oldest->id.toString().c_str());
-        return oldest;
+    /* Table full: reuse the least recently used search that is done. */
+    auto oldest = searches.end();
+    for (auto i = searches.begin(); i != searches.end(); ++i) {
+        if (i->done and i->callbacks.empty() and i->announce.empty() and i->listeners.empty()
+            and (oldest == searches.end() or oldest->step_time > i->step_time))
+            oldest = i;
     }
-
-    /* Allocate a new slot. */
-    if (searches.size() < MAX_SEARCHES) {
-        searches.push_front(Search {});
-        return searches.begin();
+    if (oldest != searches.end()) {
+        DHT_WARN("Reusing search %s", oldest->id.toString().c_str());
+        if (oldest->nextSearchStep)
+            oldest->nextSearchStep->cancel();
+        unindexSearch(*oldest);
     }
-
-    /* Oh, well, never mind.  Reuse the oldest slot. */
     return oldest;
 }
 
+void
+Dht::scheduleSearchStep(Search& sr)
+{
+    scheduler.edit(sr.nextSearchStep, sr.getNextStepTime(types, now));
+}
+
 /* Insert the contents of a bucket into a search structure. */
 unsigned
 Dht::Search::insertBucket(const Bucket& b, time_point now)
@@ -1174,6 +1612,34 @@ Dht::Search::getLastGetTime() const
     return last;
 }
 
+Query
+Dht::Search::getQuery() const
+{
+    if (callbacks.empty() or not callbacks.front().filter.getQuery())
+        return {};
+    const auto& q = *callbacks.front().filter.getQuery();
+    for (const auto& g : callbacks) {
+        const auto& gq = g.filter.getQuery();
+        if (not gq or *gq != q)
+            return {};
+    }
+    return q;
+}
+
+Query
+Dht::Search::getListenQuery() const
+{
+    if (listeners.empty() or not listeners.begin()->second.filter.getQuery())
+        return {};
+    const auto& q = *listeners.begin()->second.filter.getQuery();
+    for (const auto& l : listeners) {
+        const auto& lq = l.second.filter.getQuery();
+        if (not lq or *lq != q)
+            return {};
+    }
+    return q;
+}
+
 bool
 Dht::Search::isDone(const Get& get, time_point now) const
 {
@@ -1202,13 +1668,13 @@ Dht::Search::getUpdateTime(time_point now) const
         if (sn.getStatus.reply_time < std::max(now - Node::NODE_EXPIRE_TIME, last_get)) {
             // not isSynced
             ut = std::min(ut, std::max(
-                sn.getStatus.request_time + Node::MAX_RESPONSE_TIME,
-                get_step_time + SEARCH_GET_STEP));
+                sn.getStatus.request_time + sn.node->getResponseTime(),
+                get_step_time + get_step_timeout));
             if (not sn.candidate)
                 d++;
         } else {
             ut = std::min(ut, std::max(
-                sn.getStatus.request_time + Node::MAX_RESPONSE_TIME,
+                sn.getStatus.request_time + sn.node->getResponseTime(),
                 sn.getStatus.reply_time + Node::NODE_EXPIRE_TIME));
         }
         t++;
@@ -1298,35 +1764,107 @@ Dht::Search::getListenTime(time_point now) const
     return listen_time;
 }
 
+namespace {
+/**
+ * Selects the first nodes of a search used for an operation: at most limit
+ * non-candidate nodes, and candidates only until limit nodes were seen.
+ */
+struct SearchWindow {
+    unsigned limit;
+    unsigned i {0}, t {0};
+    bool full {false};
+
+    SearchWindow(unsigned limit) : limit(limit) {}
+
+    bool take(bool eligible, bool candidate) {
+        if (full or not eligible or (candidate and t >= limit))
+            return false;
+        t++;
+        if (not candidate and ++i == limit)
+            full = true;
+        return true;
+    }
+};
+}
+
 time_point
 Dht::Search::getNextStepTime(const std::map<ValueType::Id, ValueType>& types, time_point now) const
 {
-    auto next_step = time_point::max();
     if (expired or done)
-        return next_step;
+        return time_point::max();
 
-    auto ut = getUpdateTime(now);
-    if (ut != time_point::max()) {
-        //std::cout << id.toString() << " IPv" << (af==AF_INET?"4":"6") << " update time in " << print_dt(ut - now) << " s" << std::endl;
-        next_step = std::min(next_step, ut);
+    /* Same as the min of getUpdateTime, and, when isSynced,
+       getAnnounceTime and getListenTime, in one pass. */
+    struct AnnounceType {
+        Value::Id id;
+        const ValueType& type;
+    };
+    std::vector<AnnounceType> announce_types;
+    announce_types.reserve(announce.size());
+    for (const auto& a : announce) {
+        if (!a.value) continue;
+        auto type_it = types.find(a.value->type);
+        announce_types.emplace_back(AnnounceType {a.value->id, (type_it == types.end()) ? ValueType::USER_DATA : type_it->second});
     }
 
-    if (isSynced(now))
-    {
-        auto at = getAnnounceTime(types, now);
-        if (at != time_point::max()) {
-            //std::cout << id.toString() << " IPv" << (af==AF_INET?"4":"6") << " announce time in " << print_dt(at - now) << " s" << std::endl;
-            next_step = std::min(next_step, at);
+    const auto last_get = getLastGetTime();
+    SearchWindow update_window {TARGET_NODES};
+    SearchWindow announce_window {TARGET_NODES};
+    SearchWindow listen_window {LISTEN_NODES};
+    announce_window.full = announce_types.empty();
+    listen_window.full = listeners.empty();
+
+    time_point ut {time_point::max()}, at {time_point::max()}, lt {time_point::max()};
+    unsigned d = 0;
+    unsigned synced_nodes = 0;
+    bool synced = true, synced_known = false;
+
+    for (const auto& sn : nodes) {
+        if (update_window.full and announce_window.full and listen_window.full and synced_known)
+            break;
+        bool node_expired = sn.node->isExpired(now);
+        bool node_synced = sn.isSynced(now);
+
+        if (update_window.take(not node_expired, sn.candidate)) {
+            if (sn.getStatus.reply_time < std::max(now - Node::NODE_EXPIRE_TIME, last_get)) {
+                // not isSynced
+                ut = std::min(ut, std::max(
+                    sn.getStatus.request_time + sn.node->getResponseTime(),
+                    get_step_time + get_step_timeout));
+                if (not sn.candidate)
+                    d++;
+            } else {
+                ut = std::min(ut, std::max(
+                    sn.getStatus.request_time + sn.node->getResponseTime(),
+                    sn.getStatus.reply_time + Node::NODE_EXPIRE_TIME));
+            }
         }
 
-        auto lt = getListenTime(now);
-        if (lt != time_point::max()) {
-            //std::cout << id.toString() << " IPv" << (af==AF_INET?"4":"6") << " listen time in " << print_dt(lt - now) << " s" << std::endl;
-            next_step = std::min(next_step, lt);
+        if (not synced_known and not node_expired and not sn.candidate) {
+            if (not node_synced) {
+                synced = false;
+                synced_known = true;
+            } else if (++synced_nodes == TARGET_NODES)
+                synced_known = true;
         }
+
+        if (announce_window.take(node_synced, sn.candidate))
+            for (const auto& a : announce_types)
+                at = std::min(at, sn.getAnnounceTime(a.id, a.type));
+
+        if (listen_window.take(node_synced, sn.candidate))
+            lt = std::min(lt, sn.getListenTime());
     }
+    synced = synced and synced_nodes > 0;
 
+    if ((not callbacks.empty() or not announce.empty()) and d == 0) {
+        // If all synced/updated but some callbacks remain, step now to clear them
+        ut = now;
+    }
 
+    auto next_step = ut;
+    if (synced)
+        next_step = std::min({next_step, at, lt});
     return next_step;
 }
 
@@ -1387,19 +1925,27 @@ Dht::search(const InfoHash& id, sa_family_t af, GetCallback callback, DoneCallba
         return nullptr;
     }
 
-    auto sr = std::find_if (searches.begin(), searches.end(), [id,af](const Search& s) {
-        return s.id == id && s.af == af;
-    });
-
-    if (sr != searches.end()) {
+    auto sr = findSearch(id, af);
+    if (sr) {
         sr->done = false;
         sr->expired = false;
     } else {
-        sr = newSearch();
-        if (sr == searches.end())
+        auto srp = newSearch();
+        if (srp == searches.end()) {
+            DHT_ERROR("[search %s IPv%c] too many searches", id.toString().c_str(), (af == AF_INET) ? '4' : '6');
+            if (done_callback)
+                done_callback(false, {});
             return nullptr;
+        }
+        sr = &*srp;
         sr->af = af;
-        sr->tid = search_id++;
+        /* transaction ids must be unique */
+        do {
+            sr->tid = search_id++;
+            if (search_id == 0)
+                search_id++;
+        } while (searches_by_tid.find(sr->tid) != searches_by_tid.end());
+        sr->refill_time = TIME_INVALID;
         sr->step_time = TIME_INVALID;
         sr->get_step_time = TIME_INVALID;
         sr->id = id;
@@ -1407,9 +1953,13 @@ Dht::search(const InfoHash& id, sa_family_t af, GetCallback callback, DoneCallba
         sr->expired = false;
         sr->nodes.clear();
         sr->nodes.reserve(SEARCH_NODES+1);
+        sr->announce.clear();
+        sr->callbacks.clear();
+        sr->listeners.clear();
+        sr->nextSearchStep = scheduler.add(time_point::max(), std::bind(&Dht::searchStep, this, std::ref(*sr)));
+        searches_by_tid.emplace(sr->tid, sr);
+        getSearchIndex(af)[id] = sr;
         DHT_WARN("[search %s IPv%c] new search", id.toString().c_str(), (af == AF_INET) ? '4' : '6');
-        if (search_id == 0)
-            search_id++;
     }
 
     if (callback)
@@ -1417,8 +1967,7 @@ Dht::search(const InfoHash& id, sa_family_t af, GetCallback callback, DoneCallba
 
     bootstrapSearch(*sr);
     searchStep(*sr);
-    search_time = now;
-    return &(*sr);
+    return sr;
 }
 
 void
@@ -1429,10 +1978,9 @@ Dht::announce(const InfoHash& id, sa_family_t af, std::shared_ptr<Value> value,
             callback(false, {});
         return;
     }
-    auto sri = std::find_if (searches.begin(), searches.end(), [id,af](const Search& s) {
-        return s.id == id && s.af == af;
-    });
-    Search* sr = (sri == searches.end()) ? search(id, af, nullptr, nullptr) : &(*sri);
+    auto sr = findSearch(id, af);
+    if (not sr)
+        sr = search(id, af, nullptr, nullptr);
     if (!sr) {
         if (callback)
             callback(false, {});
@@ -1468,11 +2016,7 @@ Dht::announce(const InfoHash& id, sa_family_t af, std::shared_ptr<Value> value,
             a_sr->callback = callback;
         }
     }
-    auto tm = sr->getNextStepTime(types, now);
-    if (tm < search_time) {
-        DHT_ERROR("[search %s IPv%c] search_time is now in %lfs", sr->id.toString().c_str(), (sr->af == AF_INET) ? '4' : '6', print_dt(tm-clock::now()));
-        search_time = tm;
-    }
+    scheduleSearchStep(*sr);
 }
 
 size_t
@@ -1480,27 +2024,30 @@ Dht::listenTo(const InfoHash& id, sa_family_t af, GetCallback cb, Value::Filter
 {
     if (!isRunning(af))
         return 0;
-       // DHT_ERROR("[search %s IPv%c] search_time is now in %lfs", sr->id.toString().c_str(), (sr->af == AF_INET) ? '4' : '6', print_dt(tm-clock::now()));
 
     //DHT_WARN("listenTo %s", id.toString().c_str());
-    auto sri = std::find_if (searches.begin(), searches.end(), [id,af](const Search& s) {
-        return s.id == id && s.af == af;
-    });
-    Search* sr = (sri == searches.end()) ? search(id, af, nullptr, nullptr) : &(*sri);
+    auto sr = findSearch(id, af);
+    if (not sr)
+        sr = search(id, af, nullptr, nullptr);
     if (!sr)
         throw DhtException("Can't create search");
     DHT_ERROR("[search %s IPv%c] listen", id.toString().c_str(), (af == AF_INET) ? '4' : '6');
     sr->done = false;
     auto token = ++sr->listener_token;
+    auto query = sr->getListenQuery();
     sr->listeners.emplace(token, LocalListener{f, cb});
-    search_time = std::min(search_time, sr->getNextStepTime(types, now));
+    // remote nodes filter values with the previous query: listen again
+    if (sr->getListenQuery() != query)
+        for (auto& sn : sr->nodes)
+            sn.listenStatus = {};
+    scheduleSearchStep(*sr);
     return token;
 }
 
 size_t
 Dht::listen(const InfoHash& id, GetCallback cb, Value::Filter f)
 {
-    now = clock::now();
+    now = getTime();
 
     auto vals = std::make_shared<std::map<Value::Id, std::shared_ptr<Value>>>();
     auto token = ++listener_token;
@@ -1528,13 +2075,12 @@ Dht::listen(const InfoHash& id, GetCallback cb, Value::Filter f)
 
     auto st = findStorage(id);
     size_t tokenlocal = 0;
-    if (st == store.end() && store.size() < MAX_HASHES) {
-        store.emplace_back(id, now);
-        st = std::prev(store.end());
-    }
+    if (st == store.end() && store.size() < MAX_HASHES)
+        st = newStorage(id);
     if (st != store.end()) {
-        if (not st->empty()) {
-            std::vector<std::shared_ptr<Value>> newvals = st->get(f);
+        if (not st->second.empty()) {
+            st->second.access_time = now;
+            std::vector<std::shared_ptr<Value>> newvals = st->second.get(f);
             if (not newvals.empty()) {
                 if (!cb(newvals))
                     return 0;
@@ -1545,8 +2091,8 @@ Dht::listen(const InfoHash& id, GetCallback cb, Value::Filter f)
                 }
             }
         }
-        tokenlocal = ++st->listener_token;
-        st->local_listeners.emplace(tokenlocal, LocalListener{f, gcb});
+        tokenlocal = ++st->second.listener_token;
+        st->second.local_listeners.emplace(tokenlocal, LocalListener{f, gcb});
     }
 
     auto token4 = Dht::listenTo(id, AF_INET, gcb, f);
@@ -1560,7 +2106,7 @@ Dht::listen(const InfoHash& id, GetCallback cb, Value::Filter f)
 bool
 Dht::cancelListen(const InfoHash& id, size_t token)
 {
-    now = clock::now();
+    now = getTime();
 
     auto it = listeners.find(token);
     if (it == listeners.end()) {
@@ -1571,13 +2117,13 @@ Dht::cancelListen(const InfoHash& id, size_t token)
     auto st = findStorage(id);
     auto tokenlocal = std::get<0>(it->second);
     if (st != store.end() && tokenlocal)
-        st->local_listeners.erase(tokenlocal);
-    for (auto& s : searches) {
-        if (s.id != id) continue;
-        auto af_token = s.af == AF_INET ? std::get<1>(it->second) : std::get<2>(it->second);
+        st->second.local_listeners.erase(tokenlocal);
+    for (auto af : {AF_INET, AF_INET6}) {
+        auto af_token = af == AF_INET ? std::get<1>(it->second) : std::get<2>(it->second);
         if (af_token == 0)
             continue;
-        s.listeners.erase(af_token);
+        if (auto s = findSearch(id, af))
+            s->listeners.erase(af_token);
     }
     listeners.erase(it);
     return true;
@@ -1586,7 +2132,7 @@ Dht::cancelListen(const InfoHash& id, size_t token)
 void
 Dht::put(const InfoHash& id, std::shared_ptr<Value> val, DoneCallback callback, time_point created)
 {
-    now = clock::now();
+    now = getTime();
 
     if (val->id == Value::INVALID_ID) {
         crypto::random_device rdev;
@@ -1600,11 +2146,14 @@ Dht::put(const InfoHash& id, std::shared_ptr<Value> val, DoneCallback callback,
     auto done = std::make_shared<bool>(false);
     auto done4 = std::make_shared<bool>(false);
     auto done6 = std::make_shared<bool>(false);
+    const auto start = now;
     auto donecb = [=](const std::vector<std::shared_ptr<Node>>& nodes) {
         // Callback as soon as the value is announced on one of the available networks
-        if (callback && !*done && (*ok || (*done4 && *done6))) {
-            callback(*ok, nodes);
+        if (!*done && (*ok || (*done4 && *done6))) {
             *done = true;
+            metrics.put_time.add(now - start);
+            if (callback)
+                callback(*ok, nodes);
         }
     };
     announce(id, AF_INET, val, [=](bool ok4, const std::vector<std::shared_ptr<Node>>& nodes) {
@@ -1627,62 +2176,349 @@ struct OpStatus {
 };
 
 void
-Dht::get(const InfoHash& id, GetCallback getcb, DoneCallback donecb, Value::Filter filter)
+Dht::GetSubscriber::notify(const std::vector<std::shared_ptr<Value>>& values, const std::vector<std::shared_ptr<Node>>& nodes)
 {
-    now = clock::now();
+    if (done or not get_cb)
+        return;
+    std::vector<std::shared_ptr<Value>> vals;
+    vals.reserve(std::min(values.size(), GET_CHUNK_SIZE));
+    for (const auto& v : values) {
+        if (filter and not filter(*v))
+            continue;
+        vals.emplace_back(v);
+        if (vals.size() == GET_CHUNK_SIZE) {
+            if (not get_cb(vals)) {
+                finish(true, nodes);
+                return;
+            }
+            vals.clear();
+        }
+    }
+    if (vals.empty() or get_cb(vals))
+        return;
+    finish(true, nodes);
+}
 
-    auto status = std::make_shared<OpStatus>();
-    auto status4 = std::make_shared<OpStatus>();
-    auto status6 = std::make_shared<OpStatus>();
-    auto vals = std::make_shared<std::vector<std::shared_ptr<Value>>>();
-    auto all_nodes = std::make_shared<std::vector<std::shared_ptr<Node>>>();
+void
+Dht::GetSubscriber::finish(bool ok, const std::vector<std::shared_ptr<Node>>& nodes)
+{
+    if (done)
+        return;
+    done = true;
+    if (done_cb)
+        done_cb(ok, nodes);
+}
 
-    auto done_l = [=](const std::vector<std::shared_ptr<Node>>& nodes) {
-        if (status->done)
+uint64_t
+Dht::valueDigest(const Value& v) const
+{
+    std::array<uint64_t, 2> h {{}}, hs {{}};
+    const auto& content = v.isEncrypted() ? v.cypher : v.data;
+    sipHash128(digest_state, content.data(), content.size(), (uint8_t*)h.data());
+    if (not v.isEncrypted() and not v.signature.empty())
+        sipHash128(digest_state, v.signature.data(), v.signature.size(), (uint8_t*)hs.data());
+    return h[0] ^ rotl64(hs[0], 1) ^ (v.id * 0x9E3779B97F4A7C15ULL) ^ v.type;
+}
+
+bool
+Dht::addGetValues(GetCacheEntry& entry, const std::vector<std::shared_ptr<Value>>& values)
+{
+    std::vector<std::shared_ptr<Value>> newvals {};
+    for (const auto& v : values) {
+        // results of both families and of the local storage end up here
+        auto digest = valueDigest(*v);
+        auto range = entry.values_index.equal_range(digest);
+        auto it = std::find_if(range.first, range.second, [&](const std::pair<const uint64_t, size_t>& i) {
+            const auto& sv = entry.values[i.second];
+            return sv == v || *sv == *v;
+        });
+        if (it != range.second)
+            continue;
+        entry.values_index.emplace(digest, entry.values.size());
+        entry.values.emplace_back(v);
+        newvals.emplace_back(v);
+    }
+    if (not newvals.empty()) {
+        // callbacks can add subscribers, that get entry.values when joining
+        auto subs = entry.subscribers;
+        for (auto& s : subs)
+            s->notify(newvals, entry.nodes);
+    }
+
+    // forget the subscribers that don't want more values
+    entry.subscribers.erase(std::remove_if(entry.subscribers.begin(), entry.subscribers.end(),
+        [](const std::shared_ptr<GetSubscriber>& s) { return s->done; }), entry.subscribers.end());
+    return not entry.subscribers.empty();
+}
+
+void
+Dht::joinGet(const InfoHash& id, const std::shared_ptr<GetCacheEntry>& entry, std::shared_ptr<GetSubscriber> sub)
+{
+    if (not entry->done)
+        entry->subscribers.emplace_back(sub);
+    sub->notify(entry->values, entry->nodes);
+
+    /* Values stored since the get started. */
+    addGetValues(*entry, getLocal(id));
+
+    if (entry->done)
+        sub->finish(entry->ok, entry->nodes);
+}
+
+void
+Dht::getDone(const InfoHash& id, const std::shared_ptr<GetCacheEntry>& entry, bool ok)
+{
+    entry->done = true;
+    entry->ok = ok;
+    entry->done_time = now;
+    auto subs = std::move(entry->subscribers);
+    entry->subscribers.clear();
+    for (auto& s : subs)
+        s->finish(ok, entry->nodes);
+
+    auto c = get_cache.find(id);
+    if (c == get_cache.end() or c->second != entry)
+        return;
+    if (not ok or get_cache_window == duration::zero()) {
+        get_cache.erase(c);
+        return;
+    }
+    scheduler.add(now + get_cache_window, [this,id,entry]() {
+        auto c = get_cache.find(id);
+        if (c != get_cache.end() and c->second == entry)
+            get_cache.erase(c);
+    });
+}
+
+void
+Dht::get(const InfoHash& id, GetCallback getcb, DoneCallback donecb, Value::Filter filter)
+{
+    now = getTime();
+    findStorage(id);
+
+    auto query = filter.getQuery();
+    auto sub = std::make_shared<GetSubscriber>(std::move(getcb), std::move(donecb), std::move(filter));
+
+    bool cache = get_cache_window > duration::zero() and get_cache.size() < GET_CACHE_MAX;
+    auto c = get_cache.find(id);
+    if (c != get_cache.end()) {
+        auto entry = c->second;
+        // values of a filtered get only answer gets with the same query
+        bool joinable = not entry->query or (query and *entry->query == *query);
+        if (not joinable and not entry->done)
+            cache = false;
+        else if (not joinable)
+            get_cache.erase(c);
+        else if (not entry->done or (entry->ok and now <= entry->done_time + get_cache_window)) {
+            if (entry->done)
+                get_cache_stats.hits++;
+            else
+                get_cache_stats.coalesced++;
+            joinGet(id, entry, std::move(sub));
+            return;
+        } else
+            get_cache.erase(c);
+    }
+    get_cache_stats.misses++;
+
+    auto entry = std::make_shared<GetCacheEntry>();
+    entry->query = query;
+    entry->subscribers.emplace_back(std::move(sub));
+    if (cache)
+        get_cache.emplace(id, entry);
+
+    auto status4 = std::make_shared<OpStatus>();
+    auto status6 = std::make_shared<OpStatus>();
+    const auto start = now;
+
+    auto done_l = [=](const std::vector<std::shared_ptr<Node>>& nodes) {
+        if (entry->done)
             return;
-        all_nodes->insert(all_nodes->end(), nodes.begin(), nodes.end());
-        if (status->ok || (status4->done && status6->done)) {
-            bool ok = status->ok || status4->ok || status6->ok;
-            status->done = true;
-            if (donecb)
-                donecb(ok, *all_nodes);
+        entry->nodes.insert(entry->nodes.end(), nodes.begin(), nodes.end());
+        if (status4->done && status6->done) {
+            metrics.get_time.add(now - start);
+            getDone(id, entry, status4->ok || status6->ok);
         }
     };
     auto cb = [=](const std::vector<std::shared_ptr<Value>>& values) {
-        if (status->done)
+        if (entry->done)
             return false;
-        std::vector<std::shared_ptr<Value>> newvals {};
-        for (const auto& v : values) {
-            auto it = std::find_if(vals->cbegin(), vals->cend(), [&](const std::shared_ptr<Value>& sv) {
-                return sv == v || *sv == *v;
-            });
-            if (it == vals->cend()) {
-                if (!filter || filter(*v))
-                    newvals.push_back(v);
-            }
-        }
-        if (!newvals.empty()) {
-            status->ok = !getcb(newvals);
-            vals->insert(vals->end(), newvals.begin(), newvals.end());
-        }
-        done_l({});
-        return !status->ok;
+        if (addGetValues(*entry, values))
+            return true;
+        /* Every subscriber is done: stop the searches. Gets coming later
+           must not join the partial result. */
+        auto c = get_cache.find(id);
+        if (c != get_cache.end() and c->second == entry)
+            get_cache.erase(c);
+        return false;
     };
 
     /* Try to answer this search locally. */
-    cb(getLocal(id, filter));
+    if (not cb(getLocal(id))) {
+        getDone(id, entry, true);
+        return;
+    }
 
     Dht::search(id, AF_INET, cb, [=](bool ok, const std::vector<std::shared_ptr<Node>>& nodes) {
         //DHT_WARN("DHT done IPv4");
         status4->done = true;
         status4->ok = ok;
         done_l(nodes);
-    });
+    }, query ? Value::Filter(*query) : Value::Filter {});
     Dht::search(id, AF_INET6, cb, [=](bool ok, const std::vector<std::shared_ptr<Node>>& nodes) {
         //DHT_WARN("DHT done IPv6");
         status6->done = true;
         status6->ok = ok;
         done_l(nodes);
+    }, query ? Value::Filter(*query) : Value::Filter {});
+}
+
+struct BatchStatus {
+    size_t n;
+    unsigned concurrency;
+    size_t next {0};
+    size_t remaining;
+    unsigned running {0};
+    bool starting {false};
+    std::function<void(size_t, std::function<void()>)> op;
+    std::function<void()> done;
+};
+
+/* Operations can complete synchronously: they are started from
+   a loop, rather than from the completion of the previous one.
+   The op is only released once that loop is done, since the last
+   operation may complete while op is still running. */
+static void
+startBatch(const std::shared_ptr<BatchStatus>& b)
+{
+    if (b->starting)
+        return;
+    b->starting = true;
+    while (b->running < b->concurrency and b->next < b->n) {
+        b->running++;
+        b->op(b->next++, [b]() {
+            b->running--;
+            if (--b->remaining == 0) {
+                if (not b->starting)
+                    b->op = {};
+                auto done = std::move(b->done);
+                if (done)
+                    done();
+            } else
+                startBatch(b);
+        });
+    }
+    b->starting = false;
+    if (b->remaining == 0)
+        b->op = {};
+}
+
+void
+Dht::runBatch(size_t n, unsigned concurrency, std::function<void(size_t, std::function<void()>)>&& op, std::function<void()>&& done)
+{
+    if (n == 0) {
+        if (done)
+            done();
+        return;
+    }
+    auto b = std::make_shared<BatchStatus>();
+    b->n = n;
+    b->concurrency = std::max(concurrency, 1u);
+    b->remaining = n;
+    b->op = std::move(op);
+    b->done = std::move(done);
+    startBatch(b);
+}
+
+void
+Dht::seedSearches(const InfoHash& id, const InfoHash& from)
+{
+    for (auto af : {AF_INET, AF_INET6}) {
+        auto sr = findSearch(id, af);
+        auto prev = findSearch(from, af);
+        if (not sr or not prev)
+            continue;
+        unsigned added = 0;
+        for (const auto& n : prev->nodes)
+            if (not n.isBad(now) and sr->insertNode(n.node, now))
+                added++;
+        if (added)
+            scheduleSearchStep(*sr);
+    }
+}
+
+void
+Dht::putMany(std::vector<std::pair<InfoHash, std::shared_ptr<Value>>> values, PutManyCallback cb, unsigned concurrency)
+{
+    now = getTime();
+
+    auto vals = std::make_shared<std::vector<std::pair<InfoHash, std::shared_ptr<Value>>>>(std::move(values));
+    auto results = std::make_shared<std::vector<bool>>(vals->size(), false);
+    auto order = std::make_shared<std::vector<size_t>>(vals->size());
+    std::iota(order->begin(), order->end(), 0);
+    std::sort(order->begin(), order->end(), [&](size_t a, size_t b) {
+        return (*vals)[a].first < (*vals)[b].first;
+    });
+
+    runBatch(vals->size(), concurrency, [=](size_t i, std::function<void()> next) {
+        // next() may release this closure: keep what is used after put()
+        auto v = vals;
+        auto idx = (*order)[i];
+        const InfoHash key = (*v)[idx].first;
+        const InfoHash prev = i > 0 ? (*v)[(*order)[i-1]].first : InfoHash {};
+        const auto val = (*v)[idx].second;
+        if (not val) {
+            next();
+            return;
+        }
+        put(key, val, [results,idx,next](bool ok, const std::vector<std::shared_ptr<Node>>&) {
+            (*results)[idx] = ok;
+            next();
+        });
+        if (i > 0)
+            seedSearches(key, prev);
+    }, [=]() {
+        if (cb)
+            cb(std::move(*results));
+    });
+}
+
+void
+Dht::getMany(std::vector<InfoHash> keys, GetManyCallback cb, Value::Filter f, unsigned concurrency)
+{
+    getBatch(std::move(keys), std::move(cb), std::move(f), concurrency, [this](const InfoHash& key, GetCallback gcb, DoneCallback dcb, Value::Filter f) {
+        get(key, gcb, dcb, f);
+    });
+}
+
+void
+Dht::getBatch(std::vector<InfoHash>&& k, GetManyCallback&& cb, Value::Filter&& f, unsigned concurrency, GetFunction&& get_fn)
+{
+    now = getTime();
+
+    auto keys = std::make_shared<std::vector<InfoHash>>(std::move(k));
+    std::sort(keys->begin(), keys->end());
+    keys->erase(std::unique(keys->begin(), keys->end()), keys->end());
+    auto results = std::make_shared<GetManyResult>();
+    for (const auto& key : *keys)
+        (*results)[key];
+
+    runBatch(keys->size(), concurrency, [=](size_t i, std::function<void()> next) {
+        // next() may release this closure: keep what is used after get_fn()
+        auto ks = keys;
+        const InfoHash key = (*ks)[i];
+        get_fn(key, [results,key](const std::vector<std::shared_ptr<Value>>& values) {
+            auto& vals = (*results)[key];
+            vals.insert(vals.end(), values.begin(), values.end());
+            return true;
+        }, [next](bool, const std::vector<std::shared_ptr<Node>>&) {
+            next();
+        }, f);
+        if (i > 0)
+            seedSearches(key, (*ks)[i-1]);
+    }, [=]() {
+        if (cb)
+            cb(std::move(*results));
     });
 }
 
@@ -1691,15 +2527,18 @@ Dht::getLocal(const InfoHash& id, Value::Filter f) const
 {
     auto s = findStorage(id);
     if (s == store.end()) return {};
-    return s->get(f);
+    s->second.access_time = now;
+    return s->second.get(f);
 }
 
 std::shared_ptr<Value>
 Dht::getLocalById(const InfoHash& id, Value::Id vid) const
 {
     auto s = findStorage(id);
-    if (s != store.end())
-        return s->getById(vid);
+    if (s != store.end()) {
+        s->second.access_time = now;
+        return s->second.getById(vid);
+    }
     return {};
 }
 
@@ -1707,11 +2546,12 @@ std::vector<std::shared_ptr<Value>>
 Dht::getPut(const InfoHash& id)
 {
     std::vector<std::shared_ptr<Value>> ret;
-    for (const auto& search: searches) {
-        if (search.id != id)
+    for (auto af : {AF_INET, AF_INET6}) {
+        auto search = findSearch(id, af);
+        if (not search)
             continue;
-        ret.reserve(ret.size() + search.announce.size());
-        for (const auto& a : search.announce)
+        ret.reserve(ret.size() + search->announce.size());
+        for (const auto& a : search->announce)
             ret.push_back(a.value);
     }
     return ret;
@@ -1720,10 +2560,11 @@ Dht::getPut(const InfoHash& id)
 std::shared_ptr<Value>
 Dht::getPut(const InfoHash& id, const Value::Id& vid)
 {
-    for (const auto& search : searches) {
-        if (search.id != id)
+    for (auto af : {AF_INET, AF_INET6}) {
+        auto search = findSearch(id, af);
+        if (not search)
             continue;
-        for (const auto& a : search.announce) {
+        for (const auto& a : search->announce) {
             if (a.value->id == vid)
                 return a.value;
         }
@@ -1735,13 +2576,14 @@ bool
 Dht::cancelPut(const InfoHash& id, const Value::Id& vid)
 {
     bool canceled {false};
-    for (auto& search: searches) {
-        if (search.id != id)
+    for (auto af : {AF_INET, AF_INET6}) {
+        auto search = findSearch(id, af);
+        if (not search)
             continue;
-        for (auto it = search.announce.begin(); it != search.announce.end();) {
+        for (auto it = search->announce.begin(); it != search->announce.end();) {
             if (it->value->id == vid) {
                 canceled = true;
-                it = search.announce.erase(it);
+                it = search->announce.erase(it);
             }
             else
                 ++it;
@@ -1754,72 +2596,299 @@ void
 Dht::storageChanged(Storage& st, ValueStorage& v)
 {
     {
-        std::vector<std::pair<GetCallback, std::vector<std::shared_ptr<Value>>>> cbs;
-        for (const auto& l : st.local_listeners) {
-            std::vector<std::shared_ptr<Value>> vals;
+        const std::vector<std::shared_ptr<Value>> vals {v.data};
+        std::vector<GetCallback> cbs;
+        for (const auto& l : st.local_listeners)
             if (not l.second.filter or l.second.filter(*v.data))
-                vals.push_back(v.data);
-            if (not vals.empty())
-                cbs.emplace_back(l.second.get_cb, std::move(vals));
-        }
+                cbs.emplace_back(l.second.get_cb);
         // listeners are copied: they may be deleted by the callback
         for (auto& cb : cbs)
-            cb.first(cb.second);
+            cb(vals);
     }
 
+    /* Listeners only asking for value ids get a value without data. */
+    std::vector<Listener> listeners, ids_listeners;
     for (const auto& l : st.listeners) {
-        DHT_WARN("Storage changed. Sending update to %s %s.", l.id.toString().c_str(), print_addr((sockaddr*)&l.ss, l.sslen).c_str());
-        std::vector<ValueStorage> vals;
-        vals.push_back(v);
-        Blob ntoken = makeToken((const sockaddr*)&l.ss, false);
-        sendClosestNodes((const sockaddr*)&l.ss, l.sslen, TransId {TransPrefix::GET_VALUES, l.tid}, st.id, WANT4 | WANT6, ntoken, vals);
+        if (not l.query.empty() and not l.query.match(*v.data))
+            continue;
+        if (l.query.ids_only and not v.data->isEncrypted())
+            ids_listeners.emplace_back(l);
+        else
+            listeners.emplace_back(l);
+    }
+    if (listeners.empty() and ids_listeners.empty())
+        return;
+    DHT_DEBUG("Storage changed. Sending update to %lu listeners.", listeners.size() + ids_listeners.size());
+
+    /* Everything but the address, token and tid of the listener
+       is the same for all listeners: pack it once. */
+    uint8_t nodes[8 * 26];
+    uint8_t nodes6[8 * 38];
+    unsigned numnodes = 0, numnodes6 = 0;
+    auto b = buckets.findBucket(st.id);
+    if (b != buckets.end()) {
+        numnodes = bufferClosestNodes(nodes, numnodes, st.id, *b);
+        if (std::next(b) != buckets.end())
+            numnodes = bufferClosestNodes(nodes, numnodes, st.id, *std::next(b));
+        if (b != buckets.begin())
+            numnodes = bufferClosestNodes(nodes, numnodes, st.id, *std::prev(b));
+    }
+    auto b6 = buckets6.findBucket(st.id);
+    if (b6 != buckets6.end()) {
+        numnodes6 = bufferClosestNodes(nodes6, numnodes6, st.id, *b6);
+        if (std::next(b6) != buckets6.end())
+            numnodes6 = bufferClosestNodes(nodes6, numnodes6, st.id, *std::next(b6));
+        if (b6 != buckets6.begin())
+            numnodes6 = bufferClosestNodes(nodes6, numnodes6, st.id, *std::prev(b6));
     }
+
+    Blob tail;
+    {
+        msgpack::sbuffer buffer;
+        msgpack::packer<msgpack::sbuffer> pk(&buffer);
+        packStr(pk, "y"); packStr(pk, "r");
+        packStr(pk, "v"); pk.pack(my_v);
+        tail = {buffer.data(), buffer.data() + buffer.size()};
+    }
+    auto pushValue = [&](std::vector<Listener>&& ls, const Blob& packed) {
+        if (ls.empty())
+            return;
+        auto push = std::make_shared<ListenerPush>();
+        msgpack::sbuffer buffer;
+        msgpack::packer<msgpack::sbuffer> pk(&buffer);
+        pk.pack_map(4);
+        packStr(pk, "r");
+        pk.pack_map(4 + (numnodes>0?1:0) + (numnodes6>0?1:0));
+        packStr(pk, "id"); pk.pack(myid);
+        if (numnodes > 0) {
+            packStr(pk, "n4");
+            pk.pack_bin(numnodes * 26);
+            pk.pack_bin_body((const char*)nodes, numnodes * 26);
+        }
+        if (numnodes6 > 0) {
+            packStr(pk, "n6");
+            pk.pack_bin(numnodes6 * 38);
+            pk.pack_bin_body((const char*)nodes6, numnodes6 * 38);
+        }
+        packStr(pk, "values"); pk.pack_array(1);
+        buffer.write((const char*)packed.data(), packed.size());
+        // followed by "sa", "token" and "t"
+        push->head = {buffer.data(), buffer.data() + buffer.size()};
+        push->tail = tail;
+        push->listeners = std::move(ls);
+        pushToListeners(push);
+    };
+    pushValue(std::move(listeners), v.getPacked());
+    if (not ids_listeners.empty())
+        pushValue(std::move(ids_listeners), packMsg(Value {v.data->type, Blob {}, v.data->id}));
 }
 
 bool
 Dht::storageStore(const InfoHash& id, const std::shared_ptr<Value>& value, time_point created)
 {
     created = std::min(created, now);
+    if (eviction_policy != EvictionPolicy::NONE) {
+        // the value and its packed copy
+        size_t needed = sizeof(ValueStorage) + sizeof(Value) + 2 * value->size();
+        if (needed < max_store_size and total_store_size + needed > max_store_size)
+            evictValues(needed);
+    }
+
     auto st = findStorage(id);
     if (st == store.end()) {
         if (store.size() >= MAX_HASHES)
             return false;
-        store.emplace_back(id, now);
-        st = std::prev(store.end());
+        st = newStorage(id);
     }
 
-    auto store = st->store(value, created, max_store_size - total_store_size);
+    auto store = st->second.store(value, created, max_store_size - total_store_size);
+    total_store_size += std::get<1>(store);
+    total_values += std::get<2>(store);
     if (std::get<0>(store)) {
-        total_store_size += std::get<1>(store);
-        total_values += std::get<2>(store);
-        storageChanged(*st, *std::get<0>(store));
-    }
+        logValue(id, *std::get<0>(store));
+        storageChanged(st->second, *std::get<0>(store));
+    } else if (st->second.getById(value->id) != value)
+        eviction_stats.refused++;
     return std::get<0>(store);
 }
 
+void
+Dht::setStorageLog(const std::string& path)
+{
+    value_log.reset();
+    logged_values.clear();
+    value_log.reset(new ValueLog(path));
+    logged_values = value_log->takeRecords();
+    DHT_DEBUG("Opened value log %s: %lu keys to load", path.c_str(), logged_values.size());
+    if (logged_values.empty())
+        value_log->release();
+    else
+        scheduler.add(now, std::bind(&Dht::loadLoggedBatch, this));
+
+    // values stored before the log was opened
+    for (const auto& st : store)
+        for (const auto& v : st.second.getValues())
+            logValue(st.first, v);
+}
+
+void
+Dht::loadLogged(const InfoHash& id)
+{
+    auto l = logged_values.find(id);
+    if (l == logged_values.end())
+        return;
+    auto records = std::move(l->second);
+    logged_values.erase(l);
+
+    auto t = std::time(nullptr);
+    for (const auto& r : records) {
+        if (r.expiration < t)
+            continue;
+        auto value = std::make_shared<Value>();
+        try {
+            msgpack::unpacked msg;
+            msgpack::unpack(msg, (const char*)value_log->getData(r), r.size);
+            value->msgpack_unpack(msg.get());
+        } catch (const std::exception& e) {
+            DHT_ERROR("Error reading logged value at %s: %s", id.toString().c_str(), e.what());
+            continue;
+        }
+        auto st = store.find(id);
+        if (st == store.end()) {
+            if (store.size() >= MAX_HASHES)
+                return;
+            st = newStorage(id);
+        }
+        auto ret = st->second.store(value, from_time_t(r.created), max_store_size - total_store_size);
+        total_store_size += std::get<1>(ret);
+        total_values += std::get<2>(ret);
+    }
+}
+
+void
+Dht::loadLoggedBatch()
+{
+    for (size_t i = 0; i < LOG_LOAD_BATCH and not logged_values.empty(); i++)
+        loadLogged(logged_values.begin()->first);
+    if (logged_values.empty()) {
+        DHT_DEBUG("Value log loaded: %lu values", total_values);
+        value_log->release();
+    } else
+        scheduler.add(now, std::bind(&Dht::loadLoggedBatch, this));
+}
+
+void
+Dht::logValue(const InfoHash& id, const ValueStorage& v)
+{
+    if (not value_log)
+        return;
+    try {
+        const auto& type = getType(v.data->type);
+        value_log->append(id, v.data->id, to_time_t(v.time), to_time_t(v.time + type.expiration), v.getPacked());
+    } catch (const std::exception& e) {
+        DHT_ERROR("Can't write value log, disabling it: %s", e.what());
+        value_log.reset();
+        logged_values.clear();
+        return;
+    }
+    auto live = total_store_size + total_values * ValueLog::RECORD_HEADER_SIZE;
+    if (logged_values.empty() and value_log->size() > LOG_COMPACT_MIN and value_log->size() > 2 * live)
+        compactStorageLog();
+}
+
+void
+Dht::logDrop(const InfoHash& id, Value::Id vid)
+{
+    if (not value_log)
+        return;
+    try {
+        value_log->drop(id, vid);
+    } catch (const std::exception& e) {
+        DHT_ERROR("Can't write value log, disabling it: %s", e.what());
+        value_log.reset();
+        logged_values.clear();
+    }
+}
+
+void
+Dht::compactStorageLog()
+{
+    auto old_size = value_log->size();
+    try {
+        value_log->startRewrite();
+        for (const auto& st : store)
+            for (const auto& v : st.second.getValues()) {
+                const auto& type = getType(v.data->type);
+                value_log->append(st.first, v.data->id, to_time_t(v.time), to_time_t(v.time + type.expiration), v.getPacked());
+            }
+        value_log->finishRewrite();
+    } catch (const std::exception& e) {
+        DHT_ERROR("Can't compact value log: %s", e.what());
+        return;
+    }
+    DHT_DEBUG("Compacted value log: %lu -> %lu bytes", old_size, value_log->size());
+}
+
+size_t
+Dht::ValueStorage::memoryUsage() const
+{
+    /* shared_ptr control block, and values_index entry: hash node
+       (next pointer and key/position pair) and bucket pointer */
+    static constexpr size_t OVERHEAD {
+        2 * sizeof(long) + sizeof(void*) + 2 * sizeof(void*) + sizeof(std::pair<const Value::Id, size_t>)
+    };
+    /* gnutls public key structure and parameters, roughly */
+    static constexpr size_t PUBLIC_KEY_MEMORY {1024};
+
+    size_t s = sizeof(ValueStorage) + OVERHEAD + packed.capacity();
+    if (data) {
+        s += sizeof(Value) + data->data.capacity() + data->cypher.capacity()
+           + data->signature.capacity() + data->user_type.capacity();
+        if (data->owner)
+            s += PUBLIC_KEY_MEMORY;
+    }
+    return s;
+}
+
 std::tuple<Dht::ValueStorage*, ssize_t, ssize_t>
 Dht::Storage::store(const std::shared_ptr<Value>& value, time_point created, ssize_t size_left) {
 
-    auto it = std::find_if (values.begin(), values.end(), [&](const ValueStorage& vr) {
-        return vr.data == value || vr.data->id == value->id;
-    });
-    if (it != values.end()) {
+    auto idx = values_index.find(value->id);
+    if (idx != values_index.end()) {
+        auto it = values.begin() + idx->second;
         /* Already there, only need to refresh */
         it->time = created;
-        ssize_t size_diff = value->size() - it->data->size();
-        if (size_diff <= size_left and it->data != value) {
+        auto old_data = it->data;
+        it->data = value;
+        // the value may have been modified in place
+        it->invalidatePacked();
+        it->getPacked();
+        ssize_t size_diff = it->memoryUsage() - it->memory;
+        if (old_data == value) {
+            // nothing to refuse, but the accounting must follow
+            it->memory += size_diff;
+            total_size += size_diff;
+            return std::make_tuple(nullptr, size_diff, 0);
+        }
+        if (size_diff <= size_left) {
             //DHT_DEBUG("Updating %s -> %s", id.toString().c_str(), value->toString().c_str());
-            it->data = value;
+            it->memory += size_diff;
             total_size += size_diff;
             return std::make_tuple(&(*it), size_diff, 0);
         }
+        it->data = old_data;
+        it->invalidatePacked();
         return std::make_tuple(nullptr, 0, 0);
     } else {
         //DHT_DEBUG("Storing %s -> %s", id.toString().c_str(), value->toString().c_str());
-        ssize_t size = value->size();
+        ValueStorage v {value, created};
+        v.getPacked();
+        ssize_t size = v.memoryUsage();
         if (size <= size_left and values.size() < MAX_VALUES) {
+            v.memory = size;
             total_size += size;
-            values.emplace_back(value, created);
+            values_index.emplace(value->id, values.size());
+            values.emplace_back(std::move(v));
             return std::make_tuple(&values.back(), size, 1);
         }
         return std::make_tuple(nullptr, 0, 0);
@@ -1830,29 +2899,48 @@ void
 Dht::Storage::clear()
 {
     values.clear();
+    values_index.clear();
     total_size = 0;
 }
 
 void
-Dht::storageAddListener(const InfoHash& id, const InfoHash& node, const sockaddr *from, socklen_t fromlen, uint16_t tid)
+Dht::Storage::reindex()
+{
+    values_index.clear();
+    values_index.reserve(values.size());
+    for (size_t i = 0; i < values.size(); i++)
+        values_index.emplace(values[i].data->id, i);
+}
+
+void
+Dht::storageAddListener(const InfoHash& id, const InfoHash& node, const sockaddr *from, socklen_t fromlen, uint16_t tid, const Query& query)
 {
     auto st = findStorage(id);
     if (st == store.end()) {
         if (store.size() >= MAX_HASHES)
             return;
-        store.emplace_back(id, now);
-        st = std::prev(store.end());
+        st = newStorage(id);
     }
     sa_family_t af = from->sa_family;
-    auto l = std::find_if(st->listeners.begin(), st->listeners.end(), [&](const Listener& l){
+    auto l = std::find_if(st->second.listeners.begin(), st->second.listeners.end(), [&](const Listener& l){
         return l.ss.ss_family == af && l.id == node;
     });
-    if (l == st->listeners.end()) {
-        sendClosestNodes(from, fromlen, TransId {TransPrefix::GET_VALUES, tid}, st->id, WANT4 | WANT6, makeToken(from, false), st->getValues());
-        st->listeners.emplace_back(node, from, fromlen, tid, now);
+    if (l == st->second.listeners.end()) {
+        st->second.access_time = now;
+        sendClosestNodes(from, fromlen, TransId {TransPrefix::GET_VALUES, tid}, id, WANT4 | WANT6, makeToken(from, false), st->second.getValues(), query);
+        st->second.listeners.emplace_back(node, from, fromlen, tid, now, query);
     }
     else
-        l->refresh(from, fromlen, tid, now);
+        l->refresh(from, fromlen, tid, now, query);
+}
+
+decltype(Dht::store)::iterator
+Dht::newStorage(const InfoHash& id)
+{
+    auto st = store.emplace(id, Storage {id, now}).first;
+    total_store_size += STORAGE_MEMORY_OVERHEAD;
+    scheduleStorageMaintenance(id, st->second, st->second.maintenance_time);
+    return st;
 }
 
 void
@@ -1860,10 +2948,11 @@ Dht::expireStorage()
 {
     auto i = store.begin();
     while (i != store.end()) {
+        auto& st = i->second;
         // put elements to remove at the end with std::partition,
         // and then remove them with std::vector::erase.
-        i->listeners.erase(
-            std::partition(i->listeners.begin(), i->listeners.end(),
+        st.listeners.erase(
+            std::partition(st.listeners.begin(), st.listeners.end(),
                 [&](const Listener& l)
                 {
                     bool expired = l.time + Node::NODE_EXPIRE_TIME < now;
@@ -1872,14 +2961,16 @@ Dht::expireStorage()
                     // return false if the element should be removed
                     return !expired;
                 }),
-            i->listeners.end());
+            st.listeners.end());
 
-        auto stats = i->expire(types, now);
+        auto stats = st.expire(types, now);
         total_store_size += stats.first;
         total_values += stats.second;
 
-        if (i->empty() && i->listeners.empty()) {
-            DHT_DEBUG("Discarding expired value %s", i->id.toString().c_str());
+        if (st.empty() && st.listeners.empty()) {
+            DHT_DEBUG("Discarding expired value %s", i->first.toString().c_str());
+            maintenance_queue.erase({st.maintenance_time, i->first});
+            total_store_size -= STORAGE_MEMORY_OVERHEAD;
             i = store.erase(i);
         }
         else
@@ -1890,86 +2981,151 @@ Dht::expireStorage()
 std::pair<ssize_t, ssize_t>
 Dht::Storage::expire(const std::map<ValueType::Id, ValueType>& types, time_point now)
 {
-    auto r = std::partition(values.begin(), values.end(), [&](const ValueStorage& v) {
-        if (!v.data) return false; // should not happen
+    return remove([&](const ValueStorage& v) {
+        if (!v.data) return true; // should not happen
         auto type_it = types.find(v.data->type);
         const ValueType& type = (type_it == types.end()) ? ValueType::USER_DATA : type_it->second;
         bool expired = v.time + type.expiration < now;
         //if (expired)
         //    DHT_DEBUG("Discarding expired value %s", v.data->toString().c_str());
-        return !expired;
+        return expired;
+    });
+}
+
+std::pair<ssize_t, ssize_t>
+Dht::Storage::remove(std::function<bool(const ValueStorage&)>&& pred)
+{
+    auto r = std::partition(values.begin(), values.end(), [&](const ValueStorage& v) {
+        return not pred(v);
     });
     ssize_t del_num = std::distance(r, values.end());
     ssize_t size_diff {};
     std::for_each(r, values.end(), [&](const ValueStorage& v){
-        size_diff -= v.data->size();
+        size_diff -= v.memory;
     });
     total_size += size_diff;
     values.erase(r, values.end());
+    // std::partition moved values around
+    if (del_num)
+        reindex();
     return {size_diff, -del_num};
 }
 
+void
+Dht::evictValues(size_t needed)
+{
+    struct Candidate {
+        int priority;
+        time_point access_time;
+        time_point created;
+        Storage* storage;
+        Value::Id id;
+        size_t memory;
+    };
+    std::vector<Candidate> candidates;
+    candidates.reserve(total_values);
+    for (auto& st : store)
+        for (const auto& v : st.second.getValues())
+            candidates.push_back({
+                eviction_policy == EvictionPolicy::TYPE_PRIORITY ? getType(v.data->type).priority : 0,
+                st.second.access_time, v.time, &st.second, v.data->id, v.memory
+            });
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate& a, const Candidate& b) {
+        return std::tie(a.priority, a.access_time, a.created) < std::tie(b.priority, b.access_time, b.created);
+    });
+
+    const size_t target = needed + max_store_size / EVICTION_RATIO;
+    size_t freed = 0, n = 0;
+    for (; n < candidates.size() and freed < target; n++)
+        freed += candidates[n].memory;
+
+    // remove by storage
+    std::sort(candidates.begin(), candidates.begin() + n, [](const Candidate& a, const Candidate& b) {
+        return std::tie(a.storage, a.id) < std::tie(b.storage, b.id);
+    });
+    for (size_t i = 0; i < n;) {
+        auto storage = candidates[i].storage;
+        auto b = candidates.begin() + i;
+        while (i < n and candidates[i].storage == storage)
+            logDrop(storage->id, candidates[i++].id);
+        auto e = candidates.begin() + i;
+        auto ret = storage->remove([&](const ValueStorage& v) {
+            auto c = std::lower_bound(b, e, v.data->id, [](const Candidate& c, Value::Id id) {
+                return c.id < id;
+            });
+            return c != e and c->id == v.data->id;
+        });
+        total_store_size += ret.first;
+        total_values += ret.second;
+        eviction_stats.evicted -= ret.second;
+    }
+    DHT_DEBUG("Evicted %lu values (%lu bytes)", n, freed);
+}
+
+std::pair<size_t, size_t>
+Dht::getStoreSize(const InfoHash& key) const
+{
+    auto st = store.find(key);
+    if (st == store.end())
+        return {0, 0};
+    return {STORAGE_MEMORY_OVERHEAD + st->second.totalSize(), st->second.valueCount()};
+}
+
 void
 Dht::connectivityChanged()
 {
-    confirm_nodes_time = now;
+    scheduler.edit(nextNodesConfirmation, now);
     mybucket_grow_time = now;
     mybucket6_grow_time = now;
     reported_addr.clear();
     cache.clearBadNodes();
-    for (auto& s : searches)
+    for (auto& s : searches) {
         for (auto& sn : s.nodes)
             sn.listenStatus = {};
+        scheduleSearchStep(s);
+    }
 }
 
 void
 Dht::rotateSecrets()
 {
     uniform_duration_distribution<> time_dist(std::chrono::minutes(15), std::chrono::minutes(45));
-    rotate_secrets_time = now + time_dist(rd);
+    scheduler.add(now + time_dist(rd), std::bind(&Dht::rotateSecrets, this));
 
     oldsecret = secret;
     {
         crypto::random_device rdev;
         std::generate_n(secret.begin(), secret.size(), std::bind(rand_byte, std::ref(rdev)));
     }
+    old_token_state = sipInit(oldsecret);
+    token_state = sipInit(secret);
 }
 
-Blob
+Dht::Token
 Dht::makeToken(const sockaddr *sa, bool old) const
 {
-    void *ip;
+    // address followed by port
+    std::array<uint8_t, 16 + 2> data;
     size_t iplen;
     in_port_t port;
 
     if (sa->sa_family == AF_INET) {
         sockaddr_in *sin = (sockaddr_in*)sa;
-        ip = &sin->sin_addr;
         iplen = 4;
+        std::copy_n((const uint8_t*)&sin->sin_addr, iplen, data.begin());
         port = htons(sin->sin_port);
     } else if (sa->sa_family == AF_INET6) {
         sockaddr_in6 *sin6 = (sockaddr_in6*)sa;
-        ip = &sin6->sin6_addr;
         iplen = 16;
+        std::copy_n((const uint8_t*)&sin6->sin6_addr, iplen, data.begin());
         port = htons(sin6->sin6_port);
     } else {
         return {};
     }
+    std::copy_n((const uint8_t*)&port, 2, data.begin() + iplen);
 
-    const auto& c1 = old ? oldsecret : secret;
-    Blob data;
-    data.reserve(sizeof(secret)+2+iplen);
-    data.insert(data.end(), c1.begin(), c1.end());
-    data.insert(data.end(), (uint8_t*)ip, (uint8_t*)ip+iplen);
-    data.insert(data.end(), (uint8_t*)&port, ((uint8_t*)&port)+2);
-
-    size_t sz = TOKEN_SIZE;
-    Blob ret {};
-    ret.resize(sz);
-    gnutls_datum_t gnudata = {data.data(), (unsigned int)data.size()};
-    if (gnutls_fingerprint(GNUTLS_DIG_SHA512, &gnudata, ret.data(), &sz) != GNUTLS_E_SUCCESS)
-        throw DhtException("Can't compute SHA512");
-    ret.resize(sz);
+    Token ret;
+    sipHash128(old ? old_token_state : token_state, data.data(), iplen + 2, ret.data());
     return ret;
 }
 
@@ -1978,9 +3134,11 @@ Dht::tokenMatch(const Blob& token, const sockaddr *sa) const
 {
     if (!sa || token.size() != TOKEN_SIZE)
         return false;
-    if (token == makeToken(sa, false))
+    auto t = makeToken(sa, false);
+    if (std::equal(t.begin(), t.end(), token.begin()))
         return true;
-    if (token == makeToken(sa, true))
+    t = makeToken(sa, true);
+    if (std::equal(t.begin(), t.end(), token.begin()))
         return true;
     return false;
 }
@@ -2029,6 +3187,8 @@ Dht::dumpBucket(const Bucket& b, std::ostream& out) const
             out << " age " << duration_cast<seconds>(now - n->time).count() << ", reply: " << duration_cast<seconds>(now - n->reply_time).count();
         else
             out << " age " << duration_cast<seconds>(now - n->time).count();
+        if (n->rtt != duration::zero())
+            out << " rtt " << duration_cast<milliseconds>(n->rtt).count() << "ms";
         if (n->pinged)
             out << " [p " << n->pinged << "]";
         if (n->isExpired(now))
@@ -2143,13 +3303,40 @@ Dht::dumpTables() const
     DHT_DEBUG("%s", out.str().c_str());
 }
 
+std::string
+Dht::Metrics::toString() const
+{
+    std::stringstream out;
+    out << "RTT ping (us):   " << rtt_ping.toString() << std::endl;
+    out << "RTT find (us):   " << rtt_find.toString() << std::endl;
+    out << "RTT get (us):    " << rtt_get.toString() << std::endl;
+    out << "RTT listen (us): " << rtt_listen.toString() << std::endl;
+    out << "RTT put (us):    " << rtt_put.toString() << std::endl;
+    out << "Get (us):        " << get_time.toString() << std::endl;
+    out << "Put (us):        " << put_time.toString() << std::endl;
+    out << "Periodic (us):   " << periodic_time.toString() << std::endl;
+    out << "Search hops:     " << search_hops.toString() << std::endl;
+    out << "Verify (us):     " << verify_time.toString() << std::endl;
+    out << "Sign (us):       " << sign_time.toString() << std::endl;
+    out << "Encrypt (us):    " << encrypt_time.toString() << std::endl;
+    out << "Decrypt (us):    " << decrypt_time.toString() << std::endl;
+    out << "Received queue:  " << rcv_depth.toString() << std::endl;
+    out << "Pending ops:     " << ops_depth.toString() << std::endl;
+    out << "In:  " << packets_in << " packets, " << bytes_in << " bytes" << std::endl;
+    out << "Out: " << packets_out << " packets, " << bytes_out << " bytes, " << send_errors << " errors" << std::endl;
+    out << "Dropped: " << drops.malformed << " malformed, " << drops.blacklisted << " blacklisted, "
+        << drops.rate_limit_source << " rate limited (source), " << drops.rate_limit_global << " rate limited (global)";
+    return out.str();
+}
+
 std::string
 Dht::getStorageLog() const
 {
     using namespace std::chrono;
     std::stringstream out;
-    for (const auto& st : store) {
-        out << "Storage " << st.id << " " << st.listeners.size() << " list., " << st.valueCount() << " values (" << st.totalSize() << " bytes)" << std::endl;
+    for (const auto& s : store) {
+        const auto& st = s.second;
+        out << "Storage " << s.first << " " << st.listeners.size() << " list., " << st.valueCount() << " values (" << st.totalSize() << " bytes)" << std::endl;
         for (const auto& l : st.listeners) {
             out << "   " << "Listener " << l.id << " " << print_addr((sockaddr*)&l.ss, l.sslen);
             auto since = duration_cast<seconds>(now - l.time);
@@ -2184,7 +3371,8 @@ Dht::getSearchesLog(sa_family_t af) const
 
 Dht::Dht(int s, int s6, Config config)
  : dht_socket(s), dht_socket6(s6), myid(config.node_id), is_bootstrap(config.is_bootstrap),
-   now(clock::now()), mybucket_grow_time(now), mybucket6_grow_time(now)
+   max_searches(config.max_searches ? std::min(config.max_searches, MAX_SEARCHES_LIMIT) : MAX_SEARCHES),
+   now(clock::now()), mybucket_grow_time(now), mybucket6_grow_time(now), start_time(now)
 {
     if (s < 0 && s6 < 0)
         return;
@@ -2201,20 +3389,46 @@ Dht::Dht(int s, int s6, Config config)
             throw DhtException("Can't set socket to non-blocking mode");
     }
 
+    init();
+}
+
+Dht::Dht(const Transport& t, Config config)
+ : transport(t), myid(config.node_id), is_bootstrap(config.is_bootstrap),
+   max_searches(config.max_searches ? std::min(config.max_searches, MAX_SEARCHES_LIMIT) : MAX_SEARCHES)
+{
+    if (not transport.send or not (transport.ipv4 or transport.ipv6))
+        throw DhtException("Invalid transport");
+    now = getTime();
+    mybucket_grow_time = mybucket6_grow_time = start_time = now;
+
+    if (transport.ipv4)
+        buckets = {Bucket {AF_INET}};
+    if (transport.ipv6)
+        buckets6 = {Bucket {AF_INET6}};
+
+    init();
+}
+
+void
+Dht::init()
+{
     search_id = std::uniform_int_distribution<decltype(search_id)>{}(rd);
 
     uniform_duration_distribution<> time_dis {std::chrono::seconds(0), std::chrono::seconds(3)};
-    confirm_nodes_time = now + time_dis(rd);
+    nextNodesConfirmation = scheduler.add(now + time_dis(rd), std::bind(&Dht::confirmNodes, this));
+    nextStorageMaintenance = scheduler.add(time_point::max(), std::bind(&Dht::storageMaintenance, this));
 
     // Fill old secret
     {
         crypto::random_device rdev;
         std::generate_n(secret.begin(), secret.size(), std::bind(rand_byte, std::ref(rdev)));
+        std::array<uint8_t, 16> digest_key;
+        std::generate_n(digest_key.begin(), digest_key.size(), std::bind(rand_byte, std::ref(rdev)));
+        digest_state = sipInit(digest_key);
     }
     rotateSecrets();
 
-    expireBuckets(buckets);
-    expireBuckets(buckets6);
+    expire();
 
     DHT_DEBUG("DHT initialised with node ID %s", myid.toString().c_str());
 }
@@ -2223,19 +3437,84 @@ Dht::Dht(int s, int s6, Config config)
 Dht::~Dht()
 {}
 
+void
+Dht::RateLimiter::Bucket::refill(time_point now, double rate)
+{
+    if (now > last) {
+        // burst size is one second worth of requests
+        tokens = (last == time_point::min()) ? rate
+            : std::min(rate, tokens + rate * std::chrono::duration<double>(now - last).count());
+        last = now;
+    }
+}
+
+Dht::RateLimiter::Bucket&
+Dht::RateLimiter::getSourceBucket(const sockaddr* from, time_point now)
+{
+    uint64_t key;
+    std::unordered_map<uint64_t, Bucket>* sources;
+    if (from->sa_family == AF_INET) {
+        uint32_t a;
+        std::memcpy(&a, &((const sockaddr_in*)from)->sin_addr, sizeof(a));
+        key = ntohl(a) >> 8;
+        sources = &sources4;
+    } else {
+        std::memcpy(&key, &((const sockaddr_in6*)from)->sin6_addr, sizeof(key));
+        sources = &sources6;
+    }
+
+    auto it = sources->find(key);
+    if (it != sources->end())
+        return it->second;
+
+    if (sources->size() >= RATE_LIMIT_SOURCES_MAX and now - last_cleanup > std::chrono::seconds(1)) {
+        // forget sources with a full bucket, they behaved
+        last_cleanup = now;
+        constexpr double rate = MAX_REQUESTS_PER_SEC_PER_SOURCE;
+        for (auto b = sources->begin(); b != sources->end();) {
+            b->second.refill(now, rate);
+            if (b->second.tokens >= rate)
+                b = sources->erase(b);
+            else
+                ++b;
+        }
+    }
+    if (sources->size() >= RATE_LIMIT_SOURCES_MAX)
+        return overflow;
+    return sources->emplace(key, Bucket {(double)MAX_REQUESTS_PER_SEC_PER_SOURCE, now}).first->second;
+}
+
+Dht::RateLimiter::Result
+Dht::RateLimiter::limit(const sockaddr* from, time_point now)
+{
+    auto& source = getSourceBucket(from, now);
+    source.refill(now, MAX_REQUESTS_PER_SEC_PER_SOURCE);
+    if (source.tokens < 1.)
+        return Result::SOURCE;
+
+    global.refill(now, MAX_REQUESTS_PER_SEC);
+    if (global.tokens < 1.)
+        return Result::GLOBAL;
+
+    source.tokens -= 1.;
+    global.tokens -= 1.;
+    return Result::OK;
+}
+
 /* Rate control for requests we receive. */
 bool
-Dht::rateLimit()
+Dht::rateLimit(const sockaddr* from)
 {
-    using namespace std::chrono;
-    while (not rate_limit_time.empty() and duration_cast<seconds>(now - rate_limit_time.front()) > seconds(1))
-        rate_limit_time.pop();
-
-    if (rate_limit_time.size() >= MAX_REQUESTS_PER_SEC)
+    switch (rate_limiter.limit(from, now)) {
+    case RateLimiter::Result::SOURCE:
+        drop_stats.rate_limit_source++;
         return false;
-
-    rate_limit_time.emplace(now);
-    return true;
+    case RateLimiter::Result::GLOBAL:
+        drop_stats.rate_limit_global++;
+        return false;
+    default:
+        return true;
+    }
 }
 
 bool
@@ -2261,7 +3540,7 @@ Dht::neighbourhoodMaintenance(RoutingTable& list)
 
     /* Since our node-id is the same in both DHTs, it's probably
        profitable to query both families. */
-    want_t want = dht_socket >= 0 && dht_socket6 >= 0 ? (WANT4 | WANT6) : -1;
+    want_t want = isRunning(AF_INET) && isRunning(AF_INET6) ? (WANT4 | WANT6) : -1;
     auto n = q->randomNode();
     if (n) {
         DHT_DEBUG("[find %s IPv%c] sending find for neighborhood maintenance.", id.toString().c_str(), q->af == AF_INET6 ? '6' : '4');
@@ -2302,7 +3581,7 @@ Dht::bucketMaintenance(RoutingTable& list)
             if (n) {
                 want_t want = -1;
 
-                if (dht_socket >= 0 && dht_socket6 >= 0) {
+                if (isRunning(AF_INET) && isRunning(AF_INET6)) {
                     auto otherbucket = findBucket(id, q->af == AF_INET ? AF_INET6 : AF_INET);
                     if (otherbucket && otherbucket->nodes.size() < TARGET_NODES)
                         /* The corresponding bucket in the other family
@@ -2341,7 +3620,7 @@ Dht::maintainStorage(InfoHash id, bool force, DoneCallback donecb) {
     auto nodes = buckets.findClosestNodes(id);
     if (!nodes.empty()) {
         if (force || id.xorCmp(nodes.back()->id, myid) < 0) {
-            for (auto &value : local_storage->getValues()) {
+            for (auto &value : local_storage->second.getValues()) {
                 const auto& vt = getType(value.data->type);
                 if (force || value.time + vt.expiration > now + MAX_STORAGE_MAINTENANCE_EXPIRE_TIME) {
                     // gotta put that value there
@@ -2357,7 +3636,7 @@ Dht::maintainStorage(InfoHash id, bool force, DoneCallback donecb) {
     auto nodes6 = buckets6.findClosestNodes(id);
     if (!nodes6.empty()) {
         if (force || id.xorCmp(nodes6.back()->id, myid) < 0) {
-            for (auto &value : local_storage->getValues()) {
+            for (auto &value : local_storage->second.getValues()) {
                 const auto& vt = getType(value.data->type);
                 if (force || value.time + vt.expiration > now + MAX_STORAGE_MAINTENANCE_EXPIRE_TIME) {
                     // gotta put that value there
@@ -2372,7 +3651,11 @@ Dht::maintainStorage(InfoHash id, bool force, DoneCallback donecb) {
 
     if (not want4 and not want6) {
         DHT_DEBUG("Discarding storage values %s", id.toString().c_str());
-        local_storage->clear();
+        for (const auto& v : local_storage->second.getValues())
+            logDrop(id, v.data->id);
+        total_store_size -= local_storage->second.totalSize();
+        total_values -= local_storage->second.valueCount();
+        local_storage->second.clear();
     }
 
     return announce_per_af;
@@ -2389,20 +3672,24 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
 
     if (isNodeBlacklisted(from, fromlen)) {
         DHT_DEBUG("Received packet from blacklisted node.");
+        drop_stats.blacklisted++;
         return;
     }
 
     //DHT_DEBUG("processMessage %p %lu %p %lu", buf, buflen, from, fromlen);
 
+    // msg references msg_res and buf, that must outlive it.
+    msgpack::unpacked msg_res;
     ParsedMessage msg;
     try {
-        msgpack::unpacked msg_res = msgpack::unpack((const char*)buf, buflen);
+        msgpack::unpack(msg_res, (const char*)buf, buflen, referenceAll);
         msg.msgpack_unpack(msg_res.get());
         if (msg.type != MessageType::Error && msg.id == zeroes)
             throw DhtException("no or invalid InfoHash");
     } catch (const std::exception& e) {
         DHT_WARN("Can't process message of size %lu: %s.", buflen, e.what());
         DHT_DEBUG.logPrintable(buf, buflen);
+        drop_stats.malformed++;
         return;
     }
 
@@ -2413,7 +3700,7 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
 
     if (msg.type > MessageType::Reply) {
         /* Rate limit requests. */
-        if (!rateLimit()) {
+        if (!rateLimit(from)) {
             DHT_WARN("Dropping request due to rate limiting.");
             return;
         }
@@ -2436,8 +3723,10 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
                     cleared++;
                     n.getStatus.request_time = TIME_INVALID;
                     n.getStatus.reply_time = TIME_INVALID;
+                    n.getStatus.sent = 0;
                     if (searchSendGetValues(sr))
                         sr.get_step_time = now;
+                    scheduleSearchStep(sr);
                     break;
                 }
             }
@@ -2459,6 +3748,13 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
         }
         if (msg.tid.matches(TransPrefix::PING)) {
             DHT_DEBUG("[node %s %s] Pong!", msg.id.toString().c_str(), print_addr(from, fromlen).c_str());
+            auto pn = findNode(msg.id, from->sa_family);
+            /* Karn's rule: with other requests sent since the last reply,
+               the pong may answer any of them. */
+            if (pn and pn->isMessagePending(now) and pn->pinged == 1) {
+                metrics.rtt_ping.add(now - pn->pinged_time);
+                pn->updateRtt(now - pn->pinged_time);
+            }
             newNode(msg.id, from, fromlen, 2, (sockaddr*)&msg.addr.first, msg.addr.second);
         } else if (msg.tid.matches(TransPrefix::FIND_NODE) or msg.tid.matches(TransPrefix::GET_VALUES)) {
             bool gp = false;
@@ -2478,9 +3774,16 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
                 n = newNode(msg.id, from, fromlen, 1);
             } else {
                 n = newNode(msg.id, from, fromlen, 2, (sockaddr*)&msg.addr.first, msg.addr.second);
+                unsigned hops = 1;
+                if (sr)
+                    for (const auto& sn : sr->nodes)
+                        if (sn.node == n) {
+                            hops = sn.hops + 1;
+                            break;
+                        }
                 for (unsigned i = 0; i < msg.nodes4.size() / 26; i++) {
-                    uint8_t *ni = msg.nodes4.data() + i * 26;
-                    const InfoHash& ni_id = *reinterpret_cast<InfoHash*>(ni);
+                    const uint8_t *ni = msg.nodes4.data() + i * 26;
+                    const InfoHash& ni_id = *reinterpret_cast<const InfoHash*>(ni);
                     if (ni_id == myid)
                         continue;
                     sockaddr_in sin;
@@ -2490,12 +3793,12 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
                     memcpy(&sin.sin_port, ni + ni_id.size() + 4, 2);
                     auto sn = newNode(ni_id, (sockaddr*)&sin, sizeof(sin), 0);
                     if (sn && sr && sr->af == AF_INET) {
-                        sr->insertNode(sn, now);
+                        sr->insertNode(sn, now, {}, hops);
                     }
                 }
                 for (unsigned i = 0; i < msg.nodes6.size() / 38; i++) {
-                    uint8_t *ni = msg.nodes6.data() + i * 38;
-                    InfoHash* ni_id = reinterpret_cast<InfoHash*>(ni);
+                    const uint8_t *ni = msg.nodes6.data() + i * 38;
+                    const InfoHash* ni_id = reinterpret_cast<const InfoHash*>(ni);
                     if (*ni_id == myid)
                         continue;
                     sockaddr_in6 sin6;
@@ -2505,7 +3808,7 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
                     memcpy(&sin6.sin6_port, ni + HASH_LEN + 16, 2);
                     auto sn = newNode(*ni_id, (sockaddr*)&sin6, sizeof(sin6), 0);
                     if (sn && sr && sr->af == AF_INET6) {
-                        sr->insertNode(sn, now);
+                        sr->insertNode(sn, now, {}, hops);
                     }
                 }
                 if (sr) {
@@ -2521,15 +3824,27 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
                 }
             }
             if (sr) {
-                sr->insertNode(n, now, msg.token);
-                if (!msg.values.empty()) {
+                for (auto& sn : sr->nodes)
+                    if (sn.node == n) {
+                        /* Karn's rule: a reply to a request that was sent
+                           again may answer the first one, and is not timed. */
+                        if (sn.getStatus.pending(now) and sn.getStatus.sent == 1) {
+                            (msg.tid.matches(TransPrefix::GET_VALUES) ? metrics.rtt_get : metrics.rtt_find).add(now - sn.getStatus.request_time);
+                            n->updateRtt(now - sn.getStatus.request_time);
+                        }
+                        sn.getStatus.sent = 0;
+                        break;
+                    }
+                sr->insertNode(n, now, msg.token);
+                const auto& values = msg.getValues();
+                if (!values.empty()) {
                     DHT_DEBUG("[search %s IPv%c] found %u values",
                         sr->id.toString().c_str(), sr->af == AF_INET ? '4' : '6',
-                        msg.values.size());
+                        values.size());
                     for (auto& cb : sr->callbacks) {
                         if (!cb.get_cb) continue;
                         std::vector<std::shared_ptr<Value>> tmp;
-                        std::copy_if(msg.values.begin(), msg.values.end(), std::back_inserter(tmp), [&](const std::shared_ptr<Value>& v) {
+                        std::copy_if(values.begin(), values.end(), std::back_inserter(tmp), [&](const std::shared_ptr<Value>& v) {
                             return not static_cast<bool>(cb.filter) or cb.filter(*v);
                         });
                         if (not tmp.empty())
@@ -2539,7 +3854,7 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
                     for (auto& l : sr->listeners) {
                         if (!l.second.get_cb) continue;
                         std::vector<std::shared_ptr<Value>> tmp;
-                        std::copy_if(msg.values.begin(), msg.values.end(), std::back_inserter(tmp), [&](const std::shared_ptr<Value>& v) {
+                        std::copy_if(values.begin(), values.end(), std::back_inserter(tmp), [&](const std::shared_ptr<Value>& v) {
                             return not static_cast<bool>(l.second.filter) or l.second.filter(*v);
                         });
                         if (not tmp.empty())
@@ -2549,8 +3864,7 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
                         l.first(l.second);
                 }
                 // Force to recompute the next step time
-                if (sr->isSynced(now))
-                    search_time = now;
+                scheduleSearchStep(*sr);
             }
         } else if (msg.tid.matches(TransPrefix::ANNOUNCE_VALUES, &ttid)) {
             Search *sr = findSearch(ttid, from->sa_family);
@@ -2560,12 +3874,14 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
             } else {
                 DHT_DEBUG("[search %s IPv%c] got reply to put!",
                     sr->id.toString().c_str(), sr->af == AF_INET ? '4' : '6',
-                    msg.values.size());
+                    msg.getValues().size());
 
                 auto n = newNode(msg.id, from, fromlen, 2, (sockaddr*)&msg.addr.first, msg.addr.second);
                 for (auto& sn : sr->nodes)
                     if (sn.node == n) {
                         auto it = sn.acked.emplace(msg.value_id, SearchNode::RequestStatus{});
+                        if (it.first->second.pending(now))
+                            metrics.rtt_put.add(now - it.first->second.request_time);
                         it.first->second.reply_time = now;
                         break;
                     }
@@ -2599,6 +3915,8 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
                 auto n = newNode(msg.id, from, fromlen, 2, (sockaddr*)&msg.addr.first, msg.addr.second);
                 for (auto& sn : sr->nodes)
                     if (sn.node == n) {
+                        if (sn.listenStatus.pending(now))
+                            metrics.rtt_listen.add(now - sn.listenStatus.request_time);
                         sn.listenStatus.reply_time = now;
                         break;
                     }
@@ -2621,7 +3939,7 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
         in_stats.find++;
         newNode(msg.id, from, fromlen, 1);
         DHT_DEBUG("[node %s %s] got 'find' request (%d).", msg.id.toString().c_str(), print_addr(from, fromlen).c_str(), msg.want);
-        Blob ntoken = makeToken(from, false);
+        auto ntoken = makeToken(from, false);
         sendClosestNodes(from, fromlen, msg.tid, msg.target, msg.want, ntoken);
         break;
     }
@@ -2635,10 +3953,11 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
             break;
         } else {
             auto st = findStorage(msg.info_hash);
-            Blob ntoken = makeToken(from, false);
-            if (st != store.end() && not st->empty()) {
-                 DHT_DEBUG("[node %s %s] sending %u values.", msg.id.toString().c_str(), print_addr(from, fromlen).c_str(), st->valueCount());
-                 sendClosestNodes(from, fromlen, msg.tid, msg.info_hash, msg.want, ntoken, st->getValues());
+            auto ntoken = makeToken(from, false);
+            if (st != store.end() && not st->second.empty()) {
+                 DHT_DEBUG("[node %s %s] sending %u values.", msg.id.toString().c_str(), print_addr(from, fromlen).c_str(), st->second.valueCount());
+                 st->second.access_time = now;
+                 sendClosestNodes(from, fromlen, msg.tid, msg.info_hash, msg.want, ntoken, st->second.getValues(), msg.query);
             } else {
                 DHT_DEBUG("[node %s %s] sending nodes.", msg.id.toString().c_str(), print_addr(from, fromlen).c_str());
                 sendClosestNodes(from, fromlen, msg.tid, msg.info_hash, msg.want, ntoken);
@@ -2671,14 +3990,14 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
             if (msg.info_hash.xorCmp(closest_nodes.back()->id, myid) < 0) {
                 DHT_WARN("[node %s %s] announce too far from the target id. Dropping value.",
                         msg.id.toString().c_str(), print_addr(from, fromlen).c_str());
-                for (auto& v : msg.values) {
+                for (auto& v : msg.getValues()) {
                     sendValueAnnounced(from, fromlen, msg.tid, v->id);
                 }
                 break;
             }
         }
 
-        for (const auto& v : msg.values) {
+        for (const auto& v : msg.getValues()) {
             if (v->id == Value::INVALID_ID) {
                 DHT_WARN("[value %s %s] incorrect value id", msg.info_hash.toString().c_str(), v->id);
                 sendError(from, fromlen, msg.tid, 203, "Put with invalid id");
@@ -2734,7 +4053,7 @@ Dht::processMessage(const uint8_t *buf, size_t buflen, const sockaddr *from, soc
             break;
         }
         newNode(msg.id, from, fromlen, 1);
-        storageAddListener(msg.info_hash, msg.id, from, fromlen, ttid);
+        storageAddListener(msg.info_hash, msg.id, from, fromlen, ttid, msg.query);
         sendListenConfirmation(from, fromlen, msg.tid);
         break;
     }
@@ -2744,78 +4063,137 @@ time_point
 Dht::periodic(const uint8_t *buf, size_t buflen,
              const sockaddr *from, socklen_t fromlen)
 {
-    using namespace std::chrono;
-    now = clock::now();
+    now = getTime();
+    const auto start = clock::now();
 
+    if (buflen) {
+        metrics.packets_in++;
+        metrics.bytes_in += buflen;
+    }
     processMessage(buf, buflen, from, fromlen);
+    if (time_to_connected == duration::max())
+        checkConnected();
 
-    if (now >= rotate_secrets_time)
-        rotateSecrets();
+    auto next = scheduler.run(now);
 
-    if (now >= expire_stuff_time) {
-        expireBuckets(buckets);
-        expireBuckets(buckets6);
-        expireStorage();
-        expireSearches();
-    }
+    flushSendQueue();
 
-    if (now > search_time) {
-        search_time = time_point::max();
-        for (auto& sr : searches) {
-            auto step = sr.getNextStepTime(types, now);
-            if (step <= now) {
-                searchStep(sr);
-                step = sr.getNextStepTime(types, now);
-            }
-            search_time = std::min(search_time, step);
-        }
-        /*if (search_time == time_point::max())
-            DHT_DEBUG("next search time : (none)");
-        else
-            DHT_DEBUG("next search time : %lf s%s", print_dt(search_time-now), (search_time < now)?" (ASAP)":"");*/
-    }
+    metrics.periodic_time.add(clock::now() - start);
+    return next;
+}
 
-    if (now >= confirm_nodes_time) {
-        bool soon = false;
+void
+Dht::expire()
+{
+    expireBuckets(buckets);
+    expireBuckets(buckets6);
+    expireStorage();
+    expireSearches();
+    blacklist.expire(now);
 
-        if (searches.empty() and getStatus() != Status::Disconnected) {
-            get(myid, GetCallbackSimple{});
-        }
+    uniform_duration_distribution<> time_dis(std::chrono::minutes(2), std::chrono::minutes(6));
+    scheduler.add(now + duration(time_dis(rd)), std::bind(&Dht::expire, this));
+}
+
+void
+Dht::confirmNodes()
+{
+    using namespace std::chrono;
+    bool soon = false;
 
-        soon |= bucketMaintenance(buckets);
-        soon |= bucketMaintenance(buckets6);
+    if (searches.empty() and getStatus() != Status::Disconnected) {
+        get(myid, GetCallbackSimple{});
+    }
 
-        if (!soon) {
-            if (mybucket_grow_time >= now - seconds(150))
-                soon |= neighbourhoodMaintenance(buckets);
-            if (mybucket6_grow_time >= now - seconds(150))
-                soon |= neighbourhoodMaintenance(buckets6);
-        }
+    soon |= bucketMaintenance(buckets);
+    soon |= bucketMaintenance(buckets6);
 
-        /* In order to maintain all buckets' age within 600 seconds, worst
-           case is roughly 27 seconds, assuming the table is 22 bits deep.
-           We want to keep a margin for neighborhood maintenance, so keep
-           this within 25 seconds. */
-        auto time_dis = soon ?
-               uniform_duration_distribution<> {seconds(5) , seconds(25)}
-             : uniform_duration_distribution<> {seconds(60), seconds(180)};
-        confirm_nodes_time = now + time_dis(rd);
+    if (!soon) {
+        if (mybucket_grow_time >= now - seconds(150))
+            soon |= neighbourhoodMaintenance(buckets);
+        if (mybucket6_grow_time >= now - seconds(150))
+            soon |= neighbourhoodMaintenance(buckets6);
     }
 
-    //data persistence
-    time_point storage_maintenance_time = time_point::max();
-    for (auto &str : store) {
-        if (now > str.maintenance_time) {
-            maintainStorage(str.id);
-            str.maintenance_time = now + MAX_STORAGE_MAINTENANCE_EXPIRE_TIME;
+    /* In order to maintain all buckets' age within 600 seconds, worst
+       case is roughly 27 seconds, assuming the table is 22 bits deep.
+       We want to keep a margin for neighborhood maintenance, so keep
+       this within 25 seconds. */
+    auto time_dis = soon ?
+           uniform_duration_distribution<> {seconds(5) , seconds(25)}
+         : uniform_duration_distribution<> {seconds(60), seconds(180)};
+    scheduler.edit(nextNodesConfirmation, now + time_dis(rd));
+}
+
+void
+Dht::scheduleStorageMaintenance(const InfoHash& id, Storage& st, time_point t)
+{
+    maintenance_queue.erase({st.maintenance_time, id});
+    st.maintenance_time = t;
+    maintenance_queue.emplace(t, id);
+    if (nextStorageMaintenance and t < nextStorageMaintenance->time)
+        scheduler.edit(nextStorageMaintenance, t);
+}
+
+void
+Dht::storageMaintenance()
+{
+    const auto start = clock::now();
+    size_t ops = 0;
+    std::vector<InfoHash> group;
+    while (not maintenance_queue.empty() and maintenance_queue.begin()->first <= now
+       and ops < STORAGE_MAINTENANCE_OPS and clock::now() - start < STORAGE_MAINTENANCE_BUDGET)
+    {
+        const auto id = maintenance_queue.begin()->second;
+        auto st = store.find(id);
+        if (st == store.end()) {
+            maintenance_queue.erase(maintenance_queue.begin());
+            continue;
+        }
+        group.clear();
+        group.emplace_back(id);
+
+        // storages in the same bucket will be announced to the same nodes
+        const auto& table = buckets.isEmpty() ? buckets6 : buckets;
+        if (not table.isEmpty()) {
+            auto b = table.findBucket(id);
+            auto limit = now + STORAGE_MAINTENANCE_SLACK;
+            size_t visited = 0;
+            for (auto it = std::next(st); it != store.end() and table.contains(b, it->first)
+                    and visited++ < STORAGE_MAINTENANCE_GROUP; ++it)
+                if (it->second.maintenance_time <= limit)
+                    group.emplace_back(it->first);
+            visited = 0;
+            for (auto it = st; it != store.begin() and visited++ < STORAGE_MAINTENANCE_GROUP;) {
+                if (not table.contains(b, (--it)->first))
+                    break;
+                if (it->second.maintenance_time <= limit)
+                    group.emplace_back(it->first);
+            }
+        }
 
+        for (const auto& key : group) {
+            st = store.find(key);
+            if (st == store.end())
+                continue;
+            maintenance_queue.erase({st->second.maintenance_time, key});
+            ops += maintainStorage(key);
+            // maintainStorage may have removed the storage
+            st = store.find(key);
+            if (st == store.end())
+                continue;
+            st->second.maintenance_time = now + MAX_STORAGE_MAINTENANCE_EXPIRE_TIME;
+            maintenance_queue.emplace(st->second.maintenance_time, key);
         }
-        storage_maintenance_time = std::min(storage_maintenance_time, str.maintenance_time);
     }
 
-    return std::min(confirm_nodes_time, std::min(search_time, storage_maintenance_time));
+    if (maintenance_queue.empty())
+        return;
+    auto next = maintenance_queue.begin()->first;
+    scheduler.edit(nextStorageMaintenance, next <= now ? now + STORAGE_MAINTENANCE_INTERVAL : next);
 }
 
+
 std::vector<Dht::ValuesExport>
 Dht::exportValues() const
 {
@@ -2823,15 +4201,16 @@ Dht::exportValues() const
     e.reserve(store.size());
     for (const auto& h : store) {
         ValuesExport ve;
-        ve.first = h.id;
+        ve.first = h.first;
 
         msgpack::sbuffer buffer;
         msgpack::packer<msgpack::sbuffer> pk(&buffer);
-        pk.pack_array(h.getValues().size());
-        for (const auto& v : h.getValues()) {
+        pk.pack_array(h.second.getValues().size());
+        for (const auto& v : h.second.getValues()) {
             pk.pack_array(2);
             pk.pack(v.time.time_since_epoch().count());
-            v.data->msgpack_pack(pk);
+            const auto& packed = v.getPacked();
+            buffer.write((const char*)packed.data(), packed.size());
         }
         ve.second = {buffer.data(), buffer.data()+buffer.size()};
         e.push_back(std::move(ve));
@@ -2878,6 +4257,273 @@ Dht::importValues(const std::vector<ValuesExport>& import)
     }
 }
 
+struct Dht::StateExport {
+    StateWriter writer;
+    DoneCallbackSimple done;
+    std::vector<NodeExport> nodes;
+    size_t nodes_written {0};
+    bool header {true};
+    /* last exported key */
+    InfoHash last {};
+    bool started_values {false};
+};
+
+struct Dht::StateImport {
+    StateReader reader;
+    DoneCallbackSimple done;
+    msgpack::unpacker unpacker {};
+    bool header {true};
+    bool eof {false};
+};
+
+void
+Dht::exportState(StateWriter&& writer, DoneCallbackSimple&& done)
+{
+    auto e = std::make_shared<StateExport>();
+    e->writer = std::move(writer);
+    e->done = std::move(done);
+    e->nodes = exportNodes();
+    scheduler.add(now, std::bind(&Dht::exportStateChunk, this, e));
+}
+
+void
+Dht::exportState(std::ostream& os, DoneCallbackSimple&& done)
+{
+    exportState([&os](const char* data, size_t size) {
+        return (bool)os.write(data, size);
+    }, [&os, done](bool ok) {
+        os.flush();
+        if (done)
+            done(ok and os.good());
+    });
+}
+
+void
+Dht::exportStateChunk(std::shared_ptr<StateExport> e)
+{
+    msgpack::sbuffer buffer;
+    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    bool finished = false;
+
+    if (e->header) {
+        pk.pack_map(1);
+        packStr(pk, "v"); pk.pack(STATE_FORMAT_VERSION);
+        e->header = false;
+    }
+    if (e->nodes_written < e->nodes.size()) {
+        auto n = std::min(e->nodes.size() - e->nodes_written, STATE_CHUNK_SIZE);
+        pk.pack_map(1);
+        packStr(pk, "n"); pk.pack_array(n);
+        for (size_t i = e->nodes_written; i < e->nodes_written + n; i++) {
+            const auto& node = e->nodes[i];
+            pk.pack_array(3);
+            pk.pack(node.id);
+            if (node.ss.ss_family == AF_INET) {
+                const auto& sin = reinterpret_cast<const sockaddr_in&>(node.ss);
+                pk.pack_bin(sizeof(in_addr));
+                pk.pack_bin_body((const char*)&sin.sin_addr, sizeof(in_addr));
+                pk.pack(ntohs(sin.sin_port));
+            } else {
+                const auto& sin6 = reinterpret_cast<const sockaddr_in6&>(node.ss);
+                pk.pack_bin(sizeof(in6_addr));
+                pk.pack_bin_body((const char*)&sin6.sin6_addr, sizeof(in6_addr));
+                pk.pack(ntohs(sin6.sin6_port));
+            }
+        }
+        e->nodes_written += n;
+        if (e->nodes_written == e->nodes.size())
+            e->nodes.clear();
+    } else {
+        /* Iterate from the last exported key, so the store can change
+           between chunks. Values not loaded from the value log yet
+           are loaded first (see loadLogged). */
+        if (not logged_values.empty()) {
+            std::vector<InfoHash> keys;
+            auto l = e->started_values ? logged_values.upper_bound(e->last) : logged_values.begin();
+            for (; l != logged_values.end() and keys.size() < STATE_CHUNK_SIZE; ++l)
+                keys.emplace_back(l->first);
+            for (const auto& k : keys)
+                loadLogged(k);
+        }
+        auto begin = e->started_values ? store.upper_bound(e->last) : store.begin();
+        auto end = begin;
+        size_t n = 0;
+        for (; end != store.end() and n < STATE_CHUNK_SIZE; ++end)
+            if (not end->second.empty())
+                n++;
+        if (n) {
+            pk.pack_map(1);
+            packStr(pk, "s"); pk.pack_array(n);
+            for (auto st = begin; st != end; ++st) {
+                if (st->second.empty())
+                    continue;
+                const auto& values = st->second.getValues();
+                pk.pack_array(2);
+                pk.pack(st->first);
+                pk.pack_array(values.size());
+                for (const auto& v : values) {
+                    pk.pack_array(2);
+                    pk.pack((int64_t)to_time_t(v.time));
+                    const auto& packed = v.getPacked();
+                    buffer.write((const char*)packed.data(), packed.size());
+                }
+            }
+            e->last = std::prev(end)->first;
+            e->started_values = true;
+        }
+        if (end == store.end()) {
+            pk.pack_map(1);
+            packStr(pk, "end"); pk.pack(true);
+            finished = true;
+        }
+    }
+
+    if (not e->writer(buffer.data(), buffer.size())) {
+        DHT_ERROR("Can't write state export");
+        if (e->done)
+            e->done(false);
+        return;
+    }
+    if (finished) {
+        if (e->done)
+            e->done(true);
+    } else
+        scheduler.add(now, std::bind(&Dht::exportStateChunk, this, e));
+}
+
+void
+Dht::importState(StateReader&& reader, DoneCallbackSimple&& done)
+{
+    auto i = std::make_shared<StateImport>();
+    i->reader = std::move(reader);
+    i->done = std::move(done);
+    scheduler.add(now, std::bind(&Dht::importStateChunk, this, i));
+}
+
+void
+Dht::importState(std::istream& is, DoneCallbackSimple&& done)
+{
+    importState([&is](char* data, size_t size) -> size_t {
+        is.read(data, size);
+        return is.gcount();
+    }, std::move(done));
+}
+
+void
+Dht::importStateChunk(std::shared_ptr<StateImport> i)
+{
+    static constexpr size_t READ_SIZE {64 * 1024};
+    msgpack::unpacked msg;
+    // read until a full object is available
+    while (not i->unpacker.next(msg)) {
+        if (i->eof) {
+            DHT_ERROR("State import: truncated stream");
+            if (i->done)
+                i->done(false);
+            return;
+        }
+        i->unpacker.reserve_buffer(READ_SIZE);
+        auto rd = i->reader(i->unpacker.buffer(), i->unpacker.buffer_capacity());
+        if (rd == 0)
+            i->eof = true;
+        i->unpacker.buffer_consumed(rd);
+    }
+
+    bool finished;
+    try {
+        finished = importStateObject(*i, msg.get());
+    } catch (const std::exception& e) {
+        DHT_ERROR("State import: invalid stream: %s", e.what());
+        if (i->done)
+            i->done(false);
+        return;
+    }
+    if (finished) {
+        if (i->done)
+            i->done(true);
+    } else
+        scheduler.add(now, std::bind(&Dht::importStateChunk, this, i));
+}
+
+bool
+Dht::importStateObject(StateImport& i, const msgpack::object& o)
+{
+    if (i.header) {
+        auto v = findMapValue(o, "v");
+        if (not v or v->as<unsigned>() != STATE_FORMAT_VERSION)
+            throw DhtException("unsupported format version");
+        i.header = false;
+        return false;
+    }
+    if (auto nodes = findMapValue(o, "n")) {
+        if (nodes->type != msgpack::type::ARRAY)
+            throw msgpack::type_error();
+        std::vector<NodeExport> imported;
+        imported.reserve(nodes->via.array.size);
+        for (unsigned j = 0; j < nodes->via.array.size; j++) {
+            const auto& n = nodes->via.array.ptr[j];
+            if (n.type != msgpack::type::ARRAY or n.via.array.size < 3)
+                throw msgpack::type_error();
+            InfoHash id;
+            id.msgpack_unpack(n.via.array.ptr[0]);
+            const auto& addr = n.via.array.ptr[1];
+            auto port = n.via.array.ptr[2].as<in_port_t>();
+            if (addr.type != msgpack::type::BIN)
+                throw msgpack::type_error();
+            sockaddr_storage ss {};
+            socklen_t sslen;
+            if (addr.via.bin.size == sizeof(in_addr)) {
+                auto& sin = reinterpret_cast<sockaddr_in&>(ss);
+                sin.sin_family = AF_INET;
+                sin.sin_port = htons(port);
+                std::copy_n(addr.via.bin.ptr, sizeof(in_addr), (char*)&sin.sin_addr);
+                sslen = sizeof(sockaddr_in);
+            } else if (addr.via.bin.size == sizeof(in6_addr)) {
+                auto& sin6 = reinterpret_cast<sockaddr_in6&>(ss);
+                sin6.sin6_family = AF_INET6;
+                sin6.sin6_port = htons(port);
+                std::copy_n(addr.via.bin.ptr, sizeof(in6_addr), (char*)&sin6.sin6_addr);
+                sslen = sizeof(sockaddr_in6);
+            } else
+                continue;
+            imported.emplace_back(NodeExport {id, ss, sslen});
+        }
+        warmStart(imported);
+    } else if (auto values = findMapValue(o, "s")) {
+        if (values->type != msgpack::type::ARRAY)
+            throw msgpack::type_error();
+        for (unsigned j = 0; j < values->via.array.size; j++) {
+            const auto& kv = values->via.array.ptr[j];
+            if (kv.type != msgpack::type::ARRAY or kv.via.array.size < 2
+             or kv.via.array.ptr[1].type != msgpack::type::ARRAY)
+                throw msgpack::type_error();
+            InfoHash key;
+            key.msgpack_unpack(kv.via.array.ptr[0]);
+            const auto& valarr = kv.via.array.ptr[1].via.array;
+            for (unsigned k = 0; k < valarr.size; k++) {
+                const auto& valel = valarr.ptr[k];
+                time_point val_time;
+                Value tmp_val;
+                try {
+                    if (valel.type != msgpack::type::ARRAY or valel.via.array.size < 2)
+                        throw msgpack::type_error();
+                    val_time = from_time_t(valel.via.array.ptr[0].as<int64_t>());
+                    tmp_val.msgpack_unpack(valel.via.array.ptr[1]);
+                } catch (const std::exception&) {
+                    DHT_ERROR("Error reading value at %s", key.toString().c_str());
+                    continue;
+                }
+                if (val_time + getType(tmp_val.type).expiration < now)
+                    continue;
+                storageStore(key, std::make_shared<Value>(std::move(tmp_val)), val_time);
+            }
+        }
+    } else if (findMapValue(o, "end")) {
+        return true;
+    }
+    // unknown chunks are ignored
+    return false;
+}
 
 std::vector<NodeExport>
 Dht::exportNodes()
@@ -2910,12 +4556,55 @@ Dht::exportNodes()
     return nodes;
 }
 
+void
+Dht::warmStart(const std::vector<NodeExport>& nodes)
+{
+    bool idle = warm_start_nodes.empty();
+    warm_start_nodes.insert(warm_start_nodes.end(), nodes.begin(), nodes.end());
+    if (getStatus(AF_INET) != Status::Connected and getStatus(AF_INET6) != Status::Connected) {
+        start_time = now;
+        time_to_connected = duration::max();
+    }
+    DHT_DEBUG("Warm start with %lu nodes", warm_start_nodes.size());
+    if (idle)
+        scheduler.add(now, std::bind(&Dht::warmStartStep, this));
+}
+
+void
+Dht::warmStartStep()
+{
+    static constexpr size_t batch = WARM_START_PINGS_PER_SEC * WARM_START_INTERVAL.count() / 1000;
+    /* saved nodes are the closest first, ping them first */
+    auto n = std::min(batch, warm_start_nodes.size());
+    for (size_t i = 0; i < n; i++) {
+        const auto& node = warm_start_nodes[i];
+        const auto sa = reinterpret_cast<const sockaddr*>(&node.ss);
+        if (node.id == myid or isMartian(sa, node.sslen) or isNodeBlacklisted(sa, node.sslen))
+            continue;
+        sendPing(sa, node.sslen, TransId {TransPrefix::PING});
+    }
+    warm_start_nodes.erase(warm_start_nodes.begin(), warm_start_nodes.begin() + n);
+    if (not warm_start_nodes.empty())
+        scheduler.add(now + WARM_START_INTERVAL, std::bind(&Dht::warmStartStep, this));
+}
+
+void
+Dht::checkConnected()
+{
+    if (getStatus(AF_INET) != Status::Connected and getStatus(AF_INET6) != Status::Connected)
+        return;
+    time_to_connected = now - start_time;
+    DHT_DEBUG("Connected after %g s", std::chrono::duration<double>(time_to_connected).count());
+    // start looking for our neighbourhood right away
+    scheduler.edit(nextNodesConfirmation, now);
+}
+
 bool
 Dht::insertNode(const InfoHash& id, const sockaddr *sa, socklen_t salen)
 {
     if (sa->sa_family != AF_INET && sa->sa_family != AF_INET6)
         return false;
-    now = clock::now();
+    now = getTime();
     auto n = newNode(id, sa, salen, 0);
     return !!n;
 }
@@ -2933,7 +4622,7 @@ insertAddr(msgpack::packer<msgpack::sbuffer>& pk, const sockaddr *sa, socklen_t)
     size_t addr_len = (sa->sa_family == AF_INET) ? sizeof(in_addr) : sizeof(in6_addr);
     void* addr_ptr = (sa->sa_family == AF_INET) ? (void*)&((sockaddr_in*)sa)->sin_addr
                                                 : (void*)&((sockaddr_in6*)sa)->sin6_addr;
-    pk.pack("sa");
+    packStr(pk, "sa");
     pk.pack_bin(addr_len);
     pk.pack_bin_body((char*)addr_ptr, addr_len);
 }
@@ -2949,6 +4638,17 @@ Dht::send(const char *buf, size_t len, int flags, const sockaddr *sa, socklen_t
         return -1;
     }
 
+    if (transport.send) {
+        if (not isRunning(sa->sa_family))
+            return -1;
+        int rc = transport.send((const uint8_t*)buf, len, sa, salen);
+        if (rc >= 0) {
+            metrics.packets_out++;
+            metrics.bytes_out += rc;
+        }
+        return rc;
+    }
+
     int s;
     if (sa->sa_family == AF_INET)
         s = dht_socket;
@@ -2959,110 +4659,207 @@ Dht::send(const char *buf, size_t len, int flags, const sockaddr *sa, socklen_t
 
     if (s < 0)
         return -1;
-    return sendto(s, buf, len, flags, sa, salen);
+
+    if (batch_send) {
+        // errors are only known, and handled, when the queue is flushed
+        send_queue.emplace_back(PendingSend {{(const uint8_t*)buf, (const uint8_t*)buf+len}, s, flags, {}, salen});
+        std::copy_n((const uint8_t*)sa, salen, (uint8_t*)&send_queue.back().ss);
+        if (send_queue.size() >= SEND_BATCH_MAX)
+            flushSendQueue();
+        return len;
+    }
+    int rc = sendto(s, buf, len, flags, sa, salen);
+    if (rc >= 0) {
+        metrics.packets_out++;
+        metrics.bytes_out += rc;
+    } else
+        onSendError(sa, salen, errno);
+    return rc;
+}
+
+void
+Dht::onSendError(const sockaddr* sa, socklen_t salen, int err)
+{
+    metrics.send_errors++;
+    DHT_DEBUG("Can't send to %s: %s", print_addr(sa, salen).c_str(), strerror(err));
+    switch (err) {
+    case EHOSTUNREACH:
+    case ENETUNREACH:
+    case EAFNOSUPPORT:
+    case EADDRNOTAVAIL:
+        break;
+    default:
+        // transient (ENOBUFS, EAGAIN...) or local errors
+        return;
+    }
+    // the routing table and searches share the same node objects
+    for (auto& b : sa->sa_family == AF_INET ? buckets : buckets6)
+        for (auto& n : b.nodes)
+            if (n->sslen == salen and std::equal((const uint8_t*)sa, (const uint8_t*)sa + salen, (const uint8_t*)&n->ss))
+                n->setExpired(now);
+}
+
+void
+Dht::flushSendQueue()
+{
+    if (send_queue.empty())
+        return;
+#ifdef __linux__
+    std::vector<mmsghdr> msgs(send_queue.size());
+    std::vector<iovec> iovs(send_queue.size());
+    for (size_t i = 0; i < send_queue.size(); i++) {
+        auto& m = send_queue[i];
+        iovs[i].iov_base = m.data.data();
+        iovs[i].iov_len = m.data.size();
+        msgs[i].msg_hdr = {};
+        msgs[i].msg_hdr.msg_name = &m.ss;
+        msgs[i].msg_hdr.msg_namelen = m.sslen;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    // sendmmsg takes a single socket and flags: send runs of
+    // consecutive messages sharing both.
+    size_t i = 0;
+    while (i < send_queue.size()) {
+        const int s = send_queue[i].socket;
+        const int flags = send_queue[i].flags;
+        size_t n = 1;
+        while (i + n < send_queue.size() && send_queue[i+n].socket == s && send_queue[i+n].flags == flags)
+            n++;
+        int rc = sendmmsg(s, &msgs[i], n, flags);
+        if (rc <= 0) {
+            // the first message failed
+            if (rc < 0)
+                onSendError((const sockaddr*)&send_queue[i].ss, send_queue[i].sslen, errno);
+            i++;
+            continue;
+        }
+        for (int j = 0; j < rc; j++) {
+            metrics.packets_out++;
+            metrics.bytes_out += send_queue[i+j].data.size();
+        }
+        i += rc;
+        // sendmmsg stops at the first message that fails on a datagram
+        // socket, reporting it on the next call: resume after it.
+    }
+#else
+    for (const auto& m : send_queue) {
+        int rc = sendto(m.socket, (const char*)m.data.data(), m.data.size(), m.flags, (const sockaddr*)&m.ss, m.sslen);
+        if (rc >= 0) {
+            metrics.packets_out++;
+            metrics.bytes_out += rc;
+        } else
+            onSendError((const sockaddr*)&m.ss, m.sslen, errno);
+    }
+#endif
+    send_queue.clear();
 }
 
 int
 Dht::sendPing(const sockaddr *sa, socklen_t salen, TransId tid)
 {
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    send_buffer.clear();
+    msgpack::packer<msgpack::sbuffer> pk(&send_buffer);
     pk.pack_map(5);
 
-    pk.pack(std::string("a")); pk.pack_map(1);
-      pk.pack(std::string("id")); pk.pack(myid);
+    packStr(pk, "a"); pk.pack_map(1);
+      packStr(pk, "id"); pk.pack(myid);
 
-    pk.pack(std::string("q")); pk.pack(std::string("ping"));
-    pk.pack(std::string("t")); pk.pack_bin(tid.size());
-                               pk.pack_bin_body((const char*)tid.data(), tid.size());
-    pk.pack(std::string("y")); pk.pack(std::string("q"));
-    pk.pack(std::string("v")); pk.pack(my_v);
+    packStr(pk, "q"); packStr(pk, "ping");
+    packStr(pk, "t"); pk.pack_bin(tid.size());
+                      pk.pack_bin_body((const char*)tid.data(), tid.size());
+    packStr(pk, "y"); packStr(pk, "q");
+    packStr(pk, "v"); pk.pack(my_v);
 
     out_stats.ping++;
 
-    return send(buffer.data(), buffer.size(), 0, sa, salen);
+    return send(send_buffer.data(), send_buffer.size(), 0, sa, salen);
 }
 
 int
 Dht::sendPong(const sockaddr *sa, socklen_t salen, TransId tid)
 {
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    send_buffer.clear();
+    msgpack::packer<msgpack::sbuffer> pk(&send_buffer);
     pk.pack_map(4);
 
-    pk.pack(std::string("r")); pk.pack_map(2);
-      pk.pack(std::string("id")); pk.pack(myid);
+    packStr(pk, "r"); pk.pack_map(2);
+      packStr(pk, "id"); pk.pack(myid);
       insertAddr(pk, sa, salen);
 
-    pk.pack(std::string("t")); pk.pack_bin(tid.size());
-                               pk.pack_bin_body((const char*)tid.data(), tid.size());
-    pk.pack(std::string("y")); pk.pack(std::string("r"));
-    pk.pack(std::string("v")); pk.pack(my_v);
+    packStr(pk, "t"); pk.pack_bin(tid.size());
+                      pk.pack_bin_body((const char*)tid.data(), tid.size());
+    packStr(pk, "y"); packStr(pk, "r");
+    packStr(pk, "v"); pk.pack(my_v);
 
-    return send(buffer.data(), buffer.size(), 0, sa, salen);
+    return send(send_buffer.data(), send_buffer.size(), 0, sa, salen);
 }
 
 int
 Dht::sendFindNode(const sockaddr *sa, socklen_t salen, TransId tid,
                const InfoHash& target, want_t want, int confirm)
 {
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    send_buffer.clear();
+    msgpack::packer<msgpack::sbuffer> pk(&send_buffer);
     pk.pack_map(5);
 
-    pk.pack(std::string("a")); pk.pack_map(2 + (want>0?1:0));
-      pk.pack(std::string("id"));     pk.pack(myid);
-      pk.pack(std::string("target")); pk.pack(target);
+    packStr(pk, "a"); pk.pack_map(2 + (want>0?1:0));
+      packStr(pk, "id");     pk.pack(myid);
+      packStr(pk, "target"); pk.pack(target);
     if (want > 0) {
-      pk.pack(std::string("w"));
+      packStr(pk, "w");
       pk.pack_array(((want & WANT4)?1:0) + ((want & WANT6)?1:0));
       if (want & WANT4) pk.pack(AF_INET);
       if (want & WANT6) pk.pack(AF_INET6);
     }
 
-    pk.pack(std::string("q")); pk.pack(std::string("find"));
-    pk.pack(std::string("t")); pk.pack_bin(tid.size());
-                               pk.pack_bin_body((const char*)tid.data(), tid.size());
-    pk.pack(std::string("y")); pk.pack(std::string("q"));
-    pk.pack(std::string("v")); pk.pack(my_v);
+    packStr(pk, "q"); packStr(pk, "find");
+    packStr(pk, "t"); pk.pack_bin(tid.size());
+                      pk.pack_bin_body((const char*)tid.data(), tid.size());
+    packStr(pk, "y"); packStr(pk, "q");
+    packStr(pk, "v"); pk.pack(my_v);
 
     out_stats.find++;
 
-    return send(buffer.data(), buffer.size(), confirm ? 0 : MSG_CONFIRM, sa, salen);
+    return send(send_buffer.data(), send_buffer.size(), confirm ? 0 : MSG_CONFIRM, sa, salen);
 }
 
 int
 Dht::sendGetValues(const sockaddr *sa, socklen_t salen,
                TransId tid, const InfoHash& infohash,
-               want_t want, int confirm)
+               want_t want, int confirm, const Query& query)
 {
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    send_buffer.clear();
+    msgpack::packer<msgpack::sbuffer> pk(&send_buffer);
     pk.pack_map(5);
 
-    pk.pack(std::string("a"));  pk.pack_map(2 + (want>0?1:0));
-      pk.pack(std::string("id")); pk.pack(myid);
-      pk.pack(std::string("h"));  pk.pack(infohash);
+    packStr(pk, "a");  pk.pack_map(2 + (want>0?1:0) + (query.empty()?0:1));
+      packStr(pk, "id"); pk.pack(myid);
+      packStr(pk, "h");  pk.pack(infohash);
+    if (not query.empty()) {
+      packStr(pk, "q"); pk.pack(query);
+    }
     if (want > 0) {
-      pk.pack(std::string("w"));
+      packStr(pk, "w");
       pk.pack_array(((want & WANT4)?1:0) + ((want & WANT6)?1:0));
       if (want & WANT4) pk.pack(AF_INET);
       if (want & WANT6) pk.pack(AF_INET6);
     }
 
-    pk.pack(std::string("q")); pk.pack(std::string("get"));
-    pk.pack(std::string("t")); pk.pack_bin(tid.size());
-                               pk.pack_bin_body((const char*)tid.data(), tid.size());
-    pk.pack(std::string("y")); pk.pack(std::string("q"));
-    pk.pack(std::string("v")); pk.pack(my_v);
+    packStr(pk, "q"); packStr(pk, "get");
+    packStr(pk, "t"); pk.pack_bin(tid.size());
+                      pk.pack_bin_body((const char*)tid.data(), tid.size());
+    packStr(pk, "y"); packStr(pk, "q");
+    packStr(pk, "v"); pk.pack(my_v);
 
     out_stats.get++;
 
-    return send(buffer.data(), buffer.size(), confirm ? 0 : MSG_CONFIRM, sa, salen);
+    return send(send_buffer.data(), send_buffer.size(), confirm ? 0 : MSG_CONFIRM, sa, salen);
 }
 
-void
-packToken(msgpack::packer<msgpack::sbuffer>& pk, Blob token)
+template <typename T>
+static void
+packToken(msgpack::packer<msgpack::sbuffer>& pk, const T& token)
 {
     pk.pack_bin(token.size());
     pk.pack_bin_body((char*)token.data(), token.size());
@@ -3072,61 +4869,68 @@ int
 Dht::sendNodesValues(const sockaddr *sa, socklen_t salen, TransId tid,
                  const uint8_t *nodes, unsigned nodes_len,
                  const uint8_t *nodes6, unsigned nodes6_len,
-                 const std::vector<ValueStorage>& st, const Blob& token)
+                 const std::vector<ValueStorage>& st, const Token& token,
+                 const Query& query)
 {
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
-    pk.pack_map(4);
-
-    pk.pack(std::string("r"));
-    pk.pack_map(2 + (not st.empty()?1:0) + (nodes_len>0?1:0) + (nodes6_len>0?1:0) + (not token.empty()?1:0));
-    pk.pack(std::string("id")); pk.pack(myid);
-    insertAddr(pk, sa, salen);
-    if (nodes_len > 0) {
-        pk.pack(std::string("n4"));
-        pk.pack_bin(nodes_len);
-        pk.pack_bin_body((const char*)nodes, nodes_len);
-    }
-    if (nodes6_len > 0) {
-        pk.pack(std::string("n6"));
-        pk.pack_bin(nodes6_len);
-        pk.pack_bin_body((const char*)nodes6, nodes6_len);
-    }
-    if (not token.empty()) {
-        pk.pack(std::string("token")); packToken(pk, token);
-    }
+    unsigned k = 0;
     if (not st.empty()) {
         // We treat the storage as a circular list, and serve a randomly
         // chosen slice.  In order to make sure we fit,
         // we limit ourselves to 50 values.
         std::uniform_int_distribution<> pos_dis(0, st.size()-1);
-        std::vector<Blob> subset {};
-        subset.reserve(std::min<size_t>(st.size(), 50));
+        values_buffer.clear();
 
-        size_t total_size = 0;
         unsigned j0 = pos_dis(rd);
         unsigned j = j0;
-        unsigned k = 0;
+        const bool filter = not query.empty();
 
         do {
-            subset.emplace_back(packMsg(*st[j].data));
-            total_size += subset.back().size();
-            k++;
+            const auto& v = *st[j].data;
+            if (not filter or query.match(v)) {
+                if (query.ids_only and not v.isEncrypted()) {
+                    const auto packed = packMsg(Value {v.type, Blob {}, v.id});
+                    values_buffer.write((const char*)packed.data(), packed.size());
+                } else {
+                    const auto& packed = st[j].getPacked();
+                    values_buffer.write((const char*)packed.data(), packed.size());
+                }
+                k++;
+            }
             j = (j + 1) % st.size();
-        } while (j != j0 && k < 50 && total_size < MAX_VALUE_SIZE);
+        } while (j != j0 && k < 50 && values_buffer.size() < MAX_VALUE_SIZE);
+    }
+
+    send_buffer.clear();
+    msgpack::packer<msgpack::sbuffer> pk(&send_buffer);
+    pk.pack_map(4);
 
-        pk.pack(std::string("values"));
-        pk.pack_array(subset.size());
-        for (const auto& b : subset)
-            buffer.write((const char*)b.data(), b.size());
+    packStr(pk, "r");
+    pk.pack_map(3 + (k>0?1:0) + (nodes_len>0?1:0) + (nodes6_len>0?1:0));
+    packStr(pk, "id"); pk.pack(myid);
+    insertAddr(pk, sa, salen);
+    if (nodes_len > 0) {
+        packStr(pk, "n4");
+        pk.pack_bin(nodes_len);
+        pk.pack_bin_body((const char*)nodes, nodes_len);
+    }
+    if (nodes6_len > 0) {
+        packStr(pk, "n6");
+        pk.pack_bin(nodes6_len);
+        pk.pack_bin_body((const char*)nodes6, nodes6_len);
+    }
+    packStr(pk, "token"); packToken(pk, token);
+    if (k > 0) {
+        packStr(pk, "values");
+        pk.pack_array(k);
+        send_buffer.write(values_buffer.data(), values_buffer.size());
     }
 
-    pk.pack(std::string("t")); pk.pack_bin(tid.size());
-                               pk.pack_bin_body((const char*)tid.data(), tid.size());
-    pk.pack(std::string("y")); pk.pack(std::string("r"));
-    pk.pack(std::string("v")); pk.pack(my_v);
+    packStr(pk, "t"); pk.pack_bin(tid.size());
+                      pk.pack_bin_body((const char*)tid.data(), tid.size());
+    packStr(pk, "y"); packStr(pk, "r");
+    packStr(pk, "v"); pk.pack(my_v);
 
-    return send(buffer.data(), buffer.size(), 0, sa, salen);
+    return send(send_buffer.data(), send_buffer.size(), 0, sa, salen);
 }
 
 unsigned
@@ -3186,7 +4990,8 @@ Dht::bufferClosestNodes(uint8_t* nodes, unsigned numnodes, const InfoHash& id, c
 
 int
 Dht::sendClosestNodes(const sockaddr *sa, socklen_t salen, TransId tid,
-                    const InfoHash& id, want_t want, const Blob& token, const std::vector<ValueStorage>& st)
+                    const InfoHash& id, want_t want, const Token& token, const std::vector<ValueStorage>& st,
+                    const Query& query)
 {
     uint8_t nodes[8 * 26];
     uint8_t nodes6[8 * 38];
@@ -3222,54 +5027,80 @@ Dht::sendClosestNodes(const sockaddr *sa, socklen_t salen, TransId tid,
         return sendNodesValues(sa, salen, tid,
                                 nodes, numnodes * 26,
                                 nodes6, numnodes6 * 38,
-                                st, token);
+                                st, token, query);
     } catch (const std::overflow_error& e) {
         DHT_ERROR("Can't send value: buffer not large enough !");
         return -1;
     }
 }
 
+void
+Dht::pushToListeners(std::shared_ptr<ListenerPush> push)
+{
+    auto end = std::min(push->next + LISTENER_PUSH_BATCH, push->listeners.size());
+    for (; push->next < end; push->next++) {
+        const auto& l = push->listeners[push->next];
+        const auto sa = (const sockaddr*)&l.ss;
+        TransId tid {TransPrefix::GET_VALUES, l.tid};
+
+        send_buffer.clear();
+        send_buffer.write((const char*)push->head.data(), push->head.size());
+        msgpack::packer<msgpack::sbuffer> pk(&send_buffer);
+        insertAddr(pk, sa, l.sslen);
+        packStr(pk, "token"); packToken(pk, makeToken(sa, false));
+        packStr(pk, "t"); pk.pack_bin(tid.size());
+                          pk.pack_bin_body((const char*)tid.data(), tid.size());
+        send_buffer.write((const char*)push->tail.data(), push->tail.size());
+        send(send_buffer.data(), send_buffer.size(), 0, sa, l.sslen);
+    }
+    if (push->next < push->listeners.size())
+        scheduler.add(now + LISTENER_PUSH_INTERVAL, std::bind(&Dht::pushToListeners, this, push));
+}
+
 int
 Dht::sendListen(const sockaddr* sa, socklen_t salen, TransId tid,
-                        const InfoHash& infohash, const Blob& token, int confirm)
+                        const InfoHash& infohash, const Blob& token, int confirm, const Query& query)
 {
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    send_buffer.clear();
+    msgpack::packer<msgpack::sbuffer> pk(&send_buffer);
     pk.pack_map(5);
 
-    pk.pack(std::string("a")); pk.pack_map(3);
-      pk.pack(std::string("id"));    pk.pack(myid);
-      pk.pack(std::string("h"));     pk.pack(infohash);
-      pk.pack(std::string("token")); packToken(pk, token);
+    packStr(pk, "a"); pk.pack_map(3 + (query.empty()?0:1));
+      packStr(pk, "id");    pk.pack(myid);
+      packStr(pk, "h");     pk.pack(infohash);
+      packStr(pk, "token"); packToken(pk, token);
+    if (not query.empty()) {
+      packStr(pk, "q");     pk.pack(query);
+    }
 
-    pk.pack(std::string("q")); pk.pack(std::string("listen"));
-    pk.pack(std::string("t")); pk.pack_bin(tid.size());
-                               pk.pack_bin_body((const char*)tid.data(), tid.size());
-    pk.pack(std::string("y")); pk.pack(std::string("q"));
-    pk.pack(std::string("v")); pk.pack(my_v);
+    packStr(pk, "q"); packStr(pk, "listen");
+    packStr(pk, "t"); pk.pack_bin(tid.size());
+                      pk.pack_bin_body((const char*)tid.data(), tid.size());
+    packStr(pk, "y"); packStr(pk, "q");
+    packStr(pk, "v"); pk.pack(my_v);
 
     out_stats.listen++;
 
-    return send(buffer.data(), buffer.size(), confirm ? 0 : MSG_CONFIRM, sa, salen);
+    return send(send_buffer.data(), send_buffer.size(), confirm ? 0 : MSG_CONFIRM, sa, salen);
 }
 
 int
 Dht::sendListenConfirmation(const sockaddr* sa, socklen_t salen, TransId tid)
 {
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    send_buffer.clear();
+    msgpack::packer<msgpack::sbuffer> pk(&send_buffer);
     pk.pack_map(4);
 
-    pk.pack(std::string("r")); pk.pack_map(2);
-      pk.pack(std::string("id")); pk.pack(myid);
+    packStr(pk, "r"); pk.pack_map(2);
+      packStr(pk, "id"); pk.pack(myid);
       insertAddr(pk, sa, salen);
 
-    pk.pack(std::string("t")); pk.pack_bin(tid.size());
-                               pk.pack_bin_body((const char*)tid.data(), tid.size());
-    pk.pack(std::string("y")); pk.pack(std::string("r"));
-    pk.pack(std::string("v")); pk.pack(my_v);
+    packStr(pk, "t"); pk.pack_bin(tid.size());
+                      pk.pack_bin_body((const char*)tid.data(), tid.size());
+    packStr(pk, "y"); packStr(pk, "r");
+    packStr(pk, "v"); pk.pack(my_v);
 
-    return send(buffer.data(), buffer.size(), 0, sa, salen);
+    return send(send_buffer.data(), send_buffer.size(), 0, sa, salen);
 }
 
 int
@@ -3277,108 +5108,105 @@ Dht::sendAnnounceValue(const sockaddr *sa, socklen_t salen, TransId tid,
                    const InfoHash& infohash, const Value& value, time_point created,
                    const Blob& token, int confirm)
 {
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    send_buffer.clear();
+    msgpack::packer<msgpack::sbuffer> pk(&send_buffer);
     pk.pack_map(5);
 
-    pk.pack(std::string("a")); pk.pack_map((created < now ? 5 : 4));
-      pk.pack(std::string("id"));     pk.pack(myid);
-      pk.pack(std::string("h"));      pk.pack(infohash);
-      pk.pack(std::string("values")); pk.pack_array(1); pk.pack(value);
+    packStr(pk, "a"); pk.pack_map((created < now ? 5 : 4));
+      packStr(pk, "id");     pk.pack(myid);
+      packStr(pk, "h");      pk.pack(infohash);
+      packStr(pk, "values"); pk.pack_array(1); pk.pack(value);
       if (created < now) {
-          pk.pack(std::string("c"));
+          packStr(pk, "c");
           pk.pack(to_time_t(created));
       }
-      pk.pack(std::string("token"));  pk.pack(token);
+      packStr(pk, "token");  pk.pack(token);
 
-    pk.pack(std::string("q")); pk.pack(std::string("put"));
-    pk.pack(std::string("t")); pk.pack_bin(tid.size());
-                               pk.pack_bin_body((const char*)tid.data(), tid.size());
-    pk.pack(std::string("y")); pk.pack(std::string("q"));
-    pk.pack(std::string("v")); pk.pack(my_v);
+    packStr(pk, "q"); packStr(pk, "put");
+    packStr(pk, "t"); pk.pack_bin(tid.size());
+                      pk.pack_bin_body((const char*)tid.data(), tid.size());
+    packStr(pk, "y"); packStr(pk, "q");
+    packStr(pk, "v"); pk.pack(my_v);
 
     out_stats.put++;
 
-    return send(buffer.data(), buffer.size(), confirm ? 0 : MSG_CONFIRM, sa, salen);
+    return send(send_buffer.data(), send_buffer.size(), confirm ? 0 : MSG_CONFIRM, sa, salen);
 }
 
 int
 Dht::sendValueAnnounced(const sockaddr *sa, socklen_t salen, TransId tid, Value::Id vid)
 {
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    send_buffer.clear();
+    msgpack::packer<msgpack::sbuffer> pk(&send_buffer);
     pk.pack_map(4);
 
-    pk.pack(std::string("r")); pk.pack_map(3);
-      pk.pack(std::string("id"));  pk.pack(myid);
-      pk.pack(std::string("vid")); pk.pack(vid);
+    packStr(pk, "r"); pk.pack_map(3);
+      packStr(pk, "id");  pk.pack(myid);
+      packStr(pk, "vid"); pk.pack(vid);
       insertAddr(pk, sa, salen);
 
-    pk.pack(std::string("t")); pk.pack_bin(tid.size());
-                               pk.pack_bin_body((const char*)tid.data(), tid.size());
-    pk.pack(std::string("y")); pk.pack(std::string("r"));
-    pk.pack(std::string("v")); pk.pack(my_v);
+    packStr(pk, "t"); pk.pack_bin(tid.size());
+                      pk.pack_bin_body((const char*)tid.data(), tid.size());
+    packStr(pk, "y"); packStr(pk, "r");
+    packStr(pk, "v"); pk.pack(my_v);
 
-    return send(buffer.data(), buffer.size(), 0, sa, salen);
+    return send(send_buffer.data(), send_buffer.size(), 0, sa, salen);
 }
 
 int
 Dht::sendError(const sockaddr *sa, socklen_t salen, TransId tid, uint16_t code, const char *message, bool include_id)
 {
-    msgpack::sbuffer buffer;
-    msgpack::packer<msgpack::sbuffer> pk(&buffer);
+    send_buffer.clear();
+    msgpack::packer<msgpack::sbuffer> pk(&send_buffer);
     pk.pack_map(4 + (include_id?1:0));
 
-    pk.pack(std::string("e")); pk.pack_array(2);
+    packStr(pk, "e"); pk.pack_array(2);
       pk.pack(code);
       pk.pack_str(strlen(message));
       pk.pack_str_body(message, strlen(message));
 
     if (include_id) {
-        pk.pack(std::string("r")); pk.pack_map(1);
-          pk.pack(std::string("id")); pk.pack(myid);
+        packStr(pk, "r"); pk.pack_map(1);
+          packStr(pk, "id"); pk.pack(myid);
     }
 
-    pk.pack(std::string("t")); pk.pack_bin(tid.size());
-                               pk.pack_bin_body((const char*)tid.data(), tid.size());
-    pk.pack(std::string("y")); pk.pack(std::string("e"));
-    pk.pack(std::string("v")); pk.pack(my_v);
-
-    return send(buffer.data(), buffer.size(), 0, sa, salen);
-}
+    packStr(pk, "t"); pk.pack_bin(tid.size());
+                      pk.pack_bin_body((const char*)tid.data(), tid.size());
+    packStr(pk, "y"); packStr(pk, "e");
+    packStr(pk, "v"); pk.pack(my_v);
 
-msgpack::object*
-findMapValue(msgpack::object& map, const std::string& key) {
-    if (map.type != msgpack::type::MAP) throw msgpack::type_error();
-    for (unsigned i = 0; i < map.via.map.size; i++) {
-        auto& o = map.via.map.ptr[i];
-        if(o.key.type != msgpack::type::STR)
-            continue;
-        if (o.key.as<std::string>() == key) {
-            return &o.val;
-        }
-    }
-    return nullptr;
+    return send(send_buffer.data(), send_buffer.size(), 0, sa, salen);
 }
 
 void
 Dht::ParsedMessage::msgpack_unpack(msgpack::object msg)
 {
-    auto y = findMapValue(msg, "y");
-    auto a = findMapValue(msg, "a");
-    auto r = findMapValue(msg, "r");
-    auto e = findMapValue(msg, "e");
+    if (msg.type != msgpack::type::MAP) throw msgpack::type_error();
 
-    std::string query;
-    if (auto q = findMapValue(msg, "q")) {
-        if (q->type != msgpack::type::STR)
-            throw msgpack::type_error();
-        query = q->as<std::string>();
+    const msgpack::object *y {}, *a {}, *r {}, *e {}, *q {}, *t {}, *v {};
+    for (unsigned i = 0; i < msg.via.map.size; i++) {
+        auto& o = msg.via.map.ptr[i];
+        if (o.key.type != msgpack::type::STR or o.key.via.str.size != 1)
+            continue;
+        switch (o.key.via.str.ptr[0]) {
+        case 'y': y = &o.val; break;
+        case 'a': a = &o.val; break;
+        case 'r': r = &o.val; break;
+        case 'e': e = &o.val; break;
+        case 'q': q = &o.val; break;
+        case 't': t = &o.val; break;
+        case 'v': v = &o.val; break;
+        default: break;
+        }
     }
 
+    if (q and q->type != msgpack::type::STR)
+        throw msgpack::type_error();
+
     if (!a && !r && !e)
         throw msgpack::type_error();
     auto& req = a ? *a : (r ? *r : *e);
+    if (req.type != msgpack::type::MAP) throw msgpack::type_error();
 
     if (e) {
         if (e->type != msgpack::type::ARRAY)
@@ -3386,31 +5214,44 @@ Dht::ParsedMessage::msgpack_unpack(msgpack::object msg)
         error_code = e->via.array.ptr[0].as<uint16_t>();
     }
 
-    if (auto rid = findMapValue(req, "id"))
-        id = {*rid};
-
-    if (auto rh = findMapValue(req, "h"))
-        info_hash = {*rh};
-
-    if (auto rtarget = findMapValue(req, "target"))
-        target = {*rtarget};
-
-    if (auto otoken = findMapValue(req, "token"))
-        token = unpackBlob(*otoken);
-
-    if (auto vid = findMapValue(req, "vid"))
-        value_id = vid->as<Value::Id>();
-
-    if (auto rnodes4 = findMapValue(req, "n4"))
-        nodes4 = unpackBlob(*rnodes4);
-
-    if (auto rcreated = findMapValue(req, "c"))
-        created = from_time_t(rcreated->as<std::time_t>());
-
-    if (auto rnodes6 = findMapValue(req, "n6"))
-        nodes6 = unpackBlob(*rnodes6);
+    const msgpack::object *sa {}, *w {};
+    want = -1;
+    addr.second = 0;
+    for (unsigned i = 0; i < req.via.map.size; i++) {
+        auto& o = req.via.map.ptr[i];
+        if (o.key.type != msgpack::type::STR)
+            continue;
+        auto& val = o.val;
+        if (keyEquals(o.key, "id"))
+            id = {val};
+        else if (keyEquals(o.key, "h"))
+            info_hash = {val};
+        else if (keyEquals(o.key, "target"))
+            target = {val};
+        else if (keyEquals(o.key, "token"))
+            token = unpackBlob(val);
+        else if (keyEquals(o.key, "vid"))
+            value_id = val.as<Value::Id>();
+        else if (keyEquals(o.key, "n4"))
+            nodes4 = {val};
+        else if (keyEquals(o.key, "n6"))
+            nodes6 = {val};
+        else if (keyEquals(o.key, "c"))
+            created = from_time_t(val.as<std::time_t>());
+        else if (keyEquals(o.key, "sa"))
+            sa = &val;
+        else if (keyEquals(o.key, "values")) {
+            if (val.type != msgpack::type::ARRAY)
+                throw msgpack::type_error();
+            values_obj = val;
+        }
+        else if (keyEquals(o.key, "w"))
+            w = &val;
+        else if (keyEquals(o.key, "q"))
+            query.msgpack_unpack(val);
+    }
 
-    if (auto sa = findMapValue(req, "sa")) {
+    if (sa) {
         if (sa->type != msgpack::type::BIN)
             throw msgpack::type_error();
         auto l = sa->via.bin.size;
@@ -3429,21 +5270,9 @@ Dht::ParsedMessage::msgpack_unpack(msgpack::object msg)
             std::copy_n(sa->via.bin.ptr, l, (char*)&a->sin6_addr);
             addr.second = sizeof(sockaddr_in6);
         }
-    } else
-        addr.second = 0;
-
-    if (auto rvalues = findMapValue(req, "values")) {
-        if (rvalues->type != msgpack::type::ARRAY)
-            throw msgpack::type_error();
-        for (size_t i = 0; i < rvalues->via.array.size; i++)
-            try {
-                values.emplace_back(std::make_shared<Value>(rvalues->via.array.ptr[i]));
-            } catch (const std::exception& e) {
-                //DHT_WARN("Error reading value: %s", e.what());
-            }
     }
 
-    if (auto w = findMapValue(req, "w")) {
+    if (w) {
         if (w->type != msgpack::type::ARRAY)
             throw msgpack::type_error();
         want = 0;
@@ -3457,34 +5286,49 @@ Dht::ParsedMessage::msgpack_unpack(msgpack::object msg)
                     want |= WANT6;
             } catch (const std::exception& e) {};
         }
-    } else {
-        want = -1;
     }
 
-    if (auto t = findMapValue(msg, "t"))
+    if (t)
         tid = {t->as<std::array<char, 4>>()};
 
-    if (auto rv = findMapValue(msg, "v"))
-        ua = rv->as<std::string>();
+    if (v)
+        ua = v->as<std::string>();
 
     if (e)
         type = MessageType::Error;
     else if (r)
         type = MessageType::Reply;
-    else if (y and y->as<std::string>() != "q")
+    else if (y and not keyEquals(*y, "q"))
+        throw msgpack::type_error();
+    else if (not q)
         throw msgpack::type_error();
-    else if (query == "ping")
+    else if (keyEquals(*q, "ping"))
         type = MessageType::Ping;
-    else if (query == "find")
+    else if (keyEquals(*q, "find"))
         type = MessageType::FindNode;
-    else if (query == "get")
+    else if (keyEquals(*q, "get"))
         type = MessageType::GetValues;
-    else if (query == "listen")
+    else if (keyEquals(*q, "listen"))
         type = MessageType::Listen;
-    else if (query == "put")
+    else if (keyEquals(*q, "put"))
         type = MessageType::AnnounceValue;
     else
         throw msgpack::type_error();
 }
 
+const std::vector<std::shared_ptr<Value>>&
+Dht::ParsedMessage::getValues()
+{
+    if (values_obj.type == msgpack::type::ARRAY) {
+        for (size_t i = 0; i < values_obj.via.array.size; i++)
+            try {
+                values.emplace_back(std::make_shared<Value>(values_obj.via.array.ptr[i]));
+            } catch (const std::exception& e) {
+                //DHT_WARN("Error reading value: %s", e.what());
+            }
+        values_obj = {};
+    }
+    return values;
+}
+
 }
@@ -30,8 +30,19 @@
 #define close(x) closesocket(x)
 #endif
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#endif
+
+#include <limits>
+
 namespace dht {
 
+constexpr size_t DhtRunner::RCV_BATCH_MAX;
+constexpr size_t DhtRunner::RCV_POOL_MAX;
+
 DhtRunner::DhtRunner()
 {
 #ifdef _WIN32
@@ -80,56 +91,59 @@ DhtRunner::run(const sockaddr_in* local4, const sockaddr_in6* local6, DhtRunner:
     if (rcv_thread.joinable())
         rcv_thread.join();
     running = true;
-    doRun(local4, local6, config.dht_config);
-    if (not config.threaded)
+#ifdef __linux__
+    if (config.threaded) {
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_fd < 0)
+            throw DhtException(std::string("Can't create eventfd: ") + strerror(errno));
+    }
+#else
+    config.event_loop = false;
+#endif
+    doRun(local4, local6, config.dht_config, config.batched_io, config.threaded and config.event_loop);
+    if (not config.threaded or config.event_loop)
         return;
     dht_thread = std::thread([this]() {
         while (running) {
-            std::unique_lock<std::mutex> lk(dht_mtx);
-            auto wakeup = loop_();
-            cv.wait_until(lk, wakeup, [this]() {
-                if (not running)
-                    return true;
-                {
-                    std::lock_guard<std::mutex> lck(sock_mtx);
-                    if (not rcv.empty())
-                        return true;
-                }
-                {
-                    std::lock_guard<std::mutex> lck(storage_mtx);
-                    if (not pending_ops_prio.empty())
-                        return true;
-                    if (not pending_ops.empty() and getStatus() >= Dht::Status::Connecting)
-                        return true;
-                }
-                return false;
-            });
+            time_point wakeup;
+            {
+                std::lock_guard<std::mutex> lck(dht_mtx);
+                wakeup = loop_();
+            }
+            waitUntil(wakeup);
         }
     });
 }
 
 void
 DhtRunner::shutdown(Dht::ShutdownCallback cb) {
-    std::lock_guard<std::mutex> lck(storage_mtx);
-    pending_ops_prio.emplace([=](SecureDht& dht) mutable {
+    postPriority([=](SecureDht& dht) mutable {
         dht.shutdown(cb);
     });
-    cv.notify_all();
 }
 
 void
 DhtRunner::join()
 {
     running = false;
-    cv.notify_all();
+    notify();
     if (dht_thread.joinable())
         dht_thread.join();
     if (rcv_thread.joinable())
         rcv_thread.join();
+    if (event_fd >= 0) {
+        close(event_fd);
+        event_fd = -1;
+    }
     {
-        std::lock_guard<std::mutex> lck(storage_mtx);
-        pending_ops = decltype(pending_ops)();
-        pending_ops_prio = decltype(pending_ops_prio)();
+        std::lock_guard<std::mutex> lck(dht_mtx);
+        pending_ops.clear();
+        pending_ops_prio.clear();
+    }
+    {
+        std::lock_guard<std::mutex> lck(sock_mtx);
+        rcv.clear();
+        rcv_pool.clear();
     }
     {
         std::lock_guard<std::mutex> lck(dht_mtx);
@@ -147,25 +161,13 @@ DhtRunner::loop_()
     if (!dht_)
         return {};
 
-    decltype(pending_ops) ops {};
-    {
-        std::lock_guard<std::mutex> lck(storage_mtx);
-        ops = std::move(pending_ops_prio);
-    }
-    while (not ops.empty()) {
-        ops.front()(*dht_);
-        ops.pop();
-    }
-    if (getStatus() >= Dht::Status::Connecting) {
-        {
-            std::lock_guard<std::mutex> lck(storage_mtx);
-            ops = std::move(pending_ops);
-        }
-        while (not ops.empty()) {
-            ops.front()(*dht_);
-            ops.pop();
-        }
-    }
+    auto run_op = [this](std::function<void(SecureDht&)>& op) {
+        op(*dht_);
+    };
+    size_t ops = pending_ops_prio.consume(run_op);
+    if (getStatus() >= Dht::Status::Connecting)
+        ops += pending_ops.consume(run_op);
+    ops_depth.add(ops);
 
     time_point wakeup {};
     decltype(rcv) received {};
@@ -174,13 +176,17 @@ DhtRunner::loop_()
         // move to stack
         received = std::move(rcv);
     }
+    rcv_depth.add(received.size());
     if (not received.empty()) {
-        for (const auto& pck : received) {
-            auto& buf = pck.first;
-            auto& from = pck.second;
-            wakeup = dht_->periodic(buf.data(), buf.size()-1, (sockaddr*)&from.first, from.second);
+        for (const auto& pck : received)
+            wakeup = dht_->periodic(pck->data.data(), pck->size, (sockaddr*)&pck->from, pck->fromlen);
+        // give buffers back to the receive thread
+        std::lock_guard<std::mutex> lck(sock_mtx);
+        for (auto& pck : received) {
+            if (rcv_pool.size() >= RCV_POOL_MAX)
+                break;
+            rcv_pool.emplace_back(std::move(pck));
         }
-        received.clear();
     } else {
         wakeup = dht_->periodic(nullptr, 0, nullptr, 0);
     }
@@ -192,13 +198,16 @@ DhtRunner::loop_()
         status6 = nstatus6;
         if (statusCb)
             statusCb(status4, status6);
+        // run operations queued while disconnected
+        if (getStatus() >= Dht::Status::Connecting and not pending_ops.empty())
+            wakeup = clock::now();
     }
 
     return wakeup;
 }
 
 void
-DhtRunner::doRun(const sockaddr_in* sin4, const sockaddr_in6* sin6, SecureDht::Config config)
+DhtRunner::doRun(const sockaddr_in* sin4, const sockaddr_in6* sin6, SecureDht::Config config, bool batched_io, bool event_loop)
 {
     dht_.reset();
 
@@ -237,14 +246,63 @@ DhtRunner::doRun(const sockaddr_in* sin4, const sockaddr_in6* sin6, SecureDht::C
 #endif
 
     dht_ = std::unique_ptr<SecureDht>(new SecureDht {s4, s6, config});
+    dht_->setOnCryptoDone([this]() {
+        // wake up the DHT thread to deliver checked values
+        notify();
+    });
+#ifdef __linux__
+    dht_->setBatchedSend(batched_io);
+#else
+    batched_io = false;
+#endif
 
-    rcv_thread = std::thread([this,s4,s6]() {
+#ifdef __linux__
+    if (event_loop) {
+        dht_thread = std::thread([this,s4,s6]() {
+            eventLoop(s4, s6);
+        });
+        return;
+    }
+#endif
+
+    rcv_thread = std::thread([this,s4,s6,batched_io]() {
         try {
+#ifdef __linux__
+            // buffers for batched receive
+            std::vector<std::unique_ptr<ReceivedPacket>> pkts(batched_io ? RCV_BATCH_MAX : 0);
+            std::vector<iovec> iovs(pkts.size());
+            std::vector<mmsghdr> msgs(pkts.size());
+            auto drain = [&](int s) {
+                for (size_t i = 0; i < msgs.size(); i++) {
+                    if (not pkts[i])
+                        pkts[i] = getPacketBuffer();
+                    iovs[i].iov_base = pkts[i]->data.data();
+                    iovs[i].iov_len = pkts[i]->data.size();
+                    msgs[i].msg_hdr = {};
+                    msgs[i].msg_hdr.msg_name = &pkts[i]->from;
+                    msgs[i].msg_hdr.msg_namelen = sizeof(pkts[i]->from);
+                    msgs[i].msg_hdr.msg_iov = &iovs[i];
+                    msgs[i].msg_hdr.msg_iovlen = 1;
+                }
+                int n = recvmmsg(s, msgs.data(), msgs.size(), MSG_DONTWAIT, nullptr);
+                if (n <= 0)
+                    return;
+                bool was_empty;
+                {
+                    std::lock_guard<std::mutex> lck(sock_mtx);
+                    was_empty = rcv.empty();
+                    for (int i = 0; i < n; i++) {
+                        pkts[i]->size = msgs[i].msg_len;
+                        pkts[i]->fromlen = msgs[i].msg_hdr.msg_namelen;
+                        rcv.emplace_back(std::move(pkts[i]));
+                    }
+                }
+                if (was_empty)
+                    notify();
+            };
+#endif
+            auto pkt = getPacketBuffer();
             while (true) {
-                std::array<uint8_t, 1024 * 64> buf;
-                sockaddr_storage from;
-                socklen_t fromlen;
-
                 struct timeval tv {.tv_sec = 0, .tv_usec = 250000};
                 fd_set readfds;
 
@@ -265,20 +323,36 @@ DhtRunner::doRun(const sockaddr_in* sin4, const sockaddr_in6* sin6, SecureDht::C
                 if(!running)
                     break;
 
+#ifdef __linux__
+                if(rc > 0 && batched_io) {
+                    if(s4 >= 0 && FD_ISSET(s4, &readfds))
+                        drain(s4);
+                    if(s6 >= 0 && FD_ISSET(s6, &readfds))
+                        drain(s6);
+                    continue;
+                }
+#endif
+
                 if(rc > 0) {
-                    fromlen = sizeof(from);
+                    auto& buf = pkt->data;
+                    pkt->fromlen = sizeof(pkt->from);
                     if(s4 >= 0 && FD_ISSET(s4, &readfds))
-                        rc = recvfrom(s4, (char*)buf.data(), buf.size(), 0, (struct sockaddr*)&from, &fromlen);
+                        rc = recvfrom(s4, (char*)buf.data(), buf.size(), 0, (struct sockaddr*)&pkt->from, &pkt->fromlen);
                     else if(s6 >= 0 && FD_ISSET(s6, &readfds))
-                        rc = recvfrom(s6, (char*)buf.data(), buf.size(), 0, (struct sockaddr*)&from, &fromlen);
+                        rc = recvfrom(s6, (char*)buf.data(), buf.size(), 0, (struct sockaddr*)&pkt->from, &pkt->fromlen);
                     else
                         break;
                     if (rc > 0) {
+                        pkt->size = rc;
+                        bool was_empty;
                         {
                             std::lock_guard<std::mutex> lck(sock_mtx);
-                            rcv.emplace_back(Blob {buf.begin(), buf.begin()+rc+1}, std::make_pair(from, fromlen));
+                            was_empty = rcv.empty();
+                            rcv.emplace_back(std::move(pkt));
                         }
-                        cv.notify_all();
+                        if (was_empty)
+                            notify();
+                        pkt = getPacketBuffer();
                     }
                 }
             }
@@ -292,14 +366,164 @@ DhtRunner::doRun(const sockaddr_in* sin4, const sockaddr_in6* sin6, SecureDht::C
     });
 }
 
+std::unique_ptr<DhtRunner::ReceivedPacket>
+DhtRunner::getPacketBuffer()
+{
+    {
+        std::lock_guard<std::mutex> lck(sock_mtx);
+        if (not rcv_pool.empty()) {
+            auto pkt = std::move(rcv_pool.back());
+            rcv_pool.pop_back();
+            return pkt;
+        }
+    }
+    return std::unique_ptr<ReceivedPacket>(new ReceivedPacket);
+}
+
+void
+DhtRunner::post(std::function<void(SecureDht&)>&& op)
+{
+    if (pending_ops.push(std::move(op)))
+        notify();
+}
+
+void
+DhtRunner::postPriority(std::function<void(SecureDht&)>&& op)
+{
+    if (pending_ops_prio.push(std::move(op)))
+        notify();
+}
+
+void
+DhtRunner::notify()
+{
+#ifdef __linux__
+    if (event_fd >= 0) {
+        uint64_t one = 1;
+        if (write(event_fd, &one, sizeof(one)) < 0 and errno != EAGAIN)
+            perror("write");
+        return;
+    }
+#endif
+    {
+        std::lock_guard<std::mutex> lck(wake_mtx);
+        wake = true;
+    }
+    cv.notify_all();
+}
+
+#ifdef __linux__
+static int
+pollTimeout(time_point wakeup)
+{
+    if (wakeup == time_point::max())
+        return -1;
+    auto now = clock::now();
+    return wakeup <= now ? 0 : std::min<long>(
+        std::chrono::duration_cast<std::chrono::milliseconds>(wakeup - now).count() + 1,
+        std::numeric_limits<int>::max());
+}
+#endif
+
+void
+DhtRunner::waitUntil(time_point wakeup)
+{
+#ifdef __linux__
+    if (event_fd >= 0) {
+        pollfd pfd {};
+        pfd.fd = event_fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, pollTimeout(wakeup)) > 0) {
+            uint64_t val;
+            if (read(event_fd, &val, sizeof(val)) < 0 and errno != EAGAIN)
+                perror("read");
+        }
+        return;
+    }
+#endif
+    std::unique_lock<std::mutex> lk(wake_mtx);
+    cv.wait_until(lk, wakeup, [this]() {
+        return wake or not running;
+    });
+    wake = false;
+}
+
+#ifdef __linux__
+void
+DhtRunner::eventLoop(int s4, int s6)
+{
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0) {
+        perror("epoll_create1");
+        return;
+    }
+    for (int fd : {s4, s6, event_fd}) {
+        if (fd < 0)
+            continue;
+        epoll_event ev {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0)
+            perror("epoll_ctl");
+    }
+
+    try {
+        std::array<uint8_t, 1024 * 64> buf;
+        time_point wakeup = clock::now();
+        while (running) {
+            std::array<epoll_event, 3> events;
+            int n = epoll_wait(ep, events.data(), events.size(), pollTimeout(wakeup));
+            if (n < 0 && errno != EINTR) {
+                perror("epoll_wait");
+                std::this_thread::sleep_for( std::chrono::seconds(1) );
+            }
+            if (not running)
+                break;
+
+            std::lock_guard<std::mutex> lck(dht_mtx);
+            for (int i = 0; i < n; i++) {
+                int fd = events[i].data.fd;
+                if (fd == event_fd) {
+                    uint64_t val;
+                    if (read(event_fd, &val, sizeof(val)) < 0 and errno != EAGAIN)
+                        perror("read");
+                    continue;
+                }
+                // read everything available, without blocking
+                while (true) {
+                    sockaddr_storage from;
+                    socklen_t fromlen = sizeof(from);
+                    int rc = recvfrom(fd, (char*)buf.data(), buf.size(), MSG_DONTWAIT, (sockaddr*)&from, &fromlen);
+                    if (rc < 0) {
+                        if (errno == EINTR)
+                            continue;
+                        if (errno != EAGAIN and errno != EWOULDBLOCK)
+                            perror("recvfrom");
+                        break;
+                    }
+                    if (rc > 0)
+                        dht_->periodic(buf.data(), rc, (sockaddr*)&from, fromlen);
+                }
+            }
+            wakeup = loop_();
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error in DHT event loop: " << e.what() << std::endl;
+    }
+    close(ep);
+    if (s4 >= 0)
+        close(s4);
+    if (s6 >= 0)
+        close(s6);
+}
+#endif
+
 void
 DhtRunner::get(InfoHash hash, Dht::GetCallback vcb, Dht::DoneCallback dcb, Value::Filter f)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
-    pending_ops.emplace([=](SecureDht& dht) mutable {
+    post([=](SecureDht& dht) mutable {
         dht.get(hash, vcb, dcb, std::move(f));
     });
-    cv.notify_all();
 }
 
 void
@@ -311,12 +535,10 @@ DhtRunner::get(const std::string& key, Dht::GetCallback vcb, Dht::DoneCallbackSi
 std::future<size_t>
 DhtRunner::listen(InfoHash hash, Dht::GetCallback vcb, Value::Filter f)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
     auto ret_token = std::make_shared<std::promise<size_t>>();
-    pending_ops.emplace([=](SecureDht& dht) mutable {
+    post([=](SecureDht& dht) mutable {
         ret_token->set_value(dht.listen(hash, vcb, std::move(f)));
     });
-    cv.notify_all();
     return ret_token->get_future();
 }
 
@@ -329,43 +551,35 @@ DhtRunner::listen(const std::string& key, Dht::GetCallback vcb, Value::Filter f)
 void
 DhtRunner::cancelListen(InfoHash h, size_t token)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
-    pending_ops.emplace([=](SecureDht& dht) {
+    post([=](SecureDht& dht) {
         dht.cancelListen(h, token);
     });
-    cv.notify_all();
 }
 
 void
 DhtRunner::cancelListen(InfoHash h, std::shared_future<size_t> token)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
-    pending_ops.emplace([=](SecureDht& dht) {
+    post([=](SecureDht& dht) {
         auto tk = token.get();
         dht.cancelListen(h, tk);
     });
-    cv.notify_all();
 }
 
 void
 DhtRunner::put(InfoHash hash, Value&& value, Dht::DoneCallback cb)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
     auto sv = std::make_shared<Value>(std::move(value));
-    pending_ops.emplace([=](SecureDht& dht) {
+    post([=](SecureDht& dht) {
         dht.put(hash, sv, cb);
     });
-    cv.notify_all();
 }
 
 void
 DhtRunner::put(InfoHash hash, std::shared_ptr<Value> value, Dht::DoneCallback cb)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
-    pending_ops.emplace([=](SecureDht& dht) {
+    post([=](SecureDht& dht) {
         dht.put(hash, value, cb);
     });
-    cv.notify_all();
 }
 
 void
@@ -377,21 +591,43 @@ DhtRunner::put(const std::string& key, Value&& value, Dht::DoneCallbackSimple cb
 void
 DhtRunner::cancelPut(const InfoHash& h , const Value::Id& id)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
-    pending_ops.emplace([=](SecureDht& dht) {
+    post([=](SecureDht& dht) {
         dht.cancelPut(h, id);
     });
-    cv.notify_all();
+}
+
+std::future<std::vector<bool>>
+DhtRunner::putMany(std::vector<std::pair<InfoHash, std::shared_ptr<Value>>> values, unsigned concurrency)
+{
+    auto p = std::make_shared<std::promise<std::vector<bool>>>();
+    auto vals = std::make_shared<std::vector<std::pair<InfoHash, std::shared_ptr<Value>>>>(std::move(values));
+    post([=](SecureDht& dht) {
+        dht.putMany(std::move(*vals), [p](std::vector<bool>&& ok) {
+            p->set_value(std::move(ok));
+        }, concurrency);
+    });
+    return p->get_future();
+}
+
+std::future<Dht::GetManyResult>
+DhtRunner::getMany(std::vector<InfoHash> keys, Value::Filter f, unsigned concurrency)
+{
+    auto p = std::make_shared<std::promise<Dht::GetManyResult>>();
+    auto k = std::make_shared<std::vector<InfoHash>>(std::move(keys));
+    post([=](SecureDht& dht) {
+        dht.getMany(std::move(*k), [p](Dht::GetManyResult&& values) {
+            p->set_value(std::move(values));
+        }, f, concurrency);
+    });
+    return p->get_future();
 }
 
 void
 DhtRunner::putSigned(InfoHash hash, std::shared_ptr<Value> value, Dht::DoneCallback cb)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
-    pending_ops.emplace([=](SecureDht& dht) {
+    post([=](SecureDht& dht) {
         dht.putSigned(hash, value, cb);
     });
-    cv.notify_all();
 }
 
 void
@@ -409,11 +645,9 @@ DhtRunner::putSigned(const std::string& key, Value&& value, Dht::DoneCallbackSim
 void
 DhtRunner::putEncrypted(InfoHash hash, InfoHash to, std::shared_ptr<Value> value, Dht::DoneCallback cb)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);    
-    pending_ops.emplace([=](SecureDht& dht) {
+    post([=](SecureDht& dht) {
         dht.putEncrypted(hash, to, value, cb);
     });
-    cv.notify_all();
 }
 
 void
@@ -462,42 +696,108 @@ DhtRunner::bootstrap(const char* host, const char* service)
 void
 DhtRunner::bootstrap(const std::vector<std::pair<sockaddr_storage, socklen_t>>& nodes)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
-    pending_ops_prio.emplace([=](SecureDht& dht) {
+    postPriority([=](SecureDht& dht) {
         for (auto& node : nodes)
             dht.pingNode((sockaddr*)&node.first, node.second);
     });
-    cv.notify_all();
 }
 
 void
 DhtRunner::bootstrap(const std::vector<NodeExport>& nodes)
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
-    pending_ops_prio.emplace([=](SecureDht& dht) {
+    postPriority([=](SecureDht& dht) {
         for (auto& node : nodes)
             dht.insertNode(node);
     });
-    cv.notify_all();
+}
+
+void
+DhtRunner::warmStart(const std::vector<NodeExport>& nodes)
+{
+    postPriority([=](SecureDht& dht) {
+        dht.warmStart(nodes);
+    });
 }
 
 void
 DhtRunner::connectivityChanged()
 {
-    std::lock_guard<std::mutex> lck(storage_mtx);
-    pending_ops.emplace([=](SecureDht& dht) {
+    post([=](SecureDht& dht) {
         dht.connectivityChanged();
     });
-    cv.notify_all();
+}
+
+void
+DhtRunner::blacklistAddress(const sockaddr* sa, socklen_t salen, unsigned prefix_len, time_point expiration)
+{
+    if (not sa or salen > sizeof(sockaddr_storage))
+        return;
+    sockaddr_storage ss;
+    std::copy_n((const uint8_t*)sa, salen, (uint8_t*)&ss);
+    post([=](SecureDht& dht) {
+        dht.blacklistAddress((const sockaddr*)&ss, salen, prefix_len, expiration);
+    });
+}
+
+void
+DhtRunner::exportNodes(std::function<void(std::vector<NodeExport>&&)>&& cb)
+{
+    postPriority([=](SecureDht& dht) {
+        cb(dht.exportNodes());
+    });
+}
+
+void
+DhtRunner::exportState(Dht::StateWriter&& writer, Dht::DoneCallbackSimple&& done)
+{
+    auto w = std::make_shared<Dht::StateWriter>(std::move(writer));
+    auto d = std::make_shared<Dht::DoneCallbackSimple>(std::move(done));
+    post([=](SecureDht& dht) {
+        dht.exportState(std::move(*w), std::move(*d));
+    });
+}
+
+void
+DhtRunner::importState(Dht::StateReader&& reader, Dht::DoneCallbackSimple&& done)
+{
+    auto r = std::make_shared<Dht::StateReader>(std::move(reader));
+    auto d = std::make_shared<Dht::DoneCallbackSimple>(std::move(done));
+    post([=](SecureDht& dht) {
+        dht.importState(std::move(*r), std::move(*d));
+    });
+}
+
+std::future<bool>
+DhtRunner::exportState(std::ostream& os)
+{
+    auto p = std::make_shared<std::promise<bool>>();
+    auto s = &os;
+    post([=](SecureDht& dht) {
+        dht.exportState(*s, [p](bool ok) {
+            p->set_value(ok);
+        });
+    });
+    return p->get_future();
+}
+
+std::future<bool>
+DhtRunner::importState(std::istream& is)
+{
+    auto p = std::make_shared<std::promise<bool>>();
+    auto s = &is;
+    post([=](SecureDht& dht) {
+        dht.importState(*s, [p](bool ok) {
+            p->set_value(ok);
+        });
+    });
+    return p->get_future();
 }
 
 void
 DhtRunner::findCertificate(InfoHash hash, std::function<void(const std::shared_ptr<crypto::Certificate>)> cb) {
-    std::lock_guard<std::mutex> lck(storage_mtx);
-    pending_ops.emplace([=](SecureDht& dht) {
+    post([=](SecureDht& dht) {
         dht.findCertificate(hash, cb);
     });
-    cv.notify_all();
 }
 
 }
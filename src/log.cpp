@@ -0,0 +1,170 @@
+/*
+ *  Copyright (C) 2014-2016 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#include "log.h"
+
+#include <cstring>
+#include <cerrno>
+
+namespace dht {
+namespace log {
+
+constexpr size_t AsyncFileLog::DEFAULT_BUFFER_SIZE;
+constexpr size_t AsyncFileLog::MAX_MESSAGE_SIZE;
+
+void
+printLog(std::ostream& s, char const* m, va_list args)
+{
+    static constexpr int BUF_SZ = 8192;
+    char buffer[BUF_SZ];
+    int ret = vsnprintf(buffer, sizeof(buffer), m, args);
+    if (ret < 0)
+        return;
+    s.write(buffer, std::min(ret, BUF_SZ));
+    if (ret >= BUF_SZ)
+        s << "[[TRUNCATED]]";
+    s.put('\n');
+}
+
+AsyncFileLog::AsyncFileLog(const std::string& path, size_t buffer_size)
+    : buffer_(std::max(buffer_size, MAX_MESSAGE_SIZE))
+{
+    file_ = std::fopen(path.c_str(), "w");
+    if (not file_)
+        throw DhtException("Can't open log file " + path + ": " + strerror(errno));
+    thread_ = std::thread([this]() { run(); });
+}
+
+AsyncFileLog::~AsyncFileLog()
+{
+    {
+        std::lock_guard<std::mutex> lck(mtx_);
+        running_ = false;
+    }
+    cv_.notify_one();
+    thread_.join();
+    std::fclose(file_);
+}
+
+void
+AsyncFileLog::log(char const* m, va_list args)
+{
+    char msg[MAX_MESSAGE_SIZE];
+    int ret = vsnprintf(msg, sizeof(msg), m, args);
+    if (ret < 0)
+        return;
+    // keep room for the new line
+    size_t len = std::min<size_t>(ret, sizeof(msg) - 1);
+    msg[len++] = '\n';
+
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lck(mtx_);
+        if (head_ - tail_ + len > buffer_.size()) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        was_empty = head_ == tail_;
+        size_t pos = head_ % buffer_.size();
+        size_t first = std::min(len, buffer_.size() - pos);
+        std::memcpy(&buffer_[pos], msg, first);
+        std::memcpy(&buffer_[0], msg + first, len - first);
+        head_ += len;
+    }
+    if (was_empty)
+        cv_.notify_one();
+}
+
+void
+AsyncFileLog::flush()
+{
+    std::unique_lock<std::mutex> lck(mtx_);
+    auto head = head_;
+    flushed_.wait(lck, [&]() { return tail_ >= head; });
+}
+
+void
+AsyncFileLog::run()
+{
+    uint64_t reported_drops {0};
+    std::unique_lock<std::mutex> lck(mtx_);
+    while (true) {
+        cv_.wait(lck, [this]() { return head_ != tail_ or not running_; });
+        if (head_ == tail_)
+            break;
+        auto tail = tail_;
+        const auto head = head_;
+        lck.unlock();
+
+        // producers only write after head_, and before tail_ is updated
+        while (tail < head) {
+            size_t pos = tail % buffer_.size();
+            size_t n = std::min<uint64_t>(head - tail, buffer_.size() - pos);
+            std::fwrite(&buffer_[pos], 1, n, file_);
+            tail += n;
+        }
+        auto dropped = dropped_.load(std::memory_order_relaxed);
+        if (dropped != reported_drops) {
+            std::fprintf(file_, "[[%llu messages dropped]]\n", (unsigned long long)(dropped - reported_drops));
+            reported_drops = dropped;
+        }
+        std::fflush(file_);
+
+        lck.lock();
+        tail_ = tail;
+        flushed_.notify_all();
+    }
+}
+
+static LogMethod
+atLevel(Level level, Level min, LogMethod&& method)
+{
+    return level >= min ? std::move(method) : LogMethod(NOLOG);
+}
+
+void
+enableLogging(dht::DhtRunner& dht, Level level)
+{
+    dht.setLoggers(
+        [](char const* m, va_list args){ std::cerr << red; printLog(std::cerr, m, args); std::cerr << def; },
+        atLevel(level, Level::Warning, [](char const* m, va_list args){ std::cout << yellow; printLog(std::cout, m, args); std::cout << def; }),
+        atLevel(level, Level::Debug, [](char const* m, va_list args){ printLog(std::cout, m, args); })
+    );
+}
+
+void
+enableFileLogging(dht::DhtRunner& dht, const std::string& path, Level level)
+{
+    auto logfile = std::make_shared<AsyncFileLog>(path);
+    auto sink = [logfile](char const* m, va_list args){ logfile->log(m, args); };
+    dht.setLoggers(
+        sink,
+        atLevel(level, Level::Warning, sink),
+        atLevel(level, Level::Debug, sink)
+    );
+}
+
+void
+disableLogging(dht::DhtRunner& dht)
+{
+    dht.setLoggers(dht::NOLOG, dht::NOLOG, dht::NOLOG);
+}
+
+}
+}
@@ -0,0 +1,53 @@
+/*
+ *  Copyright (C) 2014-2016 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#include "metrics.h"
+
+#include <sstream>
+#include <algorithm>
+
+namespace dht {
+
+constexpr unsigned Histogram::BUCKETS;
+
+uint64_t
+Histogram::quantile(double p) const
+{
+    if (count_ == 0)
+        return 0;
+    uint64_t rank = p * count_;
+    uint64_t n = 0;
+    for (unsigned i = 0; i < BUCKETS; i++) {
+        n += buckets_[i];
+        if (n > rank)
+            return i == 0 ? 0 : std::min(max_, (uint64_t(1) << i) - 1);
+    }
+    return max_;
+}
+
+std::string
+Histogram::toString() const
+{
+    std::stringstream out;
+    out << "n=" << count_ << " mean=" << mean() << " p50<=" << quantile(0.5)
+        << " p99<=" << quantile(0.99) << " max=" << max_;
+    return out.str();
+}
+
+}
@@ -29,9 +29,41 @@ extern "C" {
 }
 
 #include <random>
+#include <algorithm>
+
+// Log arguments are only evaluated if the level is enabled
+#define DHT_DEBUG(...) DHT_LOG(DHT_DEBUG, __VA_ARGS__)
+#define DHT_WARN(...) DHT_LOG(DHT_WARN, __VA_ARGS__)
+#define DHT_ERROR(...) DHT_LOG(DHT_ERROR, __VA_ARGS__)
 
 namespace dht {
 
+/**
+ * State of a get or listen operation whose values are checked by the
+ * crypto worker threads. Only accessed from the DHT thread.
+ */
+struct SecureDht::AsyncGet {
+    GetCallback cb;
+    Value::Filter filter;
+    DoneCallback donecb {};
+
+    /* the callback asked to stop */
+    bool stop {false};
+
+    /* number of batches received but not delivered yet */
+    unsigned pending {0};
+    uint64_t next_seq {0};
+    uint64_t deliver_seq {0};
+    std::map<uint64_t, std::vector<std::shared_ptr<Value>>> ready {};
+
+    /* the operation is over, waiting for pending batches */
+    bool done {false};
+    bool done_ok {false};
+    std::vector<std::shared_ptr<Node>> done_nodes {};
+};
+
+constexpr size_t SecureDht::SIGNATURE_CACHE_MAX;
+
 Dht::Config& getConfig(SecureDht::Config& conf)
 {
     auto& c = conf.node_config;
@@ -80,21 +112,70 @@ SecureDht::SecureDht(int s, int s6, SecureDht::Config conf)
                 DHT_ERROR("SecureDht: error while announcing public key!");
         });
     }
+
+    orderedDelivery_ = conf.ordered_delivery;
+    for (unsigned i = 0; i < conf.crypto_threads; i++)
+        cryptoWorkers_.emplace_back(&SecureDht::cryptoWorker, this);
 }
 
 SecureDht::~SecureDht()
 {
+    {
+        std::lock_guard<std::mutex> lck(cryptoMtx_);
+        cryptoStop_ = true;
+    }
+    cryptoCv_.notify_all();
+    for (auto& w : cryptoWorkers_)
+        w.join();
 #if GNUTLS_VERSION_NUMBER < 0x030300
     gnutls_global_deinit();
 #endif
 }
 
+void
+SecureDht::cryptoWorker()
+{
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lk(cryptoMtx_);
+            cryptoCv_.wait(lk, [this]() {
+                return cryptoStop_ or not cryptoJobs_.empty();
+            });
+            if (cryptoStop_)
+                return;
+            job = std::move(cryptoJobs_.front());
+            cryptoJobs_.pop();
+        }
+        job();
+    }
+}
+
+time_point
+SecureDht::periodic(const uint8_t *buf, size_t buflen, const sockaddr* from, socklen_t fromlen)
+{
+    auto next = Dht::periodic(buf, buflen, from, fromlen);
+    if (cryptoWorkers_.empty())
+        return next;
+
+    decltype(cryptoDone_) done {};
+    {
+        std::lock_guard<std::mutex> lck(cryptoDoneMtx_);
+        std::swap(done, cryptoDone_);
+    }
+    while (not done.empty()) {
+        done.front()();
+        done.pop();
+    }
+    return next;
+}
+
 ValueType
 SecureDht::secureType(ValueType&& type)
 {
     type.storePolicy = [this,type](InfoHash id, std::shared_ptr<Value>& v, InfoHash nid, const sockaddr* a, socklen_t al) {
         if (v->isSigned()) {
-            if (!v->owner.checkSignature(v->getToSign(), v->signature)) {
+            if (!checkSignature(*v)) {
                 DHT_WARN("Signature verification failed");
                 return false;
             }
@@ -110,7 +191,8 @@ SecureDht::secureType(ValueType&& type)
             DHT_WARN("Edition forbidden: owner changed.");
             return false;
         }
-        if (!o->owner.checkSignature(n->getToSign(), n->signature)) {
+        // owners are the same: n is signed by o->owner if its signature is valid
+        if (!checkSignature(*n)) {
             DHT_WARN("Edition forbidden: signature verification failed.");
             return false;
         }
@@ -141,6 +223,43 @@ SecureDht::getCertificate(const InfoHash& node) const
         return it->second;
 }
 
+bool
+SecureDht::checkSignature(const Value& v)
+{
+    auto to_sign = v.getToSign();
+    Blob signed_data {to_sign};
+    signed_data.insert(signed_data.end(), v.signature.begin(), v.signature.end());
+    auto digest = crypto::hash(signed_data);
+    {
+        std::lock_guard<std::mutex> lck(sigCacheMtx_);
+        auto c = sigCache_.find(digest);
+        if (c != sigCache_.end()) {
+            sigCacheHits_++;
+            sigCacheOrder_.splice(sigCacheOrder_.begin(), sigCacheOrder_, c->second);
+            return true;
+        }
+        sigCacheMisses_++;
+    }
+
+    auto start = clock::now();
+    bool ok = v.owner.checkSignature(to_sign, v.signature);
+    addCryptoTime(verifyTime_, start);
+    if (not ok)
+        return false;
+
+    // only successful verifications are cached
+    std::lock_guard<std::mutex> lck(sigCacheMtx_);
+    if (sigCache_.find(digest) != sigCache_.end())
+        return true;
+    if (sigCache_.size() >= SIGNATURE_CACHE_MAX) {
+        sigCache_.erase(sigCacheOrder_.back());
+        sigCacheOrder_.pop_back();
+    }
+    sigCacheOrder_.emplace_front(digest);
+    sigCache_.emplace(std::move(digest), sigCacheOrder_.begin());
+    return true;
+}
+
 const std::shared_ptr<crypto::Certificate>
 SecureDht::registerCertificate(const InfoHash& node, const Blob& data)
 {
@@ -214,41 +333,52 @@ SecureDht::findCertificate(const InfoHash& node, std::function<void(const std::s
 }
 
 
+std::shared_ptr<Value>
+SecureDht::checkValue(const std::shared_ptr<Value>& v)
+{
+    // Decrypt encrypted values
+    if (v->isEncrypted()) {
+        if (not key_)
+            return {};
+        try {
+            Value decrypted_val (decrypt(*v));
+            if (decrypted_val.recipient == getId())
+                return std::make_shared<Value>(std::move(decrypted_val));
+            // Ignore values belonging to other people
+        } catch (const std::exception& e) {
+            DHT_WARN("Could not decrypt value %s : %s", v->toString().c_str(), e.what());
+        }
+    }
+    // Check signed values
+    else if (v->isSigned()) {
+        if (checkSignature(*v))
+            return v;
+        DHT_WARN("Signature verification failed for %s", v->toString().c_str());
+    }
+    // Forward normal values
+    else
+        return v;
+    return {};
+}
+
+/* The query of a filter, for the remote nodes: the filter itself is
+   applied once the values are decrypted and checked. */
+static Value::Filter
+queryFilter(const Value::Filter& f)
+{
+    const auto& q = f.getQuery();
+    return q ? Value::Filter(*q) : Value::Filter {};
+}
+
 Dht::GetCallback
 SecureDht::getCallbackFilter(GetCallback cb, Value::Filter&& filter)
 {
     return [=](const std::vector<std::shared_ptr<Value>>& values) {
         std::vector<std::shared_ptr<Value>> tmpvals {};
         for (const auto& v : values) {
-            // Decrypt encrypted values
-            if (v->isEncrypted()) {
-                if (not key_)
-                    continue;
-                try {
-                    Value decrypted_val (decrypt(*v));
-                    if (decrypted_val.recipient == getId()) {
-                        if (not filter or filter(decrypted_val))
-                            tmpvals.push_back(std::make_shared<Value>(std::move(decrypted_val)));
-                    }
-                    // Ignore values belonging to other people
-                } catch (const std::exception& e) {
-                    DHT_WARN("Could not decrypt value %s : %s", v->toString().c_str(), e.what());
-                }
-            }
-            // Check signed values
-            else if (v->isSigned()) {
-                if (v->owner.checkSignature(v->getToSign(), v->signature)) {
-                    if (not filter  or filter(*v))
-                        tmpvals.push_back(v);
-                }
-                else
-                    DHT_WARN("Signature verification failed for %s", v->toString().c_str());
-            }
-            // Forward normal values
-            else {
-                if (not filter or filter(*v))
-                    tmpvals.push_back(v);
-            }
+            auto cv = checkValue(v);
+            if (cv and (not filter or filter(*cv)))
+                tmpvals.push_back(std::move(cv));
         }
         if (cb && not tmpvals.empty())
             return cb(tmpvals);
@@ -256,16 +386,119 @@ SecureDht::getCallbackFilter(GetCallback cb, Value::Filter&& filter)
     };
 }
 
+Dht::GetCallback
+SecureDht::getCallbackAsync(const std::shared_ptr<AsyncGet>& op)
+{
+    return [this,op](const std::vector<std::shared_ptr<Value>>& values) {
+        if (op->stop)
+            return false;
+        auto seq = op->next_seq++;
+        op->pending++;
+        bool check = std::any_of(values.begin(), values.end(), [](const std::shared_ptr<Value>& v) {
+            return v->isEncrypted() or v->isSigned();
+        });
+        if (not check) {
+            // nothing to check: deliver now (or as soon as
+            // previous batches are delivered).
+            deliverAsync(op, seq, std::vector<std::shared_ptr<Value>>(values));
+            return not op->stop;
+        }
+        {
+            std::lock_guard<std::mutex> lck(cryptoMtx_);
+            cryptoJobs_.emplace([this,op,seq,values]() {
+                std::vector<std::shared_ptr<Value>> checked {};
+                checked.reserve(values.size());
+                for (const auto& v : values)
+                    if (auto cv = checkValue(v))
+                        checked.emplace_back(std::move(cv));
+                {
+                    std::lock_guard<std::mutex> lck(cryptoDoneMtx_);
+                    cryptoDone_.emplace([this,op,seq,checked]() mutable {
+                        deliverAsync(op, seq, std::move(checked));
+                    });
+                }
+                if (onCryptoDone_)
+                    onCryptoDone_();
+            });
+        }
+        cryptoCv_.notify_one();
+        return true;
+    };
+}
+
+Dht::DoneCallback
+SecureDht::getDoneCallbackAsync(const std::shared_ptr<AsyncGet>& op)
+{
+    return [op](bool ok, const std::vector<std::shared_ptr<Node>>& nodes) {
+        if (op->pending) {
+            // called by deliverAsync when all values are delivered
+            op->done = true;
+            op->done_ok = ok;
+            op->done_nodes = nodes;
+            return;
+        }
+        if (op->donecb)
+            op->donecb(ok, nodes);
+    };
+}
+
+void
+SecureDht::deliverAsync(const std::shared_ptr<AsyncGet>& op, uint64_t seq, std::vector<std::shared_ptr<Value>>&& values)
+{
+    op->pending--;
+    auto deliver = [&](const std::vector<std::shared_ptr<Value>>& vals) {
+        if (op->stop or not op->cb)
+            return;
+        std::vector<std::shared_ptr<Value>> tmpvals {};
+        for (const auto& v : vals)
+            if (not op->filter or op->filter(*v))
+                tmpvals.push_back(v);
+        if (not tmpvals.empty() and not op->cb(tmpvals))
+            op->stop = true;
+    };
+    if (orderedDelivery_) {
+        op->ready.emplace(seq, std::move(values));
+        auto r = op->ready.begin();
+        while (r != op->ready.end() and r->first == op->deliver_seq) {
+            deliver(r->second);
+            op->deliver_seq++;
+            r = op->ready.erase(r);
+        }
+    } else
+        deliver(values);
+
+    if (op->done and not op->pending) {
+        op->done = false;
+        if (op->donecb)
+            op->donecb(op->done_ok, op->done_nodes);
+    }
+}
+
 void
 SecureDht::get(const InfoHash& id, GetCallback cb, DoneCallback donecb, Value::Filter&& f)
 {
-    Dht::get(id, getCallbackFilter(cb, std::forward<Value::Filter>(f)), donecb);
+    auto qf = queryFilter(f);
+    if (cryptoWorkers_.empty()) {
+        Dht::get(id, getCallbackFilter(cb, std::forward<Value::Filter>(f)), donecb, std::move(qf));
+        return;
+    }
+    auto op = std::make_shared<AsyncGet>();
+    op->cb = cb;
+    op->filter = std::move(f);
+    op->donecb = donecb;
+    Dht::get(id, getCallbackAsync(op), getDoneCallbackAsync(op), std::move(qf));
 }
 
 size_t
 SecureDht::listen(const InfoHash& id, GetCallback cb, Value::Filter&& f)
 {
-    return Dht::listen(id, getCallbackFilter(cb, std::forward<Value::Filter>(f)));
+    auto qf = queryFilter(f);
+    if (cryptoWorkers_.empty())
+        return Dht::listen(id, getCallbackFilter(cb, std::forward<Value::Filter>(f)), std::move(qf));
+    auto op = std::make_shared<AsyncGet>();
+    op->cb = cb;
+    op->filter = std::move(f);
+    return Dht::listen(id, getCallbackAsync(op), std::move(qf));
 }
 
 void
@@ -330,8 +563,10 @@ SecureDht::sign(Value& v) const
 {
     if (v.isEncrypted())
         throw DhtException("Can't sign encrypted data.");
+    auto start = clock::now();
     v.owner = key_->getPublicKey();
     v.signature = key_->sign(v.getToSign());
+    addCryptoTime(signTime_, start);
 }
 
 Value
@@ -341,18 +576,36 @@ SecureDht::encrypt(Value& v, const crypto::PublicKey& to) const
         throw DhtException("Data is already encrypted.");
     v.setRecipient(to.getId());
     sign(v);
+    auto start = clock::now();
     Value nv {v.id};
     nv.setCypher(to.encrypt(v.getToEncrypt()));
+    addCryptoTime(encryptTime_, start);
     return nv;
 }
 
+Dht::Metrics
+SecureDht::getMetrics(bool reset)
+{
+    auto m = Dht::getMetrics(reset);
+    std::lock_guard<std::mutex> lck(cryptoTimeMtx_);
+    m.verify_time = verifyTime_;
+    m.sign_time = signTime_;
+    m.encrypt_time = encryptTime_;
+    m.decrypt_time = decryptTime_;
+    if (reset)
+        verifyTime_ = signTime_ = encryptTime_ = decryptTime_ = {};
+    return m;
+}
+
 Value
 SecureDht::decrypt(const Value& v)
 {
     if (not v.isEncrypted())
         throw DhtException("Data is not encrypted.");
 
+    auto start = clock::now();
     auto decrypted = key_->decrypt(v.cypher);
+    addCryptoTime(decryptTime_, start);
 
     Value ret {v.id};
     auto msg = msgpack::unpack((const char*)decrypted.data(), decrypted.size());
@@ -0,0 +1,196 @@
+/*
+ *  Copyright (C) 2014-2016 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#include "sharded_runner.h"
+
+#include <atomic>
+
+namespace dht {
+
+void
+ShardedDhtRunner::run(in_port_t port, Config config)
+{
+    if (isRunning())
+        return;
+    if (config.shards == 0 or config.shards > 256)
+        throw DhtException("invalid number of shards");
+    join();
+
+    // spread node ids evenly over the keyspace
+    auto& node_config = config.runner_config.dht_config.node_config;
+    InfoHash base = node_config.node_id == InfoHash() ? InfoHash::getRandom() : node_config.node_id;
+    for (unsigned i = 0; i < config.shards; i++) {
+        InfoHash id = base;
+        id[0] = (i * 256 + base[0]) / config.shards;
+        ids_.emplace_back(id);
+    }
+
+    // Status callbacks run on the shard threads and use shards_:
+    // create every shard before running any of them.
+    {
+        std::lock_guard<std::mutex> lck(mtx_);
+        status_.resize(config.shards, {Dht::Status::Disconnected, Dht::Status::Disconnected});
+        shards_.reserve(config.shards);
+        for (unsigned i = 0; i < config.shards; i++) {
+            shards_.emplace_back(new DhtRunner);
+            shards_.back()->setOnStatusChanged([this,i](Dht::Status s4, Dht::Status s6) {
+                onStatusChanged(i, s4, s6);
+            });
+        }
+    }
+
+    for (unsigned i = 0; i < config.shards; i++) {
+        auto c = config.runner_config;
+        c.dht_config.node_config.node_id = ids_[i];
+        shards_[i]->run(port ? port + i : 0, c);
+    }
+}
+
+time_point
+ShardedDhtRunner::loop()
+{
+    time_point wakeup = time_point::max();
+    for (auto& shard : shards_)
+        wakeup = std::min(wakeup, shard->loop());
+    return wakeup;
+}
+
+void
+ShardedDhtRunner::shutdown(Dht::ShutdownCallback cb)
+{
+    auto remaining = std::make_shared<std::atomic<unsigned>>(shards_.size());
+    for (auto& shard : shards_) {
+        shard->shutdown([=]() {
+            if (--*remaining == 0 and cb)
+                cb();
+        });
+    }
+}
+
+void
+ShardedDhtRunner::join()
+{
+    for (auto& shard : shards_)
+        shard->join();
+    std::lock_guard<std::mutex> lck(mtx_);
+    shards_.clear();
+    ids_.clear();
+    status_.clear();
+    seeded_ = false;
+}
+
+DhtRunner&
+ShardedDhtRunner::getShard(const InfoHash& key)
+{
+    if (shards_.empty())
+        throw DhtException("dht is not running");
+    size_t best = 0;
+    for (size_t i = 1; i < ids_.size(); i++)
+        if (key.xorCmp(ids_[i], ids_[best]) < 0)
+            best = i;
+    return *shards_[best];
+}
+
+void
+ShardedDhtRunner::onStatusChanged(size_t shard, Dht::Status status4, Dht::Status status6)
+{
+    std::unique_lock<std::mutex> lck(mtx_);
+    if (shard >= status_.size())
+        return;
+    auto best = [this]() {
+        auto b = std::make_pair(Dht::Status::Disconnected, Dht::Status::Disconnected);
+        for (const auto& s : status_) {
+            b.first = std::max(b.first, s.first);
+            b.second = std::max(b.second, s.second);
+        }
+        return b;
+    };
+    auto old_status = best();
+    status_[shard] = {status4, status6};
+    auto new_status = best();
+
+    // The first shard to connect shares its routing table with
+    // the others, so they don't all have to walk the network.
+    if (not seeded_ and shards_.size() > 1 and std::max(status4, status6) == Dht::Status::Connected) {
+        seeded_ = true;
+        shards_[shard]->exportNodes([this,shard](std::vector<NodeExport>&& nodes) {
+            std::lock_guard<std::mutex> lck(mtx_);
+            for (size_t i = 0; i < shards_.size(); i++)
+                if (i != shard)
+                    shards_[i]->bootstrap(nodes);
+        });
+    }
+
+    auto cb = statusCb_;
+    lck.unlock();
+    if (cb and new_status != old_status)
+        cb(new_status.first, new_status.second);
+}
+
+void
+ShardedDhtRunner::bootstrap(const char* host, const char* service)
+{
+    bootstrap(DhtRunner::getAddrInfo(host, service));
+}
+
+void
+ShardedDhtRunner::bootstrap(const std::vector<std::pair<sockaddr_storage, socklen_t>>& nodes)
+{
+    for (auto& shard : shards_)
+        shard->bootstrap(nodes);
+}
+
+void
+ShardedDhtRunner::bootstrap(const std::vector<NodeExport>& nodes)
+{
+    for (auto& shard : shards_)
+        shard->bootstrap(nodes);
+}
+
+void
+ShardedDhtRunner::connectivityChanged()
+{
+    for (auto& shard : shards_)
+        shard->connectivityChanged();
+}
+
+std::vector<NodeExport>
+ShardedDhtRunner::exportNodes() const
+{
+    std::vector<NodeExport> nodes;
+    for (const auto& shard : shards_) {
+        auto n = shard->exportNodes();
+        nodes.insert(nodes.end(), n.begin(), n.end());
+    }
+    return nodes;
+}
+
+std::pair<size_t, size_t>
+ShardedDhtRunner::getStoreSize() const
+{
+    std::pair<size_t, size_t> size {0, 0};
+    for (const auto& shard : shards_) {
+        auto s = shard->getStoreSize();
+        size.first += s.first;
+        size.second += s.second;
+    }
+    return size;
+}
+
+}
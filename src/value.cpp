@@ -80,6 +80,151 @@ findMapValue(const msgpack::object& map, const std::string& key) {
     return nullptr;
 }
 
+/* With ids_only, remote nodes send values without their content:
+   only their id and type can be checked. */
+Value::Filter::Filter(const Query& q)
+    : std::function<bool(const Value&)>([q](const Value& v) {
+        if (q.ids_only and v.data.empty() and not v.owner)
+            return q.matchIdAndType(v);
+        return q.match(v);
+    }),
+      query(std::make_shared<Query>(q))
+{}
+
+/* The query of the combined filter can match more values than the
+   filter itself: the filter still applies locally. */
+static std::shared_ptr<const Query>
+combineQueries(const std::shared_ptr<const Query>& a, const std::shared_ptr<const Query>& b)
+{
+    if (not a)
+        return b;
+    if (not b)
+        return a;
+    return std::make_shared<Query>(Query::combine(*a, *b));
+}
+
+Value::Filter
+Value::Filter::chain(Filter&& f1, Filter&& f2)
+{
+    auto q = combineQueries(f1.query, f2.query);
+    Filter f = [f1,f2](const Value& v){
+        return f1(v) && f2(v);
+    };
+    f.query = std::move(q);
+    return f;
+}
+
+Value::Filter
+Value::Filter::chain(std::initializer_list<Filter> l)
+{
+    const std::vector<Filter> list(l.begin(), l.end());
+    std::shared_ptr<const Query> q;
+    for (const auto& f : list)
+        q = combineQueries(q, f.query);
+    Filter f = [list](const Value& v){
+        for (const auto& f : list)
+            if (f and not f(v))
+                return false;
+        return true;
+    };
+    f.query = std::move(q);
+    return f;
+}
+
+Value::Filter
+Value::Filter::chain(Filter&& f2)
+{
+    Filter f1 = std::move(*this);
+    return chain(std::move(f1), std::move(f2));
+}
+
+Value::Filter
+Value::TypeFilter(const ValueType& t)
+{
+    Query q;
+    q.types = {t.id};
+    return q;
+}
+
+Value::Filter
+Value::IdFilter(const Id id)
+{
+    Query q;
+    q.ids = {id};
+    return q;
+}
+
+bool
+Query::matchIdAndType(const Value& v) const
+{
+    if (not ids.empty() and std::find(ids.begin(), ids.end(), v.id) == ids.end())
+        return false;
+    // other fields are encrypted
+    if (v.isEncrypted())
+        return true;
+    if (not types.empty() and std::find(types.begin(), types.end(), v.type) == types.end())
+        return false;
+    return true;
+}
+
+bool
+Query::match(const Value& v) const
+{
+    if (not matchIdAndType(v))
+        return false;
+    if (v.isEncrypted())
+        return true;
+    if (seq_after >= 0 and v.seq <= seq_after)
+        return false;
+    if (owner != InfoHash() and (not v.owner or v.owner.getId() != owner))
+        return false;
+    return true;
+}
+
+Query
+Query::combine(const Query& a, const Query& b)
+{
+    auto intersect = [](const std::vector<uint64_t>& x, const std::vector<uint64_t>& y) {
+        if (x.empty())
+            return y;
+        if (y.empty())
+            return x;
+        std::vector<uint64_t> r;
+        for (auto i : x)
+            if (std::find(y.begin(), y.end(), i) != y.end())
+                r.push_back(i);
+        // no common element: any value, filtered locally
+        return r;
+    };
+    Query q;
+    auto types = intersect({a.types.begin(), a.types.end()}, {b.types.begin(), b.types.end()});
+    q.types = {types.begin(), types.end()};
+    q.ids = intersect(a.ids, b.ids);
+    q.owner = a.owner != InfoHash() ? a.owner : b.owner;
+    q.seq_after = std::max(a.seq_after, b.seq_after);
+    // the values must have their content for the filters
+    q.ids_only = a.ids_only and b.ids_only;
+    return q;
+}
+
+void
+Query::msgpack_unpack(msgpack::object o)
+{
+    if (o.type != msgpack::type::MAP)
+        throw msgpack::type_error();
+    *this = {};
+    if (auto t = findMapValue(o, "t"))
+        types = t->as<decltype(types)>();
+    if (auto ow = findMapValue(o, "o"))
+        owner = ow->as<InfoHash>();
+    if (auto i = findMapValue(o, "i"))
+        ids = i->as<decltype(ids)>();
+    if (auto s = findMapValue(o, "s"))
+        seq_after = s->as<int32_t>();
+    if (auto p = findMapValue(o, "p"))
+        ids_only = p->as<bool>();
+}
+
 size_t
 Value::size() const
 {
@@ -0,0 +1,275 @@
+/*
+ *  Copyright (C) 2014-2016 Savoir-faire Linux Inc.
+ *  Author : Adrien Béraud <adrien.beraud@savoirfairelinux.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA.
+ */
+
+#include "value_log.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <unordered_map>
+
+namespace dht {
+
+static const char LOG_MAGIC[8] = {'O', 'D', 'H', 'T', 'L', 'O', 'G', '1'};
+
+enum class RecordType : uint32_t {
+    STORE = 0,
+    DROP = 1
+};
+
+/* size (4), type (4), key, value id (8), created (8), expiration (8) */
+const size_t ValueLog::RECORD_HEADER_SIZE {4 + 4 + HASH_LEN + 8 + 8 + 8};
+
+#ifndef _WIN32
+
+ValueLog::ValueLog(const std::string& path) : path_(path)
+{
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd_ < 0)
+        throw DhtException("Can't open value log " + path + ": " + strerror(errno));
+    struct stat st;
+    if (fstat(fd_, &st) < 0) {
+        close(fd_);
+        throw DhtException("Can't read value log " + path + ": " + strerror(errno));
+    }
+    size_ = st.st_size;
+    if (size_ == 0) {
+        write((const uint8_t*)LOG_MAGIC, sizeof(LOG_MAGIC));
+        return;
+    }
+    map_size_ = size_;
+    void* m = mmap(nullptr, map_size_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (m == MAP_FAILED) {
+        close(fd_);
+        throw DhtException("Can't map value log " + path + ": " + strerror(errno));
+    }
+    map_ = (const uint8_t*)m;
+    if (map_size_ < sizeof(LOG_MAGIC) or memcmp(map_, LOG_MAGIC, sizeof(LOG_MAGIC)) != 0) {
+        release();
+        close(fd_);
+        throw DhtException("Not a value log: " + path);
+    }
+    scan();
+}
+
+ValueLog::~ValueLog()
+{
+    release();
+    if (rewrite_fd_ >= 0) {
+        close(rewrite_fd_);
+        unlink((path_ + ".tmp").c_str());
+    }
+    if (fd_ >= 0) {
+        fdatasync(fd_);
+        close(fd_);
+    }
+}
+
+void
+ValueLog::scan()
+{
+    // position of each value in records_, to replace or drop it without
+    // a scan. Keys come from remote puts: no std::hash<InfoHash> here.
+    std::map<InfoHash, std::unordered_map<Value::Id, size_t>> index;
+    size_t pos = sizeof(LOG_MAGIC);
+    while (pos + RECORD_HEADER_SIZE <= map_size_) {
+        const uint8_t* h = map_ + pos;
+        uint32_t size;
+        RecordType type;
+        InfoHash key;
+        Value::Id id;
+        int64_t created, expiration;
+        std::memcpy(&size, h, 4);
+        std::memcpy(&type, h + 4, 4);
+        std::copy_n(h + 8, HASH_LEN, key.begin());
+        std::memcpy(&id, h + 8 + HASH_LEN, 8);
+        std::memcpy(&created, h + 16 + HASH_LEN, 8);
+        std::memcpy(&expiration, h + 24 + HASH_LEN, 8);
+        if ((type != RecordType::STORE and type != RecordType::DROP)
+         or pos + RECORD_HEADER_SIZE + size > map_size_)
+            break;
+
+        auto& recs = records_[key];
+        auto& ids = index[key];
+        auto r = ids.find(id);
+        if (type == RecordType::STORE) {
+            Record rec {id, (std::time_t)created, (std::time_t)expiration, pos + RECORD_HEADER_SIZE, size};
+            if (r != ids.end())
+                recs[r->second] = rec;
+            else {
+                ids.emplace(id, recs.size());
+                recs.emplace_back(rec);
+            }
+        } else if (r != ids.end()) {
+            // move the last record in place of the dropped one
+            auto i = r->second;
+            ids.erase(r);
+            if (i + 1 != recs.size()) {
+                recs[i] = recs.back();
+                ids[recs[i].id] = i;
+            }
+            recs.pop_back();
+        }
+        if (recs.empty()) {
+            records_.erase(key);
+            index.erase(key);
+        }
+        pos += RECORD_HEADER_SIZE + size;
+    }
+    if (pos != size_) {
+        // incomplete or corrupted tail, from an interrupted write
+        if (ftruncate(fd_, pos) == 0)
+            size_ = pos;
+    }
+}
+
+std::map<InfoHash, std::vector<ValueLog::Record>>
+ValueLog::takeRecords()
+{
+    return std::move(records_);
+}
+
+void
+ValueLog::release()
+{
+    if (map_) {
+        munmap((void*)map_, map_size_);
+        map_ = nullptr;
+        map_size_ = 0;
+    }
+    records_.clear();
+}
+
+void
+ValueLog::write(const uint8_t* data, size_t size)
+{
+    int fd = rewrite_fd_ >= 0 ? rewrite_fd_ : fd_;
+    size_t& file_size = rewrite_fd_ >= 0 ? rewrite_size_ : size_;
+    size_t written = 0;
+    while (written < size) {
+        ssize_t rc = pwrite(fd, data + written, size - written, file_size + written);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            // don't leave a partial record behind
+            if (ftruncate(fd, file_size) < 0)
+                file_size += written;
+            throw DhtException("Can't write value log " + path_ + ": " + strerror(errno));
+        }
+        written += rc;
+    }
+    file_size += written;
+}
+
+void
+ValueLog::writeRecord(const InfoHash& key, Value::Id id, std::time_t created, std::time_t expiration, const uint8_t* data, uint32_t size)
+{
+    std::vector<uint8_t> rec(RECORD_HEADER_SIZE + size);
+    auto type = data ? RecordType::STORE : RecordType::DROP;
+    int64_t c = created, e = expiration;
+    std::memcpy(rec.data(), &size, 4);
+    std::memcpy(rec.data() + 4, &type, 4);
+    std::copy_n(key.begin(), HASH_LEN, rec.begin() + 8);
+    std::memcpy(rec.data() + 8 + HASH_LEN, &id, 8);
+    std::memcpy(rec.data() + 16 + HASH_LEN, &c, 8);
+    std::memcpy(rec.data() + 24 + HASH_LEN, &e, 8);
+    if (size)
+        std::copy_n(data, size, rec.begin() + RECORD_HEADER_SIZE);
+    write(rec.data(), rec.size());
+}
+
+void
+ValueLog::append(const InfoHash& key, Value::Id id, std::time_t created, std::time_t expiration, const Blob& packed)
+{
+    writeRecord(key, id, created, expiration, packed.data(), packed.size());
+}
+
+void
+ValueLog::drop(const InfoHash& key, Value::Id id)
+{
+    writeRecord(key, id, 0, 0, nullptr, 0);
+}
+
+void
+ValueLog::startRewrite()
+{
+    if (map_)
+        throw DhtException("Can't rewrite a mapped value log");
+    if (rewrite_fd_ >= 0)
+        close(rewrite_fd_);
+    auto tmp = path_ + ".tmp";
+    rewrite_fd_ = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (rewrite_fd_ < 0)
+        throw DhtException("Can't open value log " + tmp + ": " + strerror(errno));
+    rewrite_size_ = 0;
+    write((const uint8_t*)LOG_MAGIC, sizeof(LOG_MAGIC));
+}
+
+void
+ValueLog::finishRewrite()
+{
+    if (rewrite_fd_ < 0)
+        return;
+    if (fdatasync(rewrite_fd_) < 0 or rename((path_ + ".tmp").c_str(), path_.c_str()) < 0) {
+        close(rewrite_fd_);
+        rewrite_fd_ = -1;
+        throw DhtException("Can't replace value log " + path_ + ": " + strerror(errno));
+    }
+    close(fd_);
+    fd_ = rewrite_fd_;
+    size_ = rewrite_size_;
+    rewrite_fd_ = -1;
+
+    // make the rename itself durable
+    auto sep = path_.find_last_of('/');
+    auto dir = sep == std::string::npos ? std::string(".") : path_.substr(0, std::max<size_t>(sep, 1));
+    int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0 or fsync(dir_fd) < 0) {
+        auto err = errno;
+        if (dir_fd >= 0)
+            close(dir_fd);
+        throw DhtException("Can't sync directory of value log " + path_ + ": " + strerror(err));
+    }
+    close(dir_fd);
+}
+
+#else
+
+ValueLog::ValueLog(const std::string& path) : path_(path)
+{
+    throw DhtException("Value log is not supported on this platform");
+}
+ValueLog::~ValueLog() {}
+std::map<InfoHash, std::vector<ValueLog::Record>> ValueLog::takeRecords() { return {}; }
+void ValueLog::release() {}
+void ValueLog::append(const InfoHash&, Value::Id, std::time_t, std::time_t, const Blob&) {}
+void ValueLog::drop(const InfoHash&, Value::Id) {}
+void ValueLog::startRewrite() {}
+void ValueLog::finishRewrite() {}
+
+#endif
+
+}
@@ -29,7 +29,7 @@ extern "C" {
 using namespace dht;
 
 void print_usage() {
-    std::cout << "Usage: dhtnode [-p local_port] [-b bootstrap_host:port]" << std::endl << std::endl;
+    std::cout << "Usage: dhtnode [-p local_port] [-b bootstrap_host:port] [-s state_file]" << std::endl << std::endl;
     std::cout << "dhtnode, a simple OpenDHT command line node runner." << std::endl;
     std::cout << "Report bugs to: http://opendht.net" << std::endl;
 }
@@ -46,6 +46,24 @@ void print_node_info(const DhtRunner& dht, const dht_params& params) {
         std::cout << "Public key ID " << dht.getId() << std::endl;
 }
 
+/**
+ * Snapshot the node state to file. The snapshot is written to a temporary
+ * file first, so a previous one is never left half-written.
+ */
+bool save_state(DhtRunner& dht, const std::string& file) {
+    auto tmp = file + ".tmp";
+    std::ofstream os(tmp, std::ios::binary);
+    if (not os or not dht.exportState(os).get())
+        return false;
+    os.close();
+    return std::rename(tmp.c_str(), file.c_str()) == 0;
+}
+
+bool load_state(DhtRunner& dht, const std::string& file) {
+    std::ifstream is(file, std::ios::binary);
+    return is and dht.importState(is).get();
+}
+
 void print_help() {
     std::cout << "OpenDht command line interface (CLI)" << std::endl;
     std::cout << "Possible commands:" << std::endl
@@ -57,7 +75,10 @@ void print_help() {
               << "  ll         Print basic information and stats about the current node." << std::endl
               << "  ls         Print basic information about current searches." << std::endl
               << "  ld         Print basic information about currenty stored values on this node." << std::endl
-              << "  lr         Print the full current routing table of this node" << std::endl;
+              << "  lr         Print the full current routing table of this node" << std::endl
+              << "  lm         Print metrics about the activity of this node." << std::endl
+              << "  save [file] Save nodes and stored values to [file]." << std::endl
+              << "  load [file] Load nodes and stored values from [file]." << std::endl;
 
     std::cout << std::endl << "Operations on the DHT:" << std::endl
               << "  b ip:port             Ping potential node at given IP address/port." << std::endl
@@ -101,6 +122,11 @@ void cmd_loop(DhtRunner& dht, dht_params& params)
             dht.getNodesStats(AF_INET6, &good6, &dubious6, &cached6, &incoming6);
             std::cout << "IPv4 nodes : " << good4 << " good, " << dubious4 << " dubious, " << incoming4 << " incoming." << std::endl;
             std::cout << "IPv6 nodes : " << good6 << " good, " << dubious6 << " dubious, " << incoming6 << " incoming." << std::endl;
+            auto ttc = dht.getTimeToConnected();
+            if (ttc != duration::max())
+                std::cout << "Connected in " << print_dt(ttc) << "s" << std::endl;
+            auto gets = dht.getGetCacheStats();
+            std::cout << "Gets : " << gets.hits << " cached, " << gets.coalesced << " coalesced, " << gets.misses << " searched." << std::endl;
             continue;
         } else if (op == "lr") {
             std::cout << "IPv4 routing table:" << std::endl;
@@ -108,6 +134,9 @@ void cmd_loop(DhtRunner& dht, dht_params& params)
             std::cout << "IPv6 routing table:" << std::endl;
             std::cout << dht.getRoutingTablesLog(AF_INET6) << std::endl;
             continue;
+        } else if (op == "lm") {
+            std::cout << dht.getMetrics().toString() << std::endl;
+            continue;
         } else if (op == "ld") {
             std::cout << dht.getStorageLog() << std::endl;
             continue;
@@ -134,6 +163,15 @@ void cmd_loop(DhtRunner& dht, dht_params& params)
                 std::cerr << e.what() << std::endl;
             }
             continue;
+        } else if (op == "save" or op == "load") {
+            auto file = idstr.empty() ? params.state_file : idstr;
+            if (file.empty()) {
+                std::cout << "Syntax error: no file provided." << std::endl;
+                continue;
+            }
+            bool ok = op == "save" ? save_state(dht, file) : load_state(dht, file);
+            std::cout << (op == "save" ? "Save " : "Load ") << file << ": " << (ok ? "success" : "failure") << std::endl;
+            continue;
         } else if (op == "log") {
             params.log = !params.log;
             if (params.log)
@@ -266,17 +304,26 @@ main(int argc, char **argv)
                 log::enableLogging(dht);
         }
 
+        if (not params.state_file.empty())
+            load_state(dht, params.state_file);
+
         if (not params.bootstrap.first.empty()) {
             //std::cout << "Bootstrap: " << params.bootstrap.first << ":" << params.bootstrap.second << std::endl;
             dht.bootstrap(params.bootstrap.first.c_str(), params.bootstrap.second.c_str());
         }
 
         if (params.daemonize) {
-            while (true)
+            // periodic snapshots, every 10 minutes
+            for (unsigned i = 1; ; i++) {
                 std::this_thread::sleep_for(std::chrono::seconds(30));
+                if (i % 20 == 0 and not params.state_file.empty())
+                    save_state(dht, params.state_file);
+            }
         } else {
             cmd_loop(dht, params);
         }
+        if (not params.state_file.empty())
+            save_state(dht, params.state_file);
 
     } catch(const std::exception&e) {
         std::cerr << std::endl <<  e.what() << std::endl;
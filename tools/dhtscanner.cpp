@@ -19,12 +19,18 @@
  */
 
 #include "tools_common.h"
+#include <opendht/rng.h>
 extern "C" {
 #include <gnutls/gnutls.h>
 }
 #include <set>
+#include <unordered_set>
+#include <deque>
+#include <iomanip>
 #include <condition_variable>
 #include <mutex>
+#include <random>
+#include <cstring>
 
 using namespace dht;
 
@@ -35,6 +41,31 @@ struct snode_compare {
     }
 };
 
+/**
+ * Peers choose their ids: they are hashed with a random key, so that they
+ * can't be made to collide. Multilinear hashing of the 32 bit words of the
+ * id, keeping the high half of the sum.
+ */
+struct IdHash {
+    IdHash() {
+        crypto::random_device rdev;
+        std::uniform_int_distribution<uint64_t> dist;
+        for (auto& k : key)
+            k = dist(rdev);
+    }
+    size_t operator()(const InfoHash& id) const {
+        uint64_t h = key[0];
+        for (size_t i = 0; i < HASH_LEN / 4; i++) {
+            uint32_t w;
+            std::memcpy(&w, id.data() + 4 * i, 4);
+            h += key[i + 1] * w;
+        }
+        return h >> 32;
+    }
+private:
+    std::array<uint64_t, HASH_LEN / 4 + 1> key;
+};
+
 using NodeSet = std::set<std::shared_ptr<Node>, snode_compare>;
 std::condition_variable cv;
 
@@ -64,10 +95,229 @@ step(DhtRunner& dht, std::atomic_uint& done, std::shared_ptr<NodeSet> all_nodes,
     });
 }
 
+/**
+ * Parallel crawl of the network: the keyspace is split in 2^shard_bits
+ * prefixes, searched concurrently. Like step(), a search whose closest
+ * nodes share more bits than its depth queues searches for the sibling
+ * subtrees below it.
+ *
+ * Nodes are deduplicated by id and address family, and written to the
+ * output as they are found, one "<id> <address> <rtt ms>" line each, so
+ * only their ids are kept in memory.
+ */
+class Crawler {
+public:
+    Crawler(DhtRunner& dht, std::ostream& out, unsigned concurrency, double rate)
+        : dht(dht), out(out), concurrency(std::max(concurrency, 1u)), rate(rate) {}
+
+    /**
+     * Crawl until no search is left, printing progress every second.
+     */
+    void run(unsigned shard_bits);
+
+private:
+    struct Target {
+        InfoHash h;
+        unsigned depth;
+    };
+
+    void search(const Target& t);
+    void onDone(const Target& t, const std::vector<std::shared_ptr<Node>>& nodes);
+    void report(time_point now);
+
+    DhtRunner& dht;
+    std::ostream& out;
+    const unsigned concurrency;
+    /* maximum number of searches started per second, 0 for no limit */
+    const double rate;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<Target> pending {};
+    unsigned running {0};
+    size_t searches_done {0};
+    std::unordered_set<InfoHash, IdHash> nodes4 {};
+    std::unordered_set<InfoHash, IdHash> nodes6 {};
+
+    time_point start_time {};
+    time_point last_report {};
+    size_t last_nodes {0};
+    size_t last_searches {0};
+};
+
+void
+Crawler::run(unsigned shard_bits)
+{
+    shard_bits = std::min(shard_bits, 16u);
+    for (unsigned i = 0; i < (1u << shard_bits); i++) {
+        auto h = InfoHash::getRandom();
+        for (unsigned b = 0; b < shard_bits; b++)
+            h.setBit(b, (i >> (shard_bits - 1 - b)) & 1);
+        pending.push_back({h, shard_bits});
+    }
+
+    // token bucket on search starts, allowing bursts of one round
+    double tokens = concurrency;
+    start_time = last_report = clock::now();
+    auto refill_time = start_time;
+
+    std::unique_lock<std::mutex> lk(mtx);
+    while (not pending.empty() or running) {
+        auto now = clock::now();
+        if (rate > 0) {
+            tokens = std::min<double>(concurrency, tokens + rate * print_dt(now - refill_time));
+            refill_time = now;
+        }
+        while (not pending.empty() and running < concurrency and (rate <= 0 or tokens >= 1)) {
+            auto t = pending.front();
+            pending.pop_front();
+            running++;
+            tokens -= 1;
+            lk.unlock();
+            search(t);
+            lk.lock();
+        }
+
+        auto next_report = last_report + std::chrono::seconds(1);
+        auto wakeup = next_report;
+        if (rate > 0 and tokens < 1 and not pending.empty() and running < concurrency)
+            wakeup = std::min(wakeup, now + std::chrono::duration_cast<duration>(std::chrono::duration<double>((1 - tokens) / rate)));
+        cv.wait_until(lk, wakeup);
+
+        now = clock::now();
+        if (now >= next_report)
+            report(now);
+    }
+    report(clock::now());
+    out.flush();
+}
+
+void
+Crawler::search(const Target& t)
+{
+    dht.get(t.h, [](const std::vector<std::shared_ptr<Value>>& /*values*/) {
+        return true;
+    }, [this,t](bool, const std::vector<std::shared_ptr<Node>>& nodes) {
+        onDone(t, nodes);
+    });
+}
+
+void
+Crawler::onDone(const Target& t, const std::vector<std::shared_ptr<Node>>& nodes)
+{
+    std::lock_guard<std::mutex> lk(mtx);
+    for (const auto& n : nodes) {
+        auto& known = n->getFamily() == AF_INET ? nodes4 : nodes6;
+        if (not known.insert(n->id).second)
+            continue;
+        out << n->id << ' ' << n->getAddrStr() << ' ';
+        if (n->rtt > duration::zero())
+            out << std::chrono::duration_cast<std::chrono::microseconds>(n->rtt).count() / 1000. << '\n';
+        else
+            out << "-\n";
+    }
+
+    NodeSet sbuck {nodes.begin(), nodes.end()};
+    if (sbuck.size() > 1) {
+        unsigned bdepth = InfoHash::commonBits((*sbuck.begin())->id, (*std::prev(sbuck.end()))->id);
+        unsigned target_depth = std::min(159u, bdepth+3u);
+        for (unsigned b = t.depth; b < target_depth; b++) {
+            auto new_h = t.h;
+            new_h.setBit(b, not t.h.getBit(b));
+            pending.push_back({new_h, b+1});
+        }
+    }
+
+    running--;
+    searches_done++;
+    cv.notify_one();
+}
+
+void
+Crawler::report(time_point now)
+{
+    auto found = nodes4.size() + nodes6.size();
+    auto dt = print_dt(now - last_report);
+    std::cerr << std::fixed << std::setprecision(1) << print_dt(now - start_time) << "s: "
+              << searches_done << " searches (" << running << " running, " << pending.size() << " queued), "
+              << found << " nodes (" << nodes4.size() << " IPv4, " << nodes6.size() << " IPv6), "
+              << (dt > 0 ? (found - last_nodes) / dt : 0.) << " nodes/s, "
+              << (dt > 0 ? (searches_done - last_searches) / dt : 0.) << " searches/s" << std::endl;
+    out.flush();
+    last_report = now;
+    last_nodes = found;
+    last_searches = searches_done;
+}
+
+struct crawl_params {
+    bool crawl {false};
+    unsigned concurrency {32};
+    double rate {64};
+    unsigned shard_bits {6};
+    std::string output {};
+};
+
+static const constexpr struct option crawl_options[] = {
+   {"crawl",       no_argument,       nullptr, 'c'},
+   {"concurrency", required_argument, nullptr, 'j'},
+   {"rate",        required_argument, nullptr, 'r'},
+   {"shards",      required_argument, nullptr, 'n'},
+   {"output",      required_argument, nullptr, 'o'},
+   {nullptr,       0,                 nullptr,  0}
+};
+
+/**
+ * Parse the crawl options, ignoring the ones handled by parseArgs().
+ */
+crawl_params
+parseCrawlArgs(int argc, char **argv) {
+    crawl_params params;
+    int opt;
+    optind = 1;
+    while ((opt = getopt_long(argc, argv, ":cj:r:n:o:", crawl_options, nullptr)) != -1) {
+        switch (opt) {
+        case 'c':
+            params.crawl = true;
+            break;
+        case 'j':
+            params.concurrency = std::max(atoi(optarg), 1);
+            break;
+        case 'r':
+            params.rate = std::max(atof(optarg), 0.);
+            break;
+        case 'n':
+            params.shard_bits = std::min(std::max(atoi(optarg), 0), 16);
+            break;
+        case 'o':
+            params.output = {optarg};
+            break;
+        default:
+            break;
+        }
+    }
+    return params;
+}
+
+void print_usage() {
+    std::cout << "Usage: dhtscanner [-p local_port] [-b bootstrap_host:port]" << std::endl
+              << "                  [-c [-j concurrency] [-r searches_per_sec] [-n shard_bits] [-o output_file]]" << std::endl << std::endl;
+    std::cout << "dhtscanner, an OpenDHT network scanner." << std::endl;
+    std::cout << "With -c, the keyspace is split in 2^shard_bits shards crawled by concurrent" << std::endl
+              << "searches, starting at most searches_per_sec searches per second (0 for no limit)." << std::endl
+              << "Nodes found are written to output_file, or the standard output, as" << std::endl
+              << "\"<id> <address> <rtt ms>\" lines. Progress is reported on the standard error." << std::endl;
+    std::cout << "Report bugs to: http://opendht.net" << std::endl;
+}
+
 int
 main(int argc, char **argv)
 {
     auto params = parseArgs(argc, argv);
+    auto crawl = parseCrawlArgs(argc, argv);
+    if (params.help) {
+        print_usage();
+        return 0;
+    }
 
     // TODO: remove with GnuTLS >= 3.3
     int rc = gnutls_global_init();
@@ -78,20 +328,49 @@ main(int argc, char **argv)
     auto crt_tmp = dht::crypto::generateIdentity("Scanner node", ca_tmp);
 
     DhtRunner dht;
-    dht.run(params.port, crt_tmp, true, [](dht::Dht::Status /* ipv4 */, dht::Dht::Status /* ipv6 */) {});
+    if (crawl.crawl) {
+        DhtRunner::Config config {};
+        config.dht_config.id = crt_tmp;
+        // done searches are recycled, so a few more slots than the
+        // concurrency are enough (0 keeps the default)
+        config.dht_config.node_config.max_searches = crawl.concurrency > 64 ? 2 * crawl.concurrency : 0;
+        config.threaded = true;
+        config.batched_io = true;
+        dht.run(params.port, config);
+    } else
+        dht.run(params.port, crt_tmp, true, [](dht::Dht::Status /* ipv4 */, dht::Dht::Status /* ipv6 */) {});
 
     if (not params.bootstrap.first.empty())
         dht.bootstrap(params.bootstrap.first.c_str(), params.bootstrap.second.c_str());
 
     std::cout << "OpenDht node " << dht.getNodeId() << " running on port " <<  params.port << std::endl;
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+
+    if (crawl.crawl) {
+        std::ofstream file;
+        if (not crawl.output.empty()) {
+            file.open(crawl.output, std::ios::out | std::ios::trunc);
+            if (not file) {
+                std::cerr << "Can't open " << crawl.output << std::endl;
+                dht.join();
+                gnutls_global_deinit();
+                return 1;
+            }
+        }
+        std::cerr << "Crawling network with " << crawl.concurrency << " concurrent searches..." << std::endl;
+        Crawler crawler {dht, file.is_open() ? file : std::cout, crawl.concurrency, crawl.rate};
+        crawler.run(crawl.shard_bits);
+        dht.join();
+        gnutls_global_deinit();
+        return 0;
+    }
+
     std::cout << "Scanning network..." << std::endl;
     auto all_nodes = std::make_shared<NodeSet>();
 
     dht::InfoHash cur_h {};
     cur_h.setBit(8*HASH_LEN-1, 1);
 
-    std::this_thread::sleep_for(std::chrono::seconds(2));
-
     std::atomic_uint done {false};
     step(dht, done, all_nodes, cur_h, 0);
 
@@ -155,6 +155,7 @@ struct dht_params {
     bool generate_identity {false};
     bool daemonize {false};
     std::pair<std::string, std::string> bootstrap {};
+    std::string state_file {};
 };
 
 static const constexpr struct option long_options[] = {
@@ -164,6 +165,7 @@ static const constexpr struct option long_options[] = {
    {"identity",   no_argument      , nullptr, 'i'},
    {"verbose",    no_argument      , nullptr, 'v'},
    {"daemonize",  no_argument      , nullptr, 'd'},
+   {"state",      required_argument, nullptr, 's'},
    {nullptr,      0,                 nullptr,  0}
 };
 
@@ -171,7 +173,7 @@ dht_params
 parseArgs(int argc, char **argv) {
     dht_params params;
     int opt;
-    while ((opt = getopt_long(argc, argv, ":hidv:p:b:", long_options, nullptr)) != -1) {
+    while ((opt = getopt_long(argc, argv, ":hidv:p:b:s:", long_options, nullptr)) != -1) {
         switch (opt) {
         case 'p': {
                 int port_arg = atoi(optarg);
@@ -207,6 +209,9 @@ parseArgs(int argc, char **argv) {
         case 'd':
             params.daemonize = true;
             break;
+        case 's':
+            params.state_file = {optarg};
+            break;
         case ':':
             switch (optopt) {
             case 'b':